@@ -7,9 +7,62 @@
 #include <algorithm>
 #include <stdexcept>
 #include <chrono>
+#include <random>
+#include <functional>
+#include <memory>
+#include <map>
+#include <queue>
+#include <thread>
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+#include <sstream>
+#include <cmath>
+#include <cstring>
+#include <dirent.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <sys/syscall.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <unistd.h>
+#include <cerrno>
+#include <climits>
+#include <limits>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
+
+// Adjust charset and max_key_length based on your specific requirements for P1 and DMR
+const char* default_charset = "abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789";
+
+// Longest key the search kernel keeps in private memory
+const int max_search_key_length = 32;
 
 // OpenCL kernel for RC4 decryption
 const char* kernel_code = R"(
+#define MAX_KEY_LENGTH 32
+#define SCORE_CLASSES 32
+#define CASCADE_PREFIX 64
+#define TARGET_BUCKET_BITS 12
+
+// Survivor of a cascade stage: key index, PRGA state after `position` keystream bytes and the
+// plaintext decrypted so far, so later stages resume instead of redoing the KSA
+typedef struct {
+    ulong index;
+    uint position;
+    uchar i;
+    uchar j;
+    uchar S[256];
+    uchar prefix[CASCADE_PREFIX];
+} cascade_record;
+
 __kernel void rc4_decrypt(__global const uchar *encrypted_data,
                           __global uchar *decrypted_data,
                           __global const uchar *keys,
@@ -29,7 +82,7 @@ __kernel void rc4_decrypt(__global const uchar *encrypted_data,
             S[j] = temp;
         }
         i = j = 0;
-        for (int n = 0; n < gid; n++) {
+        for (int n = 0; n <= gid; n++) {
             i = (i + 1) % 256;
             j = (j + S[i]) % 256;
             uchar temp = S[i];
@@ -39,174 +92,9586 @@ __kernel void rc4_decrypt(__global const uchar *encrypted_data,
         decrypted_data[gid] = encrypted_data[gid] ^ S[(S[i] + S[j]) % 256];
     }
 }
-)";
 
-bool is_valid_plaintext(const std::vector<unsigned char>& data) {
-    // Enhanced validation: check for printable characters, spaces, and common punctuation
-    return std::all_of(data.begin(), data.end(), [](unsigned char c) {
-        return isprint(c) || isspace(c);
-        });
+// Mixed-radix decode of a key index over the charset, most significant position first
+// A charset longer than 256 bytes is a constrained keyspace's layout (see kernel_charset_size):
+// a 256-byte symbol row per key position, then each position's radix as a little-endian ushort.
+// Fixed positions have radix 1 and take no division.
+void rc4_key_from_index(ulong index, __constant uchar *charset, int charset_size, int key_length, uchar *key) {
+    if (charset_size > 256) {
+        __constant uchar *radices = charset + key_length * 256;
+        for (int k = key_length - 1; k >= 0; k--) {
+            uint radix = radices[2 * k] | (uint)radices[2 * k + 1] << 8;
+            uint digit = 0;
+            if (radix > 1) {
+                digit = index % radix;
+                index /= radix;
+            }
+            key[k] = charset[k * 256 + digit];
+        }
+        return;
+    }
+    for (int k = key_length - 1; k >= 0; k--) {
+        key[k] = charset[index % charset_size];
+        index /= charset_size;
+    }
 }
 
-std::vector<unsigned char> brute_force_rc4_gpu(const std::vector<unsigned char>& encrypted_data, const std::string& charset, int max_key_length) {
-    cl_int err;
-    cl_uint num_platforms;
-    cl_platform_id platform_id;
-    cl_uint num_devices;
-    cl_device_id device_id;
-    cl_context context;
-    cl_command_queue queue;
-    cl_program program;
-    cl_kernel kernel;
+void rc4_ksa(uchar *S, const uchar *key, int key_length) {
+    for (int k = 0; k < 256; k++) {
+        S[k] = k;
+    }
+    uchar j = 0;
+    for (int k = 0; k < 256; k++) {
+        j += S[k] + key[k % key_length];
+        uchar temp = S[k];
+        S[k] = S[j];
+        S[j] = temp;
+    }
+}
 
-    // Initialize OpenCL
-    err = clGetPlatformIDs(1, &platform_id, &num_platforms);
-    if (err != CL_SUCCESS) {
-        std::cerr << "Failed to get OpenCL platform IDs. Error code: " << err << std::endl;
-        throw std::runtime_error("OpenCL initialization error");
+// One work item per candidate key: mixed-radix decode of base_index + gid over the charset,
+// KSA, then a check of the first check_length plaintext bytes against the accept bitmap
+// (bit c & 7 of accept[c >> 3] set for each accepted byte c, printable ASCII by default)
+__kernel void rc4_search(__global const uchar *ciphertext,
+                         const int check_length,
+                         __constant uchar *charset,
+                         const int charset_size,
+                         const int key_length,
+                         const ulong base_index,
+                         const ulong count,
+                         __global ulong *hits,
+                         __global uint *hit_count,
+                         const uint max_hits,
+                         __constant uchar *accept) {
+    ulong gid = get_global_id(0);
+    if (gid >= count) {
+        return;
     }
 
-    err = clGetDeviceIDs(platform_id, CL_DEVICE_TYPE_GPU, 1, &device_id, &num_devices);
-    if (err != CL_SUCCESS) {
-        std::cerr << "Failed to get OpenCL device IDs. Error code: " << err << std::endl;
-        throw std::runtime_error("OpenCL initialization error");
+    uchar key[MAX_KEY_LENGTH];
+    rc4_key_from_index(base_index + gid, charset, charset_size, key_length, key);
+    uchar S[256];
+    rc4_ksa(S, key, key_length);
+
+    uchar i = 0, j = 0;
+    for (int n = 0; n < check_length; n++) {
+        i++;
+        j += S[i];
+        uchar temp = S[i];
+        S[i] = S[j];
+        S[j] = temp;
+        uchar c = ciphertext[n] ^ S[(uchar)(S[i] + S[j])];
+        if (!((accept[c >> 3] >> (c & 7)) & 1)) {
+            return;
+        }
     }
 
-    context = clCreateContext(nullptr, 1, &device_id, nullptr, nullptr, &err);
-    if (err != CL_SUCCESS) {
-        std::cerr << "Failed to create OpenCL context. Error code: " << err << std::endl;
-        throw std::runtime_error("OpenCL context creation error");
+    uint slot = atomic_inc(hit_count);
+    if (slot < max_hits) {
+        hits[slot] = base_index + gid;
     }
+}
 
-    queue = clCreateCommandQueueWithProperties(context, device_id, nullptr, &err);
-    if (err != CL_SUCCESS) {
-        std::cerr << "Failed to create OpenCL command queue. Error code: " << err << std::endl;
-        throw std::runtime_error("OpenCL command queue creation error");
+// Same key generation as rc4_search, but every key gets a log-likelihood score of its first
+// check_length plaintext bytes: per-byte unigram terms plus class bigram terms. Keys scoring at
+// least threshold (the host's current K-th best) are appended with their scores.
+__kernel void rc4_score(__global const uchar *ciphertext,
+                        const int check_length,
+                        __constant uchar *charset,
+                        const int charset_size,
+                        const int key_length,
+                        const ulong base_index,
+                        const ulong count,
+                        __global ulong *hits,
+                        __global uint *hit_count,
+                        const uint max_hits,
+                        __constant uchar *byte_class,
+                        __constant float *unigram,
+                        __constant float *bigram,
+                        const float threshold,
+                        __global float *hit_scores) {
+    ulong gid = get_global_id(0);
+    if (gid >= count) {
+        return;
     }
 
-    program = clCreateProgramWithSource(context, 1, &kernel_code, nullptr, &err);
-    if (err != CL_SUCCESS) {
-        std::cerr << "Failed to create OpenCL program. Error code: " << err << std::endl;
-        throw std::runtime_error("OpenCL program creation error");
+    uchar key[MAX_KEY_LENGTH];
+    rc4_key_from_index(base_index + gid, charset, charset_size, key_length, key);
+    uchar S[256];
+    rc4_ksa(S, key, key_length);
+
+    uchar i = 0, j = 0;
+    uchar previous = 0;
+    float score = 0.0f;
+    for (int n = 0; n < check_length; n++) {
+        i++;
+        j += S[i];
+        uchar temp = S[i];
+        S[i] = S[j];
+        S[j] = temp;
+        uchar c = ciphertext[n] ^ S[(uchar)(S[i] + S[j])];
+        uchar cls = byte_class[c];
+        score += unigram[c];
+        if (n > 0) {
+            score += bigram[previous * SCORE_CLASSES + cls];
+        }
+        previous = cls;
     }
 
-    err = clBuildProgram(program, 1, &device_id, nullptr, nullptr, nullptr);
-    if (err != CL_SUCCESS) {
-        size_t log_size;
-        clGetProgramBuildInfo(program, device_id, CL_PROGRAM_BUILD_LOG, 0, nullptr, &log_size);
-        std::vector<char> log(log_size);
-        clGetProgramBuildInfo(program, device_id, CL_PROGRAM_BUILD_LOG, log_size, log.data(), nullptr);
-        std::cerr << "Build log:\n" << log.data() << std::endl;
-        throw std::runtime_error("OpenCL program build error");
+    if (score >= threshold) {
+        uint slot = atomic_inc(hit_count);
+        if (slot < max_hits) {
+            hits[slot] = base_index + gid;
+            hit_scores[slot] = score;
+        }
     }
+}
 
-    kernel = clCreateKernel(program, "rc4_decrypt", &err);
-    if (err != CL_SUCCESS) {
-        std::cerr << "Failed to create OpenCL kernel. Error code: " << err << std::endl;
-        throw std::runtime_error("OpenCL kernel creation error");
+// One device stage of the cascade oracle. The first stage starts from key indices
+// [base_index, base_index + count), later ones from the previous stage's survivor records.
+// Keystream is only generated up to the last byte this stage reads; survivors are appended to
+// output, which has room for every input.
+__kernel void rc4_cascade_stage(__global const uchar *ciphertext,
+                                __constant uchar *charset,
+                                const int charset_size,
+                                const int key_length,
+                                const ulong base_index,
+                                const ulong count,
+                                const int first_stage,
+                                __global const cascade_record *input,
+                                __global cascade_record *output,
+                                __global uint *output_count,
+                                const int stage_kind,
+                                const int stage_offset,
+                                const int stage_length,
+                                __constant uchar *stage_bytes,
+                                __constant uchar *byte_class,
+                                __constant float *unigram,
+                                __constant float *bigram,
+                                const float min_score) {
+    ulong gid = get_global_id(0);
+    if (gid >= count) {
+        return;
     }
 
-    size_t data_length = encrypted_data.size();
-    std::vector<unsigned char> decrypted_data(data_length);
+    cascade_record r;
+    if (first_stage) {
+        uchar key[MAX_KEY_LENGTH];
+        r.index = base_index + gid;
+        rc4_key_from_index(r.index, charset, charset_size, key_length, key);
+        rc4_ksa(r.S, key, key_length);
+        r.i = 0;
+        r.j = 0;
+        r.position = 0;
+    }
+    else {
+        r = input[gid];
+    }
 
-    cl_mem encrypted_data_buffer = clCreateBuffer(context, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR, data_length, (void*)encrypted_data.data(), &err);
-    if (err != CL_SUCCESS) {
-        std::cerr << "Failed to create encrypted data buffer. Error code: " << err << std::endl;
-        throw std::runtime_error("OpenCL buffer creation error");
+    uint needed = stage_offset + stage_length;
+    for (; r.position < needed; r.position++) {
+        r.i++;
+        r.j += r.S[r.i];
+        uchar temp = r.S[r.i];
+        r.S[r.i] = r.S[r.j];
+        r.S[r.j] = temp;
+        r.prefix[r.position] = ciphertext[r.position] ^ r.S[(uchar)(r.S[r.i] + r.S[r.j])];
     }
 
-    cl_mem decrypted_data_buffer = clCreateBuffer(context, CL_MEM_WRITE_ONLY, data_length, nullptr, &err);
-    if (err != CL_SUCCESS) {
-        std::cerr << "Failed to create decrypted data buffer. Error code: " << err << std::endl;
-        throw std::runtime_error("OpenCL buffer creation error");
+    bool pass = true;
+    if (stage_kind == 0) {
+        for (int n = stage_offset; n < stage_offset + stage_length && pass; n++) {
+            uchar c = r.prefix[n];
+            pass = (c >= 0x20 && c <= 0x7e) || (c >= 0x09 && c <= 0x0d);
+        }
+    }
+    else if (stage_kind == 1) {
+        for (int n = 0; n < stage_length && pass; n++) {
+            pass = r.prefix[stage_offset + n] == stage_bytes[n];
+        }
+    }
+    else {
+        float score = 0.0f;
+        uchar previous = 0;
+        for (int n = 0; n < stage_length; n++) {
+            uchar cls = byte_class[r.prefix[n]];
+            score += unigram[r.prefix[n]];
+            if (n > 0) {
+                score += bigram[previous * SCORE_CLASSES + cls];
+            }
+            previous = cls;
+        }
+        pass = score >= min_score;
     }
 
-    // Measure performance
-    auto start_time = std::chrono::high_resolution_clock::now();
+    if (pass) {
+        output[atomic_inc(output_count)] = r;
+    }
+}
 
-    for (int key_length = 1; key_length <= max_key_length; ++key_length) {
-        std::vector<unsigned char> keys(key_length);
-        std::string key_str(key_length, charset[0]);
+// Signature oracle: ops is a comparison program sorted by plaintext position, each op packed as
+// position << 16 | value << 8 | mask and clearing its signature's bit in alive on a mismatch.
+// Keystream is generated only while some signature is still alive.
+__kernel void rc4_signature(__global const uchar *ciphertext,
+                            const int check_length,
+                            __constant uchar *charset,
+                            const int charset_size,
+                            const int key_length,
+                            const ulong base_index,
+                            const ulong count,
+                            __global ulong *hits,
+                            __global uint *hit_count,
+                            const uint max_hits,
+                            __constant uint *ops,
+                            __constant uchar *op_signature,
+                            const int op_count,
+                            const ulong all_signatures) {
+    ulong gid = get_global_id(0);
+    if (gid >= count) {
+        return;
+    }
 
-        do {
-            std::copy(key_str.begin(), key_str.end(), keys.begin());
+    uchar key[MAX_KEY_LENGTH];
+    rc4_key_from_index(base_index + gid, charset, charset_size, key_length, key);
+    uchar S[256];
+    rc4_ksa(S, key, key_length);
 
-            cl_mem keys_buffer = clCreateBuffer(context, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR, keys.size(), keys.data(), &err);
-            if (err != CL_SUCCESS) {
-                std::cerr << "Failed to create keys buffer. Error code: " << err << std::endl;
-                throw std::runtime_error("OpenCL buffer creation error");
+    uchar i = 0, j = 0;
+    ulong alive = all_signatures;
+    int op = 0;
+    for (int n = 0; n < check_length && alive; n++) {
+        i++;
+        j += S[i];
+        uchar temp = S[i];
+        S[i] = S[j];
+        S[j] = temp;
+        uchar c = ciphertext[n] ^ S[(uchar)(S[i] + S[j])];
+        for (; op < op_count && (int)(ops[op] >> 16) == n; op++) {
+            if ((c & (ops[op] & 0xff)) != ((ops[op] >> 8) & 0xff)) {
+                alive &= ~((ulong)1 << op_signature[op]);
             }
+        }
+    }
+
+    if (alive) {
+        uint slot = atomic_inc(hit_count);
+        if (slot < max_hits) {
+            hits[slot] = base_index + gid;
+        }
+    }
+}
+
+// CRC oracle: decrypts frame bytes [0, check_length), runs a table-driven CRC over
+// [span_begin, span_end) and compares it with the crc_width / 8 byte field at crc_position.
+// crc_init is the initial register value (already reflected for reflected CRCs).
+__kernel void rc4_crc(__global const uchar *ciphertext,
+                      const int check_length,
+                      __constant uchar *charset,
+                      const int charset_size,
+                      const int key_length,
+                      const ulong base_index,
+                      const ulong count,
+                      __global ulong *hits,
+                      __global uint *hit_count,
+                      const uint max_hits,
+                      __constant uint *crc_table,
+                      const uint crc_init,
+                      const uint crc_xorout,
+                      const uint crc_mask,
+                      const int crc_width,
+                      const int crc_reflect,
+                      const int crc_big_endian,
+                      const int span_begin,
+                      const int span_end,
+                      const int crc_position) {
+    ulong gid = get_global_id(0);
+    if (gid >= count) {
+        return;
+    }
+
+    uchar key[MAX_KEY_LENGTH];
+    rc4_key_from_index(base_index + gid, charset, charset_size, key_length, key);
+    uchar S[256];
+    rc4_ksa(S, key, key_length);
+
+    uchar i = 0, j = 0;
+    uint reg = crc_init;
+    uint stored = 0;
+    int bytes = crc_width / 8;
+    int shift = crc_width - 8;
+    for (int n = 0; n < check_length; n++) {
+        i++;
+        j += S[i];
+        uchar temp = S[i];
+        S[i] = S[j];
+        S[j] = temp;
+        uchar c = ciphertext[n] ^ S[(uchar)(S[i] + S[j])];
+        if (n >= span_begin && n < span_end) {
+            reg = crc_reflect ? (reg >> 8) ^ crc_table[(reg ^ c) & 0xff]
+                              : ((reg << 8) ^ crc_table[((reg >> shift) ^ c) & 0xff]) & crc_mask;
+        }
+        if (n >= crc_position && n < crc_position + bytes) {
+            int k = n - crc_position;
+            stored |= (uint)c << (8 * (crc_big_endian ? bytes - 1 - k : k));
+        }
+    }
+
+    if ((reg ^ crc_xorout) == stored) {
+        uint slot = atomic_inc(hit_count);
+        if (slot < max_hits) {
+            hits[slot] = base_index + gid;
+        }
+    }
+}
+
+// UTF-8 text oracle: the plaintext prefix is decoded as it is generated and the key dropped at
+// the first byte that cannot continue a well-formed sequence, or at a complete code point outside
+// the accepted scripts. ascii is the accept bitmap for bytes below 0x80; ranges holds range_count
+// inclusive [first, last] pairs for code points above U+007F. A sequence cut off by the end of
+// the prefix is left to the host's full check.
+__kernel void rc4_utf8(__global const uchar *ciphertext,
+                       const int check_length,
+                       __constant uchar *charset,
+                       const int charset_size,
+                       const int key_length,
+                       const ulong base_index,
+                       const ulong count,
+                       __global ulong *hits,
+                       __global uint *hit_count,
+                       const uint max_hits,
+                       __constant uchar *ascii,
+                       __constant uint *ranges,
+                       const int range_count) {
+    ulong gid = get_global_id(0);
+    if (gid >= count) {
+        return;
+    }
+
+    uchar key[MAX_KEY_LENGTH];
+    rc4_key_from_index(base_index + gid, charset, charset_size, key_length, key);
+    uchar S[256];
+    rc4_ksa(S, key, key_length);
 
-            err = clSetKernelArg(kernel, 0, sizeof(cl_mem), &encrypted_data_buffer);
-            err |= clSetKernelArg(kernel, 1, sizeof(cl_mem), &decrypted_data_buffer);
-            err |= clSetKernelArg(kernel, 2, sizeof(cl_mem), &keys_buffer);
-            err |= clSetKernelArg(kernel, 3, sizeof(int), &key_length);
-            err |= clSetKernelArg(kernel, 4, sizeof(int), &data_length);
-            if (err != CL_SUCCESS) {
-                std::cerr << "Failed to set OpenCL kernel arguments. Error code: " << err << std::endl;
-                throw std::runtime_error("OpenCL kernel argument setting error");
+    uchar i = 0, j = 0;
+    uint code_point = 0;
+    int pending = 0;
+    uchar low = 0x80, high = 0xbf;
+    for (int n = 0; n < check_length; n++) {
+        i++;
+        j += S[i];
+        uchar temp = S[i];
+        S[i] = S[j];
+        S[j] = temp;
+        uchar c = ciphertext[n] ^ S[(uchar)(S[i] + S[j])];
+        if (pending == 0) {
+            if (c < 0x80) {
+                if (!((ascii[c >> 3] >> (c & 7)) & 1)) {
+                    return;
+                }
             }
+            else if (c >= 0xc2 && c <= 0xdf) {
+                pending = 1;
+                code_point = c & 0x1f;
+            }
+            else if (c >= 0xe0 && c <= 0xef) {
+                pending = 2;
+                code_point = c & 0x0f;
+                low = c == 0xe0 ? 0xa0 : 0x80;
+                high = c == 0xed ? 0x9f : 0xbf;
+            }
+            else if (c >= 0xf0 && c <= 0xf4) {
+                pending = 3;
+                code_point = c & 0x07;
+                low = c == 0xf0 ? 0x90 : 0x80;
+                high = c == 0xf4 ? 0x8f : 0xbf;
+            }
+            else {
+                return;
+            }
+            continue;
+        }
+        if (c < low || c > high) {
+            return;
+        }
+        code_point = code_point << 6 | (c & 0x3f);
+        low = 0x80;
+        high = 0xbf;
+        if (--pending == 0) {
+            bool allowed = false;
+            for (int r = 0; r < range_count && !allowed; r++) {
+                allowed = code_point >= ranges[2 * r] && code_point <= ranges[2 * r + 1];
+            }
+            if (!allowed) {
+                return;
+            }
+        }
+    }
+
+    uint slot = atomic_inc(hit_count);
+    if (slot < max_hits) {
+        hits[slot] = base_index + gid;
+    }
+}
+
+// Keystream-target oracle: the "ciphertext" is the known keystream itself, packed little-endian
+// into 64-bit target words (the last one zero-padded past check_length). Keystream is generated
+// a word at a time and the key dropped at the first word that differs.
+__kernel void rc4_keystream_match(__global const uchar *ciphertext,
+                                  const int check_length,
+                                  __constant uchar *charset,
+                                  const int charset_size,
+                                  const int key_length,
+                                  const ulong base_index,
+                                  const ulong count,
+                                  __global ulong *hits,
+                                  __global uint *hit_count,
+                                  const uint max_hits,
+                                  __constant ulong *target) {
+    ulong gid = get_global_id(0);
+    if (gid >= count) {
+        return;
+    }
+
+    uchar key[MAX_KEY_LENGTH];
+    rc4_key_from_index(base_index + gid, charset, charset_size, key_length, key);
+    uchar S[256];
+    rc4_ksa(S, key, key_length);
+
+    uchar i = 0, j = 0;
+    for (int n = 0; n < check_length; n += 8) {
+        ulong word = 0;
+        int bytes = min(8, check_length - n);
+        for (int b = 0; b < bytes; b++) {
+            i++;
+            j += S[i];
+            uchar temp = S[i];
+            S[i] = S[j];
+            S[j] = temp;
+            word |= (ulong)S[(uchar)(S[i] + S[j])] << (8 * b);
+        }
+        if (word != target[n >> 3]) {
+            return;
+        }
+    }
+
+    uint slot = atomic_inc(hit_count);
+    if (slot < max_hits) {
+        hits[slot] = base_index + gid;
+    }
+}
+
+// Multi-target oracle: the first 8 keystream bytes, packed little-endian, are looked up in the
+// sorted target_words. target_buckets[b] is the first word whose top TARGET_BUCKET_BITS bits are
+// at least b, so the lookup is a binary search over one bucket: a handful of probes whatever
+// the number of targets. check_length is always 8.
+__kernel void rc4_multi_target(__global const uchar *ciphertext,
+                               const int check_length,
+                               __constant uchar *charset,
+                               const int charset_size,
+                               const int key_length,
+                               const ulong base_index,
+                               const ulong count,
+                               __global ulong *hits,
+                               __global uint *hit_count,
+                               const uint max_hits,
+                               __global const ulong *target_words,
+                               __constant uint *target_buckets) {
+    ulong gid = get_global_id(0);
+    if (gid >= count) {
+        return;
+    }
+
+    uchar key[MAX_KEY_LENGTH];
+    rc4_key_from_index(base_index + gid, charset, charset_size, key_length, key);
+    uchar S[256];
+    rc4_ksa(S, key, key_length);
+
+    uchar i = 0, j = 0;
+    ulong word = 0;
+    for (int b = 0; b < 8; b++) {
+        i++;
+        j += S[i];
+        uchar temp = S[i];
+        S[i] = S[j];
+        S[j] = temp;
+        word |= (ulong)S[(uchar)(S[i] + S[j])] << (8 * b);
+    }
+
+    uint bucket = (uint)(word >> (64 - TARGET_BUCKET_BITS));
+    uint low = target_buckets[bucket], high = target_buckets[bucket + 1];
+    while (low < high) {
+        uint middle = (low + high) / 2;
+        if (target_words[middle] < word) {
+            low = middle + 1;
+        }
+        else {
+            high = middle;
+        }
+    }
+    if (low == target_buckets[bucket + 1] || target_words[low] != word) {
+        return;
+    }
+
+    uint slot = atomic_inc(hit_count);
+    if (slot < max_hits) {
+        hits[slot] = base_index + gid;
+    }
+}
+
+// Finalizer of splitmix64, used to derive the per-column reduction masks of TMTO chains
+ulong tmto_mix(ulong x) {
+    x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9UL;
+    x = (x ^ (x >> 27)) * 0x94d049bb133111ebUL;
+    return x ^ (x >> 31);
+}
+
+// Time-memory tradeoff chains over raw keys of key_bytes bytes. One step runs the KSA on the
+// big-endian key bytes, reads the first key_bytes keystream bytes back as a big-endian number
+// and reduces it into the keyspace with column c's mask, tmto_mix(salt + c). Work item gid
+// walks the chain starting at key first_start + gid through chain_length columns.
+__kernel void rc4_tmto_chains(const ulong first_start,
+                              const ulong count,
+                              const int key_bytes,
+                              const ulong key_mask,
+                              const ulong salt,
+                              const int chain_length,
+                              __global ulong *ends) {
+    ulong gid = get_global_id(0);
+    if (gid >= count) {
+        return;
+    }
+
+    ulong x = first_start + gid;
+    uchar key[8];
+    uchar S[256];
+    for (int column = 0; column < chain_length; column++) {
+        for (int b = 0; b < key_bytes; b++) {
+            key[b] = (uchar)(x >> (8 * (key_bytes - 1 - b)));
+        }
+        rc4_ksa(S, key, key_bytes);
+        uchar i = 0, j = 0;
+        ulong y = 0;
+        for (int b = 0; b < key_bytes; b++) {
+            i++;
+            j += S[i];
+            uchar temp = S[i];
+            S[i] = S[j];
+            S[j] = temp;
+            y = (y << 8) | S[(uchar)(S[i] + S[j])];
+        }
+        x = (y ^ tmto_mix(salt + column)) & key_mask;
+    }
+    ends[gid] = x;
+}
+
+// Prefix-table generation: the first prefix_bytes keystream bytes of key index base_index + gid,
+// as a big-endian number so that numeric order is byte order
+__kernel void rc4_prefix_values(__constant uchar *charset,
+                                const int charset_size,
+                                const int key_length,
+                                const ulong base_index,
+                                const ulong count,
+                                const int prefix_bytes,
+                                __global ulong *prefixes) {
+    ulong gid = get_global_id(0);
+    if (gid >= count) {
+        return;
+    }
+
+    uchar key[MAX_KEY_LENGTH];
+    rc4_key_from_index(base_index + gid, charset, charset_size, key_length, key);
+    uchar S[256];
+    rc4_ksa(S, key, key_length);
+
+    uchar i = 0, j = 0;
+    ulong prefix = 0;
+    for (int n = 0; n < prefix_bytes; n++) {
+        i++;
+        j += S[i];
+        uchar temp = S[i];
+        S[i] = S[j];
+        S[j] = temp;
+        prefix = (prefix << 8) | S[(uchar)(S[i] + S[j])];
+    }
+    prefixes[gid] = prefix;
+}
+
+// Bias table sampling: work item gid draws the 16-byte key of sample first_sample + gid (the
+// little-endian words tmto_mix(seed + 2 * sample) and tmto_mix(seed + 2 * sample + 1)) and
+// counts keystream positions first_position .. first_position + window - 1 in the work group's
+// local histogram, which is added to the global one with one atomic per non-zero bin
+__kernel void rc4_keystream_histogram(const ulong seed,
+                                      const ulong first_sample,
+                                      const ulong count,
+                                      const int first_position,
+                                      const int window,
+                                      __local uint *local_hist,
+                                      __global uint *hist) {
+    int lid = get_local_id(0), local_size = get_local_size(0);
+    for (int n = lid; n < window * 256; n += local_size) {
+        local_hist[n] = 0;
+    }
+    barrier(CLK_LOCAL_MEM_FENCE);
+
+    ulong gid = get_global_id(0);
+    if (gid < count) {
+        ulong sample = first_sample + gid;
+        ulong words[2] = { tmto_mix(seed + 2 * sample), tmto_mix(seed + 2 * sample + 1) };
+        uchar key[16];
+        for (int b = 0; b < 16; b++) {
+            key[b] = (uchar)(words[b >> 3] >> (8 * (b & 7)));
+        }
+        uchar S[256];
+        rc4_ksa(S, key, 16);
 
-            size_t global_work_size = data_length;
-            err = clEnqueueNDRangeKernel(queue, kernel, 1, nullptr, &global_work_size, nullptr, 0, nullptr, nullptr);
-            if (err != CL_SUCCESS) {
-                std::cerr << "Failed to enqueue OpenCL kernel. Error code: " << err << std::endl;
-                throw std::runtime_error("OpenCL kernel enqueue error");
+        uchar i = 0, j = 0;
+        for (int r = 0; r < first_position + window; r++) {
+            i++;
+            j += S[i];
+            uchar temp = S[i];
+            S[i] = S[j];
+            S[j] = temp;
+            if (r >= first_position) {
+                atomic_inc(&local_hist[(r - first_position) * 256 + S[(uchar)(S[i] + S[j])]]);
             }
+        }
+    }
+    barrier(CLK_LOCAL_MEM_FENCE);
+
+    for (int n = lid; n < window * 256; n += local_size) {
+        if (local_hist[n]) {
+            atomic_add(&hist[n], local_hist[n]);
+        }
+    }
+}
+
+__constant uint md5_sines[64] = {
+    0xd76aa478, 0xe8c7b756, 0x242070db, 0xc1bdceee, 0xf57c0faf, 0x4787c62a, 0xa8304613, 0xfd469501,
+    0x698098d8, 0x8b44f7af, 0xffff5bb1, 0x895cd7be, 0x6b901122, 0xfd987193, 0xa679438e, 0x49b40821,
+    0xf61e2562, 0xc040b340, 0x265e5a51, 0xe9b6c7aa, 0xd62f105d, 0x02441453, 0xd8a1e681, 0xe7d3fbc8,
+    0x21e1cde6, 0xc33707d6, 0xf4d50d87, 0x455a14ed, 0xa9e3e905, 0xfcefa3f8, 0x676f02d9, 0x8d2a4c8a,
+    0xfffa3942, 0x8771f681, 0x6d9d6122, 0xfde5380c, 0xa4beea44, 0x4bdecfa9, 0xf6bb4b60, 0xbebfbc70,
+    0x289b7ec6, 0xeaa127fa, 0xd4ef3085, 0x04881d05, 0xd9d4d039, 0xe6db99e5, 0x1fa27cf8, 0xc4ac5665,
+    0xf4292244, 0x432aff97, 0xab9423a7, 0xfc93a039, 0x655b59c3, 0x8f0ccc92, 0xffeff47d, 0x85845dd1,
+    0x6fa87e4f, 0xfe2ce6e0, 0xa3014314, 0x4e0811a1, 0xf7537e82, 0xbd3af235, 0x2ad7d2bb, 0xeb86d391,
+};
+__constant uint md5_shifts[16] = { 7, 12, 17, 22, 5, 9, 14, 20, 4, 11, 16, 23, 6, 10, 15, 21 };
+
+// One MD5 compression of the little-endian message words w into state[0..3]
+void md5_compress(uint *state, const uint *w) {
+    uint a = state[0], b = state[1], c = state[2], d = state[3];
+    #pragma unroll
+    for (int t = 0; t < 64; t++) {
+        uint f;
+        int g;
+        if (t < 16) {
+            f = bitselect(d, c, b);
+            g = t;
+        }
+        else if (t < 32) {
+            f = bitselect(c, b, d);
+            g = (5 * t + 1) & 15;
+        }
+        else if (t < 48) {
+            f = b ^ c ^ d;
+            g = (3 * t + 5) & 15;
+        }
+        else {
+            f = c ^ (b | ~d);
+            g = (7 * t) & 15;
+        }
+        uint temp = d;
+        d = c;
+        c = b;
+        b += rotate(a + f + md5_sines[t] + w[g], md5_shifts[(t >> 4) * 4 + (t & 3)]);
+        a = temp;
+    }
+    state[0] += a;
+    state[1] += b;
+    state[2] += c;
+    state[3] += d;
+}
+
+// One SHA-1 compression of the big-endian message words w into state[0..4]; the schedule is
+// expanded in place in w as a 16-word ring
+void sha1_compress(uint *state, uint *w) {
+    uint a = state[0], b = state[1], c = state[2], d = state[3], e = state[4];
+    #pragma unroll
+    for (int t = 0; t < 80; t++) {
+        if (t >= 16) {
+            w[t & 15] = rotate(w[(t - 3) & 15] ^ w[(t - 8) & 15] ^ w[(t - 14) & 15] ^ w[t & 15], 1u);
+        }
+        uint f = t < 20 ? bitselect(d, c, b) + 0x5a827999 : t < 40 ? (b ^ c ^ d) + 0x6ed9eba1
+            : t < 60 ? bitselect(b, d, b ^ c) + 0x8f1bbcdc : (b ^ c ^ d) + 0xca62c1d6;
+        uint temp = rotate(a, 5u) + f + e + w[t & 15];
+        e = d;
+        d = c;
+        c = rotate(b, 30u);
+        b = a;
+        a = temp;
+    }
+    state[0] += a;
+    state[1] += b;
+    state[2] += c;
+    state[3] += d;
+    state[4] += e;
+}
+
+// Passphrase-to-key stage of the KDF pipeline: work item gid hashes passphrase index
+// base_index + gid followed by the salt with MD5 (algorithm 0) or SHA-1 (algorithm 1) and
+// keeps the first key_bytes digest bytes as its RC4 key. Passphrase and salt fit one block.
+__kernel void kdf_derive_keys(__constant uchar *charset,
+                              const int charset_size,
+                              const int passphrase_length,
+                              const ulong base_index,
+                              const ulong count,
+                              __constant uchar *salt,
+                              const int salt_length,
+                              const int algorithm,
+                              const int key_bytes,
+                              __global uchar *keys) {
+    ulong gid = get_global_id(0);
+    if (gid >= count) {
+        return;
+    }
+
+    uchar passphrase[MAX_KEY_LENGTH];
+    rc4_key_from_index(base_index + gid, charset, charset_size, passphrase_length, passphrase);
+
+    // Byte n of the message sits in word n / 4, at the top of the word for SHA-1's big-endian order
+    int swap = algorithm == 1 ? 3 : 0;
+    int length = passphrase_length + salt_length;
+    uint w[16];
+    for (int k = 0; k < 16; k++) {
+        w[k] = 0;
+    }
+    for (int n = 0; n < passphrase_length; n++) {
+        w[n >> 2] |= (uint)passphrase[n] << (8 * ((n & 3) ^ swap));
+    }
+    for (int n = passphrase_length; n < length; n++) {
+        w[n >> 2] |= (uint)salt[n - passphrase_length] << (8 * ((n & 3) ^ swap));
+    }
+    w[length >> 2] |= 0x80u << (8 * ((length & 3) ^ swap));
+
+    uint state[5] = { 0x67452301, 0xefcdab89, 0x98badcfe, 0x10325476, 0xc3d2e1f0 };
+    if (algorithm == 1) {
+        w[15] = length * 8;
+        sha1_compress(state, w);
+    }
+    else {
+        w[14] = length * 8;
+        md5_compress(state, w);
+    }
+    for (int b = 0; b < key_bytes; b++) {
+        keys[gid * key_bytes + b] = (uchar)(state[b >> 2] >> (8 * ((b & 3) ^ swap)));
+    }
+}
+
+// RC4 stage of the KDF pipeline: rc4_search's accept-bitmap check over the keys that
+// kdf_derive_keys left in keys, reporting passphrase indices as hits
+__kernel void rc4_search_keys(__global const uchar *ciphertext,
+                              const int check_length,
+                              __global const uchar *keys,
+                              const int key_bytes,
+                              const ulong base_index,
+                              const ulong count,
+                              __global ulong *hits,
+                              __global uint *hit_count,
+                              const uint max_hits,
+                              __constant uchar *accept) {
+    ulong gid = get_global_id(0);
+    if (gid >= count) {
+        return;
+    }
+
+    uchar key[MAX_KEY_LENGTH];
+    for (int b = 0; b < key_bytes; b++) {
+        key[b] = keys[gid * key_bytes + b];
+    }
+    uchar S[256];
+    rc4_ksa(S, key, key_bytes);
+
+    uchar i = 0, j = 0;
+    for (int n = 0; n < check_length; n++) {
+        i++;
+        j += S[i];
+        uchar temp = S[i];
+        S[i] = S[j];
+        S[j] = temp;
+        uchar c = ciphertext[n] ^ S[(uchar)(S[i] + S[j])];
+        if (!((accept[c >> 3] >> (c & 7)) & 1)) {
+            return;
+        }
+    }
+
+    uint slot = atomic_inc(hit_count);
+    if (slot < max_hits) {
+        hits[slot] = base_index + gid;
+    }
+}
+
+__constant uchar pdf_padding[32] = {
+    0x28, 0xbf, 0x4e, 0x5e, 0x4e, 0x75, 0x8a, 0x41, 0x64, 0x00, 0x4e, 0x56, 0xff, 0xfa, 0x01, 0x08,
+    0x2e, 0x2e, 0x00, 0xb6, 0xd0, 0x68, 0x3e, 0x80, 0x2f, 0x0c, 0xa9, 0xfe, 0x64, 0x53, 0x69, 0x7a,
+};
+
+// PDF Standard Security Handler check (revisions 2-4, RC4). With derive set, work item gid
+// turns password index base_index + gid into the file key: MD5 over the padded password and
+// the host-built rest of the message (message_blocks blocks in message, whose first 8 words
+// are left for the password), then 50 rehashes of the key's file_key_bytes bytes for revision
+// 3 and up. Without derive the index is the file key itself. The key is right when u_seed XOR
+// the keystreams of key ^ 0 .. key ^ (rounds - 1) reproduces u_target: one round over 32
+// bytes for revision 2, 20 rounds over 16 bytes after that.
+__kernel void pdf_check_keys(__constant uchar *charset,
+                             const int charset_size,
+                             const int key_length,
+                             const ulong base_index,
+                             const ulong count,
+                             const int derive,
+                             __constant uint *message,
+                             const int message_blocks,
+                             const int revision,
+                             const int file_key_bytes,
+                             __constant uchar *u_seed,
+                             __constant uchar *u_target,
+                             __global ulong *hits,
+                             __global uint *hit_count,
+                             const uint max_hits) {
+    ulong gid = get_global_id(0);
+    if (gid >= count) {
+        return;
+    }
 
-            err = clEnqueueReadBuffer(queue, decrypted_data_buffer, CL_TRUE, 0, data_length, decrypted_data.data(), 0, nullptr, nullptr);
-            if (err != CL_SUCCESS) {
-                std::cerr << "Failed to read buffer from OpenCL kernel. Error code: " << err << std::endl;
-                throw std::runtime_error("OpenCL buffer read error");
+    uchar candidate[MAX_KEY_LENGTH];
+    rc4_key_from_index(base_index + gid, charset, charset_size, key_length, candidate);
+    uchar key[16];
+    if (derive) {
+        uint w[16];
+        for (int k = 0; k < 8; k++) {
+            uint word = 0;
+            for (int b = 3; b >= 0; b--) {
+                int n = 4 * k + b;
+                word = word << 8 | (n < key_length ? candidate[n] : pdf_padding[n - key_length]);
+            }
+            w[k] = word;
+        }
+        uint state[4] = { 0x67452301, 0xefcdab89, 0x98badcfe, 0x10325476 };
+        for (int block = 0; block < message_blocks; block++) {
+            for (int k = block == 0 ? 8 : 0; k < 16; k++) {
+                w[k] = message[block * 16 + k];
+            }
+            md5_compress(state, w);
+        }
+        for (int round = revision >= 3 ? 0 : 50; round < 50; round++) {
+            for (int k = 0; k < 16; k++) {
+                w[k] = 0;
             }
+            for (int b = 0; b < file_key_bytes; b++) {
+                w[b >> 2] |= state[b >> 2] & (0xffu << (8 * (b & 3)));
+            }
+            w[file_key_bytes >> 2] |= 0x80u << (8 * (file_key_bytes & 3));
+            w[14] = file_key_bytes * 8;
+            state[0] = 0x67452301;
+            state[1] = 0xefcdab89;
+            state[2] = 0x98badcfe;
+            state[3] = 0x10325476;
+            md5_compress(state, w);
+        }
+        for (int b = 0; b < file_key_bytes; b++) {
+            key[b] = (uchar)(state[b >> 2] >> (8 * (b & 3)));
+        }
+    }
+    else {
+        for (int b = 0; b < file_key_bytes; b++) {
+            key[b] = candidate[b];
+        }
+    }
 
-            if (is_valid_plaintext(decrypted_data)) {
-                auto end_time = std::chrono::high_resolution_clock::now();
-                std::chrono::duration<double> elapsed = end_time - start_time;
-                std::cout << "Decryption successful, key found: " << key_str << std::endl;
-                std::cout << "Time taken: " << elapsed.count() << " seconds" << std::endl;
-                return decrypted_data;
+    const int rounds = revision >= 3 ? 20 : 1, check_bytes = revision >= 3 ? 16 : 32;
+    uchar value[32];
+    for (int n = 0; n < check_bytes; n++) {
+        value[n] = u_seed[n];
+    }
+    uchar round_key[16];
+    uchar S[256];
+    for (int round = 0; round < rounds; round++) {
+        for (int b = 0; b < file_key_bytes; b++) {
+            round_key[b] = key[b] ^ round;
+        }
+        rc4_ksa(S, round_key, file_key_bytes);
+        uchar i = 0, j = 0;
+        for (int n = 0; n < check_bytes; n++) {
+            i++;
+            j += S[i];
+            uchar temp = S[i];
+            S[i] = S[j];
+            S[j] = temp;
+            value[n] ^= S[(uchar)(S[i] + S[j])];
+            if (round == rounds - 1 && value[n] != u_target[n]) {
+                return;
             }
+        }
+    }
 
-            clReleaseMemObject(keys_buffer);
-        } while (std::next_permutation(key_str.begin(), key_str.end()));
+    uint slot = atomic_inc(hit_count);
+    if (slot < max_hits) {
+        hits[slot] = base_index + gid;
     }
+}
+)";
 
-    auto end_time = std::chrono::high_resolution_clock::now();
-    std::chrono::duration<double> elapsed = end_time - start_time;
-    std::cout << "No valid key found" << std::endl;
-    std::cout << "Time taken: " << elapsed.count() << " seconds" << std::endl;
+// 256-bit set of accepted byte values
+struct ByteClass {
+    uint64_t bits[4] = { 0, 0, 0, 0 };
+
+    void add(unsigned char c) {
+        bits[c >> 6] |= (uint64_t)1 << (c & 63);
+    }
+    bool contains(unsigned char c) const {
+        return (bits[c >> 6] >> (c & 63)) & 1;
+    }
+};
 
-    return {};
+// Printable ASCII plus \t \n \v \f \r, the same set the kernels accept; unlike isprint this
+// does not depend on the locale
+ByteClass printable_byte_class() {
+    ByteClass cls;
+    for (int c = 0x20; c <= 0x7e; c++) {
+        cls.add((unsigned char)c);
+    }
+    for (int c = 0x09; c <= 0x0d; c++) {
+        cls.add((unsigned char)c);
+    }
+    return cls;
 }
 
-int main() {
-    try {
-        std::ifstream input_file("encrypted_file.bin", std::ios::binary);
-        if (!input_file) {
-            std::cerr << "Failed to open input file" << std::endl;
-            throw std::runtime_error("File open error");
+// "printable", or comma-separated hex bytes and ranges such as "09-0d,20-7e,c0-ff"
+ByteClass parse_byte_class(const std::string& spec) {
+    if (spec == "printable") {
+        return printable_byte_class();
+    }
+    ByteClass cls;
+    std::stringstream ss(spec);
+    std::string item;
+    while (std::getline(ss, item, ',')) {
+        size_t dash = item.find('-');
+        unsigned long first = std::stoul(item.substr(0, dash), nullptr, 16);
+        unsigned long last = dash == std::string::npos ? first : std::stoul(item.substr(dash + 1), nullptr, 16);
+        if (first > last || last > 0xff) {
+            throw std::runtime_error("Invalid byte class range: " + item);
+        }
+        for (unsigned long c = first; c <= last; c++) {
+            cls.add((unsigned char)c);
         }
+    }
+    return cls;
+}
 
-        std::vector<unsigned char> encrypted_data((std::istreambuf_iterator<char>(input_file)), std::istreambuf_iterator<char>());
-        input_file.close();
+// The class as 32 bytes, bit c & 7 of byte c >> 3 set for accepted c, as the kernels read it
+std::vector<unsigned char> byte_class_bitmap(const ByteClass& cls) {
+    std::vector<unsigned char> bitmap(32, 0);
+    for (int c = 0; c < 256; c++) {
+        if (cls.contains((unsigned char)c)) {
+            bitmap[c >> 3] |= (unsigned char)(1 << (c & 7));
+        }
+    }
+    return bitmap;
+}
 
-        // Adjust charset and max_key_length based on your specific requirements for P1 and DMR
-        std::string charset = "abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789";
-        int max_key_length = 5;
+// Nibble tables for the vector lookups: bit k of low_rows[lo] is set when byte (k << 4 | lo)
+// is in the class, high_rows does the same for high nibbles 8-15. A byte is accepted when its
+// row, picked by its top bit, has the bit of its high nibble (mod 8) set.
+struct ByteClassTables {
+    alignas(64) unsigned char low_rows[16];
+    alignas(64) unsigned char high_rows[16];
+};
 
-        std::vector<unsigned char> decrypted_data = brute_force_rc4_gpu(encrypted_data, charset, max_key_length);
+ByteClassTables byte_class_tables(const ByteClass& cls) {
+    ByteClassTables tables = {};
+    for (int c = 0; c < 256; c++) {
+        if (cls.contains((unsigned char)c)) {
+            int hi = c >> 4;
+            (hi < 8 ? tables.low_rows : tables.high_rows)[c & 15] |= (unsigned char)(1 << (hi & 7));
+        }
+    }
+    return tables;
+}
 
-        if (!decrypted_data.empty()) {
-            std::ofstream output_file("decrypted_file.bin", std::ios::binary);
-            if (!output_file) {
-                std::cerr << "Failed to open output file" << std::endl;
-                throw std::runtime_error("File open error");
-            }
+size_t first_invalid_scalar(const ByteClass& cls, const unsigned char* data, size_t length) {
+    for (size_t k = 0; k < length; k++) {
+        if (!cls.contains(data[k])) {
+            return k;
+        }
+    }
+    return length;
+}
+
+// The vector validators and everything else below that uses intrinsics are x86 only; other
+// targets run the scalar paths, with simd_level() reporting 0
+#if defined(__x86_64__) || defined(__i386__)
+__attribute__((target("sse4.2")))
+size_t first_invalid_sse42(const ByteClass& cls, const unsigned char* data, size_t length) {
+    ByteClassTables tables = byte_class_tables(cls);
+    const __m128i low_rows = _mm_load_si128((const __m128i*)tables.low_rows);
+    const __m128i high_rows = _mm_load_si128((const __m128i*)tables.high_rows);
+    const __m128i row_bit = _mm_setr_epi8(1, 2, 4, 8, 16, 32, 64, -128, 1, 2, 4, 8, 16, 32, 64, -128);
+    const __m128i nibble = _mm_set1_epi8(0x0f);
+    size_t k = 0;
+    for (; k + 16 <= length; k += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i*)(data + k));
+        __m128i lo = _mm_and_si128(v, nibble);
+        __m128i hi = _mm_and_si128(_mm_srli_epi16(v, 4), nibble);
+        __m128i rows = _mm_blendv_epi8(_mm_shuffle_epi8(low_rows, lo), _mm_shuffle_epi8(high_rows, lo), v);
+        __m128i hit = _mm_and_si128(rows, _mm_shuffle_epi8(row_bit, hi));
+        int bad = _mm_movemask_epi8(_mm_cmpeq_epi8(hit, _mm_setzero_si128()));
+        if (bad) {
+            return k + __builtin_ctz(bad);
+        }
+    }
+    return k + first_invalid_scalar(cls, data + k, length - k);
+}
+
+// Bit k set when byte k of the 32 at p is outside the class
+__attribute__((target("avx2"))) inline
+uint32_t avx2_rejected(const unsigned char* p, const __m256i& low_rows, const __m256i& high_rows, const __m256i& row_bit, const __m256i& nibble) {
+    __m256i v = _mm256_loadu_si256((const __m256i*)p);
+    __m256i lo = _mm256_and_si256(v, nibble);
+    __m256i hi = _mm256_and_si256(_mm256_srli_epi16(v, 4), nibble);
+    __m256i rows = _mm256_blendv_epi8(_mm256_shuffle_epi8(low_rows, lo), _mm256_shuffle_epi8(high_rows, lo), v);
+    __m256i hit = _mm256_and_si256(rows, _mm256_shuffle_epi8(row_bit, hi));
+    return (uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(hit, _mm256_setzero_si256()));
+}
+
+__attribute__((target("avx2")))
+size_t first_invalid_avx2(const ByteClass& cls, const unsigned char* data, size_t length) {
+    ByteClassTables tables = byte_class_tables(cls);
+    const __m256i low_rows = _mm256_broadcastsi128_si256(_mm_load_si128((const __m128i*)tables.low_rows));
+    const __m256i high_rows = _mm256_broadcastsi128_si256(_mm_load_si128((const __m128i*)tables.high_rows));
+    const __m256i row_bit = _mm256_broadcastsi128_si256(_mm_setr_epi8(1, 2, 4, 8, 16, 32, 64, -128, 1, 2, 4, 8, 16, 32, 64, -128));
+    const __m256i nibble = _mm256_set1_epi8(0x0f);
+    size_t k = 0;
+    // Two vectors per iteration keep enough loads in flight to run at memory bandwidth
+    for (; k + 64 <= length; k += 64) {
+        uint64_t bad = avx2_rejected(data + k, low_rows, high_rows, row_bit, nibble)
+            | (uint64_t)avx2_rejected(data + k + 32, low_rows, high_rows, row_bit, nibble) << 32;
+        if (bad) {
+            return k + __builtin_ctzll(bad);
+        }
+    }
+    for (; k + 32 <= length; k += 32) {
+        uint32_t bad = avx2_rejected(data + k, low_rows, high_rows, row_bit, nibble);
+        if (bad) {
+            return k + __builtin_ctz(bad);
+        }
+    }
+    return k + first_invalid_scalar(cls, data + k, length - k);
+}
+
+__attribute__((target("avx512f,avx512bw")))
+size_t first_invalid_avx512(const ByteClass& cls, const unsigned char* data, size_t length) {
+    ByteClassTables tables = byte_class_tables(cls);
+    // vpshufb looks up within 128-bit lanes, so every lane gets its own copy of the tables
+    alignas(64) unsigned char lanes[3][64];
+    for (int k = 0; k < 64; k++) {
+        lanes[0][k] = tables.low_rows[k & 15];
+        lanes[1][k] = tables.high_rows[k & 15];
+        lanes[2][k] = (unsigned char)(1 << (k & 7));
+    }
+    const __m512i low_rows = _mm512_load_si512((const void*)lanes[0]);
+    const __m512i high_rows = _mm512_load_si512((const void*)lanes[1]);
+    const __m512i row_bit = _mm512_load_si512((const void*)lanes[2]);
+    const __m512i nibble = _mm512_set1_epi8(0x0f);
+    size_t k = 0;
+    for (; k + 64 <= length; k += 64) {
+        __m512i v = _mm512_loadu_si512((const void*)(data + k));
+        __m512i lo = _mm512_and_si512(v, nibble);
+        __m512i hi = _mm512_and_si512(_mm512_srli_epi16(v, 4), nibble);
+        __m512i rows = _mm512_mask_blend_epi8(_mm512_movepi8_mask(v), _mm512_shuffle_epi8(low_rows, lo), _mm512_shuffle_epi8(high_rows, lo));
+        uint64_t bad = ~(uint64_t)_mm512_test_epi8_mask(rows, _mm512_shuffle_epi8(row_bit, hi));
+        if (bad) {
+            return k + __builtin_ctzll(bad);
+        }
+    }
+    return k + first_invalid_scalar(cls, data + k, length - k);
+}
+#endif
+
+// Widest vector unit of this CPU, picked once: 0 scalar, 1 SSE4.2, 2 AVX2, 3 AVX-512BW
+int simd_level() {
+#if defined(__x86_64__) || defined(__i386__)
+    static const int level = __builtin_cpu_supports("avx512bw") ? 3 : __builtin_cpu_supports("avx2") ? 2 : __builtin_cpu_supports("sse4.2") ? 1 : 0;
+    return level;
+#else
+    return 0;
+#endif
+}
+
+const char* simd_level_name() {
+    static const char* names[] = { "scalar", "SSE4.2", "AVX2", "AVX-512BW" };
+    return names[simd_level()];
+}
+
+// Offset of the first byte outside the class, or length when every byte is in it
+size_t first_invalid_byte(const ByteClass& cls, const unsigned char* data, size_t length) {
+#if defined(__x86_64__) || defined(__i386__)
+    switch (simd_level()) {
+    case 3:
+        return first_invalid_avx512(cls, data, length);
+    case 2:
+        return first_invalid_avx2(cls, data, length);
+    case 1:
+        return first_invalid_sse42(cls, data, length);
+    }
+#endif
+    return first_invalid_scalar(cls, data, length);
+}
+
+// Length of the leading run of ASCII bytes, skipped a vector at a time
+size_t ascii_prefix_length(const unsigned char* data, size_t length) {
+    size_t k = 0;
+#if defined(__x86_64__) || defined(__i386__)
+    for (; k + 16 <= length; k += 16) {
+        int high = _mm_movemask_epi8(_mm_loadu_si128((const __m128i*)(data + k)));
+        if (high) {
+            return k + __builtin_ctz(high);
+        }
+    }
+#endif
+    while (k < length && data[k] < 0x80) {
+        k++;
+    }
+    return k;
+}
+
+// Offset of the first byte of the first ill-formed UTF-8 sequence (overlong forms, surrogates
+// and code points past U+10FFFF included), or length when the whole buffer is well-formed
+size_t first_invalid_utf8(const unsigned char* data, size_t length) {
+    size_t k = 0;
+    while (k < length) {
+        k += ascii_prefix_length(data + k, length - k);
+        if (k == length) {
+            break;
+        }
+        unsigned char lead = data[k];
+        size_t count;
+        unsigned char min_second = 0x80, max_second = 0xbf;
+        if (lead >= 0xc2 && lead <= 0xdf) {
+            count = 1;
+        }
+        else if (lead >= 0xe0 && lead <= 0xef) {
+            count = 2;
+            min_second = lead == 0xe0 ? 0xa0 : 0x80;
+            max_second = lead == 0xed ? 0x9f : 0xbf;
+        }
+        else if (lead >= 0xf0 && lead <= 0xf4) {
+            count = 3;
+            min_second = lead == 0xf0 ? 0x90 : 0x80;
+            max_second = lead == 0xf4 ? 0x8f : 0xbf;
+        }
+        else {
+            return k;
+        }
+        if (k + count >= length || data[k + 1] < min_second || data[k + 1] > max_second) {
+            return k;
+        }
+        for (size_t n = 2; n <= count; n++) {
+            if ((data[k + n] & 0xc0) != 0x80) {
+                return k;
+            }
+        }
+        k += count + 1;
+    }
+    return length;
+}
+
+bool is_valid_plaintext(const std::vector<unsigned char>& data, const ByteClass& cls = printable_byte_class()) {
+    return first_invalid_byte(cls, data.data(), data.size()) == data.size();
+}
+
+// Statistics of a ^ b: set bits, bytes with the top bit set and zero (equal) bytes. Under
+// independent keystreams the XOR is uniform, 4 bits and half a top bit per byte; under a reused
+// keystream it is plaintext ^ plaintext, which for text clears the top bit and has few set bits.
+struct XorStats {
+    uint64_t bytes;
+    uint64_t bits;
+    uint64_t high;
+    uint64_t equal;
+
+    // Standard deviations by which the bit count falls short of the uniform 4n (variance 2n)
+    double score() const {
+        return bytes ? (4.0 * bytes - (double)bits) / std::sqrt(2.0 * bytes) : 0.0;
+    }
+};
+
+XorStats xor_stats_scalar(const unsigned char* a, const unsigned char* b, size_t length) {
+    XorStats stats = { length, 0, 0, 0 };
+    for (size_t k = 0; k < length; k++) {
+        unsigned char x = a[k] ^ b[k];
+        stats.bits += __builtin_popcount(x);
+        stats.high += x >> 7;
+        stats.equal += x == 0;
+    }
+    return stats;
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+// Per-byte popcounts from a nibble table, summed into 64-bit lanes by vpsadbw; the top-bit and
+// zero-byte counts come from movemask
+__attribute__((target("avx2")))
+XorStats xor_stats_avx2(const unsigned char* a, const unsigned char* b, size_t length) {
+    const __m256i nibble_bits = _mm256_setr_epi8(0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4, 0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4);
+    const __m256i nibble = _mm256_set1_epi8(0x0f);
+    const __m256i zero = _mm256_setzero_si256();
+    __m256i bits = zero;
+    XorStats stats = { length, 0, 0, 0 };
+    size_t k = 0;
+    for (; k + 32 <= length; k += 32) {
+        __m256i x = _mm256_xor_si256(_mm256_loadu_si256((const __m256i*)(a + k)), _mm256_loadu_si256((const __m256i*)(b + k)));
+        __m256i counts = _mm256_add_epi8(_mm256_shuffle_epi8(nibble_bits, _mm256_and_si256(x, nibble)),
+            _mm256_shuffle_epi8(nibble_bits, _mm256_and_si256(_mm256_srli_epi16(x, 4), nibble)));
+        bits = _mm256_add_epi64(bits, _mm256_sad_epu8(counts, zero));
+        stats.high += __builtin_popcount((uint32_t)_mm256_movemask_epi8(x));
+        stats.equal += __builtin_popcount((uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(x, zero)));
+    }
+    alignas(32) uint64_t lanes[4];
+    _mm256_store_si256((__m256i*)lanes, bits);
+    XorStats tail = xor_stats_scalar(a + k, b + k, length - k);
+    stats.bits = lanes[0] + lanes[1] + lanes[2] + lanes[3] + tail.bits;
+    stats.high += tail.high;
+    stats.equal += tail.equal;
+    return stats;
+}
+#endif
+
+XorStats xor_stats(const unsigned char* a, const unsigned char* b, size_t length) {
+#if defined(__x86_64__) || defined(__i386__)
+    if (simd_level() >= 2) {
+        return xor_stats_avx2(a, b, length);
+    }
+#endif
+    return xor_stats_scalar(a, b, length);
+}
+
+// Code point blocks the UTF-8 oracle can be restricted to, by script name. The "punctuation"
+// blocks (Latin-1 symbols, general punctuation, currency) come with every named script.
+struct ScriptBlock {
+    const char* script;
+    uint32_t first;
+    uint32_t last;
+};
+
+const ScriptBlock script_blocks[] = {
+    { "punctuation", 0x00a0, 0x00bf }, { "punctuation", 0x2000, 0x206f }, { "punctuation", 0x20a0, 0x20cf },
+    { "latin", 0x00c0, 0x024f }, { "latin", 0x1e00, 0x1eff },
+    { "greek", 0x0370, 0x03ff },
+    { "cyrillic", 0x0400, 0x052f },
+    { "hebrew", 0x0590, 0x05ff },
+    { "arabic", 0x0600, 0x06ff }, { "arabic", 0x0750, 0x077f }, { "arabic", 0xfb50, 0xfdff }, { "arabic", 0xfe70, 0xfeff },
+    { "cjk", 0x2e80, 0x2fdf }, { "cjk", 0x3000, 0x312f }, { "cjk", 0x3400, 0x4dbf }, { "cjk", 0x4e00, 0x9fff },
+    { "cjk", 0xac00, 0xd7af }, { "cjk", 0xf900, 0xfaff }, { "cjk", 0xff00, 0xffef },
+    { "any", 0x00a0, 0x10ffff },
+};
+
+// Code points the UTF-8 oracle accepts: single-byte ones as a byte class (never holding bytes
+// >= 0x80), the rest as sorted, disjoint inclusive [first, last] pairs
+struct TextScripts {
+    ByteClass ascii;
+    std::vector<uint32_t> ranges;
+};
+
+// Comma-separated script names from script_blocks and hex code point ranges ("0400-04ff" or a
+// single "20ac"). Printable ASCII is always accepted.
+TextScripts parse_text_scripts(const std::string& spec) {
+    TextScripts scripts;
+    scripts.ascii = printable_byte_class();
+    std::vector<std::pair<uint32_t, uint32_t>> blocks;
+    std::stringstream items(spec);
+    std::string item;
+    bool named = false;
+    while (std::getline(items, item, ',')) {
+        bool found = false;
+        for (const ScriptBlock& block : script_blocks) {
+            if (item == block.script) {
+                blocks.push_back({ block.first, block.last });
+                found = true;
+            }
+        }
+        named = named || found;
+        if (found || item == "ascii") {
+            continue;
+        }
+        size_t dash = item.find('-');
+        char* end = nullptr;
+        unsigned long first = strtoul(item.c_str(), &end, 16);
+        unsigned long last = dash == std::string::npos ? first : strtoul(item.c_str() + dash + 1, &end, 16);
+        if (item.empty() || *end != '\0' || (dash != std::string::npos && end == item.c_str() + dash + 1) || first > last || last > 0x10ffff) {
+            std::cerr << "Invalid script or code point range: " << item << std::endl;
+            throw std::runtime_error("Invalid arguments");
+        }
+        for (; first < 0x80 && first <= last; first++) {
+            scripts.ascii.add((unsigned char)first);
+        }
+        if (first <= last) {
+            blocks.push_back({ (uint32_t)first, (uint32_t)last });
+        }
+    }
+
+    for (const ScriptBlock& block : script_blocks) {
+        if (named && block.script == std::string("punctuation")) {
+            blocks.push_back({ block.first, block.last });
+        }
+    }
+
+    std::sort(blocks.begin(), blocks.end());
+    for (const auto& block : blocks) {
+        if (!scripts.ranges.empty() && block.first <= scripts.ranges.back() + 1) {
+            scripts.ranges.back() = std::max(scripts.ranges.back(), block.second);
+        }
+        else {
+            scripts.ranges.push_back(block.first);
+            scripts.ranges.push_back(block.second);
+        }
+    }
+    return scripts;
+}
+
+bool script_allows(const TextScripts& scripts, uint32_t code_point) {
+    // The first bound at or above code_point is either the last bound of the range holding it or
+    // the first bound of a later range, which holds it only when equal
+    auto it = std::lower_bound(scripts.ranges.begin(), scripts.ranges.end(), code_point);
+    size_t k = it - scripts.ranges.begin();
+    return k < scripts.ranges.size() && (k % 2 == 1 || *it == code_point);
+}
+
+// Incremental UTF-8 check fed one plaintext byte at a time, mirrored by rc4_utf8 on the device.
+// A key is rejected at the first byte that cannot continue a well-formed sequence, or once a
+// complete code point falls outside the accepted scripts.
+struct Utf8Decoder {
+    uint32_t code_point = 0;
+    int pending = 0;
+    unsigned char low = 0x80, high = 0xbf;
+
+    bool feed(const TextScripts& scripts, unsigned char c) {
+        if (pending == 0) {
+            if (c < 0x80) {
+                return scripts.ascii.contains(c);
+            }
+            if (c >= 0xc2 && c <= 0xdf) {
+                pending = 1;
+                code_point = c & 0x1f;
+            }
+            else if (c >= 0xe0 && c <= 0xef) {
+                pending = 2;
+                code_point = c & 0x0f;
+                low = c == 0xe0 ? 0xa0 : 0x80;
+                high = c == 0xed ? 0x9f : 0xbf;
+            }
+            else if (c >= 0xf0 && c <= 0xf4) {
+                pending = 3;
+                code_point = c & 0x07;
+                low = c == 0xf0 ? 0x90 : 0x80;
+                high = c == 0xf4 ? 0x8f : 0xbf;
+            }
+            else {
+                return false;
+            }
+            return true;
+        }
+        if (c < low || c > high) {
+            return false;
+        }
+        code_point = code_point << 6 | (c & 0x3f);
+        low = 0x80;
+        high = 0xbf;
+        return --pending > 0 || script_allows(scripts, code_point);
+    }
+};
+
+// Offset of the first byte of the first rejected sequence, or length when the whole buffer is
+// accepted text. Runs of accepted ASCII are skipped with the vector byte-class validator.
+size_t first_rejected_text(const TextScripts& scripts, const unsigned char* data, size_t length) {
+    Utf8Decoder decoder;
+    size_t start = 0;
+    for (size_t k = 0; k < length; k++) {
+        if (decoder.pending == 0) {
+            k += first_invalid_byte(scripts.ascii, data + k, length - k);
+            if (k == length) {
+                break;
+            }
+            start = k;
+        }
+        if (!decoder.feed(scripts, data[k])) {
+            return start;
+        }
+    }
+    return decoder.pending > 0 ? start : length;
+}
+
+struct OpenCLContext {
+    cl_platform_id platform_id;
+    cl_device_id device_id;
+    cl_context context;
+    cl_command_queue queue;
+    cl_program program;
+};
+
+// Creates a context, queue and built program on the first device of the requested type
+OpenCLContext create_opencl_context(cl_device_type device_type) {
+    cl_int err;
+    cl_uint num_platforms;
+    cl_platform_id platform_id;
+    cl_uint num_devices;
+    cl_device_id device_id;
+    cl_context context;
+    cl_command_queue queue;
+    cl_program program;
+
+    // Initialize OpenCL
+    err = clGetPlatformIDs(1, &platform_id, &num_platforms);
+    if (err != CL_SUCCESS) {
+        std::cerr << "Failed to get OpenCL platform IDs. Error code: " << err << std::endl;
+        throw std::runtime_error("OpenCL initialization error");
+    }
+
+    err = clGetDeviceIDs(platform_id, device_type, 1, &device_id, &num_devices);
+    if (err != CL_SUCCESS) {
+        std::cerr << "Failed to get OpenCL device IDs. Error code: " << err << std::endl;
+        throw std::runtime_error("OpenCL initialization error");
+    }
+
+    context = clCreateContext(nullptr, 1, &device_id, nullptr, nullptr, &err);
+    if (err != CL_SUCCESS) {
+        std::cerr << "Failed to create OpenCL context. Error code: " << err << std::endl;
+        throw std::runtime_error("OpenCL context creation error");
+    }
+
+    queue = clCreateCommandQueueWithProperties(context, device_id, nullptr, &err);
+    if (err != CL_SUCCESS) {
+        std::cerr << "Failed to create OpenCL command queue. Error code: " << err << std::endl;
+        throw std::runtime_error("OpenCL command queue creation error");
+    }
+
+    program = clCreateProgramWithSource(context, 1, &kernel_code, nullptr, &err);
+    if (err != CL_SUCCESS) {
+        std::cerr << "Failed to create OpenCL program. Error code: " << err << std::endl;
+        throw std::runtime_error("OpenCL program creation error");
+    }
+
+    err = clBuildProgram(program, 1, &device_id, nullptr, nullptr, nullptr);
+    if (err != CL_SUCCESS) {
+        size_t log_size;
+        clGetProgramBuildInfo(program, device_id, CL_PROGRAM_BUILD_LOG, 0, nullptr, &log_size);
+        std::vector<char> log(log_size);
+        clGetProgramBuildInfo(program, device_id, CL_PROGRAM_BUILD_LOG, log_size, log.data(), nullptr);
+        std::cerr << "Build log:\n" << log.data() << std::endl;
+        throw std::runtime_error("OpenCL program build error");
+    }
+
+    return { platform_id, device_id, context, queue, program };
+}
+
+void release_opencl_context(OpenCLContext& cl) {
+    clReleaseProgram(cl.program);
+    clReleaseCommandQueue(cl.queue);
+    clReleaseContext(cl.context);
+}
+
+cl_device_type parse_device_type(const std::string& name) {
+    if (name == "gpu") {
+        return CL_DEVICE_TYPE_GPU;
+    }
+    if (name == "cpu") {
+        return CL_DEVICE_TYPE_CPU;
+    }
+    if (name == "all") {
+        return CL_DEVICE_TYPE_ALL;
+    }
+    std::cerr << "Unknown device type: " << name << " (expected gpu, cpu or all)" << std::endl;
+    throw std::runtime_error("Invalid arguments");
+}
+
+// Number of keys of the given length over the charset
+unsigned long long keyspace_size(size_t charset_size, int key_length) {
+    unsigned long long size = 1;
+    for (int k = 0; k < key_length; k++) {
+        if (size > ~0ULL / charset_size) {
+            throw std::runtime_error("Keyspace too large");
+        }
+        size *= charset_size;
+    }
+    return size;
+}
+
+// What a search enumerates: every key of each length over a plain charset or, when layout is set
+// (see compile_key_constraints), only keys of the layout's own length, each position drawing
+// from its own row. The kernels read either through one byte table; see kernel_charset_size.
+struct Keyspace {
+    std::string charset;
+    std::string layout;
+
+    bool constrained() const {
+        return !layout.empty();
+    }
+    // Key length of a constrained layout, 0 for a plain charset
+    int key_length() const {
+        return (int)(layout.size() / 258);
+    }
+    // The bytes the key decoders read
+    const std::string& table() const {
+        return constrained() ? layout : charset;
+    }
+};
+
+// Radix of key position k in a constrained keyspace layout
+size_t constrained_radix(const unsigned char* layout, int key_length, int k) {
+    return layout[key_length * 256 + 2 * k] | (size_t)layout[key_length * 256 + 2 * k + 1] << 8;
+}
+
+// Keyspace of one key length; a constrained layout holds keys of its own length only
+unsigned long long keyspace_size(const Keyspace& keyspace, int key_length) {
+    if (!keyspace.constrained()) {
+        return keyspace_size(keyspace.charset.size(), key_length);
+    }
+    if (key_length != keyspace.key_length()) {
+        return 0;
+    }
+    unsigned long long size = 1;
+    for (int k = 0; k < key_length; k++) {
+        size_t radix = constrained_radix((const unsigned char*)keyspace.layout.data(), key_length, k);
+        if (size > ~0ULL / radix) {
+            throw std::runtime_error("Keyspace too large");
+        }
+        size *= radix;
+    }
+    return size;
+}
+
+// Exact fraction of a key length's index space, used for shard boundaries
+struct Fraction {
+    unsigned long long num;
+    unsigned long long den;
+};
+
+// The slice [begin, end) of every key length's index space that this process searches.
+// Boundaries are computed exactly per key length, so shards that share a fraction meet
+// without overlap or gap on every node.
+struct KeyspaceShard {
+    Fraction begin{ 0, 1 };
+    Fraction end{ 1, 1 };
+};
+
+unsigned long long shard_boundary(unsigned long long total, const Fraction& fraction) {
+    return (unsigned long long)((unsigned __int128)total * fraction.num / fraction.den);
+}
+
+Fraction parse_fraction(const std::string& text) {
+    size_t slash = text.find('/');
+    Fraction fraction{ std::stoull(text.substr(0, slash)), slash == std::string::npos ? 1 : std::stoull(text.substr(slash + 1)) };
+    if (fraction.den == 0 || fraction.num > fraction.den) {
+        throw std::runtime_error("Invalid keyspace fraction: " + text);
+    }
+    return fraction;
+}
+
+// "--shard i/N": the i-th (0-based) of N equal slices
+KeyspaceShard parse_shard(const std::string& spec) {
+    size_t slash = spec.find('/');
+    if (slash == std::string::npos) {
+        throw std::runtime_error("Invalid shard: " + spec + " (expected i/N)");
+    }
+    unsigned long long index = std::stoull(spec.substr(0, slash));
+    unsigned long long count = std::stoull(spec.substr(slash + 1));
+    if (count == 0 || index >= count) {
+        throw std::runtime_error("Invalid shard: " + spec + " (expected 0 <= i < N)");
+    }
+    return { { index, count }, { index + 1, count } };
+}
+
+// "--shard-range a:b" with a and b written as p/q, e.g. 0:3/8 and 3/8:1 for a 3:5 split
+KeyspaceShard parse_shard_range(const std::string& spec) {
+    size_t colon = spec.find(':');
+    if (colon == std::string::npos) {
+        throw std::runtime_error("Invalid shard range: " + spec + " (expected a:b)");
+    }
+    KeyspaceShard shard{ parse_fraction(spec.substr(0, colon)), parse_fraction(spec.substr(colon + 1)) };
+    if ((unsigned __int128)shard.begin.num * shard.end.den > (unsigned __int128)shard.end.num * shard.begin.den) {
+        throw std::runtime_error("Invalid shard range: " + spec + " (begin after end)");
+    }
+    return shard;
+}
+
+// Mixed-radix decode of a key index: position 0 is the most significant digit. A constrained
+// table is a layout and gives each position its own row and radix, as on the device.
+void key_from_index(unsigned long long index, const unsigned char* table, size_t charset_size, bool constrained, int key_length, unsigned char* key) {
+    if (constrained) {
+        for (int k = key_length - 1; k >= 0; k--) {
+            size_t radix = constrained_radix(table, key_length, k);
+            key[k] = table[k * 256 + index % radix];
+            index /= radix;
+        }
+        return;
+    }
+    for (int k = key_length - 1; k >= 0; k--) {
+        key[k] = table[index % charset_size];
+        index /= charset_size;
+    }
+}
+
+void key_from_index(unsigned long long index, const Keyspace& keyspace, int key_length, unsigned char* key) {
+    key_from_index(index, (const unsigned char*)keyspace.table().data(), keyspace.charset.size(), keyspace.constrained(), key_length, key);
+}
+
+// Inverse of key_from_index. Returns false when the key is outside the keyspace: a byte missing
+// from the charset or its position's row, or a length the constrained layout does not have.
+bool key_index(const unsigned char* key, int key_length, const Keyspace& keyspace, unsigned long long& index) {
+    if (keyspace.constrained() && key_length != keyspace.key_length()) {
+        return false;
+    }
+    index = 0;
+    for (int k = 0; k < key_length; k++) {
+        std::string row = keyspace.constrained()
+            ? keyspace.layout.substr(k * 256, constrained_radix((const unsigned char*)keyspace.layout.data(), key_length, k))
+            : keyspace.charset;
+        size_t digit = row.find((char)key[k]);
+        if (digit == std::string::npos) {
+            return false;
+        }
+        index = index * row.size() + digit;
+    }
+    return true;
+}
+
+// Compiles a partial-knowledge key spec into the constrained keyspace layout the key decoders
+// read. One comma-separated item per key position, each a '|'-separated union of "*" (every
+// charset byte), hex bytes "41" and hex ranges "30-39", then optional "!XX" / "!XX-YY"
+// exclusions and an optional "{N}" repeat count: "56,45,4e,*{3},30-39!35" is a "VEN" vendor
+// prefix, three charset bytes and a digit other than 5.
+std::string compile_key_constraints(const std::string& spec, const std::string& charset) {
+    auto too_many_positions = []() {
+        std::cerr << "Key constraints must describe 1 to " << max_search_key_length << " positions" << std::endl;
+        return std::runtime_error("Invalid arguments");
+    };
+    std::vector<std::string> positions;
+    std::stringstream items(spec);
+    std::string item;
+    while (std::getline(items, item, ',')) {
+        size_t repeat = 1;
+        size_t brace = item.find('{');
+        if (brace != std::string::npos) {
+            // "{N}" ends the item, N at least 1; counts too long to parse are over the limit anyway
+            if (item.back() != '}' || brace + 2 >= item.size() || item.find_first_not_of("0123456789", brace + 1) != item.size() - 1) {
+                throw std::runtime_error("Invalid key constraint repeat: " + item);
+            }
+            std::string count = item.substr(brace + 1, item.size() - brace - 2);
+            repeat = count.size() > 6 ? (size_t)max_search_key_length + 1 : std::stoul(count);
+            if (repeat < 1) {
+                throw std::runtime_error("Invalid key constraint repeat: " + item);
+            }
+            item = item.substr(0, brace);
+        }
+        bool allowed[256] = { false };
+        bool excluded[256] = { false };
+        std::string symbols;
+        std::string part;
+        // The first '!' starts the exclusions; before it, '|' separates alternatives
+        std::string alternatives = item.substr(0, item.find('!'));
+        std::string exclusions = item.find('!') == std::string::npos ? "" : item.substr(item.find('!'));
+        auto byte_range = [&](const std::string& range, bool* set) {
+            size_t dash = range.find('-');
+            unsigned long first = std::stoul(range.substr(0, dash), nullptr, 16);
+            unsigned long last = dash == std::string::npos ? first : std::stoul(range.substr(dash + 1), nullptr, 16);
+            if (first > last || last > 0xff) {
+                throw std::runtime_error("Invalid key constraint range: " + range);
+            }
+            for (unsigned long c = first; c <= last; c++) {
+                set[c] = true;
+            }
+        };
+        std::stringstream alternative_list(alternatives);
+        while (std::getline(alternative_list, part, '|')) {
+            if (part == "*") {
+                for (unsigned char c : charset) {
+                    if (!allowed[c]) {
+                        allowed[c] = true;
+                        symbols.push_back((char)c);
+                    }
+                }
+            }
+            else {
+                bool range[256] = { false };
+                byte_range(part, range);
+                for (int c = 0; c < 256; c++) {
+                    if (range[c] && !allowed[c]) {
+                        allowed[c] = true;
+                        symbols.push_back((char)c);
+                    }
+                }
+            }
+        }
+        std::stringstream exclusion_list(exclusions);
+        while (std::getline(exclusion_list, part, '!')) {
+            if (!part.empty()) {
+                byte_range(part, excluded);
+            }
+        }
+        symbols.erase(std::remove_if(symbols.begin(), symbols.end(), [&](char c) { return excluded[(unsigned char)c]; }), symbols.end());
+        if (symbols.empty()) {
+            throw std::runtime_error("Key constraint allows no byte: " + item);
+        }
+        // Bounded before inserting, so a huge repeat count cannot exhaust memory
+        if (positions.size() + repeat > (size_t)max_search_key_length) {
+            throw too_many_positions();
+        }
+        positions.insert(positions.end(), repeat, symbols);
+    }
+    if (positions.empty()) {
+        throw too_many_positions();
+    }
+
+    const int key_length = (int)positions.size();
+    std::string layout(key_length * 258, '\0');
+    for (int k = 0; k < key_length; k++) {
+        std::copy(positions[k].begin(), positions[k].end(), layout.begin() + k * 256);
+        layout[key_length * 256 + 2 * k] = (char)(positions[k].size() & 0xff);
+        layout[key_length * 256 + 2 * k + 1] = (char)(positions[k].size() >> 8);
+    }
+    return layout;
+}
+
+// Plain charsets hold 1-256 bytes; per-position sets are compiled into a Keyspace layout
+void check_charset(const std::string& charset) {
+    if (charset.empty() || charset.size() > 256) {
+        std::cerr << "A charset holds 1-256 bytes, this one has " << charset.size() << "; use --key-constraints for per-position sets" << std::endl;
+        throw std::runtime_error("Invalid arguments");
+    }
+}
+
+// Rejects a constrained layout the key decoders would read past: a size that is not
+// key_length * 258 bytes, or a position radix outside 1-256
+void check_key_layout(const std::string& layout) {
+    int key_length = (int)(layout.size() / 258);
+    bool valid = key_length >= 1 && key_length <= max_search_key_length && layout.size() == (size_t)key_length * 258;
+    for (int k = 0; k < key_length && valid; k++) {
+        size_t radix = constrained_radix((const unsigned char*)layout.data(), key_length, k);
+        valid = radix >= 1 && radix <= 256;
+    }
+    if (!valid) {
+        std::cerr << "Malformed key layout of " << layout.size() << " bytes" << std::endl;
+        throw std::runtime_error("Invalid arguments");
+    }
+}
+
+std::vector<unsigned char> parse_hex(const std::string& hex) {
+    if (hex.size() % 2 != 0) {
+        throw std::runtime_error("Invalid hex string: " + hex);
+    }
+    std::vector<unsigned char> bytes;
+    for (size_t k = 0; k < hex.size(); k += 2) {
+        bytes.push_back((unsigned char)std::stoul(hex.substr(k, 2), nullptr, 16));
+    }
+    return bytes;
+}
+
+std::string to_hex(const unsigned char* data, size_t length) {
+    static const char digits[] = "0123456789abcdef";
+    std::string hex;
+    for (size_t k = 0; k < length; k++) {
+        hex += digits[data[k] >> 4];
+        hex += digits[data[k] & 15];
+    }
+    return hex;
+}
+
+// The keyspace as a job or signature field: charset-hex for a plain charset, key-layout-hex for
+// a compiled constrained layout
+std::string keyspace_field(const Keyspace& keyspace) {
+    return (keyspace.constrained() ? "key-layout-hex=" : "charset-hex=") + to_hex((const unsigned char*)keyspace.table().data(), keyspace.table().size());
+}
+
+// Parses a keyspace_field value back into the keyspace it describes
+Keyspace parse_keyspace_field(const std::string& name, const std::string& value) {
+    std::vector<unsigned char> bytes = parse_hex(value);
+    Keyspace keyspace;
+    if (name == "key-layout-hex") {
+        keyspace.layout.assign(bytes.begin(), bytes.end());
+        check_key_layout(keyspace.layout);
+    }
+    else {
+        keyspace.charset.assign(bytes.begin(), bytes.end());
+        check_charset(keyspace.charset);
+    }
+    return keyspace;
+}
+
+// The charset_size argument of the search kernels. They take a constrained layout through the
+// same charset buffer, recognising it by a size over 256 (see rc4_key_from_index).
+int kernel_charset_size(const Keyspace& keyspace) {
+    return (int)keyspace.table().size();
+}
+
+// Host-side RC4 keystream, used by the CPU backend
+void rc4_keystream(const unsigned char* key, int key_length, unsigned char* out, size_t length) {
+    unsigned char S[256];
+    for (int k = 0; k < 256; k++) {
+        S[k] = (unsigned char)k;
+    }
+    unsigned char j = 0;
+    for (int k = 0; k < 256; k++) {
+        j = (unsigned char)(j + S[k] + key[k % key_length]);
+        std::swap(S[k], S[j]);
+    }
+    unsigned char i = 0;
+    j = 0;
+    for (size_t n = 0; n < length; n++) {
+        i = (unsigned char)(i + 1);
+        j = (unsigned char)(j + S[i]);
+        std::swap(S[i], S[j]);
+        out[n] = S[(unsigned char)(S[i] + S[j])];
+    }
+}
+
+// Up to 8 keystream bytes as a little-endian 64-bit word, zero-padded
+uint64_t keystream_word(const unsigned char* keystream, size_t count) {
+    uint64_t word = 0;
+    for (size_t b = 0; b < count; b++) {
+        word |= (uint64_t)keystream[b] << (8 * b);
+    }
+    return word;
+}
+
+// Target keystream bytes [0, length) as little-endian 64-bit words, the last one zero-padded
+std::vector<uint64_t> pack_keystream_words(const unsigned char* keystream, size_t length) {
+    std::vector<uint64_t> words;
+    for (size_t n = 0; n < length; n += 8) {
+        words.push_back(keystream_word(keystream + n, std::min<size_t>(8, length - n)));
+    }
+    return words;
+}
+
+// One frame of the multi-target oracle: a label and the keystream recovered from it
+struct KeystreamTarget {
+    std::string label;
+    std::vector<unsigned char> keystream;
+};
+
+// "label hex" or bare "hex" lines, '#' starting a comment; bare targets are labelled by line
+std::vector<KeystreamTarget> parse_keystream_targets(const std::string& text, size_t min_bytes = 8) {
+    std::vector<KeystreamTarget> targets;
+    std::stringstream lines(text);
+    std::string line;
+    for (int line_number = 1; std::getline(lines, line); line_number++) {
+        line = line.substr(0, line.find('#'));
+        std::stringstream fields(line);
+        std::string first, second;
+        if (!(fields >> first)) {
+            continue;
+        }
+        KeystreamTarget target;
+        target.label = fields >> second ? first : "line " + std::to_string(line_number);
+        target.keystream = parse_hex(second.empty() ? first : second);
+        if (target.keystream.size() < min_bytes) {
+            std::cerr << "Target " << target.label << " has " << target.keystream.size() << " keystream bytes; at least " << min_bytes << " are needed" << std::endl;
+            throw std::runtime_error("Invalid arguments");
+        }
+        targets.push_back(target);
+    }
+    if (targets.empty()) {
+        std::cerr << "No keystream targets given" << std::endl;
+        throw std::runtime_error("Invalid arguments");
+    }
+    return targets;
+}
+
+const int target_bucket_bits = 12;
+
+// Lookup table of the multi-target oracle, mirrored on the device: the first keystream word of
+// every target, sorted, with the target each one came from, and buckets[b] the first word whose
+// top target_bucket_bits bits are at least b (buckets has one extra entry closing the last one)
+struct TargetSet {
+    std::vector<uint64_t> words;
+    std::vector<uint32_t> targets;
+    std::vector<uint32_t> buckets;
+    size_t longest = 0;
+};
+
+TargetSet build_target_set(const std::vector<KeystreamTarget>& targets) {
+    std::vector<std::pair<uint64_t, uint32_t>> entries;
+    TargetSet set;
+    for (size_t t = 0; t < targets.size(); t++) {
+        entries.push_back({ keystream_word(targets[t].keystream.data(), 8), (uint32_t)t });
+        set.longest = std::max(set.longest, targets[t].keystream.size());
+    }
+    std::sort(entries.begin(), entries.end());
+    for (const auto& entry : entries) {
+        set.words.push_back(entry.first);
+        set.targets.push_back(entry.second);
+    }
+    size_t next = 0;
+    for (uint64_t bucket = 0; bucket <= ((uint64_t)1 << target_bucket_bits); bucket++) {
+        while (next < set.words.size() && (set.words[next] >> (64 - target_bucket_bits)) < bucket) {
+            next++;
+        }
+        set.buckets.push_back((uint32_t)next);
+    }
+    return set;
+}
+
+bool target_set_contains(const TargetSet& set, uint64_t word) {
+    size_t bucket = (size_t)(word >> (64 - target_bucket_bits));
+    auto first = set.words.begin() + set.buckets[bucket], last = set.words.begin() + set.buckets[bucket + 1];
+    return std::binary_search(first, last, word);
+}
+
+// CPU twin of rc4_keystream_match: KSA, then keystream a word at a time up to the first word
+// that differs from the packed target
+bool keystream_matches(const unsigned char* key, int key_length, const uint64_t* target, size_t length) {
+    unsigned char S[256];
+    for (int k = 0; k < 256; k++) {
+        S[k] = (unsigned char)k;
+    }
+    unsigned char j = 0;
+    for (int k = 0; k < 256; k++) {
+        j = (unsigned char)(j + S[k] + key[k % key_length]);
+        std::swap(S[k], S[j]);
+    }
+    unsigned char i = 0;
+    j = 0;
+    for (size_t n = 0; n < length; n += 8) {
+        uint64_t word = 0;
+        size_t bytes = std::min<size_t>(8, length - n);
+        for (size_t b = 0; b < bytes; b++) {
+            i = (unsigned char)(i + 1);
+            j = (unsigned char)(j + S[i]);
+            std::swap(S[i], S[j]);
+            word |= (uint64_t)S[(unsigned char)(S[i] + S[j])] << (8 * b);
+        }
+        if (word != target[n / 8]) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Reference text for the default scoring model. Only its byte and byte-class statistics matter;
+// --score-corpus replaces it with a sample that matches the expected plaintext.
+const char* default_score_corpus =
+    "The quick brown fox jumps over the lazy dog. This is a short sample of ordinary English text, "
+    "used to estimate how often each letter, digit, space and punctuation mark appears, and which kinds "
+    "of characters tend to follow each other. Words are separated by single spaces; sentences end with "
+    "a full stop, and new paragraphs start on a new line.\n"
+    "When the plaintext is a letter, a report, a log file or a configuration file, most of its bytes are "
+    "lower case letters, with capitals at the start of sentences and names. Numbers such as 2024, 42 or "
+    "3.14 appear now and then, as do quotes, commas, colons and brackets (like these).\n"
+    "She said that the meeting had been moved to Thursday at ten o'clock, and that everyone should bring "
+    "the notes from the last one. He asked whether the results were ready; they were not, but they would "
+    "be by the end of the week. In the meantime there was plenty of other work to do, and nobody wanted "
+    "to fall behind again.\n"
+    "Name: John Smith\nAddress: 221 Baker Street, London\nEmail: john.smith@example.com\n"
+    "It was the best of times, it was the worst of times, it was the age of wisdom, it was the age of "
+    "foolishness, it was the epoch of belief, it was the epoch of incredulity.\n";
+
+// Byte classes of the bigram table: 26 case-folded letters, space, digit, punctuation, other
+// whitespace, high bytes and control bytes. Must match SCORE_CLASSES in the kernel source.
+const int score_classes = 32;
+
+int score_class(unsigned char c) {
+    if (isalpha(c)) {
+        return tolower(c) - 'a';
+    }
+    if (c == ' ') {
+        return 26;
+    }
+    if (isdigit(c)) {
+        return 27;
+    }
+    if (ispunct(c)) {
+        return 28;
+    }
+    if (isspace(c)) {
+        return 29;
+    }
+    return c >= 0x80 ? 30 : 31;
+}
+
+// Log-likelihood-ratio model against uniformly random bytes, in bits. unigram[b] is
+// log2 P(b) + 8; bigram[a * score_classes + b] is log2 P(class b | class a) - log2 P(class b),
+// so a plaintext's score is its log-likelihood under a class-bigram model minus that of noise.
+struct ScoreModel {
+    unsigned char byte_class[256];
+    float unigram[256];
+    float bigram[score_classes * score_classes];
+};
+
+ScoreModel build_score_model(const std::vector<unsigned char>& corpus) {
+    ScoreModel model;
+    std::vector<double> byte_counts(256, 0.0), class_counts(score_classes, 0.0), pair_counts(score_classes * score_classes, 0.0);
+    for (int c = 0; c < 256; c++) {
+        model.byte_class[c] = (unsigned char)score_class((unsigned char)c);
+    }
+    for (size_t k = 0; k < corpus.size(); k++) {
+        byte_counts[corpus[k]]++;
+        class_counts[model.byte_class[corpus[k]]]++;
+        if (k > 0) {
+            pair_counts[model.byte_class[corpus[k - 1]] * score_classes + model.byte_class[corpus[k]]]++;
+        }
+    }
+
+    // Add-half smoothing keeps unseen bytes finite, so a few binary bytes cost a bounded penalty
+    double total = (double)corpus.size();
+    for (int c = 0; c < 256; c++) {
+        model.unigram[c] = (float)(std::log2((byte_counts[c] + 0.5) / (total + 128.0)) + 8.0);
+    }
+    for (int a = 0; a < score_classes; a++) {
+        double row = 0.0;
+        for (int b = 0; b < score_classes; b++) {
+            row += pair_counts[a * score_classes + b];
+        }
+        for (int b = 0; b < score_classes; b++) {
+            double conditional = (pair_counts[a * score_classes + b] + 0.5) / (row + score_classes * 0.5);
+            double marginal = (class_counts[b] + 0.5) / (total + score_classes * 0.5);
+            model.bigram[a * score_classes + b] = (float)(std::log2(conditional) - std::log2(marginal));
+        }
+    }
+    return model;
+}
+
+// Host twin of the rc4_score kernel's inner loop; the summation order is the same so both
+// backends produce identical float scores
+float score_plaintext(const ScoreModel& model, const unsigned char* plaintext, size_t length) {
+    float score = 0.0f;
+    unsigned char previous = 0;
+    for (size_t n = 0; n < length; n++) {
+        unsigned char cls = model.byte_class[plaintext[n]];
+        score += model.unigram[plaintext[n]];
+        if (n > 0) {
+            score += model.bigram[previous * score_classes + cls];
+        }
+        previous = cls;
+    }
+    return score;
+}
+
+// Magic numbers of common binary formats, one per line: name, offset, hex bytes and an optional
+// hex mask (1 bits are compared). --signatures loads a table in the same format.
+const char* default_signature_table = R"(
+zip       0  504b0304
+zip-empty 0  504b0506
+png       0  89504e470d0a1a0a
+jpeg      0  ffd8ff
+gif       0  474946383161  fffffffff1ff
+pdf       0  255044462d
+gzip      0  1f8b08
+bzip2     0  425a6839  fffffff0
+7z        0  377abcaf271c
+rar       0  526172211a07
+xz        0  fd377a585a00
+zstd      0  28b52ffd
+elf       0  7f454c46
+riff      0  52494646
+ogg       0  4f676753
+sqlite    0  53514c69746520666f726d6174203300
+)";
+
+struct FileSignature {
+    std::string name;
+    size_t offset;
+    std::vector<unsigned char> bytes;
+    std::vector<unsigned char> mask;
+};
+
+std::vector<FileSignature> parse_signature_table(const std::string& table) {
+    std::vector<FileSignature> signatures;
+    std::stringstream lines(table);
+    std::string line;
+    while (std::getline(lines, line)) {
+        line = line.substr(0, line.find('#'));
+        std::stringstream fields(line);
+        FileSignature signature;
+        std::string bytes_hex, mask_hex, part;
+        if (!(fields >> signature.name)) {
+            continue;
+        }
+        if (!(fields >> signature.offset >> bytes_hex)) {
+            throw std::runtime_error("Malformed signature line: " + line);
+        }
+        while (fields >> part) {
+            mask_hex += part;
+        }
+        signature.bytes = parse_hex(bytes_hex);
+        signature.mask = mask_hex.empty() ? std::vector<unsigned char>(signature.bytes.size(), 0xff) : parse_hex(mask_hex);
+        if (signature.bytes.empty() || signature.mask.size() != signature.bytes.size()) {
+            throw std::runtime_error("Signature " + signature.name + " needs as many mask bytes as magic bytes");
+        }
+        for (size_t k = 0; k < signature.bytes.size(); k++) {
+            signature.bytes[k] &= signature.mask[k];
+        }
+        signatures.push_back(signature);
+    }
+    return signatures;
+}
+
+// Index of the first signature the whole plaintext matches, or -1
+int match_signature(const std::vector<FileSignature>& signatures, const std::vector<unsigned char>& plaintext) {
+    for (size_t s = 0; s < signatures.size(); s++) {
+        const FileSignature& signature = signatures[s];
+        if (signature.offset + signature.bytes.size() > plaintext.size()) {
+            continue;
+        }
+        bool match = true;
+        for (size_t k = 0; k < signature.bytes.size() && match; k++) {
+            match = (plaintext[signature.offset + k] & signature.mask[k]) == signature.bytes[k];
+        }
+        if (match) {
+            return (int)s;
+        }
+    }
+    return -1;
+}
+
+// The device-side form of a signature table: byte comparisons sorted by plaintext position,
+// each packed as position << 16 | value << 8 | mask and tagged with its signature's bit.
+// Signatures are cut to their first signature_prefix_bits compared bits, which is plenty to
+// discriminate on the device since the host re-checks the full signature. The furthest kept
+// byte sets how much keystream is generated; keys die as soon as no signature is left alive.
+struct SignatureProgram {
+    std::vector<cl_uint> ops;
+    std::vector<unsigned char> op_signature;
+    cl_ulong all_signatures = 0;
+    size_t check_length = 0;
+};
+
+const int signature_prefix_bits = 32;
+const size_t max_signatures = 64;
+
+SignatureProgram compile_signatures(const std::vector<FileSignature>& signatures) {
+    if (signatures.empty() || signatures.size() > max_signatures) {
+        std::cerr << "A signature table needs between 1 and " << max_signatures << " signatures" << std::endl;
+        throw std::runtime_error("Invalid arguments");
+    }
+    struct Op {
+        size_t position;
+        unsigned char value, mask, signature;
+    };
+    std::vector<Op> ops;
+    SignatureProgram program;
+    for (size_t s = 0; s < signatures.size(); s++) {
+        const FileSignature& signature = signatures[s];
+        int bits = 0;
+        for (size_t k = 0; k < signature.bytes.size() && bits < signature_prefix_bits; k++) {
+            if (signature.mask[k] == 0) {
+                continue;
+            }
+            if (signature.offset + k > 0xffff) {
+                throw std::runtime_error("Signature " + signature.name + " lies beyond the first 64 KiB");
+            }
+            ops.push_back({ signature.offset + k, signature.bytes[k], signature.mask[k], (unsigned char)s });
+            bits += __builtin_popcount(signature.mask[k]);
+            program.check_length = std::max(program.check_length, signature.offset + k + 1);
+        }
+        program.all_signatures |= (cl_ulong)1 << s;
+    }
+    std::stable_sort(ops.begin(), ops.end(), [](const Op& a, const Op& b) { return a.position < b.position; });
+    for (const Op& op : ops) {
+        program.ops.push_back((cl_uint)(op.position << 16 | op.value << 8 | op.mask));
+        program.op_signature.push_back(op.signature);
+    }
+    return program;
+}
+
+// A CRC in the Rocksoft model (refin = refout = reflect) covering frame bytes
+// [span_begin, span_end) and stored at position, width / 8 bytes in the given byte order.
+// Negative span and position values count from the end of the frame until resolve_crc_frame
+// pins them to a frame length.
+struct CrcSpec {
+    int width = 32;
+    uint32_t poly = 0x04c11db7;
+    uint32_t init = 0xffffffff;
+    uint32_t xorout = 0xffffffff;
+    bool reflect = true;
+    bool big_endian = false;
+    long long span_begin = 0;
+    long long span_end = -4;
+    long long position = -4;
+    std::vector<uint32_t> table;
+};
+
+uint32_t reflect_bits(uint32_t value, int width) {
+    uint32_t reflected = 0;
+    for (int k = 0; k < width; k++) {
+        if (value & (1u << k)) {
+            reflected |= 1u << (width - 1 - k);
+        }
+    }
+    return reflected;
+}
+
+uint32_t crc_mask(int width) {
+    return width == 32 ? 0xffffffffu : (1u << width) - 1;
+}
+
+// Register value before the first byte; the reflected table works on a reflected register
+uint32_t crc_register_init(const CrcSpec& crc) {
+    return crc.reflect ? reflect_bits(crc.init, crc.width) : crc.init;
+}
+
+void build_crc_table(CrcSpec& crc) {
+    crc.table.assign(256, 0);
+    uint32_t mask = crc_mask(crc.width);
+    for (uint32_t byte = 0; byte < 256; byte++) {
+        uint32_t value;
+        if (crc.reflect) {
+            uint32_t poly = reflect_bits(crc.poly, crc.width);
+            value = byte;
+            for (int bit = 0; bit < 8; bit++) {
+                value = value & 1 ? (value >> 1) ^ poly : value >> 1;
+            }
+        }
+        else {
+            uint32_t top = 1u << (crc.width - 1);
+            value = byte << (crc.width - 8);
+            for (int bit = 0; bit < 8; bit++) {
+                value = value & top ? (value << 1) ^ crc.poly : value << 1;
+            }
+        }
+        crc.table[byte] = value & mask;
+    }
+}
+
+// Parses "crc32", "crc16-ccitt", "crc16-x25", "crc16-arc" or "custom", optionally followed by
+// comma-separated overrides: width=, poly=, init=, xorout= (hex), reflect=0|1, order=le|be,
+// span=begin:end and at=position, e.g. "crc16-ccitt,span=2:-2".
+CrcSpec parse_crc_spec(const std::string& text) {
+    CrcSpec crc;
+    std::stringstream ss(text);
+    std::string field;
+    bool first = true;
+    bool have_order = false, have_span = false, have_position = false;
+    auto preset = [&](int width, uint32_t poly, uint32_t init, uint32_t xorout, bool reflect) {
+        crc.width = width;
+        crc.poly = poly;
+        crc.init = init;
+        crc.xorout = xorout;
+        crc.reflect = reflect;
+    };
+    while (std::getline(ss, field, ',')) {
+        size_t eq = field.find('=');
+        if (first && eq == std::string::npos) {
+            first = false;
+            if (field == "crc16-ccitt") {
+                preset(16, 0x1021, 0xffff, 0x0000, false);
+            }
+            else if (field == "crc16-x25") {
+                preset(16, 0x1021, 0xffff, 0xffff, true);
+            }
+            else if (field == "crc16-arc") {
+                preset(16, 0x8005, 0x0000, 0x0000, true);
+            }
+            else if (field != "crc32" && field != "custom") {
+                throw std::runtime_error("Unknown CRC preset: " + field);
+            }
+            continue;
+        }
+        first = false;
+        if (eq == std::string::npos) {
+            throw std::runtime_error("Malformed CRC field: " + field);
+        }
+        std::string name = field.substr(0, eq);
+        std::string value = field.substr(eq + 1);
+        if (name == "width") {
+            crc.width = std::stoi(value);
+        }
+        else if (name == "poly") {
+            crc.poly = (uint32_t)std::stoul(value, nullptr, 16);
+        }
+        else if (name == "init") {
+            crc.init = (uint32_t)std::stoul(value, nullptr, 16);
+        }
+        else if (name == "xorout") {
+            crc.xorout = (uint32_t)std::stoul(value, nullptr, 16);
+        }
+        else if (name == "reflect") {
+            crc.reflect = value == "1";
+        }
+        else if (name == "order") {
+            crc.big_endian = value == "be";
+            have_order = true;
+        }
+        else if (name == "span") {
+            size_t colon = value.find(':');
+            if (colon == std::string::npos) {
+                throw std::runtime_error("CRC span must be begin:end");
+            }
+            crc.span_begin = std::stoll(value.substr(0, colon));
+            crc.span_end = std::stoll(value.substr(colon + 1));
+            have_span = true;
+        }
+        else if (name == "at") {
+            crc.position = std::stoll(value);
+            have_position = true;
+        }
+        else {
+            throw std::runtime_error("Unknown CRC field: " + name);
+        }
+    }
+    if (crc.width != 16 && crc.width != 32) {
+        throw std::runtime_error("CRC width must be 16 or 32");
+    }
+    if (!have_order) {
+        crc.big_endian = !crc.reflect;
+    }
+    // By default the CRC field closes the frame and the span covers everything before it
+    if (!have_span) {
+        crc.span_end = -(crc.width / 8);
+    }
+    if (!have_position) {
+        crc.position = crc.span_end;
+    }
+    crc.poly &= crc_mask(crc.width);
+    crc.init &= crc_mask(crc.width);
+    crc.xorout &= crc_mask(crc.width);
+    build_crc_table(crc);
+    return crc;
+}
+
+// Turns end-relative span and position values into offsets within a frame of frame_size bytes
+void resolve_crc_frame(CrcSpec& crc, size_t frame_size) {
+    auto resolve = [&](long long value) { return value < 0 ? (long long)frame_size + value : value; };
+    crc.span_begin = resolve(crc.span_begin);
+    crc.span_end = resolve(crc.span_end);
+    crc.position = resolve(crc.position);
+    if (crc.span_begin < 0 || crc.span_begin > crc.span_end || crc.position < 0
+        || (size_t)crc.span_end > frame_size || (size_t)crc.position + crc.width / 8 > frame_size) {
+        std::cerr << "CRC span and field do not fit a " << frame_size << "-byte frame" << std::endl;
+        throw std::runtime_error("Invalid arguments");
+    }
+}
+
+// Frame bytes the CRC check reads, i.e. the keystream it needs
+size_t crc_check_length(const CrcSpec& crc) {
+    return std::max<size_t>(crc.span_end, crc.position + crc.width / 8);
+}
+
+// Table-driven CRC over the span, compared with the stored field. byte_at(k) yields plaintext
+// byte k, so callers can decrypt on the fly.
+template <typename ByteAt>
+bool crc_frame_matches(const CrcSpec& crc, ByteAt byte_at) {
+    uint32_t reg = crc_register_init(crc);
+    int shift = crc.width - 8;
+    for (long long k = crc.span_begin; k < crc.span_end; k++) {
+        if (crc.reflect) {
+            reg = (reg >> 8) ^ crc.table[(reg ^ byte_at(k)) & 0xff];
+        }
+        else {
+            reg = ((reg << 8) ^ crc.table[((reg >> shift) ^ byte_at(k)) & 0xff]) & crc_mask(crc.width);
+        }
+    }
+    reg ^= crc.xorout;
+    uint32_t stored = 0;
+    int bytes = crc.width / 8;
+    for (int k = 0; k < bytes; k++) {
+        uint32_t byte = byte_at(crc.position + k);
+        stored |= byte << (8 * (crc.big_endian ? bytes - 1 - k : k));
+    }
+    return reg == stored;
+}
+
+// Plain CRC of a buffer, for the catalogue check values in the self-test
+uint32_t crc_of(const CrcSpec& crc, const std::vector<unsigned char>& data) {
+    uint32_t reg = crc_register_init(crc);
+    for (unsigned char byte : data) {
+        reg = crc.reflect ? (reg >> 8) ^ crc.table[(reg ^ byte) & 0xff]
+            : ((reg << 8) ^ crc.table[((reg >> (crc.width - 8)) ^ byte) & 0xff]) & crc_mask(crc.width);
+    }
+    return reg ^ crc.xorout;
+}
+
+// One stage of the cascade oracle, e.g. "printable:1", "crib:4:48454c4c4f" (offset, hex),
+// "score:1.5" (minimum bits per byte over the first cascade_prefix_length bytes) or "verify",
+// the host-side full-buffer check. Device stages only read the first cascade_prefix_length
+// plaintext bytes, which every survivor record carries along.
+struct CascadeStage {
+    std::string label;
+    std::string kind;
+    size_t offset = 0;
+    size_t length = 0;
+    std::vector<unsigned char> crib;
+    float min_score = 0.0f;
+};
+
+const size_t cascade_prefix_length = 64;
+
+// Plaintext bytes the score oracle rates on the device and the CPU workers
+const size_t score_prefix_length = 64;
+
+std::vector<CascadeStage> parse_cascade(const std::string& spec) {
+    std::vector<CascadeStage> stages;
+    std::stringstream ss(spec);
+    std::string field;
+    while (std::getline(ss, field, ',')) {
+        CascadeStage stage;
+        stage.label = field;
+        std::vector<std::string> parts;
+        std::stringstream fs(field);
+        std::string part;
+        while (std::getline(fs, part, ':')) {
+            parts.push_back(part);
+        }
+        stage.kind = parts.empty() ? "" : parts[0];
+        if (stage.kind == "printable" && parts.size() == 2) {
+            stage.length = std::stoul(parts[1]);
+        }
+        else if (stage.kind == "crib" && parts.size() == 3) {
+            stage.offset = std::stoul(parts[1]);
+            stage.crib = parse_hex(parts[2]);
+            stage.length = stage.crib.size();
+        }
+        else if (stage.kind == "score" && parts.size() == 2) {
+            stage.min_score = std::stof(parts[1]);
+            stage.length = cascade_prefix_length;
+        }
+        else if (stage.kind != "verify" || parts.size() != 1) {
+            throw std::runtime_error("Malformed cascade stage: " + field);
+        }
+        if (stage.kind != "verify" && (stage.length == 0 || stage.offset + stage.length > cascade_prefix_length)) {
+            throw std::runtime_error("Cascade stage " + field + " must check bytes within the first " + std::to_string(cascade_prefix_length));
+        }
+        if (!stages.empty() && stages.back().kind == "verify") {
+            throw std::runtime_error("verify can only be the last cascade stage");
+        }
+        stages.push_back(stage);
+    }
+    if (stages.empty() || stages[0].kind == "verify") {
+        throw std::runtime_error("A cascade needs at least one device stage before verify");
+    }
+    return stages;
+}
+
+// Score stages cover the whole prefix the buffer has; the other stages must fit inside it
+void resolve_cascade(std::vector<CascadeStage>& stages, size_t data_size) {
+    size_t available = std::min(data_size, cascade_prefix_length);
+    for (CascadeStage& stage : stages) {
+        if (stage.kind == "score") {
+            stage.length = available;
+        }
+        if (stage.offset + stage.length > available) {
+            std::cerr << "Cascade stage " << stage.label << " reads past the end of a " << data_size << "-byte input" << std::endl;
+            throw std::runtime_error("Invalid arguments");
+        }
+    }
+}
+
+// CPU twin of one device stage of rc4_cascade_stage, on a decrypted prefix
+bool cascade_stage_passes(const CascadeStage& stage, const ScoreModel& model, const unsigned char* prefix) {
+    static const ByteClass printable = printable_byte_class();
+    if (stage.kind == "printable") {
+        for (size_t k = stage.offset; k < stage.offset + stage.length; k++) {
+            if (!printable.contains(prefix[k])) {
+                return false;
+            }
+        }
+        return true;
+    }
+    if (stage.kind == "crib") {
+        return std::equal(stage.crib.begin(), stage.crib.end(), prefix + stage.offset);
+    }
+    return score_plaintext(model, prefix, stage.length) >= stage.min_score * stage.length;
+}
+
+// How candidate keys are judged. "printable" stops at the first key whose whole buffer is
+// printable ASCII; "score" ranks every key by its prefix score and reports the top_k best;
+// "signature" stops at the first key whose plaintext starts like a known file format; "crc"
+// stops at the first key whose frame carries a valid CRC. With crc_final set, the CRC is also
+// checked on the host after the printable or signature oracle's own checks. "cascade" runs
+// the stages in order, each one seeing only the survivors of the one before. "utf8" accepts
+// well-formed UTF-8 text whose code points all belong to the configured scripts. "keystream"
+// searches for known keystream held in place of the ciphertext: the right key decrypts it to zeros.
+// "multi" looks every key up in a set of known keystreams and keeps going until each has a key.
+enum class OracleKind { printable, score, signature, crc, cascade, utf8, keystream, multi };
+
+const std::pair<const char*, OracleKind> oracle_kind_names[] = {
+    { "printable", OracleKind::printable }, { "score", OracleKind::score }, { "signature", OracleKind::signature },
+    { "crc", OracleKind::crc }, { "cascade", OracleKind::cascade }, { "utf8", OracleKind::utf8 },
+    { "keystream", OracleKind::keystream }, { "multi", OracleKind::multi },
+};
+
+// The kind an --oracle name selects
+OracleKind parse_oracle_kind(const std::string& name) {
+    for (const auto& entry : oracle_kind_names) {
+        if (name == entry.first) {
+            return entry.second;
+        }
+    }
+    std::cerr << "Unknown oracle: " << name << " (expected printable, score, signature, crc, cascade, utf8, keystream or multi)" << std::endl;
+    throw std::runtime_error("Invalid arguments");
+}
+
+struct Oracle {
+    OracleKind kind = OracleKind::printable;
+    size_t top_k = 10;
+    ScoreModel model = {};
+    // Printable oracle: the accepted byte values; it, the UTF-8 and the keystream oracles check
+    // check_length bytes before the host verifies, 0 for the backend default
+    ByteClass accept = printable_byte_class();
+    size_t check_length = 0;
+    // UTF-8 oracle: the accepted code points
+    TextScripts scripts;
+    // Multi-target oracle: the known keystreams and their lookup table
+    std::vector<KeystreamTarget> targets;
+    TargetSet target_set;
+    std::vector<FileSignature> signatures;
+    SignatureProgram signature_program;
+    CrcSpec crc;
+    bool crc_final = false;
+    std::vector<CascadeStage> cascade;
+};
+
+// Keystream bytes the device and the CPU workers check before a candidate goes to the host
+size_t oracle_prefix_length(const Oracle& oracle, size_t data_size, size_t printable_length) {
+    switch (oracle.kind) {
+    case OracleKind::score:
+        return std::min(data_size, score_prefix_length);
+    case OracleKind::signature:
+        return std::min(data_size, oracle.signature_program.check_length);
+    case OracleKind::crc:
+        return std::min(data_size, crc_check_length(oracle.crc));
+    case OracleKind::cascade:
+        return std::min(data_size, cascade_prefix_length);
+    case OracleKind::multi:
+        return 8;
+    case OracleKind::printable:
+    case OracleKind::utf8:
+    case OracleKind::keystream:
+        break;
+    }
+    return std::min(data_size, oracle.check_length > 0 ? oracle.check_length : printable_length);
+}
+
+// CPU twin of the device-side check of the hit-list oracles
+bool prefix_passes(const Oracle& oracle, const unsigned char* ciphertext, const unsigned char* keystream, size_t length) {
+    switch (oracle.kind) {
+    case OracleKind::signature: {
+        const SignatureProgram& program = oracle.signature_program;
+        cl_ulong alive = program.all_signatures;
+        for (size_t op = 0; op < program.ops.size() && alive; op++) {
+            size_t position = program.ops[op] >> 16;
+            if (position >= length) {
+                break;
+            }
+            unsigned char c = ciphertext[position] ^ keystream[position];
+            if ((c & (program.ops[op] & 0xff)) != ((program.ops[op] >> 8) & 0xff)) {
+                alive &= ~((cl_ulong)1 << program.op_signature[op]);
+            }
+        }
+        return alive != 0;
+    }
+    case OracleKind::crc:
+        return length >= crc_check_length(oracle.crc) && crc_frame_matches(oracle.crc, [&](long long k) { return (uint32_t)(ciphertext[k] ^ keystream[k]); });
+    case OracleKind::keystream:
+        return memcmp(ciphertext, keystream, length) == 0;
+    case OracleKind::multi:
+        return target_set_contains(oracle.target_set, keystream_word(keystream, std::min<size_t>(length, 8)));
+    case OracleKind::utf8: {
+        // A sequence cut off by the end of the prefix is left to the full check
+        Utf8Decoder decoder;
+        for (size_t pos = 0; pos < length; pos++) {
+            if (!decoder.feed(oracle.scripts, ciphertext[pos] ^ keystream[pos])) {
+                return false;
+            }
+        }
+        return true;
+    }
+    case OracleKind::printable:
+    case OracleKind::score:
+    case OracleKind::cascade:
+        break;
+    }
+    for (size_t pos = 0; pos < length; pos++) {
+        if (!oracle.accept.contains(ciphertext[pos] ^ keystream[pos])) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Full-buffer check of a candidate that passed the prefix check
+bool oracle_accepts(const Oracle& oracle, const std::vector<unsigned char>& plaintext) {
+    bool accepted = oracle.kind == OracleKind::signature ? match_signature(oracle.signatures, plaintext) >= 0
+        : oracle.kind == OracleKind::utf8 ? first_rejected_text(oracle.scripts, plaintext.data(), plaintext.size()) == plaintext.size()
+        : oracle.kind == OracleKind::keystream ? std::all_of(plaintext.begin(), plaintext.end(), [](unsigned char c) { return c == 0; })
+        : oracle.kind == OracleKind::crc || is_valid_plaintext(plaintext, oracle.accept);
+    if (accepted && (oracle.kind == OracleKind::crc || oracle.crc_final)) {
+        accepted = crc_frame_matches(oracle.crc, [&](long long k) { return (uint32_t)plaintext[k]; });
+    }
+    return accepted;
+}
+
+// How many bytes the printable, UTF-8 or keystream oracle checks, chosen so that the whole keyspace is expected to
+// produce at most target false hits: the smallest length with keys * acceptance^length <= target.
+struct CheckPlan {
+    double acceptance;
+    long double keys;
+    size_t length;
+    long double expected_false_hits;
+};
+
+// Per-byte acceptance of the oracle, measured on random data rather than derived from the
+// character class so that it tracks whatever the check actually accepts. The UTF-8 check is
+// stateful, so this counts how many random bytes in a row pass: with per-byte acceptance a the
+// run length averages a / (1 - a).
+double measure_byte_acceptance(const Oracle& oracle) {
+    const size_t samples = 1 << 18;
+    const size_t run_limit = 64;
+    std::mt19937 rng(1);
+    unsigned char bytes[run_limit];
+    unsigned char keystream[run_limit] = { 0 };
+    size_t accepted = 0;
+    for (size_t n = 0; n < samples; n++) {
+        for (unsigned char& byte : bytes) {
+            byte = (unsigned char)rng();
+        }
+        size_t run = 0;
+        while (run < run_limit && prefix_passes(oracle, bytes, keystream, run + 1)) {
+            run++;
+        }
+        accepted += run;
+    }
+    double mean_run = (double)accepted / samples;
+    return mean_run / (1.0 + mean_run);
+}
+
+CheckPlan plan_check_length(const Oracle& oracle, long double keys, size_t data_size, double target) {
+    CheckPlan plan{ measure_byte_acceptance(oracle), keys, 1, 0 };
+    plan.expected_false_hits = keys * plan.acceptance;
+    while (plan.expected_false_hits > target && plan.length < data_size) {
+        plan.length++;
+        plan.expected_false_hits *= plan.acceptance;
+    }
+    return plan;
+}
+
+void print_check_plan(const CheckPlan& plan, double target) {
+    std::cout << "Check plan: " << (double)plan.keys << " keys, per-byte acceptance " << plan.acceptance
+        << " on random data; checking " << plan.length << " bytes gives " << (double)plan.expected_false_hits
+        << " expected false hits (target " << target << ")" << std::endl;
+    if (plan.expected_false_hits > target) {
+        std::cout << "Check plan: the input is too short to reach the target; expect false hits to be verified on the host" << std::endl;
+    }
+}
+
+// Largest --top-k; the device hit list must be able to hold a full heap of candidates
+const size_t max_top_k = 256;
+
+struct ScoredKey {
+    float score;
+    std::vector<unsigned char> key;
+};
+
+// Higher score first; ties go to the lower key so every backend ranks identically
+bool ranks_above(const ScoredKey& a, const ScoredKey& b) {
+    return a.score > b.score || (a.score == b.score && a.key < b.key);
+}
+
+// Bounded min-heap of the best k keys: front() is the weakest kept candidate
+void offer_scored_key(std::vector<ScoredKey>& heap, size_t k, float score, const unsigned char* key, int key_length) {
+    ScoredKey candidate{ score, std::vector<unsigned char>(key, key + key_length) };
+    if (heap.size() < k) {
+        heap.push_back(std::move(candidate));
+        std::push_heap(heap.begin(), heap.end(), ranks_above);
+    }
+    else if (ranks_above(candidate, heap.front())) {
+        std::pop_heap(heap.begin(), heap.end(), ranks_above);
+        heap.back() = std::move(candidate);
+        std::push_heap(heap.begin(), heap.end(), ranks_above);
+    }
+}
+
+// Keys must score at least this to have a chance of entering the heap
+float score_threshold(const std::vector<ScoredKey>& heap, size_t k) {
+    return heap.size() < k ? -std::numeric_limits<float>::infinity() : heap.front().score;
+}
+
+struct NumaNode {
+    int id;
+    std::vector<int> cpus;
+};
+
+// Parses a sysfs cpulist such as "0-3,8-11"
+std::vector<int> parse_cpu_list(const std::string& list) {
+    std::vector<int> cpus;
+    std::stringstream ss(list);
+    std::string range;
+    while (std::getline(ss, range, ',')) {
+        if (range.empty() || range == "\n") {
+            continue;
+        }
+        size_t dash = range.find('-');
+        int first = std::stoi(range.substr(0, dash));
+        int last = dash == std::string::npos ? first : std::stoi(range.substr(dash + 1));
+        for (int cpu = first; cpu <= last; cpu++) {
+            cpus.push_back(cpu);
+        }
+    }
+    return cpus;
+}
+
+// Reads the NUMA topology from sysfs; falls back to a single node holding every CPU
+std::vector<NumaNode> detect_numa_nodes() {
+    std::vector<NumaNode> nodes;
+    if (DIR* dir = opendir("/sys/devices/system/node")) {
+        while (dirent* entry = readdir(dir)) {
+            std::string name = entry->d_name;
+            if (name.compare(0, 4, "node") != 0 || name.size() == 4 || !isdigit((unsigned char)name[4])) {
+                continue;
+            }
+            std::ifstream cpulist("/sys/devices/system/node/" + name + "/cpulist");
+            std::string list;
+            std::getline(cpulist, list);
+            NumaNode node{ std::stoi(name.substr(4)), parse_cpu_list(list) };
+            if (!node.cpus.empty()) {
+                nodes.push_back(node);
+            }
+        }
+        closedir(dir);
+    }
+
+    cpu_set_t allowed;
+    CPU_ZERO(&allowed);
+    bool have_mask = sched_getaffinity(0, sizeof(allowed), &allowed) == 0;
+    for (NumaNode& node : nodes) {
+        if (have_mask) {
+            node.cpus.erase(std::remove_if(node.cpus.begin(), node.cpus.end(), [&](int cpu) {
+                return cpu >= CPU_SETSIZE || !CPU_ISSET(cpu, &allowed);
+                }), node.cpus.end());
+        }
+    }
+    nodes.erase(std::remove_if(nodes.begin(), nodes.end(), [](const NumaNode& node) {
+        return node.cpus.empty();
+        }), nodes.end());
+    std::sort(nodes.begin(), nodes.end(), [](const NumaNode& a, const NumaNode& b) { return a.id < b.id; });
+
+    if (nodes.empty()) {
+        NumaNode node{ 0, {} };
+        unsigned int count = std::max(1u, std::thread::hardware_concurrency());
+        for (unsigned int cpu = 0; cpu < count; cpu++) {
+            node.cpus.push_back((int)cpu);
+        }
+        nodes.push_back(node);
+    }
+    return nodes;
+}
+
+// Allocates memory bound to a NUMA node with mbind(2); if the kernel refuses the policy the
+// pages still land locally through first touch by the node's workers
+void* numa_alloc_on_node(size_t size, int node) {
+    void* ptr = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (ptr == MAP_FAILED) {
+        throw std::runtime_error("NUMA buffer allocation error");
+    }
+#ifdef SYS_mbind
+    const int MPOL_BIND = 2;
+    if (node >= 0 && node < (int)(8 * sizeof(unsigned long))) {
+        unsigned long nodemask = 1UL << node;
+        syscall(SYS_mbind, ptr, size, MPOL_BIND, &nodemask, 8 * sizeof(unsigned long), 0);
+    }
+#endif
+    return ptr;
+}
+
+void numa_free(void* ptr, size_t size) {
+    munmap(ptr, size);
+}
+
+bool pin_thread_to_cpu(int cpu) {
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    return pthread_setaffinity_np(pthread_self(), sizeof(set), &set) == 0;
+}
+
+// One worker thread pinned to every allowed CPU, grouped by NUMA node. Workers park between
+// jobs, so daemon work units and analysis passes reuse warm pinned threads instead of
+// spawning their own. error holds the first exception a worker's part of the job threw.
+struct CpuWorkerPool {
+    std::vector<NumaNode> nodes;
+    std::vector<size_t> worker_node;
+    std::vector<std::thread> threads;
+    std::mutex dispatch_mutex;
+    std::mutex mutex;
+    std::condition_variable wake;
+    std::condition_variable idle;
+    std::function<void(size_t)> job;
+    unsigned long long generation = 0;
+    size_t busy = 0;
+    std::exception_ptr error;
+};
+
+thread_local bool on_pool_worker = false;
+
+void pool_worker_loop(CpuWorkerPool& pool, size_t worker, int cpu) {
+    pin_thread_to_cpu(cpu);
+    on_pool_worker = true;
+    unsigned long long seen = 0;
+    std::unique_lock<std::mutex> lock(pool.mutex);
+    while (true) {
+        pool.wake.wait(lock, [&] { return pool.generation != seen; });
+        seen = pool.generation;
+        lock.unlock();
+        std::exception_ptr failure;
+        try {
+            pool.job(worker);
+        }
+        catch (...) {
+            failure = std::current_exception();
+        }
+        lock.lock();
+        if (failure && !pool.error) {
+            pool.error = failure;
+        }
+        if (--pool.busy == 0) {
+            pool.idle.notify_all();
+        }
+    }
+}
+
+// The process-wide pool, started on first use. It is never torn down: idle workers stay
+// parked on the condition variable until the process exits.
+CpuWorkerPool& cpu_worker_pool() {
+    static CpuWorkerPool* pool = [] {
+        CpuWorkerPool* created = new CpuWorkerPool();
+        created->nodes = detect_numa_nodes();
+        for (size_t n = 0; n < created->nodes.size(); n++) {
+            for (int cpu : created->nodes[n].cpus) {
+                created->worker_node.push_back(n);
+                created->threads.emplace_back(pool_worker_loop, std::ref(*created), created->threads.size(), cpu);
+            }
+        }
+        return created;
+    }();
+    return *pool;
+}
+
+// Runs job(worker) once for every worker of the pool and returns when all of them are done,
+// calling poll from the calling thread every 250 ms meanwhile. Jobs run one at a time; a job
+// started from a pool worker runs every part inline on that worker. An exception from a
+// worker's part or from poll is rethrown here, but only once every worker has finished, since
+// the job may reference the caller's stack.
+void run_on_pool(CpuWorkerPool& pool, const std::function<void(size_t)>& job, const std::function<void()>& poll = nullptr) {
+    if (on_pool_worker) {
+        for (size_t worker = 0; worker < pool.threads.size(); worker++) {
+            job(worker);
+        }
+        return;
+    }
+    std::lock_guard<std::mutex> dispatch(pool.dispatch_mutex);
+    std::unique_lock<std::mutex> lock(pool.mutex);
+    pool.job = job;
+    pool.busy = pool.threads.size();
+    pool.generation++;
+    pool.wake.notify_all();
+    std::exception_ptr poll_error;
+    while (!pool.idle.wait_for(lock, std::chrono::milliseconds(250), [&] { return pool.busy == 0; })) {
+        if (poll && !poll_error) {
+            lock.unlock();
+            try {
+                poll();
+            }
+            catch (...) {
+                poll_error = std::current_exception();
+            }
+            lock.lock();
+        }
+    }
+    pool.job = nullptr;
+    std::exception_ptr error = pool.error ? pool.error : poll_error;
+    pool.error = nullptr;
+    if (error) {
+        std::rethrow_exception(error);
+    }
+}
+
+// Calls fn(worker, begin, end) over [0, count) in blocks of `block` indices, handed to the
+// pool's workers first come first served. worker < cpu_worker_pool().threads.size() indexes
+// per-worker state, which first touch then places on the worker's node.
+void parallel_for(uint64_t count, uint64_t block, const std::function<void(size_t, uint64_t, uint64_t)>& fn) {
+    std::atomic<uint64_t> next(0);
+    run_on_pool(cpu_worker_pool(), [&](size_t worker) {
+        for (uint64_t begin = next.fetch_add(block); begin < count; begin = next.fetch_add(block)) {
+            fn(worker, begin, std::min(begin + block, count));
+        }
+    });
+}
+
+// done/total count keys of the current key length within the searched range. When a range of
+// absolute indices has been fully tested it is reported as [completed_begin, completed_end).
+struct SearchProgress {
+    int key_length;
+    unsigned long long done;
+    unsigned long long total;
+    double keys_per_second;
+    unsigned long long completed_begin = 0;
+    unsigned long long completed_end = 0;
+};
+
+// Returning false from the callback cancels the search at the next batch boundary
+using ProgressCallback = std::function<bool(const SearchProgress&)>;
+
+struct Throughput {
+    std::string label;
+    unsigned long long keys;
+    double seconds;
+};
+
+// Candidates into and out of one cascade stage and the time spent in it, summed over CPU workers
+struct StageStats {
+    std::string label;
+    unsigned long long in = 0;
+    unsigned long long out = 0;
+    double seconds = 0.0;
+};
+
+void merge_stage_stats(std::vector<StageStats>& total, const std::vector<StageStats>& part) {
+    if (total.empty()) {
+        total = part;
+        return;
+    }
+    for (size_t s = 0; s < part.size(); s++) {
+        total[s].in += part[s].in;
+        total[s].out += part[s].out;
+        total[s].seconds += part[s].seconds;
+    }
+}
+
+struct TargetMatch {
+    size_t target;
+    std::string label;
+    std::vector<unsigned char> key;
+};
+
+struct SearchResult {
+    bool found = false;
+    bool cancelled = false;
+    std::vector<unsigned char> key;
+    std::vector<unsigned char> plaintext;
+    unsigned long long keys_tested = 0;
+    double seconds = 0.0;
+    std::vector<Throughput> throughput;
+    // Score oracle only: the best keys seen so far, a heap while searching and sorted best-first
+    // once the search returns
+    std::vector<ScoredKey> ranked;
+    // Cascade oracle only: per-stage pass counts and timing
+    std::vector<StageStats> stages;
+    // Multi-target oracle only: the targets matched so far; found is set once all of them are
+    std::vector<TargetMatch> matches;
+};
+
+// Decrypts the whole buffer under a candidate key and applies the oracle's full check
+bool verify_candidate(const std::vector<unsigned char>& encrypted_data, const unsigned char* key, int key_length, std::vector<unsigned char>& plaintext,
+    const Oracle& oracle = Oracle()) {
+    plaintext.resize(encrypted_data.size());
+    rc4_keystream(key, key_length, plaintext.data(), plaintext.size());
+    for (size_t k = 0; k < plaintext.size(); k++) {
+        plaintext[k] ^= encrypted_data[k];
+    }
+    return oracle_accepts(oracle, plaintext);
+}
+
+// Multi-target verification of a key whose first keystream word is in the target set: every
+// target whose whole keystream the key reproduces is matched, once. Returns true when every
+// target has a key.
+bool record_target_matches(const Oracle& oracle, const unsigned char* key, int key_length, SearchResult& result) {
+    const TargetSet& set = oracle.target_set;
+    std::vector<unsigned char> keystream(set.longest);
+    rc4_keystream(key, key_length, keystream.data(), keystream.size());
+    auto range = std::equal_range(set.words.begin(), set.words.end(), keystream_word(keystream.data(), 8));
+    for (auto it = range.first; it != range.second; ++it) {
+        size_t index = set.targets[it - set.words.begin()];
+        const KeystreamTarget& target = oracle.targets[index];
+        bool matched = std::any_of(result.matches.begin(), result.matches.end(), [&](const TargetMatch& match) { return match.target == index; });
+        if (!matched && std::equal(target.keystream.begin(), target.keystream.end(), keystream.begin())) {
+            result.matches.push_back({ index, target.label, std::vector<unsigned char>(key, key + key_length) });
+        }
+    }
+    return result.matches.size() == oracle.targets.size();
+}
+
+// Ends a score-oracle search: sorts the heap best-first and reports the best key as the result
+void finish_ranking(SearchResult& result, const std::vector<unsigned char>& encrypted_data) {
+    std::sort(result.ranked.begin(), result.ranked.end(), ranks_above);
+    if (result.ranked.empty()) {
+        return;
+    }
+    result.found = true;
+    result.key = result.ranked.front().key;
+    result.plaintext.resize(encrypted_data.size());
+    rc4_keystream(result.key.data(), (int)result.key.size(), result.plaintext.data(), result.plaintext.size());
+    for (size_t k = 0; k < result.plaintext.size(); k++) {
+        result.plaintext[k] ^= encrypted_data[k];
+    }
+}
+
+// Per-node copies of everything the workers touch in their inner loop
+struct NodeBuffers {
+    unsigned char* ciphertext_prefix;
+    unsigned char* key_table;
+    unsigned char* hit_key;
+    size_t size;
+};
+
+// NUMA layout and per-node buffers for one ciphertext/keyspace, reusable across index ranges;
+// ranges run on the persistent pinned worker pool
+struct CpuSearchEngine {
+    CpuWorkerPool* pool = nullptr;
+    std::vector<NumaNode> nodes;
+    std::vector<NodeBuffers> buffers;
+    size_t total_cpus = 0;
+    size_t prefix_length = 0;
+    Oracle oracle;
+    std::vector<unsigned long long> node_keys_tested;
+    std::vector<double> node_seconds;
+};
+
+CpuSearchEngine create_cpu_engine(const std::vector<unsigned char>& encrypted_data, const Keyspace& keyspace, int max_key_length,
+    const Oracle& oracle = Oracle()) {
+    const std::string& table = keyspace.table();
+    CpuSearchEngine engine;
+    engine.prefix_length = oracle_prefix_length(oracle, encrypted_data.size(), 64);
+    engine.oracle = oracle;
+    engine.pool = &cpu_worker_pool();
+    engine.nodes = engine.pool->nodes;
+    for (const NumaNode& node : engine.nodes) {
+        engine.total_cpus += node.cpus.size();
+        size_t size = engine.prefix_length + table.size() + max_key_length;
+        unsigned char* base = (unsigned char*)numa_alloc_on_node(size, node.id);
+        NodeBuffers buffer{ base, base + engine.prefix_length, base + engine.prefix_length + table.size(), size };
+        std::copy(encrypted_data.begin(), encrypted_data.begin() + engine.prefix_length, buffer.ciphertext_prefix);
+        std::copy(table.begin(), table.end(), buffer.key_table);
+        engine.buffers.push_back(buffer);
+    }
+    engine.node_keys_tested.assign(engine.nodes.size(), 0);
+    engine.node_seconds.assign(engine.nodes.size(), 0.0);
+    return engine;
+}
+
+void release_cpu_engine(CpuSearchEngine& engine) {
+    for (const NodeBuffers& buffer : engine.buffers) {
+        numa_free(buffer.ciphertext_prefix, buffer.size);
+    }
+    engine.buffers.clear();
+}
+
+// Keys the CPU cascade pushes through each stage together, so stage timing stays cheap to take
+const size_t cascade_block = 256;
+
+// PRGA state of one key in the CPU cascade, the host side of cascade_record: prefix[0, position)
+// is decrypted and each stage extends it only as far as it reads
+struct CascadeSlot {
+    unsigned char S[256];
+    unsigned char i;
+    unsigned char j;
+    size_t position;
+};
+
+// Runs key indices [begin, end) through the cascade on one CPU worker. Stage one includes key
+// generation and the KSA; every stage generates keystream up to the last byte it checks and
+// filters the compacted survivor list of the one before. Returns true with key/plaintext
+// filled when a key passes the last stage.
+bool cascade_range_cpu(const CpuSearchEngine& engine, const NodeBuffers& buffer, const std::vector<unsigned char>& encrypted_data, const Keyspace& keyspace,
+    int key_length, unsigned long long begin, unsigned long long end, std::vector<StageStats>& stats, std::vector<unsigned char>& key,
+    std::vector<unsigned char>& plaintext, unsigned long long& tested, const std::atomic<bool>& stop) {
+    const std::vector<CascadeStage>& stages = engine.oracle.cascade;
+    const size_t prefix_length = engine.prefix_length;
+    const size_t charset_size = keyspace.charset.size();
+    const bool constrained = keyspace.constrained();
+    std::vector<unsigned char> prefixes(cascade_block * prefix_length);
+    std::vector<CascadeSlot> slots(cascade_block);
+    std::vector<size_t> survivors, next;
+
+    for (unsigned long long block = begin; block < end && !stop; block += cascade_block) {
+        size_t block_size = (size_t)std::min<unsigned long long>(cascade_block, end - block);
+        for (size_t s = 0; s < stages.size(); s++) {
+            auto stage_start = std::chrono::steady_clock::now();
+            size_t in = s == 0 ? block_size : survivors.size();
+            next.clear();
+            for (size_t n = 0; n < in; n++) {
+                size_t slot = s == 0 ? n : survivors[n];
+                unsigned char* prefix = &prefixes[slot * prefix_length];
+                CascadeSlot& state = slots[slot];
+                bool pass;
+                if (s == 0) {
+                    key_from_index(block + slot, buffer.key_table, charset_size, constrained, key_length, key.data());
+                    for (int k = 0; k < 256; k++) {
+                        state.S[k] = (unsigned char)k;
+                    }
+                    unsigned char j = 0;
+                    for (int k = 0; k < 256; k++) {
+                        j = (unsigned char)(j + state.S[k] + key[k % key_length]);
+                        std::swap(state.S[k], state.S[j]);
+                    }
+                    state.i = 0;
+                    state.j = 0;
+                    state.position = 0;
+                }
+                if (stages[s].kind == "verify") {
+                    key_from_index(block + slot, buffer.key_table, charset_size, constrained, key_length, key.data());
+                    pass = verify_candidate(encrypted_data, key.data(), key_length, plaintext, engine.oracle);
+                }
+                else {
+                    for (size_t needed = stages[s].offset + stages[s].length; state.position < needed; state.position++) {
+                        state.i = (unsigned char)(state.i + 1);
+                        state.j = (unsigned char)(state.j + state.S[state.i]);
+                        std::swap(state.S[state.i], state.S[state.j]);
+                        prefix[state.position] = buffer.ciphertext_prefix[state.position] ^ state.S[(unsigned char)(state.S[state.i] + state.S[state.j])];
+                    }
+                    pass = cascade_stage_passes(stages[s], engine.oracle.model, prefix);
+                }
+                if (pass) {
+                    next.push_back(slot);
+                }
+            }
+            std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - stage_start;
+            stats[s].in += in;
+            stats[s].out += next.size();
+            stats[s].seconds += elapsed.count();
+            survivors.swap(next);
+            if (survivors.empty()) {
+                break;
+            }
+        }
+        tested += block_size;
+
+        if (!survivors.empty()) {
+            key_from_index(block + survivors[0], buffer.key_table, charset_size, constrained, key_length, key.data());
+            verify_candidate(encrypted_data, key.data(), key_length, plaintext, engine.oracle);
+            return true;
+        }
+    }
+    return false;
+}
+
+// Tests key indices [begin, end) of one key length on every core. Returns true when a key
+// verified; result.key/plaintext are filled and result.keys_tested is advanced either way.
+// Under the score oracle nothing verifies: each worker keeps its own top-K heap, merged into
+// result.ranked when the range is done.
+bool search_range_cpu(CpuSearchEngine& engine, const std::vector<unsigned char>& encrypted_data, const Keyspace& keyspace, int key_length,
+    unsigned long long begin, unsigned long long end, SearchResult& result, const ProgressCallback& progress = nullptr) {
+    const unsigned long long work_unit = 1 << 14;
+    const size_t charset_size = keyspace.charset.size();
+    const bool constrained = keyspace.constrained();
+    const size_t prefix_length = engine.prefix_length;
+    const std::vector<NumaNode>& nodes = engine.nodes;
+    unsigned long long total = end - begin;
+
+    // Split the index range between nodes in proportion to their CPU count
+    std::vector<unsigned long long> node_begin(nodes.size()), node_end(nodes.size());
+    unsigned long long offset = begin;
+    size_t cpus_seen = 0;
+    for (size_t n = 0; n < nodes.size(); n++) {
+        cpus_seen += nodes[n].cpus.size();
+        node_begin[n] = offset;
+        offset = n + 1 == nodes.size() ? end : begin + (unsigned long long)((long double)total * cpus_seen / engine.total_cpus);
+        node_end[n] = offset;
+    }
+
+    std::vector<std::atomic<unsigned long long>> node_next(nodes.size());
+    std::vector<std::atomic<unsigned long long>> node_tested(nodes.size());
+    std::vector<std::atomic<size_t>> node_workers_done(nodes.size());
+    for (size_t n = 0; n < nodes.size(); n++) {
+        node_next[n] = node_begin[n];
+        node_tested[n] = 0;
+        node_workers_done[n] = 0;
+    }
+
+    std::atomic<bool> stop(false);
+    std::mutex result_mutex;
+    bool found = false;
+
+    auto range_start = std::chrono::high_resolution_clock::now();
+    auto work = [&](size_t worker) {
+        const size_t n = engine.pool->worker_node[worker];
+        const NodeBuffers& buffer = engine.buffers[n];
+        std::vector<unsigned char> key(key_length);
+        std::vector<unsigned char> keystream(prefix_length);
+        std::vector<unsigned char> plaintext;
+        std::vector<unsigned char> prefix(prefix_length);
+        const bool scoring = engine.oracle.kind == OracleKind::score;
+        const bool keystream_target = engine.oracle.kind == OracleKind::keystream;
+        const bool multi_target = engine.oracle.kind == OracleKind::multi;
+        std::vector<uint64_t> target_words = pack_keystream_words(buffer.ciphertext_prefix, prefix_length);
+        const size_t top_k = engine.oracle.top_k;
+        std::vector<ScoredKey> top;
+        std::vector<StageStats> stage_stats;
+        for (const CascadeStage& stage : engine.oracle.cascade) {
+            stage_stats.push_back({ stage.label });
+        }
+        unsigned long long tested = 0;
+
+        while (!stop) {
+            unsigned long long unit_begin = node_next[n].fetch_add(work_unit);
+            if (unit_begin >= node_end[n]) {
+                break;
+            }
+            unsigned long long unit_end = std::min(unit_begin + work_unit, node_end[n]);
+            if (!stage_stats.empty()) {
+                if (cascade_range_cpu(engine, buffer, encrypted_data, keyspace, key_length, unit_begin, unit_end, stage_stats, key, plaintext, tested, stop)) {
+                    std::lock_guard<std::mutex> lock(result_mutex);
+                    if (!found) {
+                        result.key = key;
+                        result.plaintext = std::move(plaintext);
+                        found = true;
+                        stop = true;
+                    }
+                }
+                continue;
+            }
+            for (unsigned long long index = unit_begin; index < unit_end && !stop; index++) {
+                key_from_index(index, buffer.key_table, charset_size, constrained, key_length, key.data());
+                tested++;
+                if (keystream_target) {
+                    if (!keystream_matches(key.data(), key_length, target_words.data(), prefix_length)) {
+                        continue;
+                    }
+                }
+                else {
+                    rc4_keystream(key.data(), key_length, keystream.data(), prefix_length);
+                }
+
+                if (scoring) {
+                    for (size_t k = 0; k < prefix_length; k++) {
+                        prefix[k] = buffer.ciphertext_prefix[k] ^ keystream[k];
+                    }
+                    float score = score_plaintext(engine.oracle.model, prefix.data(), prefix_length);
+                    if (score >= score_threshold(top, top_k)) {
+                        offer_scored_key(top, top_k, score, key.data(), key_length);
+                    }
+                    continue;
+                }
+
+                if (multi_target) {
+                    if (target_set_contains(engine.oracle.target_set, keystream_word(keystream.data(), 8))) {
+                        std::lock_guard<std::mutex> lock(result_mutex);
+                        if (!found && record_target_matches(engine.oracle, key.data(), key_length, result)) {
+                            found = true;
+                            stop = true;
+                        }
+                    }
+                    continue;
+                }
+
+                if (!keystream_target && !prefix_passes(engine.oracle, buffer.ciphertext_prefix, keystream.data(), prefix_length)) {
+                    continue;
+                }
+
+                // Prefix survived: verify the whole buffer
+                if (verify_candidate(encrypted_data, key.data(), key_length, plaintext, engine.oracle)) {
+                    std::lock_guard<std::mutex> lock(result_mutex);
+                    if (!found) {
+                        std::copy(key.begin(), key.end(), buffer.hit_key);
+                        result.key.assign(buffer.hit_key, buffer.hit_key + key_length);
+                        result.plaintext = std::move(plaintext);
+                        found = true;
+                        stop = true;
+                    }
+                }
+            }
+        }
+        node_tested[n] += tested;
+        if (!stage_stats.empty()) {
+            std::lock_guard<std::mutex> lock(result_mutex);
+            merge_stage_stats(result.stages, stage_stats);
+        }
+        if (!top.empty()) {
+            std::lock_guard<std::mutex> lock(result_mutex);
+            for (const ScoredKey& entry : top) {
+                offer_scored_key(result.ranked, top_k, entry.score, entry.key.data(), (int)entry.key.size());
+            }
+        }
+
+        // The last worker of a node to finish closes that node's timing window
+        if (++node_workers_done[n] == nodes[n].cpus.size()) {
+            std::chrono::duration<double> elapsed = std::chrono::high_resolution_clock::now() - range_start;
+            engine.node_seconds[n] += elapsed.count();
+        }
+    };
+
+    // Report progress from the calling thread while the workers run
+    auto report = [&]() {
+        unsigned long long done = 0;
+        for (size_t n = 0; n < nodes.size(); n++) {
+            done += std::min<unsigned long long>(node_next[n], node_end[n]) - node_begin[n];
+        }
+        std::chrono::duration<double> elapsed = std::chrono::high_resolution_clock::now() - range_start;
+        if (!progress({ key_length, done, total, elapsed.count() > 0 ? done / elapsed.count() : 0.0 })) {
+            result.cancelled = true;
+            stop = true;
+        }
+    };
+    run_on_pool(*engine.pool, work, progress ? std::function<void()>(report) : nullptr);
+
+    for (size_t n = 0; n < nodes.size(); n++) {
+        engine.node_keys_tested[n] += node_tested[n];
+        result.keys_tested += node_tested[n];
+    }
+    if (found) {
+        result.found = true;
+    }
+    return found;
+}
+
+// Keys per worker thread in each range the CPU search hands out and reports as completed
+const unsigned long long cpu_chunk_per_thread = 1 << 18;
+
+SearchResult search_rc4_cpu(const std::vector<unsigned char>& encrypted_data, const Keyspace& keyspace, int max_key_length,
+    const ProgressCallback& progress = nullptr, const KeyspaceShard& shard = KeyspaceShard(), const Oracle& oracle = Oracle()) {
+    CpuSearchEngine engine = create_cpu_engine(encrypted_data, keyspace, max_key_length, oracle);
+    SearchResult result;
+    auto start_time = std::chrono::high_resolution_clock::now();
+
+    // Ranges are handed to the workers in chunks so completed ranges can be reported exactly
+    const unsigned long long chunk = cpu_chunk_per_thread * engine.total_cpus;
+    for (int key_length = 1; key_length <= max_key_length && !result.found && !result.cancelled; ++key_length) {
+        unsigned long long total = keyspace_size(keyspace, key_length);
+        unsigned long long begin = shard_boundary(total, shard.begin);
+        unsigned long long end = shard_boundary(total, shard.end);
+        auto length_start = std::chrono::high_resolution_clock::now();
+
+        for (unsigned long long chunk_begin = begin; chunk_begin < end && !result.found && !result.cancelled; chunk_begin += chunk) {
+            unsigned long long chunk_end = std::min(chunk_begin + chunk, end);
+            ProgressCallback chunk_progress = nullptr;
+            if (progress) {
+                chunk_progress = [&](const SearchProgress& p) {
+                    std::chrono::duration<double> elapsed = std::chrono::high_resolution_clock::now() - length_start;
+                    unsigned long long done = chunk_begin - begin + p.done;
+                    return progress({ key_length, done, end - begin, elapsed.count() > 0 ? done / elapsed.count() : 0.0 });
+                };
+            }
+            if (search_range_cpu(engine, encrypted_data, keyspace, key_length, chunk_begin, chunk_end, result, chunk_progress) || result.cancelled) {
+                break;
+            }
+            if (progress) {
+                std::chrono::duration<double> elapsed = std::chrono::high_resolution_clock::now() - length_start;
+                unsigned long long done = chunk_end - begin;
+                if (!progress({ key_length, done, end - begin, elapsed.count() > 0 ? done / elapsed.count() : 0.0, chunk_begin, chunk_end })) {
+                    result.cancelled = true;
+                }
+            }
+        }
+    }
+
+    std::chrono::duration<double> elapsed = std::chrono::high_resolution_clock::now() - start_time;
+    result.seconds = elapsed.count();
+    for (size_t n = 0; n < engine.nodes.size(); n++) {
+        result.throughput.push_back({ "NUMA node " + std::to_string(engine.nodes[n].id) + " (" + std::to_string(engine.nodes[n].cpus.size()) + " threads)",
+            engine.node_keys_tested[n], engine.node_seconds[n] });
+    }
+    release_cpu_engine(engine);
+    if (oracle.kind == OracleKind::score) {
+        finish_ranking(result, encrypted_data);
+    }
+    return result;
+}
+
+void print_search_result(const SearchResult& result) {
+    if (!result.ranked.empty()) {
+        std::cout << "Top " << result.ranked.size() << " keys by plaintext score:" << std::endl;
+        for (size_t k = 0; k < result.ranked.size(); k++) {
+            const ScoredKey& entry = result.ranked[k];
+            std::cout << "  " << k + 1 << ". " << std::string(entry.key.begin(), entry.key.end()) << " (" << to_hex(entry.key.data(), entry.key.size())
+                << ") score " << entry.score << std::endl;
+        }
+    }
+    for (const StageStats& stage : result.stages) {
+        std::cout << "Cascade stage " << stage.label << ": " << stage.in << " in, " << stage.out << " out ("
+            << (stage.in > 0 ? 100.0 * stage.out / stage.in : 0.0) << "% pass), " << stage.seconds << " s" << std::endl;
+    }
+    if (!result.matches.empty()) {
+        std::cout << "Matched " << result.matches.size() << " targets" << (result.found ? " (all)" : "") << ":" << std::endl;
+        for (const TargetMatch& match : result.matches) {
+            std::cout << "  " << match.label << ": " << std::string(match.key.begin(), match.key.end()) << " (" << to_hex(match.key.data(), match.key.size()) << ")" << std::endl;
+        }
+    }
+    if (result.found && !result.key.empty()) {
+        std::cout << "Decryption successful, key found: " << std::string(result.key.begin(), result.key.end()) << std::endl;
+    }
+    else if (result.matches.empty()) {
+        std::cout << "No valid key found" << std::endl;
+    }
+    std::cout << "Time taken: " << result.seconds << " seconds" << std::endl;
+    for (const Throughput& entry : result.throughput) {
+        double rate = entry.seconds > 0 ? entry.keys / entry.seconds : 0.0;
+        std::cout << entry.label << ": " << entry.keys << " keys, " << (unsigned long long)rate << " keys/s" << std::endl;
+    }
+}
+
+SearchResult brute_force_rc4_cpu(const std::vector<unsigned char>& encrypted_data, const Keyspace& keyspace, int max_key_length,
+    const ProgressCallback& progress = nullptr, const KeyspaceShard& shard = KeyspaceShard(), const Oracle& oracle = Oracle()) {
+    SearchResult result = search_rc4_cpu(encrypted_data, keyspace, max_key_length, progress, shard, oracle);
+    print_search_result(result);
+    return result;
+}
+
+// Each oracle has its own search kernel in kernel_code
+const char* search_kernel_name(OracleKind kind) {
+    switch (kind) {
+    case OracleKind::score:
+        return "rc4_score";
+    case OracleKind::signature:
+        return "rc4_signature";
+    case OracleKind::crc:
+        return "rc4_crc";
+    case OracleKind::cascade:
+        return "rc4_cascade_stage";
+    case OracleKind::utf8:
+        return "rc4_utf8";
+    case OracleKind::keystream:
+        return "rc4_keystream_match";
+    case OracleKind::multi:
+        return "rc4_multi_target";
+    case OracleKind::printable:
+        break;
+    }
+    return "rc4_search";
+}
+
+cl_kernel create_search_kernel(OpenCLContext& cl, const Oracle& oracle = Oracle()) {
+    cl_int err;
+    cl_kernel kernel = clCreateKernel(cl.program, search_kernel_name(oracle.kind), &err);
+    if (err != CL_SUCCESS) {
+        std::cerr << "Failed to create OpenCL kernel. Error code: " << err << std::endl;
+        throw std::runtime_error("OpenCL kernel creation error");
+    }
+    return kernel;
+}
+
+// Device-side state of one search: ciphertext prefix, charset table and the hit list, plus the
+// tables of the score or signature oracle when one is in use
+struct OpenCLSearchBuffers {
+    cl_mem ciphertext;
+    cl_mem charset;
+    cl_mem hits;
+    cl_mem hit_count;
+    int check_length;
+    Oracle oracle;
+    cl_mem byte_class = nullptr;
+    cl_mem unigram = nullptr;
+    cl_mem bigram = nullptr;
+    cl_mem hit_scores = nullptr;
+    cl_mem signature_ops = nullptr;
+    cl_mem signature_ids = nullptr;
+    cl_mem crc_table = nullptr;
+    cl_mem accept = nullptr;
+    cl_mem code_points = nullptr;
+    cl_mem target_words = nullptr;
+    cl_mem target_buckets = nullptr;
+    cl_mem records[2] = { nullptr, nullptr };
+    cl_mem record_count = nullptr;
+    std::vector<cl_mem> stage_bytes;
+};
+
+const size_t opencl_batch_size = 1 << 20;
+const cl_uint opencl_max_hits = 1024;
+
+// Host mirror of the kernel's cascade_record
+struct CascadeRecord {
+    cl_ulong index;
+    cl_uint position;
+    cl_uchar i;
+    cl_uchar j;
+    cl_uchar S[256];
+    cl_uchar prefix[cascade_prefix_length];
+};
+
+// Cascade batches are smaller: every key may need a survivor record in each of two buffers
+const size_t cascade_batch_size = 1 << 16;
+
+OpenCLSearchBuffers create_search_buffers(OpenCLContext& cl, const std::vector<unsigned char>& encrypted_data, const Keyspace& keyspace, int max_key_length,
+    const Oracle& oracle = Oracle()) {
+    cl_int err;
+    if (max_key_length > max_search_key_length) {
+        std::cerr << "Maximum key length for the OpenCL search is " << max_search_key_length << std::endl;
+        throw std::runtime_error("Invalid arguments");
+    }
+
+    OpenCLSearchBuffers buffers;
+    buffers.oracle = oracle;
+    buffers.check_length = (int)oracle_prefix_length(oracle, encrypted_data.size(), 16);
+    buffers.ciphertext = clCreateBuffer(cl.context, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR, buffers.check_length, (void*)encrypted_data.data(), &err);
+    buffers.charset = clCreateBuffer(cl.context, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR, keyspace.table().size(), (void*)keyspace.table().data(), &err);
+    buffers.hits = clCreateBuffer(cl.context, CL_MEM_WRITE_ONLY, opencl_max_hits * sizeof(cl_ulong), nullptr, &err);
+    buffers.hit_count = clCreateBuffer(cl.context, CL_MEM_READ_WRITE, sizeof(cl_uint), nullptr, &err);
+    if (oracle.kind == OracleKind::printable) {
+        std::vector<unsigned char> bitmap = byte_class_bitmap(oracle.accept);
+        buffers.accept = clCreateBuffer(cl.context, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR, bitmap.size(), bitmap.data(), &err);
+    }
+    if (oracle.kind == OracleKind::keystream) {
+        std::vector<uint64_t> words = pack_keystream_words(encrypted_data.data(), buffers.check_length);
+        buffers.target_words = clCreateBuffer(cl.context, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR, words.size() * sizeof(cl_ulong), words.data(), &err);
+    }
+    if (oracle.kind == OracleKind::multi) {
+        const TargetSet& set = oracle.target_set;
+        buffers.target_words = clCreateBuffer(cl.context, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR, set.words.size() * sizeof(cl_ulong), (void*)set.words.data(), &err);
+        buffers.target_buckets = clCreateBuffer(cl.context, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR, set.buckets.size() * sizeof(cl_uint), (void*)set.buckets.data(), &err);
+    }
+    if (oracle.kind == OracleKind::utf8) {
+        // An empty range list still needs a buffer; range_count keeps the kernel from reading it
+        std::vector<unsigned char> bitmap = byte_class_bitmap(oracle.scripts.ascii);
+        std::vector<cl_uint> ranges(oracle.scripts.ranges.begin(), oracle.scripts.ranges.end());
+        if (ranges.empty()) {
+            ranges.assign(2, 0);
+        }
+        buffers.accept = clCreateBuffer(cl.context, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR, bitmap.size(), bitmap.data(), &err);
+        buffers.code_points = clCreateBuffer(cl.context, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR, ranges.size() * sizeof(cl_uint), ranges.data(), &err);
+    }
+    if (oracle.kind == OracleKind::score || oracle.kind == OracleKind::cascade) {
+        ScoreModel& model = buffers.oracle.model;
+        buffers.byte_class = clCreateBuffer(cl.context, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR, sizeof(model.byte_class), model.byte_class, &err);
+        buffers.unigram = clCreateBuffer(cl.context, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR, sizeof(model.unigram), model.unigram, &err);
+        buffers.bigram = clCreateBuffer(cl.context, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR, sizeof(model.bigram), model.bigram, &err);
+    }
+    if (oracle.kind == OracleKind::score) {
+        buffers.hit_scores = clCreateBuffer(cl.context, CL_MEM_WRITE_ONLY, opencl_max_hits * sizeof(cl_float), nullptr, &err);
+    }
+    if (oracle.kind == OracleKind::cascade) {
+        for (cl_mem& records : buffers.records) {
+            records = clCreateBuffer(cl.context, CL_MEM_READ_WRITE, cascade_batch_size * sizeof(CascadeRecord), nullptr, &err);
+        }
+        buffers.record_count = clCreateBuffer(cl.context, CL_MEM_READ_WRITE, sizeof(cl_uint), nullptr, &err);
+        for (const CascadeStage& stage : oracle.cascade) {
+            std::vector<unsigned char> bytes = stage.crib.empty() ? std::vector<unsigned char>(1, 0) : stage.crib;
+            buffers.stage_bytes.push_back(clCreateBuffer(cl.context, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR, bytes.size(), bytes.data(), &err));
+        }
+    }
+    if (oracle.kind == OracleKind::signature) {
+        SignatureProgram& program = buffers.oracle.signature_program;
+        buffers.signature_ops = clCreateBuffer(cl.context, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR, program.ops.size() * sizeof(cl_uint), program.ops.data(), &err);
+        buffers.signature_ids = clCreateBuffer(cl.context, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR, program.op_signature.size(), program.op_signature.data(), &err);
+    }
+    if (oracle.kind == OracleKind::crc) {
+        std::vector<uint32_t>& table = buffers.oracle.crc.table;
+        buffers.crc_table = clCreateBuffer(cl.context, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR, table.size() * sizeof(cl_uint), table.data(), &err);
+    }
+    if (err != CL_SUCCESS) {
+        std::cerr << "Failed to create search buffers. Error code: " << err << std::endl;
+        throw std::runtime_error("OpenCL buffer creation error");
+    }
+    return buffers;
+}
+
+void release_search_buffers(OpenCLSearchBuffers& buffers) {
+    clReleaseMemObject(buffers.ciphertext);
+    clReleaseMemObject(buffers.charset);
+    clReleaseMemObject(buffers.hits);
+    clReleaseMemObject(buffers.hit_count);
+    if (buffers.accept) {
+        clReleaseMemObject(buffers.accept);
+    }
+    if (buffers.code_points) {
+        clReleaseMemObject(buffers.code_points);
+    }
+    if (buffers.target_words) {
+        clReleaseMemObject(buffers.target_words);
+    }
+    if (buffers.target_buckets) {
+        clReleaseMemObject(buffers.target_buckets);
+    }
+    if (buffers.byte_class) {
+        clReleaseMemObject(buffers.byte_class);
+        clReleaseMemObject(buffers.unigram);
+        clReleaseMemObject(buffers.bigram);
+    }
+    if (buffers.hit_scores) {
+        clReleaseMemObject(buffers.hit_scores);
+    }
+    if (buffers.record_count) {
+        clReleaseMemObject(buffers.records[0]);
+        clReleaseMemObject(buffers.records[1]);
+        clReleaseMemObject(buffers.record_count);
+        for (cl_mem bytes : buffers.stage_bytes) {
+            clReleaseMemObject(bytes);
+        }
+    }
+    if (buffers.signature_ops) {
+        clReleaseMemObject(buffers.signature_ops);
+        clReleaseMemObject(buffers.signature_ids);
+    }
+    if (buffers.crc_table) {
+        clReleaseMemObject(buffers.crc_table);
+    }
+}
+
+// Arguments 0-9, shared by every search kernel: key generation, ciphertext prefix and hit list
+cl_int set_search_kernel_args(cl_kernel kernel, OpenCLSearchBuffers& buffers, const Keyspace& keyspace, int key_length, cl_ulong base_index, cl_ulong count) {
+    const int charset_size = kernel_charset_size(keyspace);
+    const cl_uint max_hits = opencl_max_hits;
+    cl_int err = clSetKernelArg(kernel, 0, sizeof(cl_mem), &buffers.ciphertext);
+    err |= clSetKernelArg(kernel, 1, sizeof(int), &buffers.check_length);
+    err |= clSetKernelArg(kernel, 2, sizeof(cl_mem), &buffers.charset);
+    err |= clSetKernelArg(kernel, 3, sizeof(int), &charset_size);
+    err |= clSetKernelArg(kernel, 4, sizeof(int), &key_length);
+    err |= clSetKernelArg(kernel, 5, sizeof(cl_ulong), &base_index);
+    err |= clSetKernelArg(kernel, 6, sizeof(cl_ulong), &count);
+    err |= clSetKernelArg(kernel, 7, sizeof(cl_mem), &buffers.hits);
+    err |= clSetKernelArg(kernel, 8, sizeof(cl_mem), &buffers.hit_count);
+    err |= clSetKernelArg(kernel, 9, sizeof(cl_uint), &max_hits);
+    return err;
+}
+
+// Score-oracle launch: every key at or above the current K-th best score lands in the hit list
+// and is offered to result.ranked. An overflowing list still only holds keys at or above the
+// threshold, so the K-th best of what it kept is a safe, higher threshold for a rerun.
+void score_batch_opencl(OpenCLContext& cl, cl_kernel kernel, OpenCLSearchBuffers& buffers, const std::vector<unsigned char>& encrypted_data,
+    const Keyspace& keyspace, int key_length, cl_ulong base_index, cl_ulong count, SearchResult& result) {
+    const size_t top_k = buffers.oracle.top_k;
+    const cl_uint max_hits = opencl_max_hits;
+    float threshold = score_threshold(result.ranked, top_k);
+    std::vector<cl_ulong> hits(max_hits);
+    std::vector<cl_float> scores(max_hits);
+    std::vector<unsigned char> key(key_length);
+
+    while (true) {
+        cl_uint zero = 0;
+        cl_int err = clEnqueueWriteBuffer(cl.queue, buffers.hit_count, CL_FALSE, 0, sizeof(cl_uint), &zero, 0, nullptr, nullptr);
+        err |= set_search_kernel_args(kernel, buffers, keyspace, key_length, base_index, count);
+        err |= clSetKernelArg(kernel, 10, sizeof(cl_mem), &buffers.byte_class);
+        err |= clSetKernelArg(kernel, 11, sizeof(cl_mem), &buffers.unigram);
+        err |= clSetKernelArg(kernel, 12, sizeof(cl_mem), &buffers.bigram);
+        err |= clSetKernelArg(kernel, 13, sizeof(cl_float), &threshold);
+        err |= clSetKernelArg(kernel, 14, sizeof(cl_mem), &buffers.hit_scores);
+        if (err != CL_SUCCESS) {
+            std::cerr << "Failed to set OpenCL kernel arguments. Error code: " << err << std::endl;
+            throw std::runtime_error("OpenCL kernel argument setting error");
+        }
+
+        size_t global_work_size = (size_t)count;
+        err = clEnqueueNDRangeKernel(cl.queue, kernel, 1, nullptr, &global_work_size, nullptr, 0, nullptr, nullptr);
+        if (err != CL_SUCCESS) {
+            std::cerr << "Failed to enqueue OpenCL kernel. Error code: " << err << std::endl;
+            throw std::runtime_error("OpenCL kernel enqueue error");
+        }
+        cl_uint hit_count = 0;
+        err = clEnqueueReadBuffer(cl.queue, buffers.hit_count, CL_TRUE, 0, sizeof(cl_uint), &hit_count, 0, nullptr, nullptr);
+        cl_uint kept = std::min(hit_count, max_hits);
+        if (err == CL_SUCCESS && kept > 0) {
+            err = clEnqueueReadBuffer(cl.queue, buffers.hits, CL_TRUE, 0, kept * sizeof(cl_ulong), hits.data(), 0, nullptr, nullptr);
+            err |= clEnqueueReadBuffer(cl.queue, buffers.hit_scores, CL_TRUE, 0, kept * sizeof(cl_float), scores.data(), 0, nullptr, nullptr);
+        }
+        if (err != CL_SUCCESS) {
+            std::cerr << "Failed to read buffer from OpenCL kernel. Error code: " << err << std::endl;
+            throw std::runtime_error("OpenCL buffer read error");
+        }
+
+        if (hit_count <= max_hits) {
+            for (cl_uint k = 0; k < kept; k++) {
+                key_from_index(hits[k], keyspace, key_length, key.data());
+                offer_scored_key(result.ranked, top_k, scores[k], key.data(), key_length);
+            }
+            break;
+        }
+
+        std::vector<cl_float> best(scores.begin(), scores.begin() + kept);
+        std::nth_element(best.begin(), best.begin() + (top_k - 1), best.end(), std::greater<cl_float>());
+        if (best[top_k - 1] > threshold) {
+            threshold = best[top_k - 1];
+            continue;
+        }
+
+        // More than max_hits keys tie at the threshold; score the batch on the host instead
+        std::vector<unsigned char> plaintext(buffers.check_length);
+        for (cl_ulong index = base_index; index < base_index + count; index++) {
+            key_from_index(index, keyspace, key_length, key.data());
+            rc4_keystream(key.data(), key_length, plaintext.data(), plaintext.size());
+            for (size_t k = 0; k < plaintext.size(); k++) {
+                plaintext[k] ^= encrypted_data[k];
+            }
+            offer_scored_key(result.ranked, top_k, score_plaintext(buffers.oracle.model, plaintext.data(), plaintext.size()), key.data(), key_length);
+        }
+        break;
+    }
+    result.keys_tested += count;
+}
+
+// Cascade-oracle launch: one rc4_cascade_stage launch per device stage, each over the compacted
+// survivor records of the one before, then the host stages on the final survivors
+bool cascade_batch_opencl(OpenCLContext& cl, cl_kernel kernel, OpenCLSearchBuffers& buffers, const std::vector<unsigned char>& encrypted_data,
+    const Keyspace& keyspace, int key_length, cl_ulong base_index, cl_ulong count, SearchResult& result) {
+    const std::vector<CascadeStage>& stages = buffers.oracle.cascade;
+    const int charset_size = kernel_charset_size(keyspace);
+    if (result.stages.empty()) {
+        for (const CascadeStage& stage : stages) {
+            result.stages.push_back({ stage.label });
+        }
+    }
+    size_t device_stages = stages.back().kind == "verify" ? stages.size() - 1 : stages.size();
+    result.keys_tested += count;
+
+    cl_ulong survivors = count;
+    size_t s = 0;
+    for (; s < device_stages && survivors > 0; s++) {
+        const CascadeStage& stage = stages[s];
+        auto stage_start = std::chrono::steady_clock::now();
+        cl_uint zero = 0;
+        int first_stage = s == 0;
+        int stage_kind = stage.kind == "printable" ? 0 : stage.kind == "crib" ? 1 : 2;
+        int stage_offset = (int)stage.offset, stage_length = (int)stage.length;
+        cl_float min_score = stage.min_score * stage.length;
+        cl_int err = clEnqueueWriteBuffer(cl.queue, buffers.record_count, CL_FALSE, 0, sizeof(cl_uint), &zero, 0, nullptr, nullptr);
+        err |= clSetKernelArg(kernel, 0, sizeof(cl_mem), &buffers.ciphertext);
+        err |= clSetKernelArg(kernel, 1, sizeof(cl_mem), &buffers.charset);
+        err |= clSetKernelArg(kernel, 2, sizeof(int), &charset_size);
+        err |= clSetKernelArg(kernel, 3, sizeof(int), &key_length);
+        err |= clSetKernelArg(kernel, 4, sizeof(cl_ulong), &base_index);
+        err |= clSetKernelArg(kernel, 5, sizeof(cl_ulong), &survivors);
+        err |= clSetKernelArg(kernel, 6, sizeof(int), &first_stage);
+        err |= clSetKernelArg(kernel, 7, sizeof(cl_mem), &buffers.records[(s + 1) % 2]);
+        err |= clSetKernelArg(kernel, 8, sizeof(cl_mem), &buffers.records[s % 2]);
+        err |= clSetKernelArg(kernel, 9, sizeof(cl_mem), &buffers.record_count);
+        err |= clSetKernelArg(kernel, 10, sizeof(int), &stage_kind);
+        err |= clSetKernelArg(kernel, 11, sizeof(int), &stage_offset);
+        err |= clSetKernelArg(kernel, 12, sizeof(int), &stage_length);
+        err |= clSetKernelArg(kernel, 13, sizeof(cl_mem), &buffers.stage_bytes[s]);
+        err |= clSetKernelArg(kernel, 14, sizeof(cl_mem), &buffers.byte_class);
+        err |= clSetKernelArg(kernel, 15, sizeof(cl_mem), &buffers.unigram);
+        err |= clSetKernelArg(kernel, 16, sizeof(cl_mem), &buffers.bigram);
+        err |= clSetKernelArg(kernel, 17, sizeof(cl_float), &min_score);
+        if (err != CL_SUCCESS) {
+            std::cerr << "Failed to set OpenCL kernel arguments. Error code: " << err << std::endl;
+            throw std::runtime_error("OpenCL kernel argument setting error");
+        }
+
+        size_t global_work_size = (size_t)survivors;
+        err = clEnqueueNDRangeKernel(cl.queue, kernel, 1, nullptr, &global_work_size, nullptr, 0, nullptr, nullptr);
+        cl_uint passed = 0;
+        err |= clEnqueueReadBuffer(cl.queue, buffers.record_count, CL_TRUE, 0, sizeof(cl_uint), &passed, 0, nullptr, nullptr);
+        if (err != CL_SUCCESS) {
+            std::cerr << "Failed to run cascade stage " << stage.label << ". Error code: " << err << std::endl;
+            throw std::runtime_error("OpenCL kernel enqueue error");
+        }
+        std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - stage_start;
+        result.stages[s].in += survivors;
+        result.stages[s].out += passed;
+        result.stages[s].seconds += elapsed.count();
+        survivors = passed;
+    }
+    if (survivors == 0) {
+        return false;
+    }
+
+    // Only the final survivors cross to the host
+    std::vector<CascadeRecord> records(survivors);
+    cl_int err = clEnqueueReadBuffer(cl.queue, buffers.records[(s + 1) % 2], CL_TRUE, 0, survivors * sizeof(CascadeRecord), records.data(), 0, nullptr, nullptr);
+    if (err != CL_SUCCESS) {
+        std::cerr << "Failed to read buffer from OpenCL kernel. Error code: " << err << std::endl;
+        throw std::runtime_error("OpenCL buffer read error");
+    }
+    std::vector<cl_ulong> candidates;
+    for (const CascadeRecord& record : records) {
+        candidates.push_back(record.index);
+    }
+    std::sort(candidates.begin(), candidates.end());
+
+    auto stage_start = std::chrono::steady_clock::now();
+    std::vector<unsigned char> key(key_length);
+    std::vector<unsigned char> plaintext;
+    bool verifying = device_stages < stages.size();
+    size_t tried = 0;
+    for (cl_ulong index : candidates) {
+        key_from_index(index, keyspace, key_length, key.data());
+        tried++;
+        if (verify_candidate(encrypted_data, key.data(), key_length, plaintext, buffers.oracle) || !verifying) {
+            result.found = true;
+            result.key = key;
+            result.plaintext = plaintext;
+            break;
+        }
+    }
+    if (verifying) {
+        std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - stage_start;
+        result.stages[s].in += tried;
+        result.stages[s].out += result.found ? 1 : 0;
+        result.stages[s].seconds += elapsed.count();
+    }
+    return result.found;
+}
+
+// One kernel launch over key indices [base_index, base_index + count) of one key length; the
+// hit list is verified against the whole buffer on the host. Returns true when a key verified.
+bool search_batch_opencl(OpenCLContext& cl, cl_kernel kernel, OpenCLSearchBuffers& buffers, const std::vector<unsigned char>& encrypted_data,
+    const Keyspace& keyspace, int key_length, cl_ulong base_index, cl_ulong count, SearchResult& result) {
+    if (buffers.oracle.kind == OracleKind::score) {
+        score_batch_opencl(cl, kernel, buffers, encrypted_data, keyspace, key_length, base_index, count, result);
+        return false;
+    }
+    if (buffers.oracle.kind == OracleKind::cascade) {
+        return cascade_batch_opencl(cl, kernel, buffers, encrypted_data, keyspace, key_length, base_index, count, result);
+    }
+
+    const cl_uint max_hits = opencl_max_hits;
+    cl_uint zero = 0;
+    cl_int err = clEnqueueWriteBuffer(cl.queue, buffers.hit_count, CL_FALSE, 0, sizeof(cl_uint), &zero, 0, nullptr, nullptr);
+    err |= set_search_kernel_args(kernel, buffers, keyspace, key_length, base_index, count);
+    if (buffers.oracle.kind == OracleKind::printable) {
+        err |= clSetKernelArg(kernel, 10, sizeof(cl_mem), &buffers.accept);
+    }
+    if (buffers.oracle.kind == OracleKind::keystream || buffers.oracle.kind == OracleKind::multi) {
+        err |= clSetKernelArg(kernel, 10, sizeof(cl_mem), &buffers.target_words);
+    }
+    if (buffers.oracle.kind == OracleKind::multi) {
+        err |= clSetKernelArg(kernel, 11, sizeof(cl_mem), &buffers.target_buckets);
+    }
+    if (buffers.oracle.kind == OracleKind::utf8) {
+        int range_count = (int)buffers.oracle.scripts.ranges.size() / 2;
+        err |= clSetKernelArg(kernel, 10, sizeof(cl_mem), &buffers.accept);
+        err |= clSetKernelArg(kernel, 11, sizeof(cl_mem), &buffers.code_points);
+        err |= clSetKernelArg(kernel, 12, sizeof(int), &range_count);
+    }
+    if (buffers.oracle.kind == OracleKind::signature) {
+        const SignatureProgram& program = buffers.oracle.signature_program;
+        int op_count = (int)program.ops.size();
+        err |= clSetKernelArg(kernel, 10, sizeof(cl_mem), &buffers.signature_ops);
+        err |= clSetKernelArg(kernel, 11, sizeof(cl_mem), &buffers.signature_ids);
+        err |= clSetKernelArg(kernel, 12, sizeof(int), &op_count);
+        err |= clSetKernelArg(kernel, 13, sizeof(cl_ulong), &program.all_signatures);
+    }
+    if (buffers.oracle.kind == OracleKind::crc) {
+        const CrcSpec& crc = buffers.oracle.crc;
+        cl_uint crc_init = crc_register_init(crc), crc_xorout = crc.xorout, mask = crc_mask(crc.width);
+        int width = crc.width, reflect = crc.reflect, big_endian = crc.big_endian;
+        int span_begin = (int)crc.span_begin, span_end = (int)crc.span_end, position = (int)crc.position;
+        err |= clSetKernelArg(kernel, 10, sizeof(cl_mem), &buffers.crc_table);
+        err |= clSetKernelArg(kernel, 11, sizeof(cl_uint), &crc_init);
+        err |= clSetKernelArg(kernel, 12, sizeof(cl_uint), &crc_xorout);
+        err |= clSetKernelArg(kernel, 13, sizeof(cl_uint), &mask);
+        err |= clSetKernelArg(kernel, 14, sizeof(int), &width);
+        err |= clSetKernelArg(kernel, 15, sizeof(int), &reflect);
+        err |= clSetKernelArg(kernel, 16, sizeof(int), &big_endian);
+        err |= clSetKernelArg(kernel, 17, sizeof(int), &span_begin);
+        err |= clSetKernelArg(kernel, 18, sizeof(int), &span_end);
+        err |= clSetKernelArg(kernel, 19, sizeof(int), &position);
+    }
+    if (err != CL_SUCCESS) {
+        std::cerr << "Failed to set OpenCL kernel arguments. Error code: " << err << std::endl;
+        throw std::runtime_error("OpenCL kernel argument setting error");
+    }
+
+    size_t global_work_size = (size_t)count;
+    err = clEnqueueNDRangeKernel(cl.queue, kernel, 1, nullptr, &global_work_size, nullptr, 0, nullptr, nullptr);
+    if (err != CL_SUCCESS) {
+        std::cerr << "Failed to enqueue OpenCL kernel. Error code: " << err << std::endl;
+        throw std::runtime_error("OpenCL kernel enqueue error");
+    }
+
+    std::vector<cl_ulong> hits(max_hits);
+    cl_uint hit_count = 0;
+    err = clEnqueueReadBuffer(cl.queue, buffers.hit_count, CL_TRUE, 0, sizeof(cl_uint), &hit_count, 0, nullptr, nullptr);
+    if (err == CL_SUCCESS && hit_count > 0) {
+        err = clEnqueueReadBuffer(cl.queue, buffers.hits, CL_TRUE, 0, std::min(hit_count, max_hits) * sizeof(cl_ulong), hits.data(), 0, nullptr, nullptr);
+    }
+    if (err != CL_SUCCESS) {
+        std::cerr << "Failed to read buffer from OpenCL kernel. Error code: " << err << std::endl;
+        throw std::runtime_error("OpenCL buffer read error");
+    }
+    result.keys_tested += count;
+
+    // An overflowing hit list means the prefix check is too weak for this ciphertext;
+    // fall back to verifying every key of the batch on the host
+    std::vector<cl_ulong> candidates(hits.begin(), hits.begin() + std::min(hit_count, max_hits));
+    if (hit_count > max_hits) {
+        candidates.resize(count);
+        for (cl_ulong k = 0; k < count; k++) {
+            candidates[k] = base_index + k;
+        }
+    }
+    std::sort(candidates.begin(), candidates.end());
+    std::vector<unsigned char> key(key_length);
+    std::vector<unsigned char> plaintext;
+    for (cl_ulong index : candidates) {
+        key_from_index(index, keyspace, key_length, key.data());
+        if (buffers.oracle.kind == OracleKind::multi) {
+            if (record_target_matches(buffers.oracle, key.data(), key_length, result)) {
+                result.found = true;
+                return true;
+            }
+            continue;
+        }
+        if (verify_candidate(encrypted_data, key.data(), key_length, plaintext, buffers.oracle)) {
+            result.found = true;
+            result.key = key;
+            result.plaintext = plaintext;
+            return true;
+        }
+    }
+    return false;
+}
+
+// Batched device search: each work item tests one key index against the ciphertext prefix and
+// appends survivors to a hit list, which the host verifies against the whole buffer. The
+// context and kernel are borrowed so callers such as the daemon can keep them warm.
+SearchResult search_rc4_opencl(OpenCLContext& cl, cl_kernel kernel, const std::vector<unsigned char>& encrypted_data, const Keyspace& keyspace, int max_key_length,
+    const ProgressCallback& progress = nullptr, const KeyspaceShard& shard = KeyspaceShard(), const Oracle& oracle = Oracle()) {
+    OpenCLSearchBuffers buffers = create_search_buffers(cl, encrypted_data, keyspace, max_key_length, oracle);
+    SearchResult result;
+    auto start_time = std::chrono::high_resolution_clock::now();
+
+    for (int key_length = 1; key_length <= max_key_length && !result.found && !result.cancelled; ++key_length) {
+        cl_ulong total = keyspace_size(keyspace, key_length);
+        cl_ulong begin = shard_boundary(total, shard.begin);
+        cl_ulong end = shard_boundary(total, shard.end);
+        auto length_start = std::chrono::high_resolution_clock::now();
+
+        const cl_ulong batch_size = oracle.kind == OracleKind::cascade ? cascade_batch_size : opencl_batch_size;
+        for (cl_ulong base_index = begin; base_index < end; base_index += batch_size) {
+            cl_ulong count = std::min<cl_ulong>(batch_size, end - base_index);
+            if (search_batch_opencl(cl, kernel, buffers, encrypted_data, keyspace, key_length, base_index, count, result)) {
+                break;
+            }
+
+            if (progress) {
+                std::chrono::duration<double> elapsed = std::chrono::high_resolution_clock::now() - length_start;
+                cl_ulong done = base_index + count - begin;
+                if (!progress({ key_length, done, end - begin, elapsed.count() > 0 ? done / elapsed.count() : 0.0, base_index, base_index + count })) {
+                    result.cancelled = true;
+                    break;
+                }
+            }
+        }
+    }
+
+    std::chrono::duration<double> elapsed = std::chrono::high_resolution_clock::now() - start_time;
+    result.seconds = elapsed.count();
+    result.throughput.push_back({ "OpenCL device", result.keys_tested, result.seconds });
+    release_search_buffers(buffers);
+    if (oracle.kind == OracleKind::score) {
+        finish_ranking(result, encrypted_data);
+    }
+    return result;
+}
+
+SearchResult brute_force_rc4_gpu(const std::vector<unsigned char>& encrypted_data, const Keyspace& keyspace, int max_key_length,
+    cl_device_type device_type = CL_DEVICE_TYPE_GPU, const ProgressCallback& progress = nullptr, const KeyspaceShard& shard = KeyspaceShard(),
+    const Oracle& oracle = Oracle()) {
+    OpenCLContext cl = create_opencl_context(device_type);
+    cl_kernel kernel = create_search_kernel(cl, oracle);
+    SearchResult result = search_rc4_opencl(cl, kernel, encrypted_data, keyspace, max_key_length, progress, shard, oracle);
+    clReleaseKernel(kernel);
+    release_opencl_context(cl);
+    print_search_result(result);
+    return result;
+}
+
+// Passphrase-to-key derivation in front of the KSA: the RC4 key is the first key_length bytes
+// of MD5 or SHA-1 over passphrase || salt, and candidates are passphrases from the keyspace.
+// Keys are derived a single compression block at a time, so passphrase and salt together are
+// at most kdf_max_message bytes.
+struct KdfSpec {
+    std::string algorithm;
+    std::vector<unsigned char> salt;
+    int key_length = 0;
+};
+
+const int kdf_max_message = 55;
+
+int kdf_digest_length(const std::string& algorithm) {
+    return algorithm == "sha1" ? 20 : 16;
+}
+
+const uint32_t md5_sines[64] = {
+    0xd76aa478, 0xe8c7b756, 0x242070db, 0xc1bdceee, 0xf57c0faf, 0x4787c62a, 0xa8304613, 0xfd469501,
+    0x698098d8, 0x8b44f7af, 0xffff5bb1, 0x895cd7be, 0x6b901122, 0xfd987193, 0xa679438e, 0x49b40821,
+    0xf61e2562, 0xc040b340, 0x265e5a51, 0xe9b6c7aa, 0xd62f105d, 0x02441453, 0xd8a1e681, 0xe7d3fbc8,
+    0x21e1cde6, 0xc33707d6, 0xf4d50d87, 0x455a14ed, 0xa9e3e905, 0xfcefa3f8, 0x676f02d9, 0x8d2a4c8a,
+    0xfffa3942, 0x8771f681, 0x6d9d6122, 0xfde5380c, 0xa4beea44, 0x4bdecfa9, 0xf6bb4b60, 0xbebfbc70,
+    0x289b7ec6, 0xeaa127fa, 0xd4ef3085, 0x04881d05, 0xd9d4d039, 0xe6db99e5, 0x1fa27cf8, 0xc4ac5665,
+    0xf4292244, 0x432aff97, 0xab9423a7, 0xfc93a039, 0x655b59c3, 0x8f0ccc92, 0xffeff47d, 0x85845dd1,
+    0x6fa87e4f, 0xfe2ce6e0, 0xa3014314, 0x4e0811a1, 0xf7537e82, 0xbd3af235, 0x2ad7d2bb, 0xeb86d391,
+};
+const int md5_shifts[16] = { 7, 12, 17, 22, 5, 9, 14, 20, 4, 11, 16, 23, 6, 10, 15, 21 };
+const uint32_t hash_initial_state[5] = { 0x67452301, 0xefcdab89, 0x98badcfe, 0x10325476, 0xc3d2e1f0 };
+
+inline uint32_t rotl32(uint32_t x, int s) {
+    return (x << s) | (x >> (32 - s));
+}
+
+// Host twins of the kernel's md5_compress and sha1_compress
+void md5_compress(uint32_t* state, const uint32_t* w) {
+    uint32_t a = state[0], b = state[1], c = state[2], d = state[3];
+    for (int t = 0; t < 64; t++) {
+        uint32_t f = t < 16 ? (b & c) | (~b & d) : t < 32 ? (d & b) | (~d & c) : t < 48 ? b ^ c ^ d : c ^ (b | ~d);
+        int g = t < 16 ? t : t < 32 ? (5 * t + 1) & 15 : t < 48 ? (3 * t + 5) & 15 : (7 * t) & 15;
+        uint32_t temp = d;
+        d = c;
+        c = b;
+        b += rotl32(a + f + md5_sines[t] + w[g], md5_shifts[(t >> 4) * 4 + (t & 3)]);
+        a = temp;
+    }
+    state[0] += a;
+    state[1] += b;
+    state[2] += c;
+    state[3] += d;
+}
+
+void sha1_compress(uint32_t* state, uint32_t* w) {
+    uint32_t a = state[0], b = state[1], c = state[2], d = state[3], e = state[4];
+    for (int t = 0; t < 80; t++) {
+        if (t >= 16) {
+            w[t & 15] = rotl32(w[(t - 3) & 15] ^ w[(t - 8) & 15] ^ w[(t - 14) & 15] ^ w[t & 15], 1);
+        }
+        uint32_t f = t < 20 ? ((b & c) | (~b & d)) + 0x5a827999 : t < 40 ? (b ^ c ^ d) + 0x6ed9eba1
+            : t < 60 ? ((b & c) | (b & d) | (c & d)) + 0x8f1bbcdc : (b ^ c ^ d) + 0xca62c1d6;
+        uint32_t temp = rotl32(a, 5) + f + e + w[t & 15];
+        e = d;
+        d = c;
+        c = rotl32(b, 30);
+        b = a;
+        a = temp;
+    }
+    state[0] += a;
+    state[1] += b;
+    state[2] += c;
+    state[3] += d;
+    state[4] += e;
+}
+
+// Whole-message digests of any length: MD5 fills digest[0..15], SHA-1 digest[0..19]
+void hash_digest(bool sha1, const unsigned char* data, size_t length, unsigned char* digest) {
+    const int swap = sha1 ? 3 : 0;
+    std::vector<unsigned char> message(data, data + length);
+    message.push_back(0x80);
+    while (message.size() % 64 != 56) {
+        message.push_back(0);
+    }
+    uint64_t bits = (uint64_t)length * 8;
+    for (int b = 0; b < 8; b++) {
+        message.push_back((unsigned char)(bits >> (8 * (b ^ (sha1 ? 7 : 0)))));
+    }
+    uint32_t state[5];
+    std::copy(hash_initial_state, hash_initial_state + 5, state);
+    for (size_t block = 0; block < message.size(); block += 64) {
+        uint32_t w[16] = { 0 };
+        for (int n = 0; n < 64; n++) {
+            w[n >> 2] |= (uint32_t)message[block + n] << (8 * ((n & 3) ^ swap));
+        }
+        if (sha1) {
+            sha1_compress(state, w);
+        }
+        else {
+            md5_compress(state, w);
+        }
+    }
+    for (int b = 0; b < (sha1 ? 20 : 16); b++) {
+        digest[b] = (unsigned char)(state[b >> 2] >> (8 * ((b & 3) ^ swap)));
+    }
+}
+
+void md5_digest(const unsigned char* data, size_t length, unsigned char* digest) {
+    hash_digest(false, data, length, digest);
+}
+
+void sha1_digest(const unsigned char* data, size_t length, unsigned char* digest) {
+    hash_digest(true, data, length, digest);
+}
+
+// The single padded block of passphrase || salt, as kdf_derive_keys lays it out
+void kdf_message_block(const KdfSpec& kdf, const unsigned char* passphrase, int passphrase_length, uint32_t* w) {
+    const bool sha1 = kdf.algorithm == "sha1";
+    const int swap = sha1 ? 3 : 0;
+    const int length = passphrase_length + (int)kdf.salt.size();
+    std::fill(w, w + 16, 0);
+    for (int n = 0; n < length; n++) {
+        unsigned char byte = n < passphrase_length ? passphrase[n] : kdf.salt[n - passphrase_length];
+        w[n >> 2] |= (uint32_t)byte << (8 * ((n & 3) ^ swap));
+    }
+    w[length >> 2] |= 0x80u << (8 * ((length & 3) ^ swap));
+    w[sha1 ? 15 : 14] = length * 8;
+}
+
+void kdf_key_from_state(const KdfSpec& kdf, const uint32_t* state, unsigned char* key) {
+    const int swap = kdf.algorithm == "sha1" ? 3 : 0;
+    for (int b = 0; b < kdf.key_length; b++) {
+        key[b] = (unsigned char)(state[b >> 2] >> (8 * ((b & 3) ^ swap)));
+    }
+}
+
+void derive_kdf_key(const KdfSpec& kdf, const unsigned char* passphrase, int passphrase_length, unsigned char* key) {
+    uint32_t w[16], state[5];
+    kdf_message_block(kdf, passphrase, passphrase_length, w);
+    std::copy(hash_initial_state, hash_initial_state + 5, state);
+    if (kdf.algorithm == "sha1") {
+        sha1_compress(state, w);
+    }
+    else {
+        md5_compress(state, w);
+    }
+    kdf_key_from_state(kdf, state, key);
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+__attribute__((target("avx2"))) inline
+__m256i rotl_avx2(__m256i x, int s) {
+    return _mm256_or_si256(_mm256_sll_epi32(x, _mm_cvtsi32_si128(s)), _mm256_srl_epi32(x, _mm_cvtsi32_si128(32 - s)));
+}
+
+// Eight compressions side by side, lane n compressing blocks[n] into the chaining state states[n]
+__attribute__((target("avx2")))
+void kdf_compress_avx2(bool sha1, const uint32_t (*blocks)[16], uint32_t (*states)[5]) {
+    __m256i w[16];
+    for (int t = 0; t < 16; t++) {
+        w[t] = _mm256_setr_epi32(blocks[0][t], blocks[1][t], blocks[2][t], blocks[3][t], blocks[4][t], blocks[5][t], blocks[6][t], blocks[7][t]);
+    }
+    __m256i v[5], initial[5];
+    for (int k = 0; k < 5; k++) {
+        initial[k] = v[k] = _mm256_setr_epi32(states[0][k], states[1][k], states[2][k], states[3][k], states[4][k], states[5][k], states[6][k], states[7][k]);
+    }
+    const __m256i ones = _mm256_set1_epi32(-1);
+    __m256i &a = v[0], &b = v[1], &c = v[2], &d = v[3], &e = v[4];
+    if (sha1) {
+        for (int t = 0; t < 80; t++) {
+            if (t >= 16) {
+                w[t & 15] = rotl_avx2(_mm256_xor_si256(_mm256_xor_si256(w[(t - 3) & 15], w[(t - 8) & 15]), _mm256_xor_si256(w[(t - 14) & 15], w[t & 15])), 1);
+            }
+            __m256i f = t < 20 ? _mm256_or_si256(_mm256_and_si256(b, c), _mm256_andnot_si256(b, d))
+                : t >= 40 && t < 60 ? _mm256_or_si256(_mm256_and_si256(b, c), _mm256_and_si256(d, _mm256_or_si256(b, c)))
+                : _mm256_xor_si256(_mm256_xor_si256(b, c), d);
+            const uint32_t k = t < 20 ? 0x5a827999 : t < 40 ? 0x6ed9eba1 : t < 60 ? 0x8f1bbcdc : 0xca62c1d6;
+            __m256i temp = _mm256_add_epi32(_mm256_add_epi32(rotl_avx2(a, 5), f), _mm256_add_epi32(_mm256_add_epi32(e, w[t & 15]), _mm256_set1_epi32((int)k)));
+            e = d;
+            d = c;
+            c = rotl_avx2(b, 30);
+            b = a;
+            a = temp;
+        }
+    }
+    else {
+        for (int t = 0; t < 64; t++) {
+            __m256i f;
+            int g;
+            if (t < 16) {
+                f = _mm256_or_si256(_mm256_and_si256(b, c), _mm256_andnot_si256(b, d));
+                g = t;
+            }
+            else if (t < 32) {
+                f = _mm256_or_si256(_mm256_and_si256(d, b), _mm256_andnot_si256(d, c));
+                g = (5 * t + 1) & 15;
+            }
+            else if (t < 48) {
+                f = _mm256_xor_si256(_mm256_xor_si256(b, c), d);
+                g = (3 * t + 5) & 15;
+            }
+            else {
+                f = _mm256_xor_si256(c, _mm256_or_si256(b, _mm256_xor_si256(d, ones)));
+                g = (7 * t) & 15;
+            }
+            __m256i sum = _mm256_add_epi32(_mm256_add_epi32(a, f), _mm256_add_epi32(w[g], _mm256_set1_epi32((int)md5_sines[t])));
+            __m256i temp = d;
+            d = c;
+            c = b;
+            b = _mm256_add_epi32(b, rotl_avx2(sum, md5_shifts[(t >> 4) * 4 + (t & 3)]));
+            a = temp;
+        }
+    }
+    alignas(32) uint32_t lanes[5][8];
+    for (int k = 0; k < (sha1 ? 5 : 4); k++) {
+        _mm256_store_si256((__m256i*)lanes[k], _mm256_add_epi32(v[k], initial[k]));
+        for (int n = 0; n < 8; n++) {
+            states[n][k] = lanes[k][n];
+        }
+    }
+}
+#endif
+
+// KDF stage on the CPU: the keys of passphrase indices [base, base + count) into
+// keys[n * kdf.key_length], eight passphrases per AVX2 compression where the CPU has it
+void derive_kdf_keys_cpu(const KdfSpec& kdf, const unsigned char* key_table, size_t charset_size, bool constrained, int passphrase_length, unsigned long long base, size_t count,
+    unsigned char* keys) {
+    unsigned char passphrase[max_search_key_length];
+    size_t n = 0;
+#if defined(__x86_64__) || defined(__i386__)
+    if (simd_level() >= 2) {
+        const bool sha1 = kdf.algorithm == "sha1";
+        uint32_t blocks[8][16], states[8][5];
+        for (; n + 8 <= count; n += 8) {
+            for (int lane = 0; lane < 8; lane++) {
+                key_from_index(base + n + lane, key_table, charset_size, constrained, passphrase_length, passphrase);
+                kdf_message_block(kdf, passphrase, passphrase_length, blocks[lane]);
+                std::copy(hash_initial_state, hash_initial_state + 5, states[lane]);
+            }
+            kdf_compress_avx2(sha1, blocks, states);
+            for (int lane = 0; lane < 8; lane++) {
+                kdf_key_from_state(kdf, states[lane], keys + (n + lane) * kdf.key_length);
+            }
+        }
+    }
+#endif
+    for (; n < count; n++) {
+        key_from_index(base + n, key_table, charset_size, constrained, passphrase_length, passphrase);
+        derive_kdf_key(kdf, passphrase, passphrase_length, keys + n * kdf.key_length);
+    }
+}
+
+// Rejects what the pipeline cannot run: unknown algorithms, oversized keys or messages, and
+// oracles other than the accept-bitmap ones (printable, byte class, keystream)
+void check_kdf_spec(const KdfSpec& kdf, int max_key_length, const Oracle& oracle) {
+    if (kdf.algorithm != "md5" && kdf.algorithm != "sha1") {
+        std::cerr << "--kdf must be md5 or sha1" << std::endl;
+        throw std::runtime_error("Invalid arguments");
+    }
+    if (kdf.key_length < 1 || kdf.key_length > kdf_digest_length(kdf.algorithm)) {
+        std::cerr << "--kdf-key-length must be between 1 and " << kdf_digest_length(kdf.algorithm) << " for " << kdf.algorithm << std::endl;
+        throw std::runtime_error("Invalid arguments");
+    }
+    if (max_key_length + (int)kdf.salt.size() > kdf_max_message) {
+        std::cerr << "Passphrase plus salt must fit in " << kdf_max_message << " bytes" << std::endl;
+        throw std::runtime_error("Invalid arguments");
+    }
+    if (oracle.kind != OracleKind::printable && oracle.kind != OracleKind::keystream) {
+        std::cerr << "--kdf works with the printable and keystream oracles" << std::endl;
+        throw std::runtime_error("Invalid arguments");
+    }
+}
+
+// Bytes accepted by the pipeline's RC4 stage: the printable oracle's class, or only zero when
+// the "ciphertext" is a target keystream
+ByteClass kdf_accept_class(const Oracle& oracle) {
+    if (oracle.kind != OracleKind::keystream) {
+        return oracle.accept;
+    }
+    ByteClass zero;
+    zero.add(0);
+    return zero;
+}
+
+// Passphrases the CPU pipeline derives, then checks, as one block per worker step
+const size_t kdf_block = 1024;
+
+// KDF pipeline over passphrase indices [begin, end) of one length on the engine's pinned
+// workers. Each worker derives a block of keys from its node's copy of the key table, then runs
+// the RC4 prefix check over them against its node's ciphertext prefix; the time in each stage
+// is added to kdf_seconds and rc4_seconds (summed over workers).
+bool kdf_range_cpu(CpuSearchEngine& engine, const std::vector<unsigned char>& encrypted_data, const Keyspace& keyspace, int passphrase_length, const KdfSpec& kdf,
+    unsigned long long begin, unsigned long long end, SearchResult& result, double& kdf_seconds, double& rc4_seconds) {
+    std::atomic<unsigned long long> next(begin);
+    std::atomic<bool> stop(false);
+    std::mutex result_mutex;
+    const Oracle& oracle = engine.oracle;
+    const size_t prefix_length = engine.prefix_length;
+    const size_t charset_size = keyspace.charset.size();
+    const bool constrained = keyspace.constrained();
+    const bool keystream_target = oracle.kind == OracleKind::keystream;
+    run_on_pool(*engine.pool, [&](size_t worker) {
+        const NodeBuffers& buffer = engine.buffers[engine.pool->worker_node[worker]];
+        const std::vector<uint64_t> target_words = pack_keystream_words(buffer.ciphertext_prefix, prefix_length);
+        std::vector<unsigned char> keys(kdf_block * kdf.key_length), keystream(prefix_length), plaintext;
+        double derive_time = 0, check_time = 0;
+        unsigned long long tested = 0;
+        for (unsigned long long block = next.fetch_add(kdf_block); block < end && !stop; block = next.fetch_add(kdf_block)) {
+            size_t count = (size_t)std::min<unsigned long long>(kdf_block, end - block);
+            auto derive_start = std::chrono::steady_clock::now();
+            derive_kdf_keys_cpu(kdf, buffer.key_table, charset_size, constrained, passphrase_length, block, count, keys.data());
+            auto check_start = std::chrono::steady_clock::now();
+            for (size_t n = 0; n < count && !stop; n++) {
+                const unsigned char* key = &keys[n * kdf.key_length];
+                bool pass;
+                if (keystream_target) {
+                    pass = keystream_matches(key, kdf.key_length, target_words.data(), prefix_length);
+                }
+                else {
+                    rc4_keystream(key, kdf.key_length, keystream.data(), prefix_length);
+                    pass = prefix_passes(oracle, buffer.ciphertext_prefix, keystream.data(), prefix_length);
+                }
+                if (pass && verify_candidate(encrypted_data, key, kdf.key_length, plaintext, oracle)) {
+                    std::lock_guard<std::mutex> lock(result_mutex);
+                    if (!result.found) {
+                        result.key.resize(passphrase_length);
+                        key_from_index(block + n, buffer.key_table, charset_size, constrained, passphrase_length, result.key.data());
+                        result.plaintext = plaintext;
+                        result.found = true;
+                        stop = true;
+                    }
+                }
+            }
+            auto check_end = std::chrono::steady_clock::now();
+            derive_time += std::chrono::duration<double>(check_start - derive_start).count();
+            check_time += std::chrono::duration<double>(check_end - check_start).count();
+            tested += count;
+        }
+        std::lock_guard<std::mutex> lock(result_mutex);
+        kdf_seconds += derive_time;
+        rc4_seconds += check_time;
+        result.keys_tested += tested;
+    });
+    return result.found;
+}
+
+SearchResult search_kdf_cpu(const std::vector<unsigned char>& encrypted_data, const Keyspace& keyspace, int max_key_length, const KdfSpec& kdf,
+    const ProgressCallback& progress = nullptr, const KeyspaceShard& shard = KeyspaceShard(), const Oracle& oracle = Oracle()) {
+    check_kdf_spec(kdf, max_key_length, oracle);
+    CpuSearchEngine engine = create_cpu_engine(encrypted_data, keyspace, max_key_length, oracle);
+    const size_t threads = engine.total_cpus;
+    SearchResult result;
+    double kdf_seconds = 0, rc4_seconds = 0;
+    auto start_time = std::chrono::high_resolution_clock::now();
+
+    const unsigned long long chunk = cpu_chunk_per_thread * threads;
+    for (int key_length = 1; key_length <= max_key_length && !result.found && !result.cancelled; ++key_length) {
+        unsigned long long total = keyspace_size(keyspace, key_length);
+        unsigned long long begin = shard_boundary(total, shard.begin);
+        unsigned long long end = shard_boundary(total, shard.end);
+        auto length_start = std::chrono::high_resolution_clock::now();
+        for (unsigned long long chunk_begin = begin; chunk_begin < end; chunk_begin += chunk) {
+            unsigned long long chunk_end = std::min(chunk_begin + chunk, end);
+            if (kdf_range_cpu(engine, encrypted_data, keyspace, key_length, kdf, chunk_begin, chunk_end, result, kdf_seconds, rc4_seconds)) {
+                break;
+            }
+            if (progress) {
+                std::chrono::duration<double> elapsed = std::chrono::high_resolution_clock::now() - length_start;
+                unsigned long long done = chunk_end - begin;
+                if (!progress({ key_length, done, end - begin, elapsed.count() > 0 ? done / elapsed.count() : 0.0, chunk_begin, chunk_end })) {
+                    result.cancelled = true;
+                    break;
+                }
+            }
+        }
+    }
+
+    std::chrono::duration<double> elapsed = std::chrono::high_resolution_clock::now() - start_time;
+    result.seconds = elapsed.count();
+    // Worker time is summed over threads; per thread it is what the stage costs the whole CPU
+    result.throughput.push_back({ "KDF stage (" + kdf.algorithm + ", " + (simd_level() >= 2 ? "AVX2" : "scalar") + ")", result.keys_tested, kdf_seconds / threads });
+    result.throughput.push_back({ "RC4 stage", result.keys_tested, rc4_seconds / threads });
+    release_cpu_engine(engine);
+    return result;
+}
+
+// Device buffers and kernels of the KDF pipeline; keys holds one batch of derived keys
+struct OpenCLKdfPipeline {
+    cl_kernel derive_kernel;
+    cl_kernel search_kernel;
+    cl_mem ciphertext;
+    cl_mem charset;
+    cl_mem salt;
+    cl_mem keys;
+    cl_mem hits;
+    cl_mem hit_count;
+    cl_mem accept;
+    int check_length;
+};
+
+OpenCLKdfPipeline create_kdf_pipeline(OpenCLContext& cl, const std::vector<unsigned char>& encrypted_data, const Keyspace& keyspace, const KdfSpec& kdf,
+    const Oracle& oracle) {
+    cl_int err;
+    OpenCLKdfPipeline pipeline;
+    pipeline.derive_kernel = clCreateKernel(cl.program, "kdf_derive_keys", &err);
+    if (err == CL_SUCCESS) {
+        pipeline.search_kernel = clCreateKernel(cl.program, "rc4_search_keys", &err);
+    }
+    if (err != CL_SUCCESS) {
+        std::cerr << "Failed to create OpenCL kernel. Error code: " << err << std::endl;
+        throw std::runtime_error("OpenCL kernel creation error");
+    }
+    pipeline.check_length = (int)oracle_prefix_length(oracle, encrypted_data.size(), 16);
+    std::vector<unsigned char> salt = kdf.salt.empty() ? std::vector<unsigned char>(1, 0) : kdf.salt;
+    std::vector<unsigned char> bitmap = byte_class_bitmap(kdf_accept_class(oracle));
+    pipeline.ciphertext = clCreateBuffer(cl.context, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR, pipeline.check_length, (void*)encrypted_data.data(), &err);
+    pipeline.charset = clCreateBuffer(cl.context, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR, keyspace.table().size(), (void*)keyspace.table().data(), &err);
+    pipeline.salt = clCreateBuffer(cl.context, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR, salt.size(), salt.data(), &err);
+    pipeline.keys = clCreateBuffer(cl.context, CL_MEM_READ_WRITE, opencl_batch_size * kdf.key_length, nullptr, &err);
+    pipeline.hits = clCreateBuffer(cl.context, CL_MEM_WRITE_ONLY, opencl_max_hits * sizeof(cl_ulong), nullptr, &err);
+    pipeline.hit_count = clCreateBuffer(cl.context, CL_MEM_READ_WRITE, sizeof(cl_uint), nullptr, &err);
+    pipeline.accept = clCreateBuffer(cl.context, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR, bitmap.size(), bitmap.data(), &err);
+    if (err != CL_SUCCESS) {
+        std::cerr << "Failed to create OpenCL buffers. Error code: " << err << std::endl;
+        throw std::runtime_error("OpenCL buffer creation error");
+    }
+    return pipeline;
+}
+
+void release_kdf_pipeline(OpenCLKdfPipeline& pipeline) {
+    for (cl_mem buffer : { pipeline.ciphertext, pipeline.charset, pipeline.salt, pipeline.keys, pipeline.hits, pipeline.hit_count, pipeline.accept }) {
+        clReleaseMemObject(buffer);
+    }
+    clReleaseKernel(pipeline.derive_kernel);
+    clReleaseKernel(pipeline.search_kernel);
+}
+
+// Runs the derive stage for one batch, leaving the keys on the device
+void derive_kdf_keys_opencl(OpenCLContext& cl, OpenCLKdfPipeline& pipeline, const Keyspace& keyspace, int passphrase_length, const KdfSpec& kdf,
+    cl_ulong base_index, cl_ulong count) {
+    cl_int err = CL_SUCCESS;
+    int charset_size = kernel_charset_size(keyspace), salt_length = (int)kdf.salt.size(), algorithm = kdf.algorithm == "sha1" ? 1 : 0;
+    err |= clSetKernelArg(pipeline.derive_kernel, 0, sizeof(cl_mem), &pipeline.charset);
+    err |= clSetKernelArg(pipeline.derive_kernel, 1, sizeof(int), &charset_size);
+    err |= clSetKernelArg(pipeline.derive_kernel, 2, sizeof(int), &passphrase_length);
+    err |= clSetKernelArg(pipeline.derive_kernel, 3, sizeof(cl_ulong), &base_index);
+    err |= clSetKernelArg(pipeline.derive_kernel, 4, sizeof(cl_ulong), &count);
+    err |= clSetKernelArg(pipeline.derive_kernel, 5, sizeof(cl_mem), &pipeline.salt);
+    err |= clSetKernelArg(pipeline.derive_kernel, 6, sizeof(int), &salt_length);
+    err |= clSetKernelArg(pipeline.derive_kernel, 7, sizeof(int), &algorithm);
+    err |= clSetKernelArg(pipeline.derive_kernel, 8, sizeof(int), &kdf.key_length);
+    err |= clSetKernelArg(pipeline.derive_kernel, 9, sizeof(cl_mem), &pipeline.keys);
+    size_t global_work_size = count;
+    err |= clEnqueueNDRangeKernel(cl.queue, pipeline.derive_kernel, 1, nullptr, &global_work_size, nullptr, 0, nullptr, nullptr);
+    err |= clFinish(cl.queue);
+    if (err != CL_SUCCESS) {
+        std::cerr << "Failed to run kdf_derive_keys. Error code: " << err << std::endl;
+        throw std::runtime_error("OpenCL KDF error");
+    }
+}
+
+// Runs the RC4 stage over the batch the derive stage left in pipeline.keys and returns the
+// passphrase indices whose prefix passed, in index order. When more than opencl_max_hits
+// pass, the device list is incomplete and every index of the batch is returned instead.
+std::vector<cl_ulong> search_kdf_keys_opencl(OpenCLContext& cl, OpenCLKdfPipeline& pipeline, const KdfSpec& kdf, cl_ulong base_index, cl_ulong count) {
+    cl_int err = CL_SUCCESS;
+    cl_uint hit_count = 0, max_hits = opencl_max_hits;
+    err |= clEnqueueWriteBuffer(cl.queue, pipeline.hit_count, CL_TRUE, 0, sizeof(cl_uint), &hit_count, 0, nullptr, nullptr);
+    err |= clSetKernelArg(pipeline.search_kernel, 0, sizeof(cl_mem), &pipeline.ciphertext);
+    err |= clSetKernelArg(pipeline.search_kernel, 1, sizeof(int), &pipeline.check_length);
+    err |= clSetKernelArg(pipeline.search_kernel, 2, sizeof(cl_mem), &pipeline.keys);
+    err |= clSetKernelArg(pipeline.search_kernel, 3, sizeof(int), &kdf.key_length);
+    err |= clSetKernelArg(pipeline.search_kernel, 4, sizeof(cl_ulong), &base_index);
+    err |= clSetKernelArg(pipeline.search_kernel, 5, sizeof(cl_ulong), &count);
+    err |= clSetKernelArg(pipeline.search_kernel, 6, sizeof(cl_mem), &pipeline.hits);
+    err |= clSetKernelArg(pipeline.search_kernel, 7, sizeof(cl_mem), &pipeline.hit_count);
+    err |= clSetKernelArg(pipeline.search_kernel, 8, sizeof(cl_uint), &max_hits);
+    err |= clSetKernelArg(pipeline.search_kernel, 9, sizeof(cl_mem), &pipeline.accept);
+    size_t global_work_size = count;
+    err |= clEnqueueNDRangeKernel(cl.queue, pipeline.search_kernel, 1, nullptr, &global_work_size, nullptr, 0, nullptr, nullptr);
+    err |= clEnqueueReadBuffer(cl.queue, pipeline.hit_count, CL_TRUE, 0, sizeof(cl_uint), &hit_count, 0, nullptr, nullptr);
+    std::vector<cl_ulong> hits(std::min(hit_count, max_hits));
+    if (!hits.empty()) {
+        err |= clEnqueueReadBuffer(cl.queue, pipeline.hits, CL_TRUE, 0, hits.size() * sizeof(cl_ulong), hits.data(), 0, nullptr, nullptr);
+    }
+    if (err != CL_SUCCESS) {
+        std::cerr << "Failed to run rc4_search_keys. Error code: " << err << std::endl;
+        throw std::runtime_error("OpenCL search error");
+    }
+    // An overflowing hit list means the prefix check is too weak for this ciphertext;
+    // fall back to verifying every passphrase of the batch on the host
+    if (hit_count > max_hits) {
+        hits.resize(count);
+        for (cl_ulong k = 0; k < count; k++) {
+            hits[k] = base_index + k;
+        }
+    }
+    std::sort(hits.begin(), hits.end());
+    return hits;
+}
+
+// The two stages run back to back per batch with a host-side clock around each, so the KDF
+// and RC4 throughput come out separately; prefix survivors are verified on the host
+SearchResult search_kdf_opencl(OpenCLContext& cl, const std::vector<unsigned char>& encrypted_data, const Keyspace& keyspace, int max_key_length,
+    const KdfSpec& kdf, const ProgressCallback& progress = nullptr, const KeyspaceShard& shard = KeyspaceShard(), const Oracle& oracle = Oracle()) {
+    check_kdf_spec(kdf, max_key_length, oracle);
+    if (max_key_length > max_search_key_length) {
+        std::cerr << "Maximum key length for the OpenCL search is " << max_search_key_length << std::endl;
+        throw std::runtime_error("Invalid arguments");
+    }
+    OpenCLKdfPipeline pipeline = create_kdf_pipeline(cl, encrypted_data, keyspace, kdf, oracle);
+    SearchResult result;
+    double kdf_seconds = 0, rc4_seconds = 0;
+    std::vector<unsigned char> key(kdf.key_length), passphrase, plaintext;
+    auto start_time = std::chrono::high_resolution_clock::now();
+
+    for (int key_length = 1; key_length <= max_key_length && !result.found && !result.cancelled; ++key_length) {
+        cl_ulong total = keyspace_size(keyspace, key_length);
+        cl_ulong begin = shard_boundary(total, shard.begin);
+        cl_ulong end = shard_boundary(total, shard.end);
+        auto length_start = std::chrono::high_resolution_clock::now();
+        passphrase.resize(key_length);
+
+        for (cl_ulong base_index = begin; base_index < end; base_index += opencl_batch_size) {
+            cl_ulong count = std::min<cl_ulong>(opencl_batch_size, end - base_index);
+            auto derive_start = std::chrono::steady_clock::now();
+            derive_kdf_keys_opencl(cl, pipeline, keyspace, key_length, kdf, base_index, count);
+            auto search_start = std::chrono::steady_clock::now();
+            std::vector<cl_ulong> hits = search_kdf_keys_opencl(cl, pipeline, kdf, base_index, count);
+            auto search_end = std::chrono::steady_clock::now();
+            kdf_seconds += std::chrono::duration<double>(search_start - derive_start).count();
+            rc4_seconds += std::chrono::duration<double>(search_end - search_start).count();
+            result.keys_tested += count;
+
+            for (cl_ulong index : hits) {
+                key_from_index(index, keyspace, key_length, passphrase.data());
+                derive_kdf_key(kdf, passphrase.data(), key_length, key.data());
+                if (verify_candidate(encrypted_data, key.data(), kdf.key_length, plaintext, oracle)) {
+                    result.found = true;
+                    result.key = passphrase;
+                    result.plaintext = plaintext;
+                    break;
+                }
+            }
+            if (result.found) {
+                break;
+            }
+
+            if (progress) {
+                std::chrono::duration<double> elapsed = std::chrono::high_resolution_clock::now() - length_start;
+                cl_ulong done = base_index + count - begin;
+                if (!progress({ key_length, done, end - begin, elapsed.count() > 0 ? done / elapsed.count() : 0.0, base_index, base_index + count })) {
+                    result.cancelled = true;
+                    break;
+                }
+            }
+        }
+    }
+
+    std::chrono::duration<double> elapsed = std::chrono::high_resolution_clock::now() - start_time;
+    result.seconds = elapsed.count();
+    result.throughput.push_back({ "KDF stage (" + kdf.algorithm + ", OpenCL)", result.keys_tested, kdf_seconds });
+    result.throughput.push_back({ "RC4 stage (OpenCL)", result.keys_tested, rc4_seconds });
+    release_kdf_pipeline(pipeline);
+    return result;
+}
+
+SearchResult brute_force_kdf(const std::vector<unsigned char>& encrypted_data, const Keyspace& keyspace, int max_key_length, const KdfSpec& kdf,
+    const std::string& backend, cl_device_type device_type, const ProgressCallback& progress = nullptr, const KeyspaceShard& shard = KeyspaceShard(),
+    const Oracle& oracle = Oracle()) {
+    std::cout << "KDF: " << kdf.algorithm << "(passphrase || " << kdf.salt.size() << "-byte salt), first " << kdf.key_length << " bytes as the RC4 key" << std::endl;
+    SearchResult result;
+    if (backend == "cpu") {
+        result = search_kdf_cpu(encrypted_data, keyspace, max_key_length, kdf, progress, shard, oracle);
+    }
+    else {
+        OpenCLContext cl = create_opencl_context(device_type);
+        result = search_kdf_opencl(cl, encrypted_data, keyspace, max_key_length, kdf, progress, shard, oracle);
+        release_opencl_context(cl);
+    }
+    print_search_result(result);
+    if (result.found) {
+        std::vector<unsigned char> key(kdf.key_length);
+        derive_kdf_key(kdf, result.key.data(), (int)result.key.size(), key.data());
+        std::cout << "Derived RC4 key: " << to_hex(key.data(), key.size()) << std::endl;
+    }
+    return result;
+}
+
+std::vector<unsigned char> read_file(const std::string& path) {
+    std::ifstream input_file(path, std::ios::binary);
+    if (!input_file) {
+        std::cerr << "Failed to open input file: " << path << std::endl;
+        throw std::runtime_error("File open error");
+    }
+    return std::vector<unsigned char>((std::istreambuf_iterator<char>(input_file)), std::istreambuf_iterator<char>());
+}
+
+void write_file(const std::string& path, const std::vector<unsigned char>& data) {
+    std::ofstream output_file(path, std::ios::binary);
+    if (!output_file) {
+        std::cerr << "Failed to open output file: " << path << std::endl;
+        throw std::runtime_error("File open error");
+    }
+    output_file.write(reinterpret_cast<const char*>(data.data()), data.size());
+}
+
+// PDF Standard Security Handler, revisions 2-4 with RC4 (ISO 32000-1, 7.6.3). The file key
+// is the first key_length bytes of MD5(padded password || O || P || first ID string, plus
+// ff ff ff ff when R4 leaves metadata in clear), rehashed 50 times from revision 3 on. The user
+// password is right when the key reproduces /U: u_seed XOR the RC4 keystreams of key ^ 0 ..
+// key ^ (rounds - 1), with u_seed the padding string and one round over 32 bytes for R2,
+// MD5(padding || ID) and 20 rounds over the first 16 bytes for R3 and R4.
+struct PdfSecurity {
+    int revision = 0;
+    int key_length = 5;
+    std::vector<unsigned char> owner;
+    std::vector<unsigned char> user;
+    std::vector<unsigned char> id;
+    int32_t permissions = 0;
+    bool encrypt_metadata = true;
+    // The MD5 input after the padded password, padded into blocks: words 0..7 of the first block
+    // are left for the password, as pdf_check_keys takes it
+    std::vector<uint32_t> message;
+    std::vector<unsigned char> u_seed;
+};
+
+const unsigned char pdf_padding[32] = {
+    0x28, 0xbf, 0x4e, 0x5e, 0x4e, 0x75, 0x8a, 0x41, 0x64, 0x00, 0x4e, 0x56, 0xff, 0xfa, 0x01, 0x08,
+    0x2e, 0x2e, 0x00, 0xb6, 0xd0, 0x68, 0x3e, 0x80, 0x2f, 0x0c, 0xa9, 0xfe, 0x64, 0x53, 0x69, 0x7a,
+};
+
+// Passwords longer than the padding string are cut to it
+const int pdf_max_password = 32;
+
+int pdf_check_rounds(const PdfSecurity& pdf) {
+    return pdf.revision >= 3 ? 20 : 1;
+}
+
+int pdf_check_bytes(const PdfSecurity& pdf) {
+    return pdf.revision >= 3 ? 16 : 32;
+}
+
+// Checks the fields and precomputes message and u_seed
+PdfSecurity make_pdf_security(int revision, int key_bits, const std::vector<unsigned char>& owner, const std::vector<unsigned char>& user,
+    const std::vector<unsigned char>& id, int32_t permissions, bool encrypt_metadata) {
+    if (revision < 2 || revision > 4) {
+        std::cerr << "Unsupported security handler revision " << revision << " (RC4 revisions are 2 to 4)" << std::endl;
+        throw std::runtime_error("Invalid PDF");
+    }
+    if (key_bits < 40 || key_bits > 128 || key_bits % 8 != 0 || (revision == 2 && key_bits != 40)) {
+        std::cerr << "Invalid key length for revision " << revision << ": " << key_bits << " bits" << std::endl;
+        throw std::runtime_error("Invalid PDF");
+    }
+    if (owner.size() < 32 || user.size() < 32) {
+        std::cerr << "/O and /U must be 32 bytes" << std::endl;
+        throw std::runtime_error("Invalid PDF");
+    }
+
+    PdfSecurity pdf;
+    pdf.revision = revision;
+    pdf.key_length = key_bits / 8;
+    pdf.owner.assign(owner.begin(), owner.begin() + 32);
+    pdf.user.assign(user.begin(), user.begin() + 32);
+    pdf.id = id;
+    pdf.permissions = permissions;
+    pdf.encrypt_metadata = encrypt_metadata || revision < 4;
+
+    std::vector<unsigned char> bytes(32, 0);
+    bytes.insert(bytes.end(), pdf.owner.begin(), pdf.owner.end());
+    for (int b = 0; b < 4; b++) {
+        bytes.push_back((unsigned char)((uint32_t)permissions >> (8 * b)));
+    }
+    bytes.insert(bytes.end(), id.begin(), id.end());
+    if (!pdf.encrypt_metadata) {
+        bytes.insert(bytes.end(), 4, 0xff);
+    }
+    uint64_t bits = (uint64_t)bytes.size() * 8;
+    bytes.push_back(0x80);
+    while (bytes.size() % 64 != 56) {
+        bytes.push_back(0);
+    }
+    for (int b = 0; b < 8; b++) {
+        bytes.push_back((unsigned char)(bits >> (8 * b)));
+    }
+    pdf.message.assign(bytes.size() / 4, 0);
+    for (size_t n = 0; n < bytes.size(); n++) {
+        pdf.message[n >> 2] |= (uint32_t)bytes[n] << (8 * (n & 3));
+    }
+
+    if (revision >= 3) {
+        std::vector<unsigned char> seed(pdf_padding, pdf_padding + 32);
+        seed.insert(seed.end(), id.begin(), id.end());
+        pdf.u_seed.resize(16);
+        md5_digest(seed.data(), seed.size(), pdf.u_seed.data());
+    }
+    else {
+        pdf.u_seed.assign(pdf_padding, pdf_padding + 32);
+    }
+    return pdf;
+}
+
+// First block of the key derivation: the password padded to 32 bytes, then the message
+void pdf_first_block(const PdfSecurity& pdf, const unsigned char* password, int length, uint32_t* w) {
+    for (int n = 0; n < 32; n++) {
+        unsigned char byte = n < length ? password[n] : pdf_padding[n - length];
+        w[n >> 2] = n & 3 ? w[n >> 2] | (uint32_t)byte << (8 * (n & 3)) : byte;
+    }
+    std::copy(pdf.message.begin() + 8, pdf.message.begin() + 16, w + 8);
+}
+
+// Block hashing the first key_length bytes of the previous digest, for the R3+ rehashes
+void pdf_rehash_block(const PdfSecurity& pdf, const uint32_t* state, uint32_t* w) {
+    std::fill(w, w + 16, 0);
+    for (int b = 0; b < pdf.key_length; b++) {
+        w[b >> 2] |= state[b >> 2] & (0xffu << (8 * (b & 3)));
+    }
+    w[pdf.key_length >> 2] |= 0x80u << (8 * (pdf.key_length & 3));
+    w[14] = pdf.key_length * 8;
+}
+
+void pdf_file_key(const PdfSecurity& pdf, const unsigned char* password, int length, unsigned char* key) {
+    uint32_t w[16], state[5];
+    std::copy(hash_initial_state, hash_initial_state + 5, state);
+    pdf_first_block(pdf, password, length, w);
+    md5_compress(state, w);
+    for (size_t block = 16; block < pdf.message.size(); block += 16) {
+        md5_compress(state, &pdf.message[block]);
+    }
+    for (int round = pdf.revision >= 3 ? 0 : 50; round < 50; round++) {
+        pdf_rehash_block(pdf, state, w);
+        std::copy(hash_initial_state, hash_initial_state + 5, state);
+        md5_compress(state, w);
+    }
+    for (int b = 0; b < pdf.key_length; b++) {
+        key[b] = (unsigned char)(state[b >> 2] >> (8 * (b & 3)));
+    }
+}
+
+// The file keys of password indices [base, base + count) into keys[n * pdf.key_length], eight
+// passwords per AVX2 compression where the CPU has it
+void pdf_file_keys_cpu(const PdfSecurity& pdf, const Keyspace& keyspace, int password_length, unsigned long long base, size_t count, unsigned char* keys) {
+    unsigned char password[pdf_max_password];
+    size_t n = 0;
+#if defined(__x86_64__) || defined(__i386__)
+    if (simd_level() >= 2) {
+        uint32_t blocks[8][16], states[8][5];
+        for (; n + 8 <= count; n += 8) {
+            for (int lane = 0; lane < 8; lane++) {
+                key_from_index(base + n + lane, keyspace, password_length, password);
+                pdf_first_block(pdf, password, password_length, blocks[lane]);
+                std::copy(hash_initial_state, hash_initial_state + 5, states[lane]);
+            }
+            kdf_compress_avx2(false, blocks, states);
+            for (size_t block = 16; block < pdf.message.size(); block += 16) {
+                for (int lane = 0; lane < 8; lane++) {
+                    std::copy(&pdf.message[block], &pdf.message[block] + 16, blocks[lane]);
+                }
+                kdf_compress_avx2(false, blocks, states);
+            }
+            for (int round = pdf.revision >= 3 ? 0 : 50; round < 50; round++) {
+                for (int lane = 0; lane < 8; lane++) {
+                    pdf_rehash_block(pdf, states[lane], blocks[lane]);
+                    std::copy(hash_initial_state, hash_initial_state + 5, states[lane]);
+                }
+                kdf_compress_avx2(false, blocks, states);
+            }
+            for (int lane = 0; lane < 8; lane++) {
+                for (int b = 0; b < pdf.key_length; b++) {
+                    keys[(n + lane) * pdf.key_length + b] = (unsigned char)(states[lane][b >> 2] >> (8 * (b & 3)));
+                }
+            }
+        }
+    }
+#endif
+    for (; n < count; n++) {
+        key_from_index(base + n, keyspace, password_length, password);
+        pdf_file_key(pdf, password, password_length, keys + n * pdf.key_length);
+    }
+}
+
+// The bytes a file key turns u_seed into, to be compared with the start of /U
+std::vector<unsigned char> pdf_user_value(const PdfSecurity& pdf, const unsigned char* key) {
+    std::vector<unsigned char> value = pdf.u_seed, keystream(value.size());
+    unsigned char round_key[16];
+    for (int round = 0; round < pdf_check_rounds(pdf); round++) {
+        for (int b = 0; b < pdf.key_length; b++) {
+            round_key[b] = key[b] ^ round;
+        }
+        rc4_keystream(round_key, pdf.key_length, keystream.data(), keystream.size());
+        for (size_t n = 0; n < value.size(); n++) {
+            value[n] ^= keystream[n];
+        }
+    }
+    return value;
+}
+
+bool pdf_key_matches(const PdfSecurity& pdf, const unsigned char* key) {
+    std::vector<unsigned char> value = pdf_user_value(pdf, key);
+    return std::equal(value.begin(), value.end(), pdf.user.begin());
+}
+
+bool pdf_is_space(unsigned char c) {
+    return c == 0 || c == '\t' || c == '\n' || c == '\f' || c == '\r' || c == ' ';
+}
+
+bool pdf_is_delimiter(unsigned char c) {
+    return c == '(' || c == ')' || c == '<' || c == '>' || c == '[' || c == ']' || c == '{' || c == '}' || c == '/' || c == '%';
+}
+
+void pdf_skip_space(const std::string& text, size_t& pos) {
+    while (pos < text.size()) {
+        if (text[pos] == '%') {
+            while (pos < text.size() && text[pos] != '\n' && text[pos] != '\r') {
+                pos++;
+            }
+        }
+        else if (pdf_is_space(text[pos])) {
+            pos++;
+        }
+        else {
+            break;
+        }
+    }
+}
+
+// A bare token (number, keyword, or name without its slash) starting at pos
+std::string pdf_read_token(const std::string& text, size_t& pos) {
+    size_t start = pos;
+    while (pos < text.size() && !pdf_is_space(text[pos]) && !pdf_is_delimiter(text[pos])) {
+        pos++;
+    }
+    return text.substr(start, pos - start);
+}
+
+void pdf_syntax_error(const std::string& what, size_t pos) {
+    std::cerr << "PDF syntax error at offset " << pos << ": " << what << std::endl;
+    throw std::runtime_error("Invalid PDF");
+}
+
+// A literal "(...)" or hex "<...>" string starting at pos
+std::vector<unsigned char> pdf_read_string(const std::string& text, size_t& pos) {
+    std::vector<unsigned char> bytes;
+    if (pos < text.size() && text[pos] == '<') {
+        std::string digits;
+        for (pos++; pos < text.size() && text[pos] != '>'; pos++) {
+            if (isxdigit((unsigned char)text[pos])) {
+                digits += text[pos];
+            }
+        }
+        pos++;
+        if (digits.size() % 2) {
+            digits += '0';
+        }
+        return parse_hex(digits);
+    }
+    if (pos >= text.size() || text[pos] != '(') {
+        pdf_syntax_error("expected a string", pos);
+    }
+    int depth = 1;
+    for (pos++; pos < text.size(); pos++) {
+        unsigned char c = text[pos];
+        if (c == '\\' && pos + 1 < text.size()) {
+            c = text[++pos];
+            if (c >= '0' && c <= '7') {
+                int value = 0;
+                for (int digits = 0; digits < 3 && pos < text.size() && text[pos] >= '0' && text[pos] <= '7'; digits++, pos++) {
+                    value = value * 8 + (text[pos] - '0');
+                }
+                pos--;
+                bytes.push_back((unsigned char)value);
+                continue;
+            }
+            if (c == '\r' || c == '\n') {
+                // Line continuation
+                if (c == '\r' && pos + 1 < text.size() && text[pos + 1] == '\n') {
+                    pos++;
+                }
+                continue;
+            }
+            c = c == 'n' ? '\n' : c == 'r' ? '\r' : c == 't' ? '\t' : c == 'b' ? '\b' : c == 'f' ? '\f' : c;
+        }
+        else if (c == '\r') {
+            // An unescaped end of line reads as a line feed
+            if (pos + 1 < text.size() && text[pos + 1] == '\n') {
+                pos++;
+            }
+            c = '\n';
+        }
+        else if (c == '(') {
+            depth++;
+        }
+        else if (c == ')' && --depth == 0) {
+            pos++;
+            return bytes;
+        }
+        bytes.push_back(c);
+    }
+    pdf_syntax_error("unterminated string", pos);
+    return bytes;
+}
+
+std::map<std::string, std::string> pdf_read_dictionary(const std::string& text, size_t& pos);
+
+// Moves pos past one object: a dictionary, array, string, name, keyword or number, where
+// "N G R" counts as one indirect reference
+void pdf_skip_value(const std::string& text, size_t& pos) {
+    pdf_skip_space(text, pos);
+    if (text.compare(pos, 2, "<<") == 0) {
+        pdf_read_dictionary(text, pos);
+    }
+    else if (pos < text.size() && (text[pos] == '<' || text[pos] == '(')) {
+        pdf_read_string(text, pos);
+    }
+    else if (pos < text.size() && text[pos] == '[') {
+        for (pos++, pdf_skip_space(text, pos); pos < text.size() && text[pos] != ']'; pdf_skip_space(text, pos)) {
+            pdf_skip_value(text, pos);
+        }
+        pos++;
+    }
+    else if (pos < text.size() && text[pos] == '/') {
+        pos++;
+        pdf_read_token(text, pos);
+    }
+    else {
+        std::string token = pdf_read_token(text, pos);
+        if (token.empty()) {
+            pdf_syntax_error("unexpected character", pos);
+        }
+        size_t after = pos;
+        pdf_skip_space(text, after);
+        std::string generation = pdf_read_token(text, after);
+        pdf_skip_space(text, after);
+        if (!generation.empty() && isdigit((unsigned char)token[0]) && isdigit((unsigned char)generation[0]) && pdf_read_token(text, after) == "R") {
+            pos = after;
+        }
+    }
+}
+
+// The entries of the dictionary at pos, names without their slash, each value as raw text
+std::map<std::string, std::string> pdf_read_dictionary(const std::string& text, size_t& pos) {
+    std::map<std::string, std::string> entries;
+    pdf_skip_space(text, pos);
+    if (text.compare(pos, 2, "<<") != 0) {
+        pdf_syntax_error("expected a dictionary", pos);
+    }
+    pos += 2;
+    while (true) {
+        pdf_skip_space(text, pos);
+        if (pos >= text.size()) {
+            pdf_syntax_error("unterminated dictionary", pos);
+        }
+        if (text.compare(pos, 2, ">>") == 0) {
+            pos += 2;
+            return entries;
+        }
+        if (text[pos] != '/') {
+            pdf_syntax_error("expected a name", pos);
+        }
+        pos++;
+        std::string name = pdf_read_token(text, pos);
+        pdf_skip_space(text, pos);
+        size_t start = pos;
+        pdf_skip_value(text, pos);
+        entries[name] = text.substr(start, pos - start);
+    }
+}
+
+// Offset just past the last "/key" that is the whole name, npos when there is none
+size_t pdf_find_key(const std::string& text, const std::string& key) {
+    for (size_t pos = text.rfind(key); pos != std::string::npos; pos = pos == 0 ? std::string::npos : text.rfind(key, pos - 1)) {
+        size_t end = pos + key.size();
+        if (end == text.size() || pdf_is_space(text[end]) || pdf_is_delimiter(text[end])) {
+            return end;
+        }
+    }
+    return std::string::npos;
+}
+
+// Offset of the object a value refers to: past "N G obj" for a reference, the value itself otherwise
+size_t pdf_object_offset(const std::string& text, const std::string& value, size_t value_offset) {
+    size_t pos = 0;
+    std::string number = pdf_read_token(value, pos);
+    pdf_skip_space(value, pos);
+    std::string generation = pdf_read_token(value, pos);
+    if (generation.empty()) {
+        return value_offset;
+    }
+    std::string header = number + " " + generation + " obj";
+    for (size_t at = text.rfind(header); at != std::string::npos; at = at == 0 ? std::string::npos : text.rfind(header, at - 1)) {
+        if (at == 0 || pdf_is_space(text[at - 1])) {
+            return at + header.size();
+        }
+    }
+    std::cerr << "Object " << number << " " << generation << " not found" << std::endl;
+    throw std::runtime_error("Invalid PDF");
+}
+
+long long pdf_integer(const std::map<std::string, std::string>& dictionary, const std::string& name, long long fallback) {
+    auto it = dictionary.find(name);
+    return it == dictionary.end() ? fallback : std::stoll(it->second);
+}
+
+// Reads the security handler of the last /Encrypt entry and the first string of the last /ID.
+// Encryption dictionaries inside compressed object streams are not supported.
+PdfSecurity read_pdf_security(const std::string& path) {
+    std::vector<unsigned char> bytes = read_file(path);
+    std::string text(bytes.begin(), bytes.end());
+
+    size_t pos = pdf_find_key(text, "/Encrypt");
+    if (pos == std::string::npos) {
+        std::cerr << "No /Encrypt entry in " << path << ": the document is not encrypted" << std::endl;
+        throw std::runtime_error("Invalid PDF");
+    }
+    pdf_skip_space(text, pos);
+    size_t value_offset = pos;
+    pdf_skip_value(text, pos);
+    pos = pdf_object_offset(text, text.substr(value_offset, pos - value_offset), value_offset);
+    std::map<std::string, std::string> encrypt = pdf_read_dictionary(text, pos);
+
+    std::vector<unsigned char> id;
+    pos = pdf_find_key(text, "/ID");
+    if (pos != std::string::npos) {
+        pdf_skip_space(text, pos);
+        if (pos < text.size() && text[pos] == '[') {
+            pos++;
+            pdf_skip_space(text, pos);
+            id = pdf_read_string(text, pos);
+        }
+    }
+
+    if (encrypt["Filter"] != "/Standard") {
+        std::cerr << "Unsupported security handler " << encrypt["Filter"] << " (only /Standard is)" << std::endl;
+        throw std::runtime_error("Invalid PDF");
+    }
+    long long version = pdf_integer(encrypt, "V", 0);
+    long long key_bits = pdf_integer(encrypt, "Length", version == 4 ? 128 : 40);
+    if (version == 4) {
+        // Crypt filters: the standard one must be RC4 ("/V2"), not AES
+        std::string filters = encrypt["CF"];
+        size_t at = 0;
+        std::map<std::string, std::string> crypt_filters = filters.empty() ? std::map<std::string, std::string>() : pdf_read_dictionary(filters, at);
+        std::string standard = crypt_filters["StdCF"];
+        at = 0;
+        std::map<std::string, std::string> filter = standard.empty() ? std::map<std::string, std::string>() : pdf_read_dictionary(standard, at);
+        if (filter["CFM"] != "/V2") {
+            std::cerr << "Crypt filter method " << (filter["CFM"].empty() ? "missing" : filter["CFM"]) << " is not RC4 (/V2)" << std::endl;
+            throw std::runtime_error("Invalid PDF");
+        }
+        // The crypt filter's length is in bytes, though some writers put bits there
+        long long filter_length = pdf_integer(filter, "Length", 0);
+        if (filter_length > 0) {
+            key_bits = filter_length <= 16 ? filter_length * 8 : filter_length;
+        }
+    }
+    else if (version != 1 && version != 2) {
+        std::cerr << "Unsupported encryption algorithm /V " << version << std::endl;
+        throw std::runtime_error("Invalid PDF");
+    }
+    size_t at = 0;
+    std::vector<unsigned char> owner = pdf_read_string(encrypt["O"], at);
+    at = 0;
+    std::vector<unsigned char> user = pdf_read_string(encrypt["U"], at);
+    return make_pdf_security((int)pdf_integer(encrypt, "R", 0), (int)key_bits, owner, user, id,
+        (int32_t)(uint32_t)pdf_integer(encrypt, "P", 0), encrypt["EncryptMetadata"] != "false");
+}
+
+// The hit-list search of pdf_check_keys, on the CPU: password indices (or file keys with
+// key_search) [begin, end) of one length, in blocks on the shared worker pool
+bool pdf_range_cpu(const PdfSecurity& pdf, const Keyspace& keyspace, int key_length, bool key_search, unsigned long long begin, unsigned long long end,
+    SearchResult& result) {
+    std::atomic<bool> stop(false);
+    std::atomic<unsigned long long> tested(0);
+    std::mutex result_mutex;
+    parallel_for(end - begin, kdf_block, [&](size_t, uint64_t first, uint64_t last) {
+        if (stop) {
+            return;
+        }
+        unsigned long long block = begin + first;
+        size_t count = (size_t)(last - first);
+        std::vector<unsigned char> keys(count * pdf.key_length);
+        for (size_t n = 0; n < count && key_search; n++) {
+            key_from_index(block + n, keyspace, key_length, &keys[n * pdf.key_length]);
+        }
+        if (!key_search) {
+            pdf_file_keys_cpu(pdf, keyspace, key_length, block, count, keys.data());
+        }
+        for (size_t n = 0; n < count && !stop; n++) {
+            if (pdf_key_matches(pdf, &keys[n * pdf.key_length])) {
+                std::lock_guard<std::mutex> lock(result_mutex);
+                if (!result.found) {
+                    result.key.resize(key_length);
+                    key_from_index(block + n, keyspace, key_length, result.key.data());
+                    result.found = true;
+                    stop = true;
+                }
+            }
+        }
+        tested += count;
+    });
+    result.keys_tested += tested;
+    return result.found;
+}
+
+// Device buffers and kernel of the PDF check
+struct OpenCLPdfSearch {
+    cl_kernel kernel;
+    cl_mem charset;
+    cl_mem message;
+    cl_mem u_seed;
+    cl_mem u_target;
+    cl_mem hits;
+    cl_mem hit_count;
+};
+
+OpenCLPdfSearch create_pdf_search(OpenCLContext& cl, const PdfSecurity& pdf, const Keyspace& keyspace) {
+    cl_int err;
+    OpenCLPdfSearch search;
+    search.kernel = clCreateKernel(cl.program, "pdf_check_keys", &err);
+    if (err != CL_SUCCESS) {
+        std::cerr << "Failed to create OpenCL kernel. Error code: " << err << std::endl;
+        throw std::runtime_error("OpenCL kernel creation error");
+    }
+    search.charset = clCreateBuffer(cl.context, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR, keyspace.table().size(), (void*)keyspace.table().data(), &err);
+    search.message = clCreateBuffer(cl.context, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR, pdf.message.size() * sizeof(cl_uint), (void*)pdf.message.data(), &err);
+    search.u_seed = clCreateBuffer(cl.context, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR, pdf.u_seed.size(), (void*)pdf.u_seed.data(), &err);
+    search.u_target = clCreateBuffer(cl.context, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR, pdf.user.size(), (void*)pdf.user.data(), &err);
+    search.hits = clCreateBuffer(cl.context, CL_MEM_WRITE_ONLY, opencl_max_hits * sizeof(cl_ulong), nullptr, &err);
+    search.hit_count = clCreateBuffer(cl.context, CL_MEM_READ_WRITE, sizeof(cl_uint), nullptr, &err);
+    if (err != CL_SUCCESS) {
+        std::cerr << "Failed to create OpenCL buffers. Error code: " << err << std::endl;
+        throw std::runtime_error("OpenCL buffer creation error");
+    }
+    return search;
+}
+
+void release_pdf_search(OpenCLPdfSearch& search) {
+    for (cl_mem buffer : { search.charset, search.message, search.u_seed, search.u_target, search.hits, search.hit_count }) {
+        clReleaseMemObject(buffer);
+    }
+    clReleaseKernel(search.kernel);
+}
+
+// One batch of pdf_check_keys; returns the indices that reproduced /U in index order, or every
+// index of the batch when more than opencl_max_hits did and the device list is incomplete
+std::vector<cl_ulong> pdf_batch_opencl(OpenCLContext& cl, OpenCLPdfSearch& search, const PdfSecurity& pdf, const Keyspace& keyspace, int key_length,
+    bool key_search, cl_ulong base_index, cl_ulong count) {
+    cl_int err = CL_SUCCESS;
+    cl_uint hit_count = 0, max_hits = opencl_max_hits;
+    int charset_size = kernel_charset_size(keyspace), derive = key_search ? 0 : 1, message_blocks = (int)(pdf.message.size() / 16);
+    err |= clEnqueueWriteBuffer(cl.queue, search.hit_count, CL_TRUE, 0, sizeof(cl_uint), &hit_count, 0, nullptr, nullptr);
+    err |= clSetKernelArg(search.kernel, 0, sizeof(cl_mem), &search.charset);
+    err |= clSetKernelArg(search.kernel, 1, sizeof(int), &charset_size);
+    err |= clSetKernelArg(search.kernel, 2, sizeof(int), &key_length);
+    err |= clSetKernelArg(search.kernel, 3, sizeof(cl_ulong), &base_index);
+    err |= clSetKernelArg(search.kernel, 4, sizeof(cl_ulong), &count);
+    err |= clSetKernelArg(search.kernel, 5, sizeof(int), &derive);
+    err |= clSetKernelArg(search.kernel, 6, sizeof(cl_mem), &search.message);
+    err |= clSetKernelArg(search.kernel, 7, sizeof(int), &message_blocks);
+    err |= clSetKernelArg(search.kernel, 8, sizeof(int), &pdf.revision);
+    err |= clSetKernelArg(search.kernel, 9, sizeof(int), &pdf.key_length);
+    err |= clSetKernelArg(search.kernel, 10, sizeof(cl_mem), &search.u_seed);
+    err |= clSetKernelArg(search.kernel, 11, sizeof(cl_mem), &search.u_target);
+    err |= clSetKernelArg(search.kernel, 12, sizeof(cl_mem), &search.hits);
+    err |= clSetKernelArg(search.kernel, 13, sizeof(cl_mem), &search.hit_count);
+    err |= clSetKernelArg(search.kernel, 14, sizeof(cl_uint), &max_hits);
+    size_t global_work_size = count;
+    err |= clEnqueueNDRangeKernel(cl.queue, search.kernel, 1, nullptr, &global_work_size, nullptr, 0, nullptr, nullptr);
+    err |= clEnqueueReadBuffer(cl.queue, search.hit_count, CL_TRUE, 0, sizeof(cl_uint), &hit_count, 0, nullptr, nullptr);
+    std::vector<cl_ulong> hits(std::min(hit_count, max_hits));
+    if (!hits.empty()) {
+        err |= clEnqueueReadBuffer(cl.queue, search.hits, CL_TRUE, 0, hits.size() * sizeof(cl_ulong), hits.data(), 0, nullptr, nullptr);
+    }
+    if (err != CL_SUCCESS) {
+        std::cerr << "Failed to run pdf_check_keys. Error code: " << err << std::endl;
+        throw std::runtime_error("OpenCL search error");
+    }
+    // Passwords that run into the padding string pad alike, so matches can pile up past
+    // max_hits; hand the whole batch to the host then, as search_batch_opencl does
+    if (hit_count > max_hits) {
+        hits.resize(count);
+        for (cl_ulong k = 0; k < count; k++) {
+            hits[k] = base_index + k;
+        }
+    }
+    std::sort(hits.begin(), hits.end());
+    return hits;
+}
+
+// User-password search over the keyspace, or with key_search a search of the file keys
+// themselves (key length pdf.key_length only). result.key is the password or key found.
+SearchResult search_pdf(const PdfSecurity& pdf, const Keyspace& keyspace, int max_key_length, bool key_search, const std::string& backend,
+    cl_device_type device_type, const ProgressCallback& progress = nullptr, const KeyspaceShard& shard = KeyspaceShard()) {
+    if (max_key_length > pdf_max_password) {
+        std::cerr << "PDF passwords are cut to " << pdf_max_password << " bytes; use --max-key-length " << pdf_max_password << " or less" << std::endl;
+        throw std::runtime_error("Invalid arguments");
+    }
+    if (key_search && keyspace_size(keyspace, pdf.key_length) == 0) {
+        std::cerr << "--key-constraints must describe " << pdf.key_length << "-byte keys for --pdf-key-search" << std::endl;
+        throw std::runtime_error("Invalid arguments");
+    }
+    const bool gpu = backend != "cpu";
+    OpenCLContext cl = {};
+    OpenCLPdfSearch search = {};
+    if (gpu) {
+        cl = create_opencl_context(device_type);
+        search = create_pdf_search(cl, pdf, keyspace);
+    }
+    SearchResult result;
+    auto start_time = std::chrono::high_resolution_clock::now();
+
+    const size_t threads = gpu ? 0 : cpu_worker_pool().threads.size();
+    const unsigned long long batch = gpu ? opencl_batch_size : cpu_chunk_per_thread * threads;
+    for (int key_length = 1; key_length <= max_key_length && !result.found && !result.cancelled; ++key_length) {
+        if (key_search && key_length != pdf.key_length) {
+            continue;
+        }
+        unsigned long long total = keyspace_size(keyspace, key_length);
+        unsigned long long begin = shard_boundary(total, shard.begin);
+        unsigned long long end = shard_boundary(total, shard.end);
+        auto length_start = std::chrono::high_resolution_clock::now();
+
+        for (unsigned long long base_index = begin; base_index < end; base_index += batch) {
+            unsigned long long count = std::min(batch, end - base_index);
+            if (gpu) {
+                std::vector<cl_ulong> hits = pdf_batch_opencl(cl, search, pdf, keyspace, key_length, key_search, base_index, count);
+                result.keys_tested += count;
+                // The device compared all of /U's checked bytes; the host only confirms
+                std::vector<unsigned char> candidate(key_length), key(pdf.key_length);
+                for (cl_ulong index : hits) {
+                    key_from_index(index, keyspace, key_length, candidate.data());
+                    if (key_search) {
+                        key = candidate;
+                    }
+                    else {
+                        pdf_file_key(pdf, candidate.data(), key_length, key.data());
+                    }
+                    if (pdf_key_matches(pdf, key.data())) {
+                        result.found = true;
+                        result.key = candidate;
+                        break;
+                    }
+                }
+            }
+            else {
+                pdf_range_cpu(pdf, keyspace, key_length, key_search, base_index, base_index + count, result);
+            }
+            if (result.found) {
+                break;
+            }
+
+            if (progress) {
+                std::chrono::duration<double> elapsed = std::chrono::high_resolution_clock::now() - length_start;
+                unsigned long long done = base_index + count - begin;
+                if (!progress({ key_length, done, end - begin, elapsed.count() > 0 ? done / elapsed.count() : 0.0, base_index, base_index + count })) {
+                    result.cancelled = true;
+                    break;
+                }
+            }
+        }
+    }
+
+    std::chrono::duration<double> elapsed = std::chrono::high_resolution_clock::now() - start_time;
+    result.seconds = elapsed.count();
+    std::string label = "CPU (" + std::to_string(threads) + " threads"
+        + (key_search ? std::string(")") : std::string(", ") + (simd_level() >= 2 ? "AVX2" : "scalar") + " MD5)");
+    result.throughput.push_back({ gpu ? "OpenCL device" : label, result.keys_tested, result.seconds });
+    if (gpu) {
+        release_pdf_search(search);
+        release_opencl_context(cl);
+    }
+    return result;
+}
+
+void print_pdf_security(const PdfSecurity& pdf) {
+    std::cout << "PDF security handler: revision " << pdf.revision << ", " << pdf.key_length * 8 << "-bit RC4, P " << pdf.permissions
+        << ", ID " << to_hex(pdf.id.data(), pdf.id.size()) << (pdf.encrypt_metadata ? "" : ", metadata in clear") << std::endl;
+}
+
+// Tries the empty user password, which documents protected only by an owner password have,
+// then searches. Prints the password (or file key) when found.
+SearchResult brute_force_pdf(const PdfSecurity& pdf, const Keyspace& keyspace, int max_key_length, bool key_search, const std::string& backend,
+    cl_device_type device_type, const ProgressCallback& progress = nullptr, const KeyspaceShard& shard = KeyspaceShard()) {
+    std::vector<unsigned char> key(pdf.key_length);
+    if (!key_search) {
+        pdf_file_key(pdf, nullptr, 0, key.data());
+        if (pdf_key_matches(pdf, key.data())) {
+            std::cout << "User password is empty" << std::endl;
+            std::cout << "File key: " << to_hex(key.data(), key.size()) << std::endl;
+            SearchResult result;
+            result.found = true;
+            return result;
+        }
+    }
+    SearchResult result = search_pdf(pdf, keyspace, max_key_length, key_search, backend, device_type, progress, shard);
+    print_search_result(result);
+    if (result.found) {
+        if (key_search) {
+            key = result.key;
+        }
+        else {
+            pdf_file_key(pdf, result.key.data(), (int)result.key.size(), key.data());
+            std::cout << "User password (hex): " << to_hex(result.key.data(), result.key.size()) << std::endl;
+        }
+        std::cout << "File key: " << to_hex(key.data(), key.size()) << std::endl;
+    }
+    return result;
+}
+
+// Time-memory tradeoff tables over raw keys of key_bits bits (a multiple of 8, at most 40),
+// for ciphertexts whose first key_bits / 8 plaintext bytes are a known crib. The one-way step
+// maps a key to that many keystream bytes, so one table serves every crib. Column c of table
+// number `table` reduces a keystream value back to a key by XOR with tmto_mix(salt + c), as
+// rc4_tmto_chains does; chains are stored as (start, end) pairs sorted by end.
+struct TmtoParams {
+    int key_bits = 40;
+    unsigned long long chains = 1 << 20;
+    int chain_length = 1 << 10;
+    int table = 0;
+};
+
+struct TmtoChain {
+    uint64_t start;
+    uint64_t end;
+};
+
+// On-disk table: this header followed by `chains` TmtoChain records sorted by end, so a
+// reader can map the file and binary-search the records in place
+struct TmtoHeader {
+    char magic[8];
+    uint32_t version;
+    int32_t key_bits;
+    int32_t chain_length;
+    int32_t table;
+    uint64_t chains;
+};
+
+const char tmto_magic[8] = { 'R', 'C', '4', 'T', 'M', 'T', 'O', '\0' };
+const uint32_t tmto_version = 1;
+
+uint64_t tmto_mix(uint64_t x) {
+    x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+    return x ^ (x >> 31);
+}
+
+uint64_t tmto_salt(int table) {
+    return tmto_mix(0x524334544d544f00ULL + (uint64_t)table);
+}
+
+uint64_t tmto_key_mask(int key_bits) {
+    return ((uint64_t)1 << key_bits) - 1;
+}
+
+// The one-way step: the first key_bits / 8 keystream bytes of a key, big-endian
+uint64_t tmto_keystream_value(uint64_t key, int key_bytes) {
+    unsigned char bytes[8] = { 0 }, keystream[8];
+    for (int b = 0; b < key_bytes; b++) {
+        bytes[b] = (unsigned char)(key >> (8 * (key_bytes - 1 - b)));
+    }
+    rc4_keystream(bytes, key_bytes, keystream, key_bytes);
+    uint64_t y = 0;
+    for (int b = 0; b < key_bytes; b++) {
+        y = (y << 8) | keystream[b];
+    }
+    return y;
+}
+
+// Walks columns [from_column, to_column) starting from key x
+uint64_t tmto_walk(const TmtoParams& params, uint64_t x, int from_column, int to_column) {
+    const uint64_t salt = tmto_salt(params.table), mask = tmto_key_mask(params.key_bits);
+    for (int column = from_column; column < to_column; column++) {
+        x = (tmto_keystream_value(x, params.key_bits / 8) ^ tmto_mix(salt + column)) & mask;
+    }
+    return x;
+}
+
+// Expected share of the keyspace a table covers: column c holds about m_c distinct keys, with
+// m_{c+1} = N (1 - e^(-m_c / N)) as chains merge
+double tmto_coverage(const TmtoParams& params) {
+    const double keys = std::ldexp(1.0, params.key_bits);
+    double distinct = (double)params.chains, missed = 1.0;
+    for (int column = 0; column < params.chain_length; column++) {
+        missed *= 1.0 - distinct / keys;
+        distinct = keys * -std::expm1(-distinct / keys);
+    }
+    return 1.0 - missed;
+}
+
+void check_tmto_params(const TmtoParams& params) {
+    if (params.key_bits < 8 || params.key_bits > 40 || params.key_bits % 8 != 0) {
+        std::cerr << "--tmto-bits must be 8, 16, 24, 32 or 40" << std::endl;
+        throw std::runtime_error("Invalid arguments");
+    }
+    if (params.chains < 1 || params.chains > ((unsigned long long)1 << params.key_bits) || params.chain_length < 1) {
+        std::cerr << "--tmto-chains must be between 1 and the keyspace size, --tmto-length at least 1" << std::endl;
+        throw std::runtime_error("Invalid arguments");
+    }
+}
+
+std::vector<uint64_t> tmto_chain_ends_cpu(const TmtoParams& params, uint64_t first_start, size_t count) {
+    std::vector<uint64_t> ends(count);
+    parallel_for(count, 64, [&](size_t, uint64_t begin, uint64_t end) {
+        for (uint64_t k = begin; k < end; k++) {
+            ends[k] = tmto_walk(params, first_start + k, 0, params.chain_length);
+        }
+    });
+    return ends;
+}
+
+std::vector<uint64_t> tmto_chain_ends_opencl(OpenCLContext& cl, cl_kernel kernel, const TmtoParams& params, uint64_t first_start, size_t count) {
+    cl_int err;
+    std::vector<uint64_t> ends(count);
+    cl_mem ends_buffer = clCreateBuffer(cl.context, CL_MEM_WRITE_ONLY, count * sizeof(cl_ulong), nullptr, &err);
+    cl_ulong start = first_start, chains = count, mask = tmto_key_mask(params.key_bits), salt = tmto_salt(params.table);
+    int key_bytes = params.key_bits / 8;
+    err |= clSetKernelArg(kernel, 0, sizeof(cl_ulong), &start);
+    err |= clSetKernelArg(kernel, 1, sizeof(cl_ulong), &chains);
+    err |= clSetKernelArg(kernel, 2, sizeof(int), &key_bytes);
+    err |= clSetKernelArg(kernel, 3, sizeof(cl_ulong), &mask);
+    err |= clSetKernelArg(kernel, 4, sizeof(cl_ulong), &salt);
+    err |= clSetKernelArg(kernel, 5, sizeof(int), &params.chain_length);
+    err |= clSetKernelArg(kernel, 6, sizeof(cl_mem), &ends_buffer);
+    size_t global_work_size = count;
+    err |= clEnqueueNDRangeKernel(cl.queue, kernel, 1, nullptr, &global_work_size, nullptr, 0, nullptr, nullptr);
+    err |= clEnqueueReadBuffer(cl.queue, ends_buffer, CL_TRUE, 0, count * sizeof(cl_ulong), ends.data(), 0, nullptr, nullptr);
+    clReleaseMemObject(ends_buffer);
+    if (err != CL_SUCCESS) {
+        std::cerr << "Failed to run rc4_tmto_chains. Error code: " << err << std::endl;
+        throw std::runtime_error("OpenCL TMTO error");
+    }
+    return ends;
+}
+
+// Chains started from keys 0, 1, 2, ... are walked in batches on the chosen backend, then
+// sorted by end with merged chains (equal ends) dropped, and written with a TmtoHeader
+int build_tmto_table(const std::string& path, const TmtoParams& params, const std::string& backend, cl_device_type device_type) {
+    check_tmto_params(params);
+    const size_t batch = 1 << 16;
+    OpenCLContext cl = {};
+    cl_kernel kernel = nullptr;
+    if (backend == "gpu") {
+        cl_int err;
+        cl = create_opencl_context(device_type);
+        kernel = clCreateKernel(cl.program, "rc4_tmto_chains", &err);
+        if (err != CL_SUCCESS) {
+            std::cerr << "Failed to create OpenCL kernel. Error code: " << err << std::endl;
+            throw std::runtime_error("OpenCL kernel creation error");
+        }
+    }
+
+    auto start_time = std::chrono::high_resolution_clock::now();
+    std::vector<TmtoChain> chains;
+    chains.reserve(params.chains);
+    for (uint64_t first = 0; first < params.chains; first += batch) {
+        size_t count = (size_t)std::min<uint64_t>(batch, params.chains - first);
+        std::vector<uint64_t> ends = backend == "gpu" ? tmto_chain_ends_opencl(cl, kernel, params, first, count) : tmto_chain_ends_cpu(params, first, count);
+        for (size_t k = 0; k < count; k++) {
+            chains.push_back({ first + k, ends[k] });
+        }
+    }
+    std::chrono::duration<double> elapsed = std::chrono::high_resolution_clock::now() - start_time;
+    if (backend == "gpu") {
+        clReleaseKernel(kernel);
+        release_opencl_context(cl);
+    }
+
+    std::sort(chains.begin(), chains.end(), [](const TmtoChain& a, const TmtoChain& b) { return a.end < b.end || (a.end == b.end && a.start < b.start); });
+    size_t generated = chains.size();
+    chains.erase(std::unique(chains.begin(), chains.end(), [](const TmtoChain& a, const TmtoChain& b) { return a.end == b.end; }), chains.end());
+
+    TmtoHeader header = {};
+    std::copy(tmto_magic, tmto_magic + 8, header.magic);
+    header.version = tmto_version;
+    header.key_bits = params.key_bits;
+    header.chain_length = params.chain_length;
+    header.table = params.table;
+    header.chains = chains.size();
+    std::vector<unsigned char> data(sizeof(header) + chains.size() * sizeof(TmtoChain));
+    memcpy(data.data(), &header, sizeof(header));
+    memcpy(data.data() + sizeof(header), chains.data(), chains.size() * sizeof(TmtoChain));
+    write_file(path, data);
+
+    double steps = (double)generated * params.chain_length;
+    std::cout << "TMTO table " << params.table << ": " << generated << " chains of " << params.chain_length << " over 2^" << params.key_bits
+        << " keys in " << elapsed.count() << " s (" << (elapsed.count() > 0 ? steps / elapsed.count() : 0.0) << " steps/s on " << backend << ")" << std::endl;
+    std::cout << "TMTO table " << params.table << ": " << generated - chains.size() << " merged chains dropped, " << chains.size() << " kept, "
+        << data.size() << " bytes written to " << path << std::endl;
+    std::cout << "TMTO table " << params.table << ": estimated coverage " << 100.0 * tmto_coverage(params) << "% of the keyspace" << std::endl;
+    return 0;
+}
+
+TmtoParams read_tmto_table(const std::string& path, std::vector<TmtoChain>& chains) {
+    std::vector<unsigned char> data = read_file(path);
+    TmtoHeader header;
+    if (data.size() < sizeof(header)) {
+        std::cerr << "Not a TMTO table: " << path << std::endl;
+        throw std::runtime_error("Invalid TMTO table");
+    }
+    memcpy(&header, data.data(), sizeof(header));
+    if (memcmp(header.magic, tmto_magic, 8) != 0 || header.version != tmto_version || data.size() != sizeof(header) + header.chains * sizeof(TmtoChain)) {
+        std::cerr << "Not a version " << tmto_version << " TMTO table or truncated: " << path << std::endl;
+        throw std::runtime_error("Invalid TMTO table");
+    }
+    chains.resize(header.chains);
+    memcpy(chains.data(), data.data() + sizeof(header), chains.size() * sizeof(TmtoChain));
+    TmtoParams params;
+    params.key_bits = header.key_bits;
+    params.chains = header.chains;
+    params.chain_length = header.chain_length;
+    params.table = header.table;
+    return params;
+}
+
+// Looks the target keystream up in each table: for every column c, walk from c to the chain
+// end, and on an end match rebuild the chain from its start to recover the key at column c.
+// Columns are shared between threads; candidates are checked against the whole target.
+int lookup_tmto_tables(const std::vector<std::string>& paths, const std::vector<unsigned char>& target) {
+    auto start_time = std::chrono::high_resolution_clock::now();
+    for (const std::string& path : paths) {
+        std::vector<TmtoChain> chains;
+        TmtoParams params = read_tmto_table(path, chains);
+        const int key_bytes = params.key_bits / 8;
+        if (target.size() < (size_t)key_bytes) {
+            std::cerr << "The table needs " << key_bytes << " keystream bytes, the target has " << target.size() << std::endl;
+            throw std::runtime_error("Invalid arguments");
+        }
+        uint64_t y = 0;
+        for (int b = 0; b < key_bytes; b++) {
+            y = (y << 8) | target[b];
+        }
+
+        const uint64_t salt = tmto_salt(params.table), mask = tmto_key_mask(params.key_bits);
+        std::atomic<bool> found(false);
+        std::atomic<unsigned long long> false_alarms(0);
+        std::vector<unsigned char> key(key_bytes);
+        std::mutex key_mutex;
+        // Columns are tried last first: the short walks from the end of the chain come cheapest
+        parallel_for(params.chain_length, 1, [&](size_t, uint64_t k, uint64_t) {
+            int column = params.chain_length - 1 - (int)k;
+            if (found) {
+                return;
+            }
+            std::vector<unsigned char> candidate(key_bytes), keystream(target.size());
+            uint64_t end = tmto_walk(params, (y ^ tmto_mix(salt + column)) & mask, column + 1, params.chain_length);
+            auto range = std::equal_range(chains.begin(), chains.end(), TmtoChain{ 0, end },
+                [](const TmtoChain& a, const TmtoChain& b) { return a.end < b.end; });
+            for (auto it = range.first; it != range.second; ++it) {
+                uint64_t x = tmto_walk(params, it->start, 0, column);
+                for (int b = 0; b < key_bytes; b++) {
+                    candidate[b] = (unsigned char)(x >> (8 * (key_bytes - 1 - b)));
+                }
+                rc4_keystream(candidate.data(), key_bytes, keystream.data(), keystream.size());
+                if (keystream == target) {
+                    std::lock_guard<std::mutex> lock(key_mutex);
+                    key = candidate;
+                    found = true;
+                }
+                else {
+                    false_alarms++;
+                }
+            }
+        });
+
+        std::chrono::duration<double> elapsed = std::chrono::high_resolution_clock::now() - start_time;
+        std::cout << "TMTO table " << params.table << " (" << path << "): " << chains.size() << " chains of " << params.chain_length << ", "
+            << false_alarms << " false alarms" << std::endl;
+        if (found) {
+            std::cout << "Decryption successful, key found: " << to_hex(key.data(), key.size()) << std::endl;
+            std::cout << "Time taken: " << elapsed.count() << " seconds" << std::endl;
+            return 0;
+        }
+    }
+    std::chrono::duration<double> elapsed = std::chrono::high_resolution_clock::now() - start_time;
+    std::cout << "No valid key found" << std::endl;
+    std::cout << "Time taken: " << elapsed.count() << " seconds" << std::endl;
+    return 2;
+}
+
+// Sorted keystream-prefix tables for small keyspaces. Every key of the charset up to
+// max_key_length is stored as its first prefix_table_bytes keystream bytes and its ordinal (all
+// shorter keys first, then the mixed-radix index), 11 bytes per record, sorted by prefix. A
+// sparse index of 2^prefix_index_bits record offsets, keyed on the top bits of the prefix,
+// follows the header, so a lookup reads a single bucket of the memory-mapped file.
+const int prefix_table_bytes = 6;
+const int prefix_ordinal_bytes = 5;
+const int prefix_record_bytes = prefix_table_bytes + prefix_ordinal_bytes;
+const int prefix_index_bits = 16;
+
+struct PrefixTableHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t max_key_length;
+    uint32_t charset_size;
+    uint32_t index_bits;
+    uint64_t records;
+    unsigned char charset[256];
+};
+
+const char prefix_table_magic[8] = { 'R', 'C', '4', 'P', 'F', 'X', 'T', '\0' };
+const uint32_t prefix_table_version = 1;
+
+struct PrefixEntry {
+    uint64_t prefix;
+    uint64_t ordinal;
+
+    bool operator<(const PrefixEntry& other) const {
+        return prefix < other.prefix || (prefix == other.prefix && ordinal < other.ordinal);
+    }
+    bool operator>(const PrefixEntry& other) const {
+        return other < *this;
+    }
+};
+
+void encode_prefix_record(const PrefixEntry& entry, unsigned char* record) {
+    for (int b = 0; b < prefix_table_bytes; b++) {
+        record[b] = (unsigned char)(entry.prefix >> (8 * (prefix_table_bytes - 1 - b)));
+    }
+    for (int b = 0; b < prefix_ordinal_bytes; b++) {
+        record[prefix_table_bytes + b] = (unsigned char)(entry.ordinal >> (8 * (prefix_ordinal_bytes - 1 - b)));
+    }
+}
+
+PrefixEntry decode_prefix_record(const unsigned char* record) {
+    PrefixEntry entry = { 0, 0 };
+    for (int b = 0; b < prefix_table_bytes; b++) {
+        entry.prefix = (entry.prefix << 8) | record[b];
+    }
+    for (int b = 0; b < prefix_ordinal_bytes; b++) {
+        entry.ordinal = (entry.ordinal << 8) | record[prefix_table_bytes + b];
+    }
+    return entry;
+}
+
+uint64_t prefix_bucket(uint64_t prefix) {
+    return prefix >> (8 * prefix_table_bytes - prefix_index_bits);
+}
+
+// Inverse of the ordinal numbering: the key length and the key itself
+std::vector<unsigned char> key_from_ordinal(uint64_t ordinal, const std::string& charset, int max_key_length) {
+    for (int key_length = 1; key_length <= max_key_length; key_length++) {
+        unsigned long long total = keyspace_size(charset.size(), key_length);
+        if (ordinal < total) {
+            std::vector<unsigned char> key(key_length);
+            key_from_index(ordinal, (const unsigned char*)charset.data(), charset.size(), false, key_length, key.data());
+            return key;
+        }
+        ordinal -= total;
+    }
+    return std::vector<unsigned char>();
+}
+
+// Appends the entries of key indices [base_index, base_index + count) of one key length
+void prefix_entries_cpu(const std::string& charset, int key_length, uint64_t base_index, uint64_t count, uint64_t first_ordinal, std::vector<PrefixEntry>& entries) {
+    size_t offset = entries.size();
+    entries.resize(offset + count);
+    parallel_for(count, 4096, [&](size_t, uint64_t begin, uint64_t end) {
+        unsigned char key[max_search_key_length];
+        unsigned char keystream[prefix_table_bytes];
+        for (uint64_t k = begin; k < end; k++) {
+            key_from_index(base_index + k, (const unsigned char*)charset.data(), charset.size(), false, key_length, key);
+            rc4_keystream(key, key_length, keystream, prefix_table_bytes);
+            uint64_t prefix = 0;
+            for (int b = 0; b < prefix_table_bytes; b++) {
+                prefix = (prefix << 8) | keystream[b];
+            }
+            entries[offset + k] = { prefix, first_ordinal + k };
+        }
+    });
+}
+
+void prefix_entries_opencl(OpenCLContext& cl, cl_kernel kernel, cl_mem charset_buffer, const std::string& charset, int key_length, uint64_t base_index, uint64_t count,
+    uint64_t first_ordinal, std::vector<PrefixEntry>& entries) {
+    const uint64_t batch = 1 << 22;
+    std::vector<cl_ulong> prefixes;
+    for (uint64_t done = 0; done < count; done += batch) {
+        cl_int err;
+        cl_ulong base = base_index + done, launch = std::min(batch, count - done);
+        int charset_size = (int)charset.size(), prefix_bytes = prefix_table_bytes;
+        prefixes.resize(launch);
+        cl_mem prefix_buffer = clCreateBuffer(cl.context, CL_MEM_WRITE_ONLY, launch * sizeof(cl_ulong), nullptr, &err);
+        err |= clSetKernelArg(kernel, 0, sizeof(cl_mem), &charset_buffer);
+        err |= clSetKernelArg(kernel, 1, sizeof(int), &charset_size);
+        err |= clSetKernelArg(kernel, 2, sizeof(int), &key_length);
+        err |= clSetKernelArg(kernel, 3, sizeof(cl_ulong), &base);
+        err |= clSetKernelArg(kernel, 4, sizeof(cl_ulong), &launch);
+        err |= clSetKernelArg(kernel, 5, sizeof(int), &prefix_bytes);
+        err |= clSetKernelArg(kernel, 6, sizeof(cl_mem), &prefix_buffer);
+        size_t global_work_size = (size_t)launch;
+        err |= clEnqueueNDRangeKernel(cl.queue, kernel, 1, nullptr, &global_work_size, nullptr, 0, nullptr, nullptr);
+        err |= clEnqueueReadBuffer(cl.queue, prefix_buffer, CL_TRUE, 0, launch * sizeof(cl_ulong), prefixes.data(), 0, nullptr, nullptr);
+        clReleaseMemObject(prefix_buffer);
+        if (err != CL_SUCCESS) {
+            std::cerr << "Failed to run rc4_prefix_values. Error code: " << err << std::endl;
+            throw std::runtime_error("OpenCL prefix table error");
+        }
+        for (uint64_t k = 0; k < launch; k++) {
+            entries.push_back({ prefixes[k], first_ordinal + done + k });
+        }
+    }
+}
+
+// Sequential reader of one sorted run file for the merge
+struct PrefixRun {
+    std::ifstream file;
+    PrefixEntry current;
+
+    bool next() {
+        unsigned char record[prefix_record_bytes];
+        if (!file.read((char*)record, prefix_record_bytes)) {
+            return false;
+        }
+        current = decode_prefix_record(record);
+        return true;
+    }
+};
+
+// Generates the table in runs of at most memory_bytes, sorts each run and spills it to
+// PATH.runN, then k-way merges the runs into PATH while filling in the sparse index
+int build_prefix_table(const std::string& path, const Keyspace& keyspace, int max_key_length, size_t memory_bytes, const std::string& backend, cl_device_type device_type) {
+    // The table header records a plain charset and ordinals count keys of every length
+    if (keyspace.constrained()) {
+        std::cerr << "A prefix table covers a plain charset; --key-constraints is not supported" << std::endl;
+        throw std::runtime_error("Invalid arguments");
+    }
+    const std::string& charset = keyspace.charset;
+    long double total_keys = 0;
+    for (int key_length = 1; key_length <= max_key_length; key_length++) {
+        total_keys += keyspace_size(charset.size(), key_length);
+    }
+    if (total_keys >= std::ldexp(1.0L, 8 * prefix_ordinal_bytes) || max_key_length > max_search_key_length) {
+        std::cerr << "A prefix table holds at most 2^" << 8 * prefix_ordinal_bytes << " keys of up to " << max_search_key_length << " characters" << std::endl;
+        throw std::runtime_error("Invalid arguments");
+    }
+    const uint64_t run_capacity = std::max<uint64_t>(1 << 16, memory_bytes / sizeof(PrefixEntry));
+
+    OpenCLContext cl = {};
+    cl_kernel kernel = nullptr;
+    cl_mem charset_buffer = nullptr;
+    if (backend == "gpu") {
+        cl_int err;
+        cl = create_opencl_context(device_type);
+        kernel = clCreateKernel(cl.program, "rc4_prefix_values", &err);
+        charset_buffer = clCreateBuffer(cl.context, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR, charset.size(), (void*)charset.data(), &err);
+        if (err != CL_SUCCESS) {
+            std::cerr << "Failed to create the prefix table kernel. Error code: " << err << std::endl;
+            throw std::runtime_error("OpenCL kernel creation error");
+        }
+    }
+
+    auto start_time = std::chrono::high_resolution_clock::now();
+    double generate_seconds = 0.0, sort_seconds = 0.0;
+    std::vector<std::string> run_paths;
+    std::vector<PrefixEntry> run;
+    run.reserve((size_t)std::min<long double>(run_capacity, total_keys));
+    auto spill = [&]() {
+        auto sort_start = std::chrono::high_resolution_clock::now();
+        std::sort(run.begin(), run.end());
+        std::string run_path = path + ".run" + std::to_string(run_paths.size());
+        std::ofstream file(run_path, std::ios::binary);
+        std::vector<unsigned char> records(run.size() * prefix_record_bytes);
+        for (size_t k = 0; k < run.size(); k++) {
+            encode_prefix_record(run[k], &records[k * prefix_record_bytes]);
+        }
+        if (!file.write((const char*)records.data(), records.size())) {
+            std::cerr << "Failed to write sort run: " << run_path << std::endl;
+            throw std::runtime_error("File write error");
+        }
+        run_paths.push_back(run_path);
+        run.clear();
+        std::chrono::duration<double> elapsed = std::chrono::high_resolution_clock::now() - sort_start;
+        sort_seconds += elapsed.count();
+    };
+
+    uint64_t ordinal = 0;
+    for (int key_length = 1; key_length <= max_key_length; key_length++) {
+        unsigned long long total = keyspace_size(charset.size(), key_length);
+        for (uint64_t index = 0; index < total;) {
+            uint64_t count = std::min<uint64_t>(run_capacity - run.size(), total - index);
+            auto generate_start = std::chrono::high_resolution_clock::now();
+            if (backend == "gpu") {
+                prefix_entries_opencl(cl, kernel, charset_buffer, charset, key_length, index, count, ordinal, run);
+            }
+            else {
+                prefix_entries_cpu(charset, key_length, index, count, ordinal, run);
+            }
+            std::chrono::duration<double> elapsed = std::chrono::high_resolution_clock::now() - generate_start;
+            generate_seconds += elapsed.count();
+            index += count;
+            ordinal += count;
+            if (run.size() == run_capacity) {
+                spill();
+            }
+        }
+    }
+    if (!run.empty()) {
+        spill();
+    }
+    if (backend == "gpu") {
+        clReleaseMemObject(charset_buffer);
+        clReleaseKernel(kernel);
+        release_opencl_context(cl);
+    }
+
+    // Merge: header and a placeholder index first, records as they come out of the heap
+    auto merge_start = std::chrono::high_resolution_clock::now();
+    std::ofstream output(path, std::ios::binary);
+    if (!output) {
+        std::cerr << "Failed to open output file: " << path << std::endl;
+        throw std::runtime_error("File open error");
+    }
+    PrefixTableHeader header = {};
+    std::copy(prefix_table_magic, prefix_table_magic + 8, header.magic);
+    header.version = prefix_table_version;
+    header.max_key_length = max_key_length;
+    header.charset_size = (uint32_t)charset.size();
+    header.index_bits = prefix_index_bits;
+    header.records = ordinal;
+    std::copy(charset.begin(), charset.end(), header.charset);
+    std::vector<uint64_t> index(((size_t)1 << prefix_index_bits) + 1, 0);
+    output.write((const char*)&header, sizeof(header));
+    output.write((const char*)index.data(), index.size() * sizeof(uint64_t));
+
+    std::vector<PrefixRun> runs(run_paths.size());
+    typedef std::pair<PrefixEntry, size_t> HeapItem;
+    std::priority_queue<HeapItem, std::vector<HeapItem>, std::greater<HeapItem>> heap;
+    for (size_t r = 0; r < runs.size(); r++) {
+        runs[r].file.open(run_paths[r], std::ios::binary);
+        if (runs[r].next()) {
+            heap.push({ runs[r].current, r });
+        }
+    }
+    std::vector<unsigned char> buffer;
+    buffer.reserve(prefix_record_bytes << 16);
+    uint64_t written = 0;
+    size_t next_bucket = 0;
+    while (!heap.empty()) {
+        HeapItem item = heap.top();
+        heap.pop();
+        for (uint64_t bucket = prefix_bucket(item.first.prefix); next_bucket <= bucket; next_bucket++) {
+            index[next_bucket] = written;
+        }
+        buffer.resize(buffer.size() + prefix_record_bytes);
+        encode_prefix_record(item.first, &buffer[buffer.size() - prefix_record_bytes]);
+        written++;
+        if (buffer.size() >= (size_t)(prefix_record_bytes << 16)) {
+            output.write((const char*)buffer.data(), buffer.size());
+            buffer.clear();
+        }
+        if (runs[item.second].next()) {
+            heap.push({ runs[item.second].current, item.second });
+        }
+    }
+    output.write((const char*)buffer.data(), buffer.size());
+    for (; next_bucket < index.size(); next_bucket++) {
+        index[next_bucket] = written;
+    }
+    output.seekp(sizeof(header));
+    output.write((const char*)index.data(), index.size() * sizeof(uint64_t));
+    if (!output) {
+        std::cerr << "Failed to write prefix table: " << path << std::endl;
+        throw std::runtime_error("File write error");
+    }
+    output.close();
+    for (const std::string& run_path : run_paths) {
+        unlink(run_path.c_str());
+    }
+
+    std::chrono::duration<double> merge_elapsed = std::chrono::high_resolution_clock::now() - merge_start;
+    std::chrono::duration<double> elapsed = std::chrono::high_resolution_clock::now() - start_time;
+    std::cout << "Prefix table: " << written << " keys up to " << max_key_length << " characters, " << run_paths.size() << " sorted runs of at most "
+        << run_capacity << " entries" << std::endl;
+    std::cout << "Prefix table: generated in " << generate_seconds << " s on " << backend << " (" << (generate_seconds > 0 ? written / generate_seconds : 0.0)
+        << " keys/s), sorted in " << sort_seconds << " s, merged in " << merge_elapsed.count() << " s, " << elapsed.count() << " s total" << std::endl;
+    std::cout << "Prefix table: " << sizeof(header) + index.size() * sizeof(uint64_t) + written * prefix_record_bytes << " bytes written to " << path << std::endl;
+    return 0;
+}
+
+// Answers every target at once: targets are sorted by prefix and merge-joined against the
+// memory-mapped table, each one starting no earlier than its sparse-index bucket. Records that
+// share the prefix are checked against the rest of the target keystream.
+int query_prefix_table(const std::string& path, std::vector<KeystreamTarget> targets) {
+    auto start_time = std::chrono::high_resolution_clock::now();
+    int fd = open(path.c_str(), O_RDONLY);
+    struct stat info;
+    if (fd < 0 || fstat(fd, &info) != 0) {
+        std::cerr << "Failed to open prefix table: " << path << std::endl;
+        throw std::runtime_error("File open error");
+    }
+    size_t size = (size_t)info.st_size;
+    void* mapping = size > 0 ? mmap(nullptr, size, PROT_READ, MAP_SHARED, fd, 0) : MAP_FAILED;
+    close(fd);
+    if (mapping == MAP_FAILED) {
+        std::cerr << "Failed to map prefix table: " << path << std::endl;
+        throw std::runtime_error("File open error");
+    }
+    const unsigned char* data = (const unsigned char*)mapping;
+    PrefixTableHeader header;
+    const size_t index_entries = ((size_t)1 << prefix_index_bits) + 1;
+    const size_t records_offset = sizeof(header) + index_entries * sizeof(uint64_t);
+    memcpy(&header, data, std::min(size, sizeof(header)));
+    if (size < records_offset || memcmp(header.magic, prefix_table_magic, 8) != 0 || header.version != prefix_table_version
+        || header.index_bits != (uint32_t)prefix_index_bits || size != records_offset + header.records * prefix_record_bytes) {
+        munmap(mapping, size);
+        std::cerr << "Not a version " << prefix_table_version << " prefix table or truncated: " << path << std::endl;
+        throw std::runtime_error("Invalid prefix table");
+    }
+    const uint64_t* index = (const uint64_t*)(data + sizeof(header));
+    const unsigned char* records = data + records_offset;
+    const std::string charset((const char*)header.charset, header.charset_size);
+
+    auto target_prefix = [](const KeystreamTarget& target) {
+        uint64_t prefix = 0;
+        for (int b = 0; b < prefix_table_bytes; b++) {
+            prefix = (prefix << 8) | target.keystream[b];
+        }
+        return prefix;
+    };
+    std::sort(targets.begin(), targets.end(), [&](const KeystreamTarget& a, const KeystreamTarget& b) { return target_prefix(a) < target_prefix(b); });
+
+    size_t matched = 0;
+    unsigned long long rejected = 0;
+    uint64_t position = 0;
+    std::vector<unsigned char> keystream;
+    for (const KeystreamTarget& target : targets) {
+        uint64_t prefix = target_prefix(target);
+        position = std::max(position, index[prefix_bucket(prefix)]);
+        uint64_t bucket_end = index[prefix_bucket(prefix) + 1];
+        while (position < bucket_end && decode_prefix_record(records + position * prefix_record_bytes).prefix < prefix) {
+            position++;
+        }
+        bool found = false;
+        for (uint64_t k = position; k < bucket_end; k++) {
+            PrefixEntry entry = decode_prefix_record(records + k * prefix_record_bytes);
+            if (entry.prefix != prefix) {
+                break;
+            }
+            std::vector<unsigned char> key = key_from_ordinal(entry.ordinal, charset, header.max_key_length);
+            keystream.resize(target.keystream.size());
+            rc4_keystream(key.data(), (int)key.size(), keystream.data(), keystream.size());
+            if (keystream != target.keystream) {
+                rejected++;
+                continue;
+            }
+            std::cout << "  " << target.label << ": " << std::string(key.begin(), key.end()) << " (" << to_hex(key.data(), key.size()) << ")" << std::endl;
+            found = true;
+        }
+        matched += found;
+    }
+    munmap(mapping, size);
+
+    std::chrono::duration<double> elapsed = std::chrono::high_resolution_clock::now() - start_time;
+    std::cout << "Prefix table: " << matched << " of " << targets.size() << " targets matched, " << rejected
+        << " prefix matches rejected by the longer keystream, " << elapsed.count() << " s" << std::endl;
+    return matched > 0 ? 0 : 2;
+}
+
+// Broadcast bias analysis: the same plaintext encrypted under many keys. Position r of every
+// ciphertext is p_r ^ Z_r, so the ciphertext byte histogram at r is the keystream distribution
+// at r shifted by p_r; the decoder picks the shift the measured RC4 distribution explains best.
+
+// Adds per-worker 32-bit counters into 64-bit totals
+void merge_worker_counts(const std::vector<std::vector<uint32_t>>& counts, std::vector<uint64_t>& totals) {
+    for (const std::vector<uint32_t>& worker_counts : counts) {
+        for (size_t n = 0; n < worker_counts.size(); n++) {
+            totals[n] += worker_counts[n];
+        }
+    }
+}
+
+// Per-position byte counts of count records, [position * 256 + byte]. Workers take blocks of
+// records into their own 32-bit counters, small enough to stay in cache, merged at the end.
+std::vector<uint64_t> histogram_records(const unsigned char* records, size_t record_length, size_t count, size_t positions) {
+    std::vector<uint64_t> totals(positions * 256, 0);
+    std::vector<std::vector<uint32_t>> counts(cpu_worker_pool().threads.size());
+    parallel_for(count, 1 << 16, [&](size_t worker, uint64_t begin, uint64_t end) {
+        std::vector<uint32_t>& local = counts[worker];
+        local.resize(positions * 256, 0);
+        for (uint64_t k = begin; k < end; k++) {
+            const unsigned char* record = records + k * record_length;
+            for (size_t r = 0; r < positions; r++) {
+                local[r * 256 + record[r]]++;
+            }
+        }
+    });
+    merge_worker_counts(counts, totals);
+    return totals;
+}
+
+// Key of keystream sample number `sample`, as rc4_keystream_histogram derives it
+void bias_sample_key(uint64_t seed, uint64_t sample, unsigned char* key) {
+    uint64_t words[2] = { tmto_mix(seed + 2 * sample), tmto_mix(seed + 2 * sample + 1) };
+    for (int b = 0; b < 16; b++) {
+        key[b] = (unsigned char)(words[b >> 3] >> (8 * (b & 7)));
+    }
+}
+
+// Adds the keystream byte counts of samples [first_sample, first_sample + count) to totals,
+// which is what the ciphertext histogram of an all-zero plaintext would be
+void sample_keystream_histogram(size_t positions, uint64_t seed, uint64_t first_sample, uint64_t count, std::vector<uint64_t>& totals) {
+    std::vector<std::vector<uint32_t>> counts(cpu_worker_pool().threads.size());
+    parallel_for(count, 1 << 14, [&](size_t worker, uint64_t begin, uint64_t end) {
+        std::vector<uint32_t>& local = counts[worker];
+        local.resize(positions * 256, 0);
+        std::vector<unsigned char> keystream(positions);
+        unsigned char key[16];
+        for (uint64_t k = begin; k < end; k++) {
+            bias_sample_key(seed, first_sample + k, key);
+            rc4_keystream(key, 16, keystream.data(), positions);
+            for (size_t r = 0; r < positions; r++) {
+                local[r * 256 + keystream[r]]++;
+            }
+        }
+    });
+    merge_worker_counts(counts, totals);
+}
+
+// Device twin of sample_keystream_histogram. A work group's local histogram covers as many
+// positions as fit in local memory, so wider tables take one launch per window of positions;
+// the 32-bit device counters are merged into totals and cleared after every launch.
+void sample_keystream_histogram_opencl(OpenCLContext& cl, cl_kernel kernel, size_t positions, uint64_t seed, uint64_t first_sample, uint64_t count,
+    std::vector<uint64_t>& totals) {
+    cl_ulong local_memory = 0;
+    clGetDeviceInfo(cl.device_id, CL_DEVICE_LOCAL_MEM_SIZE, sizeof(local_memory), &local_memory, nullptr);
+    const size_t local_size = 64;
+    int window = (int)std::max<size_t>(1, std::min<size_t>(positions, local_memory / (256 * sizeof(cl_uint))));
+    cl_int err;
+    cl_mem hist_buffer = clCreateBuffer(cl.context, CL_MEM_READ_WRITE, window * 256 * sizeof(cl_uint), nullptr, &err);
+    std::vector<cl_uint> hist(window * 256);
+    const uint64_t batch = 1 << 22;
+    for (int first_position = 0; first_position < (int)positions && err == CL_SUCCESS; first_position += window) {
+        int width = std::min(window, (int)positions - first_position);
+        for (uint64_t done = 0; done < count && err == CL_SUCCESS; done += batch) {
+            cl_ulong first = first_sample + done, launch = std::min(batch, count - done);
+            cl_uint zero = 0;
+            err |= clEnqueueFillBuffer(cl.queue, hist_buffer, &zero, sizeof(zero), 0, width * 256 * sizeof(cl_uint), 0, nullptr, nullptr);
+            err |= clSetKernelArg(kernel, 0, sizeof(cl_ulong), &seed);
+            err |= clSetKernelArg(kernel, 1, sizeof(cl_ulong), &first);
+            err |= clSetKernelArg(kernel, 2, sizeof(cl_ulong), &launch);
+            err |= clSetKernelArg(kernel, 3, sizeof(int), &first_position);
+            err |= clSetKernelArg(kernel, 4, sizeof(int), &width);
+            err |= clSetKernelArg(kernel, 5, width * 256 * sizeof(cl_uint), nullptr);
+            err |= clSetKernelArg(kernel, 6, sizeof(cl_mem), &hist_buffer);
+            size_t global_work_size = (size_t)(launch + local_size - 1) / local_size * local_size;
+            err |= clEnqueueNDRangeKernel(cl.queue, kernel, 1, nullptr, &global_work_size, &local_size, 0, nullptr, nullptr);
+            err |= clEnqueueReadBuffer(cl.queue, hist_buffer, CL_TRUE, 0, width * 256 * sizeof(cl_uint), hist.data(), 0, nullptr, nullptr);
+            for (int n = 0; n < width * 256; n++) {
+                totals[first_position * 256 + n] += hist[n];
+            }
+        }
+    }
+    clReleaseMemObject(hist_buffer);
+    if (err != CL_SUCCESS) {
+        std::cerr << "Failed to run rc4_keystream_histogram. Error code: " << err << std::endl;
+        throw std::runtime_error("OpenCL bias table error");
+    }
+}
+
+// Bias tables: per-position keystream byte counts over many random 16-byte keys, a 64-byte
+// header followed by positions * 256 little-endian uint64 counts, so a table can be mapped and
+// read in place. Samples are numbered, which makes an interrupted build resumable.
+struct BiasTableHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t positions;
+    uint32_t key_length;
+    uint32_t reserved;
+    uint64_t seed;
+    uint64_t samples;
+    uint64_t padding[3];
+};
+
+const char bias_table_magic[8] = { 'R', 'C', '4', 'B', 'I', 'A', 'S', '\0' };
+const uint32_t bias_table_version = 1;
+
+struct BiasTable {
+    BiasTableHeader header;
+    const uint64_t* counts;
+    void* mapping;
+    size_t size;
+};
+
+BiasTable map_bias_table(const std::string& path) {
+    BiasTable table = {};
+    int fd = open(path.c_str(), O_RDONLY);
+    struct stat info;
+    if (fd < 0 || fstat(fd, &info) != 0) {
+        std::cerr << "Failed to open bias table: " << path << std::endl;
+        throw std::runtime_error("File open error");
+    }
+    table.size = (size_t)info.st_size;
+    table.mapping = table.size >= sizeof(BiasTableHeader) ? mmap(nullptr, table.size, PROT_READ, MAP_SHARED, fd, 0) : MAP_FAILED;
+    close(fd);
+    if (table.mapping == MAP_FAILED) {
+        std::cerr << "Failed to map bias table: " << path << std::endl;
+        throw std::runtime_error("File open error");
+    }
+    memcpy(&table.header, table.mapping, sizeof(table.header));
+    if (memcmp(table.header.magic, bias_table_magic, 8) != 0 || table.header.version != bias_table_version
+        || table.size != sizeof(BiasTableHeader) + (size_t)table.header.positions * 256 * sizeof(uint64_t)) {
+        munmap(table.mapping, table.size);
+        std::cerr << "Not a version " << bias_table_version << " bias table or truncated: " << path << std::endl;
+        throw std::runtime_error("Invalid bias table");
+    }
+    table.counts = (const uint64_t*)((const unsigned char*)table.mapping + sizeof(BiasTableHeader));
+    return table;
+}
+
+void release_bias_table(BiasTable& table) {
+    munmap(table.mapping, table.size);
+    table.mapping = nullptr;
+    table.counts = nullptr;
+}
+
+// Written to PATH.tmp and renamed, so a checkpoint never leaves a torn table behind
+void write_bias_table(const std::string& path, const BiasTableHeader& header, const std::vector<uint64_t>& counts) {
+    std::string temporary = path + ".tmp";
+    std::ofstream file(temporary, std::ios::binary);
+    file.write((const char*)&header, sizeof(header));
+    file.write((const char*)counts.data(), counts.size() * sizeof(uint64_t));
+    file.close();
+    if (!file || rename(temporary.c_str(), path.c_str()) != 0) {
+        std::cerr << "Failed to write bias table: " << path << std::endl;
+        throw std::runtime_error("File write error");
+    }
+}
+
+// --bias-table-build: samples keys until the table at path holds `samples` of them, merging
+// device counts on the host after every batch and checkpointing the file every 30 seconds. An
+// existing table with the same positions and seed is extended rather than started over.
+int build_bias_table(const std::string& path, size_t positions, uint64_t samples, uint64_t seed, const std::string& backend, cl_device_type device_type) {
+    BiasTableHeader header = {};
+    std::copy(bias_table_magic, bias_table_magic + 8, header.magic);
+    header.version = bias_table_version;
+    header.positions = (uint32_t)positions;
+    header.key_length = 16;
+    header.seed = seed;
+    std::vector<uint64_t> counts(positions * 256, 0);
+    if (access(path.c_str(), F_OK) == 0) {
+        BiasTable existing = map_bias_table(path);
+        if (existing.header.positions != header.positions || existing.header.seed != seed) {
+            release_bias_table(existing);
+            std::cerr << "Existing table " << path << " has " << existing.header.positions << " positions and seed " << existing.header.seed
+                << "; refusing to extend it with different settings" << std::endl;
+            throw std::runtime_error("Invalid arguments");
+        }
+        header.samples = existing.header.samples;
+        std::copy(existing.counts, existing.counts + counts.size(), counts.begin());
+        release_bias_table(existing);
+        std::cout << "Bias table: resuming " << path << " at " << header.samples << " samples" << std::endl;
+    }
+
+    OpenCLContext cl = {};
+    cl_kernel kernel = nullptr;
+    if (backend == "gpu") {
+        cl_int err;
+        cl = create_opencl_context(device_type);
+        kernel = clCreateKernel(cl.program, "rc4_keystream_histogram", &err);
+        if (err != CL_SUCCESS) {
+            std::cerr << "Failed to create the bias table kernel. Error code: " << err << std::endl;
+            throw std::runtime_error("OpenCL kernel creation error");
+        }
+    }
+
+    auto start_time = std::chrono::high_resolution_clock::now();
+    auto last_checkpoint = start_time;
+    const uint64_t first = header.samples;
+    const uint64_t batch = backend == "gpu" ? 1 << 24 : 1 << 20;
+    while (header.samples < samples) {
+        uint64_t count = std::min(batch, samples - header.samples);
+        if (backend == "gpu") {
+            sample_keystream_histogram_opencl(cl, kernel, positions, seed, header.samples, count, counts);
+        }
+        else {
+            sample_keystream_histogram(positions, seed, header.samples, count, counts);
+        }
+        header.samples += count;
+        auto now = std::chrono::high_resolution_clock::now();
+        std::chrono::duration<double> since_checkpoint = now - last_checkpoint, elapsed = now - start_time;
+        if (since_checkpoint.count() >= 30.0 && header.samples < samples) {
+            write_bias_table(path, header, counts);
+            last_checkpoint = now;
+            std::cout << "Bias table: " << header.samples << " of " << samples << " samples, " << (header.samples - first) / elapsed.count() << " keys/s" << std::endl;
+        }
+    }
+    write_bias_table(path, header, counts);
+    if (backend == "gpu") {
+        clReleaseKernel(kernel);
+        release_opencl_context(cl);
+    }
+
+    std::chrono::duration<double> elapsed = std::chrono::high_resolution_clock::now() - start_time;
+    std::cout << "Bias table: " << header.samples << " samples of positions 1-" << positions << " written to " << path << ", "
+        << header.samples - first << " new in " << elapsed.count() << " s on " << backend << " ("
+        << (elapsed.count() > 0 ? (header.samples - first) / elapsed.count() : 0.0) << " keys/s)" << std::endl;
+    return 0;
+}
+
+// Scalar RC4 reference engine. Deliberately written without the shortcuts of rc4_keystream or
+// the kernels so that it can arbitrate between them: KSA, discard `drop` bytes (RC4-drop[n]),
+// then return `length` keystream bytes starting `offset` bytes into the remaining stream.
+std::vector<unsigned char> rc4_reference(const std::vector<unsigned char>& key, size_t drop, size_t offset, size_t length) {
+    int S[256];
+    for (int k = 0; k < 256; k++) {
+        S[k] = k;
+    }
+    int j = 0;
+    for (int k = 0; k < 256; k++) {
+        j = (j + S[k] + key[k % key.size()]) % 256;
+        int temp = S[k];
+        S[k] = S[j];
+        S[j] = temp;
+    }
+
+    std::vector<unsigned char> keystream;
+    int i = 0;
+    j = 0;
+    for (size_t n = 0; n < drop + offset + length; n++) {
+        i = (i + 1) % 256;
+        j = (j + S[i]) % 256;
+        int temp = S[i];
+        S[i] = S[j];
+        S[j] = temp;
+        if (n >= drop + offset) {
+            keystream.push_back((unsigned char)S[(S[i] + S[j]) % 256]);
+        }
+    }
+    return keystream;
+}
+
+struct Rc4TestVector {
+    const char* key;
+    size_t offset;
+    const char* keystream;
+};
+
+// RFC 6229 section 2 (key = 0x0102...), plus the first vectors of section 3
+const Rc4TestVector rfc6229_vectors[] = {
+    { "0102030405", 0, "b2396305f03dc027ccc3524a0a1118a8" },
+    { "0102030405", 16, "6982944f18fc82d589c403a47a0d0919" },
+    { "0102030405", 240, "28cb1132c96ce286421dcaadb8b69eae" },
+    { "0102030405", 256, "1cfcf62b03eddb641d77dfcf7f8d8c93" },
+    { "0102030405", 496, "42b7d0cdd918a8a33dd51781c81f4041" },
+    { "0102030405", 512, "6459844432a7da923cfb3eb4980661f6" },
+    { "0102030405", 752, "ec10327bde2beefd18f9277680457e22" },
+    { "0102030405", 768, "eb62638d4f0ba1fe9fca20e05bf8ff2b" },
+    { "0102030405", 1008, "45129048e6a0ed0b56b490338f078da5" },
+    { "0102030405", 1024, "30abbcc7c20b01609f23ee2d5f6bb7df" },
+    { "0102030405", 1520, "3294f744d8f9790507e70f62e5bbceea" },
+    { "0102030405", 1536, "d8729db41882259bee4f825325f5a130" },
+    { "0102030405", 2032, "1eb14a0c13b3bf47fa2a0ba93ad45b8b" },
+    { "0102030405", 2048, "cc582f8ba9f265e2b1be9112e975d2d7" },
+    { "0102030405", 3056, "f2e30f9bd102ecbf75aaade9bc35c43c" },
+    { "0102030405", 3072, "ec0e11c479dc329dc8da7968fe965681" },
+    { "0102030405", 4080, "068326a2118416d21f9d04b2cd1ca050" },
+    { "0102030405", 4096, "ff25b58995996707e51fbdf08b34d875" },
+    { "01020304050607", 0, "293f02d47f37c9b633f2af5285feb46b" },
+    { "01020304050607", 16, "e620f1390d19bd84e2e0fd752031afc1" },
+    { "01020304050607", 240, "914f02531c9218810df60f67e338154c" },
+    { "01020304050607", 256, "d0fdb583073ce85ab83917740ec011d5" },
+    { "01020304050607", 4080, "f3172ceffc3b3d997c85ccd5af1a950c" },
+    { "01020304050607", 4096, "e74b0b9731227fd37c0ec08a47ddd8b8" },
+    { "0102030405060708", 0, "97ab8a1bf0afb96132f2f67258da15a8" },
+    { "0102030405060708", 16, "8263efdb45c4a18684ef87e6b19e5b09" },
+    { "0102030405060708", 240, "9636ebc9841926f4f7d1f362bddf6e18" },
+    { "0102030405060708", 256, "d0a990ff2c05fef5b90373c9ff4b870a" },
+    { "0102030405060708", 4080, "d5fa5a3469d29aaaf83d23589db8c85b" },
+    { "0102030405060708", 4096, "3fb46e2c8f0f068edce8cdcd7dfc5862" },
+    { "0102030405060708090a0b0c0d0e0f10", 0, "9ac7cc9a609d1ef7b2932899cde41b97" },
+    { "0102030405060708090a0b0c0d0e0f10", 16, "5248c4959014126a6e8a84f11d1a9e1c" },
+    { "0102030405060708090a0b0c0d0e0f10", 240, "065902e4b620f6cc36c8589f66432f2b" },
+    { "0102030405060708090a0b0c0d0e0f10", 256, "d39d566bc6bce3010768151549f3873f" },
+    { "0102030405060708090a0b0c0d0e0f10", 496, "b6d1e6c4a5e4771cad79538df295fb11" },
+    { "0102030405060708090a0b0c0d0e0f10", 512, "c68c1d5c559a974123df1dbc52a43b89" },
+    { "0102030405060708090a0b0c0d0e0f10", 752, "c5ecf88de897fd57fed301701b82a259" },
+    { "0102030405060708090a0b0c0d0e0f10", 768, "eccbe13de1fcc91c11a0b26c0bc8fa4d" },
+    { "0102030405060708090a0b0c0d0e0f10", 1008, "e7a72574f8782ae26aabcf9ebcd66065" },
+    { "0102030405060708090a0b0c0d0e0f10", 1024, "bdf0324e6083dcc6d3cedd3ca8c53c16" },
+    { "0102030405060708090a0b0c0d0e0f10", 1520, "b40110c4190b5622a96116b0017ed297" },
+    { "0102030405060708090a0b0c0d0e0f10", 1536, "ffa0b514647ec04f6306b892ae661181" },
+    { "0102030405060708090a0b0c0d0e0f10", 2032, "d03d1bc03cd33d70dff9fa5d71963ebd" },
+    { "0102030405060708090a0b0c0d0e0f10", 2048, "8a44126411eaa78bd51e8d87a8879bf5" },
+    { "0102030405060708090a0b0c0d0e0f10", 3056, "fabeb76028ade2d0e48722e46c4615a3" },
+    { "0102030405060708090a0b0c0d0e0f10", 3072, "c05d88abd50357f935a63c59ee537623" },
+    { "0102030405060708090a0b0c0d0e0f10", 4080, "ff38265c1642c1abe8d3c2fe5e572bf8" },
+    { "0102030405060708090a0b0c0d0e0f10", 4096, "a36a4c301ae8ac13610ccbc12256cacc" },
+    { "833222772a", 0, "80ad97bdc973df8a2e879e92a497efda" },
+    { "833222772a", 16, "20f060c2f2e5126501d3d4fea10d5fc0" },
+    { "833222772a", 240, "faa148e99046181fec6b2085f3b20ed9" },
+    { "833222772a", 256, "f0daf5bab3d596839857846f73fbfe5a" },
+    { "833222772a", 4080, "6349d126a37afcba89794f9804914fdc" },
+    { "833222772a", 4096, "bf42c3018c2f7c66bfde524975768115" },
+
+};
+
+// Runs keystream bytes [0, length) through the rc4_decrypt kernel by decrypting zeros
+std::vector<unsigned char> opencl_rc4_decrypt_keystream(OpenCLContext& cl, cl_kernel kernel, const std::vector<unsigned char>& key, size_t length) {
+    cl_int err;
+    std::vector<unsigned char> zeros(length, 0), keystream(length);
+    int key_length = (int)key.size();
+    int data_length = (int)length;
+
+    cl_mem input = clCreateBuffer(cl.context, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR, length, zeros.data(), &err);
+    cl_mem output = clCreateBuffer(cl.context, CL_MEM_WRITE_ONLY, length, nullptr, &err);
+    cl_mem keys = clCreateBuffer(cl.context, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR, key.size(), (void*)key.data(), &err);
+    if (err != CL_SUCCESS) {
+        std::cerr << "Failed to create self-test buffers. Error code: " << err << std::endl;
+        throw std::runtime_error("OpenCL buffer creation error");
+    }
+
+    err = clSetKernelArg(kernel, 0, sizeof(cl_mem), &input);
+    err |= clSetKernelArg(kernel, 1, sizeof(cl_mem), &output);
+    err |= clSetKernelArg(kernel, 2, sizeof(cl_mem), &keys);
+    err |= clSetKernelArg(kernel, 3, sizeof(int), &key_length);
+    err |= clSetKernelArg(kernel, 4, sizeof(int), &data_length);
+    size_t global_work_size = length;
+    err |= clEnqueueNDRangeKernel(cl.queue, kernel, 1, nullptr, &global_work_size, nullptr, 0, nullptr, nullptr);
+    err |= clEnqueueReadBuffer(cl.queue, output, CL_TRUE, 0, length, keystream.data(), 0, nullptr, nullptr);
+    clReleaseMemObject(input);
+    clReleaseMemObject(output);
+    clReleaseMemObject(keys);
+    if (err != CL_SUCCESS) {
+        std::cerr << "Failed to run rc4_decrypt for self-test. Error code: " << err << std::endl;
+        throw std::runtime_error("OpenCL self-test error");
+    }
+    return keystream;
+}
+
+// Runs one full key length through the rc4_search kernel and returns the sorted hit indices
+std::vector<cl_ulong> opencl_search_hits(OpenCLContext& cl, cl_kernel kernel, const std::vector<unsigned char>& ciphertext, const std::string& charset, int key_length) {
+    cl_int err;
+    int check_length = (int)ciphertext.size();
+    int charset_size = (int)charset.size();
+    cl_ulong base_index = 0;
+    cl_ulong count = keyspace_size(charset.size(), key_length);
+    cl_uint max_hits = (cl_uint)count;
+    cl_uint hit_count = 0;
+
+    cl_mem ciphertext_buffer = clCreateBuffer(cl.context, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR, ciphertext.size(), (void*)ciphertext.data(), &err);
+    cl_mem charset_buffer = clCreateBuffer(cl.context, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR, charset.size(), (void*)charset.data(), &err);
+    cl_mem hits_buffer = clCreateBuffer(cl.context, CL_MEM_WRITE_ONLY, count * sizeof(cl_ulong), nullptr, &err);
+    cl_mem hit_count_buffer = clCreateBuffer(cl.context, CL_MEM_READ_WRITE | CL_MEM_COPY_HOST_PTR, sizeof(cl_uint), &hit_count, &err);
+    std::vector<unsigned char> accept = byte_class_bitmap(printable_byte_class());
+    cl_mem accept_buffer = clCreateBuffer(cl.context, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR, accept.size(), accept.data(), &err);
+    if (err != CL_SUCCESS) {
+        std::cerr << "Failed to create self-test buffers. Error code: " << err << std::endl;
+        throw std::runtime_error("OpenCL buffer creation error");
+    }
+
+    err = clSetKernelArg(kernel, 0, sizeof(cl_mem), &ciphertext_buffer);
+    err |= clSetKernelArg(kernel, 1, sizeof(int), &check_length);
+    err |= clSetKernelArg(kernel, 2, sizeof(cl_mem), &charset_buffer);
+    err |= clSetKernelArg(kernel, 3, sizeof(int), &charset_size);
+    err |= clSetKernelArg(kernel, 4, sizeof(int), &key_length);
+    err |= clSetKernelArg(kernel, 5, sizeof(cl_ulong), &base_index);
+    err |= clSetKernelArg(kernel, 6, sizeof(cl_ulong), &count);
+    err |= clSetKernelArg(kernel, 7, sizeof(cl_mem), &hits_buffer);
+    err |= clSetKernelArg(kernel, 8, sizeof(cl_mem), &hit_count_buffer);
+    err |= clSetKernelArg(kernel, 9, sizeof(cl_uint), &max_hits);
+    err |= clSetKernelArg(kernel, 10, sizeof(cl_mem), &accept_buffer);
+    size_t global_work_size = (size_t)count;
+    err |= clEnqueueNDRangeKernel(cl.queue, kernel, 1, nullptr, &global_work_size, nullptr, 0, nullptr, nullptr);
+    err |= clEnqueueReadBuffer(cl.queue, hit_count_buffer, CL_TRUE, 0, sizeof(cl_uint), &hit_count, 0, nullptr, nullptr);
+    std::vector<cl_ulong> hits(std::min(hit_count, max_hits));
+    if (!hits.empty()) {
+        err |= clEnqueueReadBuffer(cl.queue, hits_buffer, CL_TRUE, 0, hits.size() * sizeof(cl_ulong), hits.data(), 0, nullptr, nullptr);
+    }
+    clReleaseMemObject(ciphertext_buffer);
+    clReleaseMemObject(charset_buffer);
+    clReleaseMemObject(hits_buffer);
+    clReleaseMemObject(hit_count_buffer);
+    clReleaseMemObject(accept_buffer);
+    if (err != CL_SUCCESS) {
+        std::cerr << "Failed to run rc4_search for self-test. Error code: " << err << std::endl;
+        throw std::runtime_error("OpenCL self-test error");
+    }
+    std::sort(hits.begin(), hits.end());
+    return hits;
+}
+
+// Checks the reference engine against RFC 6229, then diffs every backend against it on random
+// keys. Every mismatch is printed and counted; returns true only if no check failed.
+bool run_self_test(cl_device_type device_type, int random_keys, unsigned int seed) {
+    int failures = 0;
+    auto report = [&](const std::string& backend, const std::vector<unsigned char>& key, size_t offset,
+        const std::vector<unsigned char>& expected, const std::vector<unsigned char>& actual) {
+        if (expected == actual) {
+            return;
+        }
+        failures++;
+        std::cerr << "MISMATCH " << backend << " key=" << to_hex(key.data(), key.size()) << " offset=" << offset
+            << "\n  expected " << to_hex(expected.data(), expected.size())
+            << "\n  actual   " << to_hex(actual.data(), actual.size()) << std::endl;
+    };
+
+    for (const Rc4TestVector& vector : rfc6229_vectors) {
+        std::vector<unsigned char> key = parse_hex(vector.key);
+        std::vector<unsigned char> expected = parse_hex(vector.keystream);
+        report("reference", key, vector.offset, expected, rc4_reference(key, 0, vector.offset, expected.size()));
+        report("reference-drop", key, vector.offset, expected, rc4_reference(key, vector.offset, 0, expected.size()));
+
+        std::vector<unsigned char> stream(vector.offset + expected.size());
+        rc4_keystream(key.data(), (int)key.size(), stream.data(), stream.size());
+        report("cpu", key, vector.offset, expected, std::vector<unsigned char>(stream.begin() + vector.offset, stream.end()));
+    }
+    std::cout << "RFC 6229: " << sizeof(rfc6229_vectors) / sizeof(rfc6229_vectors[0]) << " vectors checked" << std::endl;
+
+    // CRC presets against the catalogue check values of "123456789"
+    const std::pair<const char*, uint32_t> crc_check_values[] = {
+        { "crc32", 0xcbf43926 }, { "crc16-ccitt", 0x29b1 }, { "crc16-x25", 0x906e }, { "crc16-arc", 0xbb3d },
+    };
+    std::vector<unsigned char> check_input = { '1', '2', '3', '4', '5', '6', '7', '8', '9' };
+    for (const auto& entry : crc_check_values) {
+        uint32_t actual = crc_of(parse_crc_spec(entry.first), check_input);
+        if (actual != entry.second) {
+            failures++;
+            std::cerr << "MISMATCH " << entry.first << " check value: expected " << std::hex << entry.second << ", got " << actual << std::dec << std::endl;
+        }
+    }
+    std::cout << "CRC: " << sizeof(crc_check_values) / sizeof(crc_check_values[0]) << " presets checked" << std::endl;
+
+    // A worker's exception must reach the caller once the pool is idle, and leave it usable
+    bool pool_rethrew = false;
+    try {
+        parallel_for(64, 1, [](size_t, uint64_t begin, uint64_t) {
+            if (begin == 7) {
+                throw std::runtime_error("pool self-test");
+            }
+        });
+    }
+    catch (const std::runtime_error&) {
+        pool_rethrew = true;
+    }
+    std::atomic<uint64_t> pool_sum(0);
+    parallel_for(64, 1, [&](size_t, uint64_t begin, uint64_t) { pool_sum += begin; });
+    if (!pool_rethrew || pool_sum != 64 * 63 / 2) {
+        failures++;
+        std::cerr << "MISMATCH worker pool: exception " << (pool_rethrew ? "rethrown" : "lost") << ", next job summed " << pool_sum << std::endl;
+    }
+    std::cout << "Worker pool: a worker's exception rethrown on the caller" << std::endl;
+
+    // MD5 and SHA-1 against the RFC 1321 / FIPS 180 test messages, then every KDF path against
+    // the whole-message digest on random passphrases and salts
+    const struct { const char* message; const char* md5; const char* sha1; } hash_vectors[] = {
+        { "", "d41d8cd98f00b204e9800998ecf8427e", "da39a3ee5e6b4b0d3255bfef95601890afd80709" },
+        { "abc", "900150983cd24fb0d6963f7d28e17f72", "a9993e364706816aba3e25717850c26c9cd0d89d" },
+        { "abcdbcdecdefdefgefghfghighijhijkijkljklmklmnlmnomnopnopq", "8215ef0796a20bcaaae116d3876c664a", "84983e441c3bd26ebaae4aa1f95129e5e54670f1" },
+    };
+    for (const auto& entry : hash_vectors) {
+        unsigned char digest[20];
+        md5_digest((const unsigned char*)entry.message, strlen(entry.message), digest);
+        std::string md5 = to_hex(digest, 16);
+        sha1_digest((const unsigned char*)entry.message, strlen(entry.message), digest);
+        std::string sha1 = to_hex(digest, 20);
+        if (md5 != entry.md5 || sha1 != entry.sha1) {
+            failures++;
+            std::cerr << "MISMATCH digests of \"" << entry.message << "\": md5 " << md5 << ", sha1 " << sha1 << std::endl;
+        }
+    }
+    std::mt19937 kdf_rng(seed);
+    for (int round = 0; round < 20; round++) {
+        KdfSpec kdf;
+        kdf.algorithm = round % 2 ? "sha1" : "md5";
+        kdf.key_length = 1 + kdf_rng() % kdf_digest_length(kdf.algorithm);
+        kdf.salt.resize(kdf_rng() % 24);
+        for (unsigned char& byte : kdf.salt) {
+            byte = (unsigned char)kdf_rng();
+        }
+        Keyspace keyspace{ std::string(1 + kdf_rng() % 64, '\0'), "" };
+        for (char& c : keyspace.charset) {
+            c = (char)kdf_rng();
+        }
+        int passphrase_length = 1 + kdf_rng() % (kdf_max_message - kdf.salt.size());
+        passphrase_length = std::min(passphrase_length, max_search_key_length);
+        const size_t count = 37;
+        unsigned long long base = kdf_rng() % 1000;
+        std::vector<unsigned char> keys(count * kdf.key_length);
+        derive_kdf_keys_cpu(kdf, (const unsigned char*)keyspace.charset.data(), keyspace.charset.size(), false, passphrase_length, base, count, keys.data());
+        for (size_t n = 0; n < count; n++) {
+            std::vector<unsigned char> message(passphrase_length), digest(20);
+            key_from_index(base + n, keyspace, passphrase_length, message.data());
+            message.insert(message.end(), kdf.salt.begin(), kdf.salt.end());
+            hash_digest(round % 2, message.data(), message.size(), digest.data());
+            if (!std::equal(digest.begin(), digest.begin() + kdf.key_length, keys.begin() + n * kdf.key_length)) {
+                failures++;
+                std::cerr << "MISMATCH " << kdf.algorithm << " KDF on " << to_hex(message.data(), message.size()) << std::endl;
+                break;
+            }
+        }
+    }
+    std::cout << "Hashes: " << sizeof(hash_vectors) / sizeof(hash_vectors[0]) << " MD5/SHA-1 vectors, 20 KDF batches up to "
+        << (simd_level() >= 2 ? "AVX2" : "scalar") << std::endl;
+
+    // PDF handlers written by another implementation: the password must reproduce /U and a
+    // neighbour must not; the batch derivation must agree with the single-key one
+    const struct { int revision; int key_bits; const char* owner; const char* user; const char* password; } pdf_vectors[] = {
+        { 2, 40, "e3370f9b98c5819f3c4932be9f972e3f82d17649a0f5065bebe51fab379d21c2", "d750a99c9699eaa64ac645360725282653efbdac33ccbefcebac4756c76ddd60", "k9q" },
+        { 3, 128, "08cb72232fe1a6327b9078f8fdba5c0ec65cd8bfcdacfcdc373fb768ce2c1d17", "4401bda7dd0184192126a1bb7263bf2d28bf4e5e4e758a4164004e56fffa0108", "zx7" },
+    };
+    for (const auto& entry : pdf_vectors) {
+        PdfSecurity pdf = make_pdf_security(entry.revision, entry.key_bits, parse_hex(entry.owner), parse_hex(entry.user),
+            parse_hex("3539633230626261656338326531623563363363616265663561666165663131"), -4, true);
+        std::string password = entry.password, wrong = password;
+        wrong.back()++;
+        std::vector<unsigned char> key(pdf.key_length), wrong_key(pdf.key_length);
+        pdf_file_key(pdf, (const unsigned char*)password.data(), (int)password.size(), key.data());
+        pdf_file_key(pdf, (const unsigned char*)wrong.data(), (int)wrong.size(), wrong_key.data());
+        if (!pdf_key_matches(pdf, key.data()) || pdf_key_matches(pdf, wrong_key.data())) {
+            failures++;
+            std::cerr << "MISMATCH PDF revision " << entry.revision << " password " << password << std::endl;
+        }
+        Keyspace keyspace{ password + "abcdefgh", "" };
+        std::vector<unsigned char> keys(40 * pdf.key_length), single(pdf.key_length), candidate(password.size());
+        pdf_file_keys_cpu(pdf, keyspace, (int)password.size(), 100, 40, keys.data());
+        for (size_t n = 0; n < 40; n++) {
+            key_from_index(100 + n, keyspace, (int)password.size(), candidate.data());
+            pdf_file_key(pdf, candidate.data(), (int)candidate.size(), single.data());
+            if (!std::equal(single.begin(), single.end(), keys.begin() + n * pdf.key_length)) {
+                failures++;
+                std::cerr << "MISMATCH PDF batch key derivation, revision " << entry.revision << std::endl;
+                break;
+            }
+        }
+    }
+    std::string pdf_text = "<< /O (a\\(b\\)\\101\\r\\\n(c)\r\n) /U <4 1f> /V 4 /CF << /StdCF << /CFM /V2 >> >> /Ref 12 0 R /P -44 >>";
+    size_t pdf_pos = 0;
+    std::map<std::string, std::string> pdf_dictionary = pdf_read_dictionary(pdf_text, pdf_pos);
+    size_t owner_pos = 0, user_pos = 0;
+    std::vector<unsigned char> pdf_owner = pdf_read_string(pdf_dictionary["O"], owner_pos), pdf_user = pdf_read_string(pdf_dictionary["U"], user_pos);
+    if (pdf_pos != pdf_text.size() || std::string(pdf_owner.begin(), pdf_owner.end()) != "a(b)A\r(c)\n" || to_hex(pdf_user.data(), pdf_user.size()) != "41f0"
+        || pdf_dictionary["Ref"] != "12 0 R" || pdf_dictionary["P"] != "-44") {
+        failures++;
+        std::cerr << "MISMATCH PDF dictionary reader" << std::endl;
+    }
+    std::cout << "PDF: " << sizeof(pdf_vectors) / sizeof(pdf_vectors[0]) << " security handler vectors, batch derivation and the dictionary reader checked" << std::endl;
+
+    // Every vector validator this CPU runs must find the same first rejected byte as the scalar one
+    std::mt19937 validator_rng(seed);
+    int validator_cases = 0;
+    for (int round = 0; round < 200; round++) {
+        ByteClass cls = round % 2 ? printable_byte_class() : ByteClass();
+        for (int c = 0; c < 256 && round % 2 == 0; c++) {
+            if (validator_rng() % 4) {
+                cls.add((unsigned char)c);
+            }
+        }
+        std::vector<unsigned char> accepted;
+        for (int c = 0; c < 256; c++) {
+            if (cls.contains((unsigned char)c)) {
+                accepted.push_back((unsigned char)c);
+            }
+        }
+        std::vector<unsigned char> buffer(validator_rng() % 300);
+        for (unsigned char& byte : buffer) {
+            byte = accepted[validator_rng() % accepted.size()];
+        }
+        if (!buffer.empty() && round % 3) {
+            buffer[validator_rng() % buffer.size()] = (unsigned char)validator_rng();
+        }
+        size_t expected = first_invalid_scalar(cls, buffer.data(), buffer.size());
+        std::vector<std::pair<const char*, size_t>> actual = { { simd_level_name(), first_invalid_byte(cls, buffer.data(), buffer.size()) } };
+#if defined(__x86_64__) || defined(__i386__)
+        if (simd_level() >= 2) {
+            actual.push_back({ "SSE4.2", first_invalid_sse42(cls, buffer.data(), buffer.size()) });
+        }
+        if (simd_level() >= 3) {
+            actual.push_back({ "AVX2", first_invalid_avx2(cls, buffer.data(), buffer.size()) });
+        }
+#endif
+        for (const auto& entry : actual) {
+            if (entry.second != expected) {
+                failures++;
+                std::cerr << "MISMATCH " << entry.first << " validator: first invalid byte " << entry.second << ", scalar says " << expected << std::endl;
+            }
+        }
+        std::vector<unsigned char> other(buffer.size());
+        for (unsigned char& byte : other) {
+            byte = (unsigned char)validator_rng();
+        }
+        XorStats scalar_stats = xor_stats_scalar(buffer.data(), other.data(), buffer.size());
+        XorStats vector_stats = xor_stats(buffer.data(), other.data(), buffer.size());
+        if (scalar_stats.bits != vector_stats.bits || scalar_stats.high != vector_stats.high || scalar_stats.equal != vector_stats.equal) {
+            failures++;
+            std::cerr << "MISMATCH " << simd_level_name() << " XOR statistics on " << buffer.size() << " bytes" << std::endl;
+        }
+        validator_cases++;
+    }
+    const std::pair<const char*, size_t> utf8_cases[] = {
+        { "48c3a9e282acf09f9880", 10 }, { "41c080", 1 }, { "41eda080", 1 }, { "f4908080", 0 }, { "e282", 0 }, { "41e282ac42ff", 5 },
+    };
+    for (const auto& entry : utf8_cases) {
+        std::vector<unsigned char> bytes = parse_hex(entry.first);
+        size_t actual = first_invalid_utf8(bytes.data(), bytes.size());
+        if (actual != entry.second) {
+            failures++;
+            std::cerr << "MISMATCH utf8 " << entry.first << ": first invalid byte " << actual << ", expected " << entry.second << std::endl;
+        }
+    }
+    // With every code point accepted the incremental text decoder must agree with the UTF-8
+    // validator; script restrictions reject at the first code point outside them
+    TextScripts all_text = parse_text_scripts("0-10ffff");
+    const char* utf8_pieces[] = { "41", "0a", "c3a9", "d0bf", "e282ac", "e4b8ad", "f09f9880", "c0", "ed", "80", "f5", "e2", "f4" };
+    for (int round = 0; round < 200; round++) {
+        std::vector<unsigned char> buffer;
+        for (int n = validator_rng() % 12; n > 0; n--) {
+            std::vector<unsigned char> piece = parse_hex(utf8_pieces[validator_rng() % (round % 2 ? 7 : 13)]);
+            buffer.insert(buffer.end(), piece.begin(), piece.end());
+        }
+        size_t expected = first_invalid_utf8(buffer.data(), buffer.size());
+        size_t actual = first_rejected_text(all_text, buffer.data(), buffer.size());
+        if (actual != expected) {
+            failures++;
+            std::cerr << "MISMATCH text decoder on " << to_hex(buffer.data(), buffer.size()) << ": " << actual << ", validator says " << expected << std::endl;
+        }
+    }
+    const struct { const char* scripts; const char* hex; size_t expected; } script_cases[] = {
+        { "cyrillic", "d09fd180d0b8d0b2d0b5d18220e2809420", 17 }, { "cjk", "d09fd180", 0 }, { "cjk", "e4b8ade69687e38082", 9 },
+        { "arabic", "d985d8b1d8add8a8d8a7", 10 }, { "ascii", "4869c3a9", 2 }, { "latin", "4869c3a9", 4 },
+    };
+    for (const auto& entry : script_cases) {
+        std::vector<unsigned char> bytes = parse_hex(entry.hex);
+        size_t actual = first_rejected_text(parse_text_scripts(entry.scripts), bytes.data(), bytes.size());
+        if (actual != entry.expected) {
+            failures++;
+            std::cerr << "MISMATCH scripts " << entry.scripts << " on " << entry.hex << ": first rejected byte " << actual << ", expected " << entry.expected << std::endl;
+        }
+    }
+
+    std::cout << "Validators: " << validator_cases << " byte-class and XOR statistics buffers up to " << simd_level_name() << ", "
+        << sizeof(utf8_cases) / sizeof(utf8_cases[0]) << " UTF-8 cases, 200 text decoder buffers, "
+        << sizeof(script_cases) / sizeof(script_cases[0]) << " script cases" << std::endl;
+
+    bool have_opencl = false;
+    OpenCLContext cl{};
+    cl_kernel decrypt_kernel = nullptr;
+    cl_kernel search_kernel = nullptr;
+    try {
+        cl = create_opencl_context(device_type);
+        cl_int err;
+        decrypt_kernel = clCreateKernel(cl.program, "rc4_decrypt", &err);
+        if (err != CL_SUCCESS) {
+            std::cerr << "Failed to create OpenCL kernel. Error code: " << err << std::endl;
+            throw std::runtime_error("OpenCL kernel creation error");
+        }
+        search_kernel = create_search_kernel(cl);
+        have_opencl = true;
+    }
+    catch (const std::exception& e) {
+        std::cout << "OpenCL backends skipped: " << e.what() << std::endl;
+    }
+
+    // Random keys, 1..32 bytes, covering the key-length wrap in the KSA
+    std::mt19937 rng(seed);
+    const size_t stream_length = 80;
+    for (int n = 0; n < random_keys; n++) {
+        std::vector<unsigned char> key(1 + rng() % 32);
+        for (unsigned char& byte : key) {
+            byte = (unsigned char)rng();
+        }
+        std::vector<unsigned char> expected = rc4_reference(key, 0, 0, stream_length);
+
+        std::vector<unsigned char> cpu(stream_length);
+        rc4_keystream(key.data(), (int)key.size(), cpu.data(), cpu.size());
+        report("cpu", key, 0, expected, cpu);
+
+        // The word-at-a-time target check must accept the key's own keystream and nothing else
+        size_t target_length = 1 + rng() % stream_length;
+        std::vector<unsigned char> target(expected.begin(), expected.begin() + target_length);
+        bool own = keystream_matches(key.data(), (int)key.size(), pack_keystream_words(target.data(), target_length).data(), target_length);
+        target[rng() % target_length] ^= (unsigned char)(1 + rng() % 255);
+        bool other = keystream_matches(key.data(), (int)key.size(), pack_keystream_words(target.data(), target_length).data(), target_length);
+        if (!own || other) {
+            failures++;
+            std::cerr << "MISMATCH cpu keystream target check key=" << to_hex(key.data(), key.size()) << " length=" << target_length << std::endl;
+        }
+
+        if (have_opencl) {
+            report("opencl:rc4_decrypt", key, 0, expected, opencl_rc4_decrypt_keystream(cl, decrypt_kernel, key, stream_length));
+        }
+    }
+    std::cout << "Differential: " << random_keys << " random keys (seed " << seed << ") through reference, cpu"
+        << (have_opencl ? ", opencl:rc4_decrypt" : "") << std::endl;
+
+    // The search kernel reports key indices rather than keystream, so diff its hit sets
+    // against the reference over small random charsets and a 2-byte printable check
+    if (have_opencl) {
+        for (int round = 0; round < 4; round++) {
+            Keyspace keyspace{ std::string(16, '\0'), "" };
+            std::vector<unsigned char> ciphertext(2);
+            for (char& c : keyspace.charset) {
+                c = (char)rng();
+            }
+            for (unsigned char& byte : ciphertext) {
+                byte = (unsigned char)rng();
+            }
+            for (int key_length = 1; key_length <= 3; key_length++) {
+                std::vector<cl_ulong> expected;
+                std::vector<unsigned char> key(key_length);
+                for (cl_ulong index = 0; index < keyspace_size(keyspace, key_length); index++) {
+                    key_from_index(index, keyspace, key_length, key.data());
+                    std::vector<unsigned char> keystream = rc4_reference(key, 0, 0, ciphertext.size());
+                    bool printable = true;
+                    for (size_t k = 0; k < ciphertext.size(); k++) {
+                        unsigned char c = ciphertext[k] ^ keystream[k];
+                        printable = printable && (isprint(c) || isspace(c));
+                    }
+                    if (printable) {
+                        expected.push_back(index);
+                    }
+                }
+                std::vector<cl_ulong> actual = opencl_search_hits(cl, search_kernel, ciphertext, keyspace.charset, key_length);
+                if (actual != expected) {
+                    failures++;
+                    std::cerr << "MISMATCH opencl:rc4_search charset=" << to_hex((const unsigned char*)keyspace.charset.data(), keyspace.charset.size())
+                        << " key-length=" << key_length << " expected " << expected.size() << " hits, got " << actual.size() << std::endl;
+                }
+            }
+        }
+        std::cout << "Differential: rc4_search hit sets checked against reference" << std::endl;
+
+        // rc4_score must rank exactly like the host scorer, including through hit-list reruns
+        Oracle oracle;
+        oracle.kind = OracleKind::score;
+        oracle.top_k = 8;
+        oracle.model = build_score_model(std::vector<unsigned char>(default_score_corpus, default_score_corpus + strlen(default_score_corpus)));
+        cl_kernel score_kernel = create_search_kernel(cl, oracle);
+        for (int round = 0; round < 2; round++) {
+            Keyspace keyspace{ std::string(64, '\0'), "" };
+            std::vector<unsigned char> ciphertext(24);
+            for (char& c : keyspace.charset) {
+                c = (char)rng();
+            }
+            for (unsigned char& byte : ciphertext) {
+                byte = (unsigned char)rng();
+            }
+            const int key_length = 3;
+            SearchResult expected, actual;
+            std::vector<unsigned char> key(key_length), plaintext(ciphertext.size());
+            for (cl_ulong index = 0; index < keyspace_size(keyspace, key_length); index++) {
+                key_from_index(index, keyspace, key_length, key.data());
+                std::vector<unsigned char> keystream = rc4_reference(key, 0, 0, ciphertext.size());
+                for (size_t k = 0; k < ciphertext.size(); k++) {
+                    plaintext[k] = ciphertext[k] ^ keystream[k];
+                }
+                offer_scored_key(expected.ranked, oracle.top_k, score_plaintext(oracle.model, plaintext.data(), plaintext.size()), key.data(), key_length);
+            }
+            OpenCLSearchBuffers buffers = create_search_buffers(cl, ciphertext, keyspace, key_length, oracle);
+            search_batch_opencl(cl, score_kernel, buffers, ciphertext, keyspace, key_length, 0, keyspace_size(keyspace, key_length), actual);
+            release_search_buffers(buffers);
+            finish_ranking(expected, ciphertext);
+            finish_ranking(actual, ciphertext);
+            for (size_t k = 0; k < oracle.top_k; k++) {
+                if (actual.ranked.size() != expected.ranked.size() || actual.ranked[k].key != expected.ranked[k].key || actual.ranked[k].score != expected.ranked[k].score) {
+                    failures++;
+                    std::cerr << "MISMATCH opencl:rc4_score charset=" << to_hex((const unsigned char*)keyspace.charset.data(), keyspace.charset.size())
+                        << " rank " << k + 1 << " differs from the host scorer" << std::endl;
+                    break;
+                }
+            }
+        }
+        clReleaseKernel(score_kernel);
+        std::cout << "Differential: rc4_score top-" << oracle.top_k << " checked against the host scorer" << std::endl;
+
+        // rc4_keystream_match must find the key whose keystream is the target, for targets
+        // ending inside a 64-bit word, on a word boundary and in the second word
+        Oracle target_oracle;
+        target_oracle.kind = OracleKind::keystream;
+        cl_kernel match_kernel = create_search_kernel(cl, target_oracle);
+        for (size_t target_length : { 4, 8, 13 }) {
+            Keyspace keyspace{ std::string(32, '\0'), "" };
+            for (char& c : keyspace.charset) {
+                c = (char)rng();
+            }
+            const int key_length = 3;
+            std::vector<unsigned char> key(key_length);
+            key_from_index(rng() % keyspace_size(keyspace, key_length), keyspace, key_length, key.data());
+            std::vector<unsigned char> target = rc4_reference(key, 0, 0, target_length);
+            target_oracle.check_length = target_length;
+            SearchResult actual;
+            OpenCLSearchBuffers buffers = create_search_buffers(cl, target, keyspace, key_length, target_oracle);
+            search_batch_opencl(cl, match_kernel, buffers, target, keyspace, key_length, 0, keyspace_size(keyspace, key_length), actual);
+            release_search_buffers(buffers);
+            if (!actual.found || actual.key != key) {
+                failures++;
+                std::cerr << "MISMATCH opencl:rc4_keystream_match key=" << to_hex(key.data(), key.size()) << " length=" << target_length << std::endl;
+            }
+        }
+
+        // Constrained keyspaces: fixed, ranged, excluded and charset positions decode the same
+        // way on the device, and key_index inverts the host decoder
+        Keyspace constrained{ "xyz", compile_key_constraints("41,*{2},30-39|61!35,ff", "xyz") };
+        unsigned long long constrained_keys = keyspace_size(constrained, 5);
+        std::vector<unsigned char> constrained_key(5);
+        unsigned long long constrained_index = rng() % constrained_keys;
+        key_from_index(constrained_index, constrained, 5, constrained_key.data());
+        std::vector<unsigned char> constrained_target = rc4_reference(constrained_key, 0, 0, 8);
+        target_oracle.check_length = 8;
+        SearchResult constrained_result;
+        OpenCLSearchBuffers constrained_buffers = create_search_buffers(cl, constrained_target, constrained, 5, target_oracle);
+        search_batch_opencl(cl, match_kernel, constrained_buffers, constrained_target, constrained, 5, 0, constrained_keys, constrained_result);
+        release_search_buffers(constrained_buffers);
+        unsigned long long decoded_index = 0;
+        std::vector<unsigned char> outside_key = constrained_key;
+        outside_key[0] = 0x42;
+        if (constrained_keys != 90 || constrained_key[0] != 0x41 || constrained_key[4] != 0xff || constrained_key[3] == '5'
+            || !key_index(constrained_key.data(), 5, constrained, decoded_index) || decoded_index != constrained_index
+            || key_index(outside_key.data(), 5, constrained, decoded_index)
+            || !constrained_result.found || constrained_result.key != constrained_key) {
+            failures++;
+            std::cerr << "MISMATCH constrained keyspace key=" << to_hex(constrained_key.data(), 5) << " keys=" << constrained_keys << std::endl;
+        }
+        clReleaseKernel(match_kernel);
+        std::cout << "Differential: rc4_keystream_match checked on 4-, 8- and 13-byte targets and a constrained keyspace" << std::endl;
+
+        // rc4_multi_target must report every key whose keystream is a target and nothing else,
+        // with some targets unreachable so the search never stops early
+        Oracle multi_oracle;
+        multi_oracle.kind = OracleKind::multi;
+        cl_kernel multi_kernel = create_search_kernel(cl, multi_oracle);
+        Keyspace keyspace{ std::string(32, '\0'), "" };
+        for (char& c : keyspace.charset) {
+            c = (char)rng();
+        }
+        const int key_length = 3;
+        std::vector<unsigned char> key(key_length);
+        for (int t = 0; t < 60; t++) {
+            std::vector<unsigned char> keystream(8 + rng() % 9);
+            if (t < 50) {
+                key_from_index(rng() % keyspace_size(keyspace, key_length), keyspace, key_length, key.data());
+                rc4_keystream(key.data(), key_length, keystream.data(), keystream.size());
+            }
+            else {
+                for (unsigned char& byte : keystream) {
+                    byte = (unsigned char)rng();
+                }
+            }
+            multi_oracle.targets.push_back({ std::to_string(t), keystream });
+        }
+        multi_oracle.target_set = build_target_set(multi_oracle.targets);
+        SearchResult multi_result;
+        OpenCLSearchBuffers multi_buffers = create_search_buffers(cl, multi_oracle.targets[0].keystream, keyspace, key_length, multi_oracle);
+        search_batch_opencl(cl, multi_kernel, multi_buffers, multi_oracle.targets[0].keystream, keyspace, key_length, 0, keyspace_size(keyspace, key_length), multi_result);
+        release_search_buffers(multi_buffers);
+        clReleaseKernel(multi_kernel);
+        size_t reachable = 0;
+        for (const TargetMatch& match : multi_result.matches) {
+            reachable += match.target < 50;
+        }
+        if (reachable != 50 || multi_result.matches.size() != 50 || multi_result.found) {
+            failures++;
+            std::cerr << "MISMATCH opencl:rc4_multi_target matched " << multi_result.matches.size() << " targets, " << reachable << " of 50 reachable" << std::endl;
+        }
+        std::cout << "Differential: rc4_multi_target checked on 50 reachable and 10 unreachable targets" << std::endl;
+
+        // rc4_tmto_chains must walk exactly the host's chains
+        TmtoParams tmto;
+        tmto.key_bits = 16 + 8 * (rng() % 3);
+        tmto.chain_length = 1 + rng() % 32;
+        tmto.table = (int)(rng() % 16);
+        cl_int err;
+        cl_kernel tmto_kernel = clCreateKernel(cl.program, "rc4_tmto_chains", &err);
+        uint64_t first_start = rng() % 4096;
+        if (err != CL_SUCCESS || tmto_chain_ends_opencl(cl, tmto_kernel, tmto, first_start, 256) != tmto_chain_ends_cpu(tmto, first_start, 256)) {
+            failures++;
+            std::cerr << "MISMATCH opencl:rc4_tmto_chains key-bits=" << tmto.key_bits << " length=" << tmto.chain_length << " table=" << tmto.table << std::endl;
+        }
+        if (err == CL_SUCCESS) {
+            clReleaseKernel(tmto_kernel);
+        }
+        std::cout << "Differential: rc4_tmto_chains checked on 256 chains of " << tmto.chain_length << " over 2^" << tmto.key_bits << " keys" << std::endl;
+
+        // rc4_prefix_values must produce the host's table entries
+        cl_kernel prefix_kernel = clCreateKernel(cl.program, "rc4_prefix_values", &err);
+        cl_mem prefix_charset = clCreateBuffer(cl.context, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR, keyspace.charset.size(), (void*)keyspace.charset.data(), &err);
+        uint64_t prefix_base = rng() % (keyspace_size(keyspace, key_length) - 1024);
+        std::vector<PrefixEntry> host_entries, device_entries;
+        prefix_entries_cpu(keyspace.charset, key_length, prefix_base, 1024, 7, host_entries);
+        prefix_entries_opencl(cl, prefix_kernel, prefix_charset, keyspace.charset, key_length, prefix_base, 1024, 7, device_entries);
+        clReleaseMemObject(prefix_charset);
+        clReleaseKernel(prefix_kernel);
+        for (size_t k = 0; k < host_entries.size(); k++) {
+            if (host_entries[k].prefix != device_entries[k].prefix || host_entries[k].ordinal != device_entries[k].ordinal) {
+                failures++;
+                std::cerr << "MISMATCH opencl:rc4_prefix_values index=" << prefix_base + k << std::endl;
+                break;
+            }
+        }
+        std::cout << "Differential: rc4_prefix_values checked on 1024 keys of length " << key_length << std::endl;
+
+        // rc4_keystream_histogram must count exactly the host's samples, across position windows
+        cl_kernel histogram_kernel = clCreateKernel(cl.program, "rc4_keystream_histogram", &err);
+        size_t histogram_positions = 1 + rng() % 48;
+        uint64_t histogram_seed = rng(), histogram_first = rng() % 100000;
+        std::vector<uint64_t> host_histogram(histogram_positions * 256, 0), device_histogram(histogram_positions * 256, 0);
+        sample_keystream_histogram(histogram_positions, histogram_seed, histogram_first, 1000, host_histogram);
+        sample_keystream_histogram_opencl(cl, histogram_kernel, histogram_positions, histogram_seed, histogram_first, 1000, device_histogram);
+        clReleaseKernel(histogram_kernel);
+        if (host_histogram != device_histogram) {
+            failures++;
+            std::cerr << "MISMATCH opencl:rc4_keystream_histogram positions=" << histogram_positions << " seed=" << histogram_seed << std::endl;
+        }
+        std::cout << "Differential: rc4_keystream_histogram checked on 1000 keys over " << histogram_positions << " positions" << std::endl;
+
+        // kdf_derive_keys must derive the host's keys, and the two-stage pipeline must find a
+        // passphrase planted in a small keyspace
+        for (const char* algorithm : { "md5", "sha1" }) {
+            KdfSpec kdf;
+            kdf.algorithm = algorithm;
+            kdf.key_length = 1 + rng() % kdf_digest_length(kdf.algorithm);
+            kdf.salt.resize(rng() % 16);
+            for (unsigned char& byte : kdf.salt) {
+                byte = (unsigned char)rng();
+            }
+            std::vector<unsigned char> ciphertext(24, 0);
+            Oracle kdf_oracle;
+            kdf_oracle.kind = OracleKind::keystream;
+            key_from_index(rng() % keyspace_size(keyspace, key_length), keyspace, key_length, key.data());
+            std::vector<unsigned char> derived(kdf.key_length);
+            derive_kdf_key(kdf, key.data(), key_length, derived.data());
+            rc4_keystream(derived.data(), kdf.key_length, ciphertext.data(), ciphertext.size());
+
+            OpenCLKdfPipeline pipeline = create_kdf_pipeline(cl, ciphertext, keyspace, kdf, kdf_oracle);
+            const cl_ulong kdf_base = rng() % 10000, kdf_count = 1000;
+            derive_kdf_keys_opencl(cl, pipeline, keyspace, key_length, kdf, kdf_base, kdf_count);
+            std::vector<unsigned char> host_keys(kdf_count * kdf.key_length), device_keys(host_keys.size());
+            derive_kdf_keys_cpu(kdf, (const unsigned char*)keyspace.charset.data(), keyspace.charset.size(), false, key_length, kdf_base, kdf_count, host_keys.data());
+            err = clEnqueueReadBuffer(cl.queue, pipeline.keys, CL_TRUE, 0, device_keys.size(), device_keys.data(), 0, nullptr, nullptr);
+            release_kdf_pipeline(pipeline);
+            SearchResult kdf_result = search_kdf_opencl(cl, ciphertext, keyspace, key_length, kdf, nullptr, KeyspaceShard(), kdf_oracle);
+            // Short derived keys collide, so any passphrase deriving the planted key is a find
+            std::vector<unsigned char> found_derived(kdf.key_length);
+            if (kdf_result.found) {
+                derive_kdf_key(kdf, kdf_result.key.data(), (int)kdf_result.key.size(), found_derived.data());
+            }
+            if (err != CL_SUCCESS || host_keys != device_keys || !kdf_result.found || found_derived != derived) {
+                failures++;
+                std::cerr << "MISMATCH opencl:kdf_derive_keys " << algorithm << " key-length=" << kdf.key_length << " salt=" << to_hex(kdf.salt.data(), kdf.salt.size()) << std::endl;
+            }
+        }
+        std::cout << "Differential: kdf_derive_keys and rc4_search_keys checked on MD5 and SHA-1 keys" << std::endl;
+
+        // pdf_check_keys must find a password planted in the keyspace for each revision, and
+        // for 40-bit keys with derive off, the file key it derives from among its neighbours
+        for (int revision = 2; revision <= 4; revision++) {
+            std::vector<unsigned char> owner(32), id(16 + rng() % 17), user(32);
+            for (unsigned char& byte : owner) {
+                byte = (unsigned char)rng();
+            }
+            for (unsigned char& byte : id) {
+                byte = (unsigned char)rng();
+            }
+            int key_bits = revision == 4 ? 40 + 8 * (rng() % 11) : 40;
+            PdfSecurity pdf = make_pdf_security(revision, key_bits, owner, user, id, (int32_t)rng(), rng() % 2);
+            uint64_t planted = rng() % keyspace_size(keyspace, key_length);
+            key_from_index(planted, keyspace, key_length, key.data());
+            std::vector<unsigned char> file_key(pdf.key_length);
+            pdf_file_key(pdf, key.data(), key_length, file_key.data());
+            std::vector<unsigned char> value = pdf_user_value(pdf, file_key.data());
+            std::copy(value.begin(), value.end(), user.begin());
+            pdf = make_pdf_security(revision, key_bits, owner, user, id, pdf.permissions, pdf.encrypt_metadata);
+
+            OpenCLPdfSearch pdf_search = create_pdf_search(cl, pdf, keyspace);
+            std::vector<cl_ulong> hits = pdf_batch_opencl(cl, pdf_search, pdf, keyspace, key_length, false, 0, keyspace_size(keyspace, key_length));
+            release_pdf_search(pdf_search);
+            bool key_found = pdf.key_length != 5;
+            if (!key_found) {
+                Keyspace bytes{ std::string(256, '\0'), "" };
+                for (int c = 0; c < 256; c++) {
+                    bytes.charset[c] = (char)c;
+                }
+                unsigned long long index = 0;
+                key_index(file_key.data(), pdf.key_length, bytes, index);
+                cl_ulong first = index < 512 ? 0 : index - 512;
+                pdf_search = create_pdf_search(cl, pdf, bytes);
+                std::vector<cl_ulong> key_hits = pdf_batch_opencl(cl, pdf_search, pdf, bytes, pdf.key_length, true, first, 1024);
+                release_pdf_search(pdf_search);
+                key_found = std::find(key_hits.begin(), key_hits.end(), index) != key_hits.end();
+            }
+            if (std::find(hits.begin(), hits.end(), planted) == hits.end() || !key_found) {
+                failures++;
+                std::cerr << "MISMATCH opencl:pdf_check_keys revision " << revision << " key-bits=" << key_bits << " password=" << to_hex(key.data(), key_length) << std::endl;
+            }
+        }
+        std::cout << "Differential: pdf_check_keys checked on planted passwords and file keys for revisions 2 to 4" << std::endl;
+    }
+
+    if (have_opencl) {
+        clReleaseKernel(search_kernel);
+        clReleaseKernel(decrypt_kernel);
+        release_opencl_context(cl);
+    }
+
+    std::cout << (failures == 0 ? "Self-test passed" : "Self-test FAILED: " + std::to_string(failures) + " mismatches") << std::endl;
+    return failures == 0;
+}
+
+// A search request as carried over the daemon socket: one line of space-separated key=value
+// fields, e.g. "JOB input=/data/capture.bin charset=abc123 max-key-length=4 backend=gpu".
+// priority is the job's weight in the daemon's fair-share scheduler. A --key-constraints
+// keyspace travels as key-layout-hex in place of charset/charset-hex.
+struct SearchJob {
+    std::vector<unsigned char> encrypted_data;
+    Keyspace keyspace{ default_charset, "" };
+    int max_key_length = 5;
+    std::string backend = "gpu";
+    std::string oracle = "printable";
+    std::string output;
+    double priority = 1.0;
+};
+
+SearchJob parse_job(const std::string& fields) {
+    SearchJob job;
+    bool have_input = false;
+    std::stringstream ss(fields);
+    std::string field;
+    while (ss >> field) {
+        size_t eq = field.find('=');
+        if (eq == std::string::npos) {
+            throw std::runtime_error("Malformed job field: " + field);
+        }
+        std::string name = field.substr(0, eq);
+        std::string value = field.substr(eq + 1);
+        if (name == "input") {
+            job.encrypted_data = read_file(value);
+            have_input = true;
+        }
+        else if (name == "input-hex") {
+            job.encrypted_data = parse_hex(value);
+            have_input = true;
+        }
+        else if (name == "charset") {
+            check_charset(value);
+            job.keyspace = Keyspace{ value, "" };
+        }
+        else if (name == "charset-hex" || name == "key-layout-hex") {
+            job.keyspace = parse_keyspace_field(name, value);
+        }
+        else if (name == "max-key-length") {
+            job.max_key_length = std::stoi(value);
+        }
+        else if (name == "backend") {
+            job.backend = value;
+        }
+        else if (name == "oracle") {
+            job.oracle = value;
+        }
+        else if (name == "output") {
+            job.output = value;
+        }
+        else if (name == "priority") {
+            job.priority = std::stod(value);
+        }
+        else {
+            throw std::runtime_error("Unknown job field: " + name);
+        }
+    }
+    if (!have_input || job.encrypted_data.empty()) {
+        throw std::runtime_error("Job has no input");
+    }
+    if (job.keyspace.table().empty() || job.max_key_length < 1) {
+        throw std::runtime_error("Job has an empty keyspace");
+    }
+    if (job.backend != "gpu" && job.backend != "cpu") {
+        throw std::runtime_error("Unknown backend: " + job.backend);
+    }
+    if (job.oracle != "printable") {
+        throw std::runtime_error("Unknown oracle: " + job.oracle);
+    }
+    if (!(job.priority > 0)) {
+        throw std::runtime_error("Job priority must be positive");
+    }
+    return job;
+}
+
+bool send_line(int fd, const std::string& line) {
+    std::string data = line + "\n";
+    size_t sent = 0;
+    while (sent < data.size()) {
+        ssize_t n = send(fd, data.data() + sent, data.size() - sent, MSG_NOSIGNAL);
+        if (n <= 0) {
+            return false;
+        }
+        sent += n;
+    }
+    return true;
+}
+
+// Reads one '\n'-terminated line, keeping any over-read bytes in `pending`
+bool read_line(int fd, std::string& pending, std::string& line) {
+    size_t newline;
+    while ((newline = pending.find('\n')) == std::string::npos) {
+        char chunk[4096];
+        ssize_t n = recv(fd, chunk, sizeof(chunk), 0);
+        if (n <= 0) {
+            return false;
+        }
+        pending.append(chunk, n);
+    }
+    line = pending.substr(0, newline);
+    pending.erase(0, newline + 1);
+    if (!line.empty() && line.back() == '\r') {
+        line.pop_back();
+    }
+    return true;
+}
+
+sockaddr_un unix_socket_address(const std::string& socket_path) {
+    sockaddr_un address{};
+    address.sun_family = AF_UNIX;
+    if (socket_path.size() >= sizeof(address.sun_path)) {
+        throw std::runtime_error("Socket path too long: " + socket_path);
+    }
+    std::strcpy(address.sun_path, socket_path.c_str());
+    return address;
+}
+
+// Engines the daemon keeps alive between jobs
+struct WarmEngines {
+    bool have_opencl = false;
+    OpenCLContext cl{};
+    cl_kernel search_kernel = nullptr;
+};
+
+// A client connection. Jobs hold a reference so the device thread can stream replies; sends
+// from the connection thread and the device thread are serialised.
+struct DaemonClient {
+    int fd;
+    std::mutex send_mutex;
+    std::atomic<bool> connected{ true };
+
+    explicit DaemonClient(int fd) : fd(fd) {}
+    ~DaemonClient() { close(fd); }
+
+    bool send(const std::string& line) {
+        std::lock_guard<std::mutex> lock(send_mutex);
+        if (connected && !send_line(fd, line)) {
+            connected = false;
+        }
+        return connected;
+    }
+};
+
+// A client's connection thread. The thread sets finished as its last step, so the accept
+// loop can join it without blocking and a resident daemon keeps threads only for live clients.
+struct DaemonConnection {
+    std::thread thread;
+    std::weak_ptr<DaemonClient> client;
+    std::shared_ptr<std::atomic<bool>> finished;
+};
+
+// Keys handed to one job per turn on the device
+const unsigned long long cpu_work_unit = 1 << 18;
+
+// A queued or running job and its scheduling/accounting state
+struct ScheduledJob {
+    unsigned long long id;
+    SearchJob job;
+    std::shared_ptr<DaemonClient> client;
+    double weight = 1.0;
+    double virtual_time = 0.0;
+    int key_length = 1;
+    unsigned long long next_index = 0;
+    std::atomic<bool> cancelled{ false };
+    SearchResult result;
+    double device_seconds = 0.0;
+    unsigned long long work_units = 0;
+    std::chrono::steady_clock::time_point submitted;
+    std::chrono::steady_clock::time_point last_report;
+
+    bool engine_ready = false;
+    OpenCLSearchBuffers cl_buffers{};
+    CpuSearchEngine cpu_engine;
+};
+
+// Weighted fair queuing over device work units: each job carries a virtual time that advances
+// by one work unit divided by its weight whenever it is served, and the job with the smallest
+// virtual time runs next. New jobs start at the current virtual clock, so a short job is
+// served at the next batch boundary instead of waiting behind the running ones.
+struct JobScheduler {
+    std::mutex mutex;
+    std::condition_variable cv;
+    std::vector<std::shared_ptr<ScheduledJob>> active;
+    double virtual_clock = 0.0;
+    unsigned long long next_job_id = 1;
+    bool running = true;
+};
+
+unsigned long long schedule_job(JobScheduler& scheduler, const SearchJob& job, const std::shared_ptr<DaemonClient>& client) {
+    auto scheduled = std::make_shared<ScheduledJob>();
+    scheduled->job = job;
+    scheduled->client = client;
+    scheduled->weight = job.priority;
+    scheduled->submitted = scheduled->last_report = std::chrono::steady_clock::now();
+    {
+        std::lock_guard<std::mutex> lock(scheduler.mutex);
+        scheduled->id = scheduler.next_job_id++;
+        scheduled->virtual_time = scheduler.virtual_clock;
+        scheduler.active.push_back(scheduled);
+    }
+    scheduler.cv.notify_all();
+    return scheduled->id;
+}
+
+std::shared_ptr<ScheduledJob> pick_next_job(JobScheduler& scheduler) {
+    std::unique_lock<std::mutex> lock(scheduler.mutex);
+    scheduler.cv.wait(lock, [&] { return !scheduler.running || !scheduler.active.empty(); });
+    if (!scheduler.running) {
+        return nullptr;
+    }
+    auto next = std::min_element(scheduler.active.begin(), scheduler.active.end(), [](const auto& a, const auto& b) {
+        return a->virtual_time != b->virtual_time ? a->virtual_time < b->virtual_time : a->id < b->id;
+        });
+    scheduler.virtual_clock = (*next)->virtual_time;
+    return *next;
+}
+
+void finish_job(JobScheduler& scheduler, ScheduledJob& job) {
+    std::string id = std::to_string(job.id);
+    if (job.result.found) {
+        job.client->send("FOUND " + id + " key-hex=" + to_hex(job.result.key.data(), job.result.key.size()));
+        if (!job.job.output.empty()) {
+            write_file(job.job.output, job.result.plaintext);
+        }
+    }
+    std::chrono::duration<double> wall = std::chrono::steady_clock::now() - job.submitted;
+    std::string status = job.result.found ? "found" : job.cancelled ? "cancelled" : "exhausted";
+    std::ostringstream done;
+    done << "DONE " << id << " status=" << status << " keys=" << job.result.keys_tested << " work-units=" << job.work_units
+        << " device-seconds=" << job.device_seconds << " seconds=" << wall.count()
+        << " keys-per-sec=" << (unsigned long long)(job.device_seconds > 0 ? job.result.keys_tested / job.device_seconds : 0.0);
+    job.client->send(done.str());
+
+    if (job.engine_ready) {
+        if (job.job.backend == "cpu") {
+            release_cpu_engine(job.cpu_engine);
+        }
+        else {
+            release_search_buffers(job.cl_buffers);
+        }
+    }
+    std::lock_guard<std::mutex> lock(scheduler.mutex);
+    scheduler.active.erase(std::remove_if(scheduler.active.begin(), scheduler.active.end(), [&](const auto& other) {
+        return other.get() == &job;
+        }), scheduler.active.end());
+}
+
+// Runs one work unit of a job on its backend and advances its cursor and virtual time
+void run_work_unit(JobScheduler& scheduler, WarmEngines& engines, ScheduledJob& job) {
+    if (!job.client->connected) {
+        job.cancelled = true;
+    }
+    if (!job.cancelled && !job.engine_ready) {
+        if (job.job.backend == "cpu") {
+            job.cpu_engine = create_cpu_engine(job.job.encrypted_data, job.job.keyspace, job.job.max_key_length);
+        }
+        else if (engines.have_opencl) {
+            job.cl_buffers = create_search_buffers(engines.cl, job.job.encrypted_data, job.job.keyspace, job.job.max_key_length);
+        }
+        else {
+            job.client->send("ERROR " + std::to_string(job.id) + " OpenCL is not available in this daemon; use backend=cpu");
+            job.cancelled = true;
+        }
+        job.engine_ready = !job.cancelled;
+    }
+    if (job.cancelled) {
+        finish_job(scheduler, job);
+        return;
+    }
+
+    unsigned long long total = keyspace_size(job.job.keyspace, job.key_length);
+    unsigned long long unit = job.job.backend == "cpu" ? cpu_work_unit : opencl_batch_size;
+    unsigned long long count = std::min(unit, total - job.next_index);
+
+    auto unit_start = std::chrono::steady_clock::now();
+    if (job.job.backend == "cpu") {
+        search_range_cpu(job.cpu_engine, job.job.encrypted_data, job.job.keyspace, job.key_length, job.next_index, job.next_index + count, job.result);
+    }
+    else {
+        search_batch_opencl(engines.cl, engines.search_kernel, job.cl_buffers, job.job.encrypted_data, job.job.keyspace,
+            job.key_length, job.next_index, count, job.result);
+    }
+    std::chrono::duration<double> unit_seconds = std::chrono::steady_clock::now() - unit_start;
+    job.device_seconds += unit_seconds.count();
+    job.work_units++;
+
+    {
+        std::lock_guard<std::mutex> lock(scheduler.mutex);
+        job.virtual_time += (double)count / unit / job.weight;
+        job.next_index += count;
+        if (job.next_index == total) {
+            job.key_length++;
+            job.next_index = 0;
+        }
+    }
+
+    if (job.result.found || job.key_length > job.job.max_key_length) {
+        finish_job(scheduler, job);
+        return;
+    }
+
+    auto now = std::chrono::steady_clock::now();
+    if (now - job.last_report >= std::chrono::milliseconds(500)) {
+        job.last_report = now;
+        job.client->send("PROGRESS " + std::to_string(job.id) + " key-length=" + std::to_string(job.key_length)
+            + " done=" + std::to_string(job.next_index) + " total=" + std::to_string(keyspace_size(job.job.keyspace, job.key_length))
+            + " keys=" + std::to_string(job.result.keys_tested)
+            + " keys-per-sec=" + std::to_string((unsigned long long)(job.result.keys_tested / job.device_seconds)));
+    }
+}
+
+void send_status(JobScheduler& scheduler, DaemonClient& client) {
+    std::vector<std::string> lines;
+    {
+        std::lock_guard<std::mutex> lock(scheduler.mutex);
+        double total_seconds = 0.0;
+        for (const auto& job : scheduler.active) {
+            total_seconds += job->device_seconds;
+        }
+        for (const auto& job : scheduler.active) {
+            std::ostringstream line;
+            line << "JOB " << job->id << " priority=" << job->weight << " key-length=" << job->key_length
+                << " done=" << job->next_index << " keys=" << job->result.keys_tested << " device-seconds=" << job->device_seconds
+                << " share=" << (total_seconds > 0 ? job->device_seconds / total_seconds : 0.0);
+            lines.push_back(line.str());
+        }
+    }
+    for (const std::string& line : lines) {
+        client.send(line);
+    }
+    client.send("END");
+}
+
+void cancel_job(JobScheduler& scheduler, unsigned long long id) {
+    std::lock_guard<std::mutex> lock(scheduler.mutex);
+    for (const auto& job : scheduler.active) {
+        if (job->id == id) {
+            job->cancelled = true;
+        }
+    }
+}
+
+// Long-lived search service: the OpenCL context, program and kernels are created once and
+// jobs arrive over a Unix domain socket, one connection thread per client. A single device
+// thread time-slices work units across the active jobs. Protocol (one line each way):
+//   client: JOB <fields> | STATUS | CANCEL <id> | PING | SHUTDOWN
+//   daemon: ACCEPTED <id> | PROGRESS <id> ... | FOUND <id> key-hex=... | DONE <id> status=...
+//           | JOB <id> ... END (status) | ERROR ... | PONG
+int run_daemon(const std::string& socket_path, cl_device_type device_type) {
+    WarmEngines engines;
+    try {
+        engines.cl = create_opencl_context(device_type);
+        engines.search_kernel = create_search_kernel(engines.cl);
+        engines.have_opencl = true;
+    }
+    catch (const std::exception& e) {
+        std::cerr << "Daemon running without OpenCL: " << e.what() << std::endl;
+    }
+
+    int listen_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    sockaddr_un address = unix_socket_address(socket_path);
+    unlink(socket_path.c_str());
+    if (listen_fd < 0 || bind(listen_fd, (sockaddr*)&address, sizeof(address)) != 0 || listen(listen_fd, 16) != 0) {
+        std::cerr << "Failed to listen on " << socket_path << ": " << std::strerror(errno) << std::endl;
+        throw std::runtime_error("Daemon socket error");
+    }
+    std::cout << "Daemon listening on " << socket_path << std::endl;
+
+    JobScheduler scheduler;
+    std::thread device_thread([&]() {
+        while (std::shared_ptr<ScheduledJob> job = pick_next_job(scheduler)) {
+            try {
+                run_work_unit(scheduler, engines, *job);
+            }
+            catch (const std::exception& e) {
+                job->client->send("ERROR " + std::to_string(job->id) + " " + e.what());
+                job->cancelled = true;
+                finish_job(scheduler, *job);
+            }
+        }
+    });
+
+    std::mutex clients_mutex;
+    std::vector<DaemonConnection> connections;
+    while (true) {
+        int fd = accept(listen_fd, nullptr, nullptr);
+        if (fd < 0) {
+            std::lock_guard<std::mutex> lock(scheduler.mutex);
+            if (!scheduler.running) {
+                break;
+            }
+            continue;
+        }
+        auto client = std::make_shared<DaemonClient>(fd);
+        auto finished = std::make_shared<std::atomic<bool>>(false);
+        std::lock_guard<std::mutex> lock(clients_mutex);
+        for (auto it = connections.begin(); it != connections.end();) {
+            if (*it->finished) {
+                it->thread.join();
+                it = connections.erase(it);
+            }
+            else {
+                ++it;
+            }
+        }
+        connections.push_back({ std::thread([&, client, finished]() {
+            std::string pending, line;
+            while (read_line(client->fd, pending, line)) {
+                if (line == "PING") {
+                    client->send("PONG");
+                }
+                else if (line == "STATUS") {
+                    send_status(scheduler, *client);
+                }
+                else if (line.compare(0, 7, "CANCEL ") == 0) {
+                    cancel_job(scheduler, std::stoull(line.substr(7)));
+                }
+                else if (line == "SHUTDOWN") {
+                    {
+                        std::lock_guard<std::mutex> lock(scheduler.mutex);
+                        scheduler.running = false;
+                    }
+                    scheduler.cv.notify_all();
+                    shutdown(listen_fd, SHUT_RDWR);
+                    break;
+                }
+                else if (line.compare(0, 4, "JOB ") == 0) {
+                    try {
+                        SearchJob job = parse_job(line.substr(4));
+                        // ACCEPTED must precede any reply the device thread streams for this job
+                        std::lock_guard<std::mutex> lock(client->send_mutex);
+                        send_line(client->fd, "ACCEPTED " + std::to_string(schedule_job(scheduler, job, client)));
+                    }
+                    catch (const std::exception& e) {
+                        client->send(std::string("ERROR ") + e.what());
+                    }
+                }
+                else {
+                    client->send("ERROR unknown command");
+                }
+            }
+            client->connected = false;
+            *finished = true;
+        }), client, finished });
+    }
+
+    device_thread.join();
+    {
+        std::lock_guard<std::mutex> lock(clients_mutex);
+        for (const DaemonConnection& connection : connections) {
+            if (auto client = connection.client.lock()) {
+                shutdown(client->fd, SHUT_RDWR);
+            }
+        }
+    }
+    for (DaemonConnection& connection : connections) {
+        connection.thread.join();
+    }
+    for (const auto& job : scheduler.active) {
+        if (job->engine_ready) {
+            if (job->job.backend == "cpu") {
+                release_cpu_engine(job->cpu_engine);
+            }
+            else {
+                release_search_buffers(job->cl_buffers);
+            }
+        }
+    }
+    scheduler.active.clear();
+
+    close(listen_fd);
+    unlink(socket_path.c_str());
+    if (engines.have_opencl) {
+        clReleaseKernel(engines.search_kernel);
+        release_opencl_context(engines.cl);
+    }
+    return 0;
+}
+
+// Sends one job to a running daemon and relays its replies until the job is done
+int submit_job(const std::string& socket_path, const std::string& job_fields) {
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    sockaddr_un address = unix_socket_address(socket_path);
+    if (fd < 0 || connect(fd, (sockaddr*)&address, sizeof(address)) != 0) {
+        std::cerr << "Failed to connect to " << socket_path << ": " << std::strerror(errno) << std::endl;
+        throw std::runtime_error("Daemon connection error");
+    }
+    send_line(fd, "JOB " + job_fields);
+
+    int status = 1;
+    std::string pending, line;
+    while (read_line(fd, pending, line)) {
+        std::cout << line << std::endl;
+        if (line.compare(0, 5, "DONE ") == 0) {
+            status = line.find("status=found") != std::string::npos ? 0 : 2;
+            break;
+        }
+        if (line.compare(0, 6, "ERROR ") == 0) {
+            break;
+        }
+    }
+    close(fd);
+    return status;
+}
+
+// FNV-1a, used to tie shard progress files to the ciphertext they were produced for
+unsigned long long fnv1a_64(const std::vector<unsigned char>& data) {
+    unsigned long long hash = 0xcbf29ce484222325ULL;
+    for (unsigned char byte : data) {
+        hash = (hash ^ byte) * 0x100000001b3ULL;
+    }
+    return hash;
+}
+
+// Identifies the search a shard progress file belongs to; files only merge when these match
+std::string keyspace_signature(const std::vector<unsigned char>& encrypted_data, const Keyspace& keyspace, int max_key_length) {
+    std::ostringstream signature;
+    signature << "keyspace " << keyspace_field(keyspace)
+        << " max-key-length=" << max_key_length << " input-fnv=" << std::hex << fnv1a_64(encrypted_data);
+    return signature.str();
+}
+
+// Shard progress file: a header, then one line per fully tested index range and per key found.
+// Lines are flushed as they are written, so a file left by a dead node is still mergeable.
+//   rc4fun-shard 1
+//   keyspace charset-hex=... max-key-length=5 input-fnv=...   (key-layout-hex=... when constrained)
+//   shard 3/12:4/12
+//   done <key-length> <begin> <end>
+//   found <key-length> <index> <key-hex>
+struct ShardLog {
+    std::ofstream file;
+};
+
+void open_shard_log(ShardLog& log, const std::string& path, const std::string& signature, const KeyspaceShard& shard) {
+    log.file.open(path, std::ios::trunc);
+    if (!log.file) {
+        std::cerr << "Failed to open progress file: " << path << std::endl;
+        throw std::runtime_error("File open error");
+    }
+    log.file << "rc4fun-shard 1\n" << signature << "\n"
+        << "shard " << shard.begin.num << "/" << shard.begin.den << ":" << shard.end.num << "/" << shard.end.den << std::endl;
+}
+
+struct MergedLength {
+    std::vector<std::pair<unsigned long long, unsigned long long>> ranges;
+};
+
+// Combines shard progress files: unions the tested ranges per key length, lists keys found and
+// reports every index range that no file covers. Returns 0 when a key was found or the keyspace
+// is fully covered, 3 when gaps remain.
+int merge_shard_logs(const std::vector<std::string>& paths, const std::string& output_path) {
+    std::string signature;
+    Keyspace keyspace;
+    int max_key_length = 0;
+    std::map<int, MergedLength> lengths;
+    std::vector<std::string> found;
+
+    for (const std::string& path : paths) {
+        std::ifstream file(path);
+        std::string magic, file_signature, line;
+        if (!file || !std::getline(file, magic) || magic != "rc4fun-shard 1" || !std::getline(file, file_signature)) {
+            std::cerr << "Not a shard progress file: " << path << std::endl;
+            throw std::runtime_error("Merge error");
+        }
+        if (signature.empty()) {
+            signature = file_signature;
+            std::stringstream fields(signature.substr(9));
+            std::string field;
+            while (fields >> field) {
+                if (field.compare(0, 12, "charset-hex=") == 0 || field.compare(0, 15, "key-layout-hex=") == 0) {
+                    size_t eq = field.find('=');
+                    keyspace = parse_keyspace_field(field.substr(0, eq), field.substr(eq + 1));
+                }
+                else if (field.compare(0, 15, "max-key-length=") == 0) {
+                    max_key_length = std::stoi(field.substr(15));
+                }
+            }
+        }
+        else if (file_signature != signature) {
+            std::cerr << "Keyspace mismatch in " << path << ":\n  " << file_signature << "\n  expected " << signature << std::endl;
+            throw std::runtime_error("Merge error");
+        }
+
+        while (std::getline(file, line)) {
+            std::stringstream ss(line);
+            std::string kind;
+            ss >> kind;
+            if (kind == "done") {
+                int key_length;
+                unsigned long long begin, end;
+                if (ss >> key_length >> begin >> end) {
+                    lengths[key_length].ranges.push_back({ begin, end });
+                }
+            }
+            else if (kind == "found") {
+                found.push_back(line.substr(6));
+            }
+        }
+    }
+    if (signature.empty() || keyspace.table().empty()) {
+        throw std::runtime_error("Nothing to merge");
+    }
+
+    std::ofstream output;
+    if (!output_path.empty()) {
+        output.open(output_path, std::ios::trunc);
+        output << "rc4fun-shard 1\n" << signature << "\nshard 0/1:1/1\n";
+    }
+
+    unsigned long long total_keys = 0, covered_keys = 0;
+    size_t gap_count = 0;
+    for (int key_length = 1; key_length <= max_key_length; key_length++) {
+        unsigned long long total = keyspace_size(keyspace, key_length);
+        std::vector<std::pair<unsigned long long, unsigned long long>>& ranges = lengths[key_length].ranges;
+        std::sort(ranges.begin(), ranges.end());
+
+        // Union of tested ranges, then the complement is the list of gaps
+        std::vector<std::pair<unsigned long long, unsigned long long>> merged;
+        for (const auto& range : ranges) {
+            if (!merged.empty() && range.first <= merged.back().second) {
+                merged.back().second = std::max(merged.back().second, range.second);
+            }
+            else {
+                merged.push_back(range);
+            }
+        }
+        unsigned long long covered = 0, cursor = 0;
+        std::vector<std::pair<unsigned long long, unsigned long long>> gaps;
+        for (const auto& range : merged) {
+            covered += range.second - range.first;
+            if (range.first > cursor) {
+                gaps.push_back({ cursor, range.first });
+            }
+            cursor = range.second;
+            if (output.is_open()) {
+                output << "done " << key_length << " " << range.first << " " << range.second << "\n";
+            }
+        }
+        if (cursor < total) {
+            gaps.push_back({ cursor, total });
+        }
+
+        total_keys += total;
+        covered_keys += covered;
+        gap_count += gaps.size();
+        std::cout << "Key length " << key_length << ": " << covered << "/" << total << " keys covered, " << gaps.size() << " gaps" << std::endl;
+        for (size_t g = 0; g < gaps.size() && g < 10; g++) {
+            std::cout << "  gap [" << gaps[g].first << ", " << gaps[g].second << ")" << std::endl;
+        }
+        if (gaps.size() > 10) {
+            std::cout << "  ... " << gaps.size() - 10 << " more" << std::endl;
+        }
+    }
+
+    for (const std::string& entry : found) {
+        std::stringstream ss(entry);
+        int key_length;
+        unsigned long long index;
+        std::string key_hex;
+        ss >> key_length >> index >> key_hex;
+        std::vector<unsigned char> key = parse_hex(key_hex);
+        std::cout << "Key found: " << std::string(key.begin(), key.end()) << " (length " << key_length << ", index " << index << ")" << std::endl;
+        if (output.is_open()) {
+            output << "found " << entry << "\n";
+        }
+    }
+    std::cout << "Coverage: " << covered_keys << "/" << total_keys << " keys ("
+        << (total_keys ? 100.0 * covered_keys / total_keys : 0.0) << "%)" << std::endl;
+    return !found.empty() || gap_count == 0 ? 0 : 3;
+}
+
+int tcp_listen(int port) {
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    int reuse = 1;
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+    sockaddr_in address{};
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = htonl(INADDR_ANY);
+    address.sin_port = htons((uint16_t)port);
+    if (fd < 0 || bind(fd, (sockaddr*)&address, sizeof(address)) != 0 || listen(fd, 64) != 0) {
+        std::cerr << "Failed to listen on port " << port << ": " << std::strerror(errno) << std::endl;
+        throw std::runtime_error("Coordinator socket error");
+    }
+    return fd;
+}
+
+// Connects to "host:port"
+int tcp_connect(const std::string& endpoint) {
+    size_t colon = endpoint.rfind(':');
+    if (colon == std::string::npos) {
+        throw std::runtime_error("Invalid endpoint: " + endpoint + " (expected host:port)");
+    }
+    addrinfo hints{}, *addresses = nullptr;
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    if (getaddrinfo(endpoint.substr(0, colon).c_str(), endpoint.substr(colon + 1).c_str(), &hints, &addresses) != 0) {
+        throw std::runtime_error("Cannot resolve " + endpoint);
+    }
+    int fd = -1;
+    for (addrinfo* address = addresses; address && fd < 0; address = address->ai_next) {
+        fd = socket(address->ai_family, address->ai_socktype, address->ai_protocol);
+        if (fd >= 0 && connect(fd, address->ai_addr, address->ai_addrlen) != 0) {
+            close(fd);
+            fd = -1;
+        }
+    }
+    freeaddrinfo(addresses);
+    if (fd < 0) {
+        std::cerr << "Failed to connect to " << endpoint << ": " << std::strerror(errno) << std::endl;
+        throw std::runtime_error("Coordinator connection error");
+    }
+    return fd;
+}
+
+using IndexRange = std::pair<unsigned long long, unsigned long long>;
+
+// A slice of one key length leased to a worker session until `expires`; heartbeats push it
+// out. worker is the session's display label.
+struct LeasedUnit {
+    int key_length;
+    unsigned long long begin;
+    unsigned long long end;
+    unsigned long long session;
+    std::string worker;
+    std::chrono::steady_clock::time_point expires;
+};
+
+// Every worker connection is a session numbered by the coordinator. Leases and rate estimates
+// belong to the session: worker names are self-reported and need not be unique.
+
+struct CoordinatorState {
+    std::mutex mutex;
+    SearchJob job;
+    std::map<int, std::vector<IndexRange>> pending;
+    std::map<unsigned long long, LeasedUnit> leased;
+    std::map<unsigned long long, double> session_rate;
+    unsigned long long next_session = 1;
+    unsigned long long next_unit_id = 1;
+    unsigned long long keys_total = 0;
+    unsigned long long keys_done = 0;
+    bool finished = false;
+    std::vector<unsigned char> found_key;
+    std::ofstream journal;
+    double lease_seconds = 60.0;
+    double unit_seconds = 30.0;
+};
+
+// Puts [begin, end) back into the free list of a key length, coalescing neighbours
+void return_range(std::vector<IndexRange>& ranges, unsigned long long begin, unsigned long long end) {
+    ranges.push_back({ begin, end });
+    std::sort(ranges.begin(), ranges.end());
+    std::vector<IndexRange> merged;
+    for (const IndexRange& range : ranges) {
+        if (!merged.empty() && range.first <= merged.back().second) {
+            merged.back().second = std::max(merged.back().second, range.second);
+        }
+        else {
+            merged.push_back(range);
+        }
+    }
+    ranges.swap(merged);
+}
+
+// Removes [begin, end) from a free list
+void remove_range(std::vector<IndexRange>& ranges, unsigned long long begin, unsigned long long end) {
+    std::vector<IndexRange> remaining;
+    for (const IndexRange& range : ranges) {
+        if (range.second <= begin || range.first >= end) {
+            remaining.push_back(range);
+            continue;
+        }
+        if (range.first < begin) {
+            remaining.push_back({ range.first, begin });
+        }
+        if (range.second > end) {
+            remaining.push_back({ end, range.second });
+        }
+    }
+    ranges.swap(remaining);
+}
+
+// Returns leases whose holders stopped heartbeating to the free lists. Caller holds the mutex.
+void reclaim_expired_leases(CoordinatorState& state) {
+    auto now = std::chrono::steady_clock::now();
+    for (auto it = state.leased.begin(); it != state.leased.end();) {
+        if (it->second.expires < now) {
+            std::cout << "Lease " << it->first << " held by " << it->second.worker << " expired; reissuing" << std::endl;
+            state.journal << "expired " << it->first << std::endl;
+            return_range(state.pending[it->second.key_length], it->second.begin, it->second.end);
+            it = state.leased.erase(it);
+        }
+        else {
+            ++it;
+        }
+    }
+}
+
+// Journal: the keyspace header, then lease/done/expired/found records. Replaying it restores
+// completed ranges; leases that were outstanding when the coordinator stopped are reissued.
+void replay_journal(CoordinatorState& state, const std::string& path, const std::string& signature) {
+    std::ifstream file(path);
+    if (!file) {
+        return;
+    }
+    std::string magic, file_signature, line;
+    if (!std::getline(file, magic) || magic != "rc4fun-journal 1" || !std::getline(file, file_signature) || file_signature != signature) {
+        std::cerr << "Journal " << path << " belongs to a different search" << std::endl;
+        throw std::runtime_error("Journal mismatch");
+    }
+    while (std::getline(file, line)) {
+        std::stringstream ss(line);
+        std::string kind;
+        ss >> kind;
+        if (kind == "done") {
+            unsigned long long id, begin, end;
+            int key_length;
+            if (ss >> id >> key_length >> begin >> end) {
+                remove_range(state.pending[key_length], begin, end);
+                state.keys_done += end - begin;
+                state.next_unit_id = std::max(state.next_unit_id, id + 1);
+            }
+        }
+        else if (kind == "lease") {
+            unsigned long long id;
+            if (ss >> id) {
+                state.next_unit_id = std::max(state.next_unit_id, id + 1);
+            }
+        }
+        else if (kind == "found") {
+            int key_length;
+            unsigned long long index;
+            std::string key_hex;
+            if (ss >> key_length >> index >> key_hex) {
+                state.found_key = parse_hex(key_hex);
+                state.finished = true;
+            }
+        }
+    }
+    std::cout << "Journal replayed: " << state.keys_done << "/" << state.keys_total << " keys already done" << std::endl;
+}
+
+// Handles one worker connection as its own session; the HELLO name only labels it in logs.
+// HEARTBEAT and COMPLETE count only for units leased to this session. Protocol (one line each way):
+//   worker: HELLO <name> | REQUEST | HEARTBEAT <unit> | COMPLETE <unit> keys=<n> seconds=<s> | FOUND <unit> <key-hex>
+//   coordinator: JOB <fields> | UNIT <unit> <key-length> <begin> <end> lease=<s> | WAIT <s> | FINISHED | OK | STOP
+void serve_worker(CoordinatorState& state, int fd) {
+    unsigned long long session;
+    {
+        std::lock_guard<std::mutex> lock(state.mutex);
+        session = state.next_session++;
+    }
+    std::string pending, line, worker = "unknown#" + std::to_string(session);
+    while (read_line(fd, pending, line)) {
+        std::stringstream ss(line);
+        std::string command;
+        ss >> command;
+        std::unique_lock<std::mutex> lock(state.mutex);
+
+        if (command == "HELLO") {
+            std::string name;
+            ss >> name;
+            worker = (name.empty() ? "unknown" : name) + "#" + std::to_string(session);
+            std::string fields = "input-hex=" + to_hex(state.job.encrypted_data.data(), state.job.encrypted_data.size())
+                + " " + keyspace_field(state.job.keyspace)
+                + " max-key-length=" + std::to_string(state.job.max_key_length);
+            lock.unlock();
+            send_line(fd, "JOB " + fields);
+        }
+        else if (command == "REQUEST") {
+            if (state.finished) {
+                lock.unlock();
+                send_line(fd, "FINISHED");
+                continue;
+            }
+            reclaim_expired_leases(state);
+            auto length = std::find_if(state.pending.begin(), state.pending.end(), [](const auto& entry) { return !entry.second.empty(); });
+            if (length == state.pending.end()) {
+                bool done = state.leased.empty();
+                lock.unlock();
+                send_line(fd, done ? "FINISHED" : "WAIT " + std::to_string((int)std::ceil(state.lease_seconds / 4)));
+                continue;
+            }
+
+            // Size the unit so it takes about unit_seconds at this worker's measured rate
+            double rate = state.session_rate.count(session) ? state.session_rate[session] : 0.0;
+            unsigned long long size = rate > 0 ? (unsigned long long)(rate * state.unit_seconds) : (1ULL << 20);
+            size = std::max<unsigned long long>(size, 1 << 14);
+            IndexRange& range = length->second.front();
+            LeasedUnit unit{ length->first, range.first, std::min(range.second, range.first + size), session, worker,
+                std::chrono::steady_clock::now() + std::chrono::milliseconds((long long)(state.lease_seconds * 1000)) };
+            range.first = unit.end;
+            if (range.first == range.second) {
+                length->second.erase(length->second.begin());
+            }
+            unsigned long long id = state.next_unit_id++;
+            state.leased[id] = unit;
+            state.journal << "lease " << id << " " << unit.key_length << " " << unit.begin << " " << unit.end << " " << worker << std::endl;
+            lock.unlock();
+            send_line(fd, "UNIT " + std::to_string(id) + " " + std::to_string(unit.key_length) + " " + std::to_string(unit.begin)
+                + " " + std::to_string(unit.end) + " lease=" + std::to_string((int)state.lease_seconds));
+        }
+        else if (command == "HEARTBEAT") {
+            unsigned long long id = 0;
+            ss >> id;
+            auto unit = state.leased.find(id);
+            bool owned = unit != state.leased.end() && unit->second.session == session;
+            if (owned) {
+                unit->second.expires = std::chrono::steady_clock::now() + std::chrono::milliseconds((long long)(state.lease_seconds * 1000));
+            }
+            // A worker whose lease already expired must drop the unit: it has been reissued
+            bool keep = !state.finished && owned;
+            lock.unlock();
+            send_line(fd, keep ? "OK" : "STOP");
+        }
+        else if (command == "COMPLETE") {
+            unsigned long long id = 0, keys = 0;
+            double seconds = 0.0;
+            std::string field;
+            ss >> id;
+            while (ss >> field) {
+                if (field.compare(0, 5, "keys=") == 0) {
+                    keys = std::stoull(field.substr(5));
+                }
+                else if (field.compare(0, 8, "seconds=") == 0) {
+                    seconds = std::stod(field.substr(8));
+                }
+            }
+            auto unit = state.leased.find(id);
+            if (unit != state.leased.end() && unit->second.session == session) {
+                state.keys_done += unit->second.end - unit->second.begin;
+                state.journal << "done " << id << " " << unit->second.key_length << " " << unit->second.begin << " " << unit->second.end << std::endl;
+                state.leased.erase(unit);
+            }
+            if (seconds > 0) {
+                double rate = keys / seconds;
+                double& estimate = state.session_rate[session];
+                estimate = estimate > 0 ? 0.5 * estimate + 0.5 * rate : rate;
+            }
+            std::cout << "Unit " << id << " done by " << worker << ": " << keys << " keys, " << (unsigned long long)(seconds > 0 ? keys / seconds : 0)
+                << " keys/s (" << state.keys_done << "/" << state.keys_total << ")" << std::endl;
+            if (state.leased.empty() && std::all_of(state.pending.begin(), state.pending.end(), [](const auto& entry) { return entry.second.empty(); })) {
+                state.finished = true;
+            }
+            lock.unlock();
+            send_line(fd, "OK");
+        }
+        else if (command == "FOUND") {
+            unsigned long long id = 0;
+            std::string key_hex;
+            ss >> id >> key_hex;
+            std::vector<unsigned char> key = parse_hex(key_hex);
+            std::vector<unsigned char> plaintext;
+            unsigned long long index = 0;
+            // A key outside the job's keyspace has no index to journal, whatever it decrypts to
+            if (!key.empty() && key_index(key.data(), (int)key.size(), state.job.keyspace, index)
+                && verify_candidate(state.job.encrypted_data, key.data(), (int)key.size(), plaintext)) {
+                state.found_key = key;
+                state.finished = true;
+                state.journal << "found " << key.size() << " " << index << " " << key_hex << std::endl;
+                std::cout << "Key found by " << worker << ": " << std::string(key.begin(), key.end()) << std::endl;
+                if (!state.job.output.empty()) {
+                    write_file(state.job.output, plaintext);
+                }
+            }
+            lock.unlock();
+            send_line(fd, "OK");
+        }
+        else {
+            lock.unlock();
+            send_line(fd, "ERROR unknown command");
+        }
+    }
+
+    // A worker that disconnects cleanly hands its session's leases back at once
+    std::lock_guard<std::mutex> lock(state.mutex);
+    state.session_rate.erase(session);
+    for (auto it = state.leased.begin(); it != state.leased.end();) {
+        if (it->second.session == session) {
+            state.journal << "expired " << it->first << std::endl;
+            return_range(state.pending[it->second.key_length], it->second.begin, it->second.end);
+            it = state.leased.erase(it);
+        }
+        else {
+            ++it;
+        }
+    }
+}
+
+int run_coordinator(int port, const SearchJob& job, const std::string& journal_path, double lease_seconds, double unit_seconds) {
+    CoordinatorState state;
+    state.job = job;
+    state.lease_seconds = lease_seconds;
+    state.unit_seconds = unit_seconds;
+    for (int key_length = 1; key_length <= job.max_key_length; key_length++) {
+        unsigned long long total = keyspace_size(job.keyspace, key_length);
+        state.pending[key_length].push_back({ 0, total });
+        state.keys_total += total;
+    }
+
+    std::string signature = keyspace_signature(job.encrypted_data, job.keyspace, job.max_key_length);
+    replay_journal(state, journal_path, signature);
+    bool fresh = !std::ifstream(journal_path).good();
+    state.journal.open(journal_path, std::ios::app);
+    if (!state.journal) {
+        std::cerr << "Failed to open journal: " << journal_path << std::endl;
+        throw std::runtime_error("File open error");
+    }
+    if (fresh) {
+        state.journal << "rc4fun-journal 1\n" << signature << std::endl;
+    }
+
+    int listen_fd = tcp_listen(port);
+    std::cout << "Coordinator listening on port " << port << ", " << state.keys_total << " keys" << std::endl;
+
+    // Wakes the accept loop once the search is over and every lease has been settled
+    std::thread watcher([&]() {
+        while (true) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(200));
+            std::lock_guard<std::mutex> lock(state.mutex);
+            if (state.finished && (state.leased.empty() || !state.found_key.empty())) {
+                shutdown(listen_fd, SHUT_RDWR);
+                return;
+            }
+        }
+    });
+
+    std::vector<int> worker_fds;
+    std::vector<std::thread> worker_threads;
+    while (true) {
+        int fd = accept(listen_fd, nullptr, nullptr);
+        if (fd < 0) {
+            std::lock_guard<std::mutex> lock(state.mutex);
+            if (state.finished) {
+                break;
+            }
+            continue;
+        }
+        worker_fds.push_back(fd);
+        worker_threads.emplace_back([&state, fd]() { serve_worker(state, fd); });
+    }
+    watcher.join();
+
+    // Give connected workers a moment to collect FINISHED/STOP, then hang up on them
+    std::this_thread::sleep_for(std::chrono::milliseconds(500));
+    for (int fd : worker_fds) {
+        shutdown(fd, SHUT_RDWR);
+    }
+    for (std::thread& thread : worker_threads) {
+        thread.join();
+    }
+    for (int fd : worker_fds) {
+        close(fd);
+    }
+    close(listen_fd);
+
+    if (!state.found_key.empty()) {
+        std::cout << "Decryption successful, key found: " << std::string(state.found_key.begin(), state.found_key.end()) << std::endl;
+        return 0;
+    }
+    std::cout << "No valid key found (" << state.keys_done << "/" << state.keys_total << " keys searched)" << std::endl;
+    return 2;
+}
+
+// Worker side: pulls units from the coordinator and runs them on the local backend, sending a
+// heartbeat at least every third of the lease and the unit's throughput when it completes
+int run_worker(const std::string& endpoint, const std::string& backend, cl_device_type device_type, const std::string& name) {
+    int fd = tcp_connect(endpoint);
+    std::string pending, line;
+    send_line(fd, "HELLO " + name);
+    if (!read_line(fd, pending, line) || line.compare(0, 4, "JOB ") != 0) {
+        throw std::runtime_error("Coordinator did not send a job");
+    }
+    SearchJob job = parse_job(line.substr(4));
+
+    OpenCLContext cl{};
+    cl_kernel kernel = nullptr;
+    OpenCLSearchBuffers cl_buffers{};
+    CpuSearchEngine cpu_engine;
+    if (backend == "cpu") {
+        cpu_engine = create_cpu_engine(job.encrypted_data, job.keyspace, job.max_key_length);
+    }
+    else {
+        cl = create_opencl_context(device_type);
+        kernel = create_search_kernel(cl);
+        cl_buffers = create_search_buffers(cl, job.encrypted_data, job.keyspace, job.max_key_length);
+    }
+
+    bool running = true;
+    while (running && send_line(fd, "REQUEST") && read_line(fd, pending, line)) {
+        std::stringstream ss(line);
+        std::string command;
+        ss >> command;
+        if (command == "FINISHED") {
+            break;
+        }
+        if (command == "WAIT") {
+            int seconds = 1;
+            ss >> seconds;
+            std::this_thread::sleep_for(std::chrono::seconds(seconds));
+            continue;
+        }
+        if (command != "UNIT") {
+            throw std::runtime_error("Unexpected coordinator reply: " + line);
+        }
+
+        unsigned long long id, begin, end;
+        int key_length;
+        std::string lease_field;
+        ss >> id >> key_length >> begin >> end >> lease_field;
+        double lease = lease_field.compare(0, 6, "lease=") == 0 ? std::stod(lease_field.substr(6)) : 60.0;
+
+        SearchResult result;
+        auto unit_start = std::chrono::steady_clock::now();
+        auto last_heartbeat = unit_start;
+        bool keep = true;
+        auto heartbeat = [&]() {
+            auto now = std::chrono::steady_clock::now();
+            if (now - last_heartbeat >= std::chrono::milliseconds((long long)(lease * 1000 / 3))) {
+                last_heartbeat = now;
+                keep = send_line(fd, "HEARTBEAT " + std::to_string(id)) && read_line(fd, pending, line) && line == "OK";
+            }
+            return keep;
+        };
+
+        if (backend == "cpu") {
+            search_range_cpu(cpu_engine, job.encrypted_data, job.keyspace, key_length, begin, end, result,
+                [&](const SearchProgress&) { return heartbeat(); });
+        }
+        else {
+            for (unsigned long long base = begin; base < end && keep; base += opencl_batch_size) {
+                unsigned long long count = std::min<unsigned long long>(opencl_batch_size, end - base);
+                if (search_batch_opencl(cl, kernel, cl_buffers, job.encrypted_data, job.keyspace, key_length, base, count, result)) {
+                    break;
+                }
+                heartbeat();
+            }
+        }
+        std::chrono::duration<double> seconds = std::chrono::steady_clock::now() - unit_start;
+
+        if (result.found) {
+            std::cout << "Key found: " << std::string(result.key.begin(), result.key.end()) << std::endl;
+            send_line(fd, "FOUND " + std::to_string(id) + " " + to_hex(result.key.data(), result.key.size()));
+            read_line(fd, pending, line);
+            running = false;
+        }
+        else if (keep && !result.cancelled) {
+            std::ostringstream complete;
+            complete << "COMPLETE " << id << " keys=" << result.keys_tested << " seconds=" << seconds.count();
+            send_line(fd, complete.str());
+            read_line(fd, pending, line);
+            std::cout << "Unit " << id << ": " << result.keys_tested << " keys in " << seconds.count() << " s" << std::endl;
+        }
+    }
+
+    if (backend == "cpu") {
+        release_cpu_engine(cpu_engine);
+    }
+    else {
+        release_search_buffers(cl_buffers);
+        clReleaseKernel(kernel);
+        release_opencl_context(cl);
+    }
+    close(fd);
+    return 0;
+}
+
+// Known keystream for the keystream oracle: given directly, or recovered from a known-plaintext
+// frame as ciphertext XOR plaintext over their common length
+std::vector<unsigned char> load_keystream_target(const std::string& hex, const std::string& path, const std::string& input_path, const std::string& known_plaintext_path) {
+    std::vector<unsigned char> keystream = !hex.empty() ? parse_hex(hex) : !path.empty() ? read_file(path) : read_file(input_path);
+    if (hex.empty() && path.empty()) {
+        std::vector<unsigned char> plaintext = read_file(known_plaintext_path);
+        keystream.resize(std::min(keystream.size(), plaintext.size()));
+        for (size_t k = 0; k < keystream.size(); k++) {
+            keystream[k] ^= plaintext[k];
+        }
+    }
+    if (keystream.empty()) {
+        std::cerr << "The keystream target is empty" << std::endl;
+        throw std::runtime_error("Invalid arguments");
+    }
+    return keystream;
+}
+
+// --benchmark: runs the keystream oracle, the cheapest check there is, for about `seconds` on
+// the selected backend and reports its keys/s as the device's throughput ceiling, next to the
+// printable oracle on the same keyspace. Targets are random, so no key is ever found.
+int run_benchmark(const std::string& backend, cl_device_type device_type, const Keyspace& keyspace, int max_key_length, double seconds) {
+    std::mt19937 rng(1);
+    std::vector<unsigned char> target(64);
+    for (unsigned char& byte : target) {
+        byte = (unsigned char)rng();
+    }
+    long double keys = 0;
+    for (int key_length = 1; key_length <= max_key_length; key_length++) {
+        keys += keyspace_size(keyspace, key_length);
+    }
+
+    OpenCLContext cl = {};
+    if (backend == "gpu") {
+        cl = create_opencl_context(device_type);
+    }
+    double ceiling = 0.0;
+    for (const char* kind : { "keystream", "printable" }) {
+        Oracle oracle;
+        oracle.kind = parse_oracle_kind(kind);
+        oracle.check_length = plan_check_length(oracle, keys, target.size(), 1.0).length;
+
+        auto start = std::chrono::high_resolution_clock::now();
+        ProgressCallback until_done = [&](const SearchProgress&) {
+            std::chrono::duration<double> elapsed = std::chrono::high_resolution_clock::now() - start;
+            return elapsed.count() < seconds;
+        };
+        SearchResult result;
+        if (backend == "gpu") {
+            cl_kernel kernel = create_search_kernel(cl, oracle);
+            result = search_rc4_opencl(cl, kernel, target, keyspace, max_key_length, until_done, KeyspaceShard(), oracle);
+            clReleaseKernel(kernel);
+        }
+        else {
+            result = search_rc4_cpu(target, keyspace, max_key_length, until_done, KeyspaceShard(), oracle);
+        }
+
+        double rate = result.seconds > 0 ? result.keys_tested / result.seconds : 0.0;
+        std::cout << "Benchmark (" << backend << "): " << kind << " oracle over " << oracle.check_length << " bytes, "
+            << result.keys_tested << " keys, " << (unsigned long long)rate << " keys/s";
+        if (ceiling > 0) {
+            std::cout << " (" << 100.0 * rate / ceiling << "% of ceiling)";
+        }
+        else {
+            ceiling = rate;
+            std::cout << " (throughput ceiling)";
+        }
+        std::cout << std::endl;
+        for (const Throughput& entry : result.throughput) {
+            std::cout << "  " << entry.label << ": " << (unsigned long long)(entry.seconds > 0 ? entry.keys / entry.seconds : 0.0) << " keys/s" << std::endl;
+        }
+    }
+    if (backend == "gpu") {
+        release_opencl_context(cl);
+    }
+    return 0;
+}
+
+// --validate: checks a whole file against a byte class or for UTF-8 well-formedness, reports
+// the first failing offset and the validator's throughput. Returns 0 when the file is valid.
+int validate_file(const std::string& path, const ByteClass& cls, bool utf8) {
+    std::vector<unsigned char> data = read_file(path);
+    size_t first_invalid = 0;
+    double best_seconds = 0.0;
+    // Repeat small files so the throughput figure measures the validator, not the timer
+    int rounds = (int)std::max<size_t>(3, std::min<size_t>(1000, (64u << 20) / std::max<size_t>(data.size(), 1)));
+    for (int round = 0; round < rounds; round++) {
+        auto start = std::chrono::high_resolution_clock::now();
+        first_invalid = utf8 ? first_invalid_utf8(data.data(), data.size()) : first_invalid_byte(cls, data.data(), data.size());
+        std::chrono::duration<double> elapsed = std::chrono::high_resolution_clock::now() - start;
+        best_seconds = round == 0 ? elapsed.count() : std::min(best_seconds, elapsed.count());
+    }
+
+    std::cout << (utf8 ? "UTF-8" : "Byte class") << " check of " << data.size() << " bytes (" << (utf8 ? (simd_level() > 0 ? "SSE2 ASCII skip" : "scalar") : simd_level_name()) << "): ";
+    if (first_invalid == data.size()) {
+        std::cout << "valid" << std::endl;
+    }
+    else {
+        std::cout << "first invalid byte at offset " << first_invalid << " (0x" << to_hex(&data[first_invalid], 1) << ")" << std::endl;
+    }
+    if (best_seconds > 0) {
+        std::cout << "Throughput: " << first_invalid / best_seconds / 1e9 << " GB/s" << std::endl;
+    }
+    return first_invalid == data.size() ? 0 : 2;
+}
+
+// Top bits of the 16 bytes at p, bit k from byte k
+uint32_t band_top_bits(const unsigned char* p) {
+#if defined(__x86_64__) || defined(__i386__)
+    return (uint16_t)_mm_movemask_epi8(_mm_loadu_si128((const __m128i*)p));
+#else
+    uint32_t bits = 0;
+    for (int k = 0; k < 16; k++) {
+        bits |= (uint32_t)(p[k] >> 7) << k;
+    }
+    return bits;
+#endif
+}
+
+// --reuse-scan: finds ciphertexts that were encrypted under the same keystream. Plaintext
+// ASCII has a clear top bit, so the top bits of a ciphertext are those of its keystream; each
+// file is bucketed by the top bits of its first 64 bytes, in four 16-byte bands, and only files
+// sharing a band are compared, by the bit count of their XOR over the common length. Pairs
+// scoring at least threshold join a cluster, written as "cluster<TAB>path" lines to
+// clusters_path. With all_pairs every pair is compared instead, for plaintexts that are not text.
+int scan_keystream_reuse(const std::string& directory, double threshold, bool all_pairs, const std::string& clusters_path) {
+    auto start_time = std::chrono::high_resolution_clock::now();
+    std::vector<std::string> paths;
+    if (DIR* dir = opendir(directory.c_str())) {
+        while (dirent* entry = readdir(dir)) {
+            std::string path = directory + "/" + entry->d_name;
+            struct stat info;
+            if (stat(path.c_str(), &info) == 0 && S_ISREG(info.st_mode)) {
+                paths.push_back(path);
+            }
+        }
+        closedir(dir);
+    }
+    else {
+        std::cerr << "Failed to open directory: " << directory << std::endl;
+        throw std::runtime_error("File open error");
+    }
+    std::sort(paths.begin(), paths.end());
+    std::vector<std::vector<unsigned char>> files;
+    size_t too_short = 0;
+    uint64_t total_bytes = 0;
+    for (size_t k = 0; k < paths.size();) {
+        std::vector<unsigned char> data = read_file(paths[k]);
+        if (data.size() < 16) {
+            too_short++;
+            paths.erase(paths.begin() + k);
+            continue;
+        }
+        total_bytes += data.size();
+        files.push_back(std::move(data));
+        k++;
+    }
+
+    // Candidate pairs: same (band, top bits of the band's 16 bytes), or everything
+    const uint64_t n = files.size();
+    std::vector<std::pair<uint32_t, uint32_t>> candidates;
+    if (all_pairs) {
+        for (uint32_t a = 0; a < n; a++) {
+            for (uint32_t b = a + 1; b < n; b++) {
+                candidates.push_back({ a, b });
+            }
+        }
+    }
+    else {
+        std::vector<std::pair<uint32_t, uint32_t>> bands;
+        for (uint32_t file = 0; file < n; file++) {
+            for (uint32_t band = 0; band < 4 && 16 * (band + 1) <= files[file].size(); band++) {
+                bands.push_back({ band << 16 | band_top_bits(files[file].data() + 16 * band), file });
+            }
+        }
+        std::sort(bands.begin(), bands.end());
+        for (size_t begin = 0, end; begin < bands.size(); begin = end) {
+            for (end = begin + 1; end < bands.size() && bands[end].first == bands[begin].first; end++) {
+                for (size_t other = begin; other < end; other++) {
+                    candidates.push_back({ bands[other].second, bands[end].second });
+                }
+            }
+        }
+        std::sort(candidates.begin(), candidates.end());
+        candidates.erase(std::unique(candidates.begin(), candidates.end()), candidates.end());
+    }
+
+    std::vector<XorStats> stats(candidates.size());
+    parallel_for(candidates.size(), 64, [&](size_t, uint64_t begin, uint64_t end) {
+        for (uint64_t k = begin; k < end; k++) {
+            const std::vector<unsigned char>& a = files[candidates[k].first];
+            const std::vector<unsigned char>& b = files[candidates[k].second];
+            stats[k] = xor_stats(a.data(), b.data(), std::min(a.size(), b.size()));
+        }
+    });
+
+    // Union-find over the pairs that pass
+    std::vector<uint32_t> parent(n);
+    for (uint32_t file = 0; file < n; file++) {
+        parent[file] = file;
+    }
+    std::function<uint32_t(uint32_t)> find = [&](uint32_t file) {
+        return parent[file] == file ? file : parent[file] = find(parent[file]);
+    };
+    size_t reused_pairs = 0;
+    uint64_t compared_bytes = 0;
+    std::map<uint32_t, std::vector<size_t>> cluster_pairs;
+    for (size_t k = 0; k < candidates.size(); k++) {
+        compared_bytes += stats[k].bytes;
+        if (stats[k].score() >= threshold) {
+            reused_pairs++;
+            parent[find(candidates[k].first)] = find(candidates[k].second);
+        }
+    }
+    std::map<uint32_t, std::vector<uint32_t>> clusters;
+    for (uint32_t file = 0; file < n; file++) {
+        clusters[find(file)].push_back(file);
+    }
+    for (size_t k = 0; k < candidates.size(); k++) {
+        if (stats[k].score() >= threshold) {
+            cluster_pairs[find(candidates[k].first)].push_back(k);
+        }
+    }
+
+    std::chrono::duration<double> elapsed = std::chrono::high_resolution_clock::now() - start_time;
+    std::cout << "Reuse scan: " << n << " ciphertexts (" << total_bytes << " bytes) in " << directory;
+    if (too_short) {
+        std::cout << ", " << too_short << " shorter than 16 bytes skipped";
+    }
+    std::cout << std::endl;
+    std::cout << "Reuse scan: " << candidates.size() << " of " << n * (n - 1) / 2 << " pairs compared (" << (all_pairs ? "all pairs" : "top-bit bands")
+        << "), " << reused_pairs << " scored at least " << threshold << ", " << compared_bytes << " bytes XORed with " << (simd_level() >= 2 ? "AVX2" : "scalar")
+        << " in " << elapsed.count() << " s" << std::endl;
+
+    std::ofstream output;
+    if (!clusters_path.empty()) {
+        output.open(clusters_path);
+        if (!output) {
+            std::cerr << "Failed to open output file: " << clusters_path << std::endl;
+            throw std::runtime_error("File open error");
+        }
+    }
+    int cluster_id = 0;
+    for (const auto& cluster : clusters) {
+        if (cluster.second.size() < 2) {
+            continue;
+        }
+        cluster_id++;
+        std::cout << "Cluster " << cluster_id << ": " << cluster.second.size() << " ciphertexts" << std::endl;
+        for (uint32_t file : cluster.second) {
+            std::cout << "  " << paths[file] << std::endl;
+            if (output) {
+                output << cluster_id << "\t" << paths[file] << "\n";
+            }
+        }
+        // The strongest few pairs show how clear the evidence is
+        std::vector<size_t>& pairs = cluster_pairs[cluster.first];
+        std::sort(pairs.begin(), pairs.end(), [&](size_t a, size_t b) { return stats[a].score() > stats[b].score(); });
+        pairs.resize(std::min<size_t>(pairs.size(), 5));
+        for (size_t k : pairs) {
+            const XorStats& pair = stats[k];
+            std::cout << "    " << paths[candidates[k].first] << " ^ " << paths[candidates[k].second] << ": score " << pair.score()
+                << ", " << (double)pair.bits / pair.bytes << " bits/byte, " << 100.0 * pair.high / pair.bytes << "% top bits, "
+                << 100.0 * pair.equal / pair.bytes << "% equal over " << pair.bytes << " bytes" << std::endl;
+        }
+    }
+    if (cluster_id == 0) {
+        std::cout << "No keystream reuse found" << std::endl;
+    }
+    else if (output) {
+        std::cout << cluster_id << " clusters written to " << clusters_path << std::endl;
+    }
+    return cluster_id > 0 ? 0 : 2;
+}
+
+// Cribs tried when no --cribs dictionary is given: frequent English words and fragments, the
+// space-delimited forms first since they pin word boundaries as well
+const char* default_cribs[] = {
+    " the ", " and ", " of the ", " to the ", " in the ", " that ", " with ", " from ", " this ", " have ", " will ",
+    " for ", " are ", " was ", " you ", " not ", " but ", " his ", " they ", " which ", " their ", " there ", " been ",
+    " would ", " about ", " please ", " should ", " could ", " after ", " before ", " other ", " these ", " some ",
+    "The ", "This ", "There ", "When ", "Please ", "Dear ", "Subject: ", "From: ", "Date: ", "Hello ",
+    "tion ", "ment ", "ing ", "ight", "ould", "ther", "ough", ". The ", ", and ", ". ", ", ",
+};
+
+// One placed crib: crib text assumed at offset in ciphertext source, worth gain bits of
+// plaintext score summed over the other ciphertexts it decrypts there
+struct CribPlacement {
+    float gain;
+    uint32_t crib;
+    uint32_t source;
+    uint32_t offset;
+};
+
+// Greedy crib dragging over ciphertexts that share a keystream. Every (crib, ciphertext,
+// offset) placement implies keystream bytes, which decrypt the other ciphertexts at that offset;
+// placements whose decryptions score at least min_score bits per byte under the plaintext model
+// are taken best first when they agree with the keystream recovered so far. The keystream is
+// then extended a byte at a time into unknown neighbours while the best byte value still scores
+// min_score across the ciphertexts covering it. Writes each reconstruction, '?' for unknown
+// bytes, to output_path.
+int drag_cribs(const std::vector<std::string>& paths, const std::vector<std::string>& cribs, const ScoreModel& model, double min_score, const std::string& output_path) {
+    auto start_time = std::chrono::high_resolution_clock::now();
+    std::vector<std::vector<unsigned char>> texts;
+    size_t longest = 0;
+    for (const std::string& path : paths) {
+        texts.push_back(read_file(path));
+        longest = std::max(longest, texts.back().size());
+    }
+    if (texts.size() < 2) {
+        std::cerr << "Crib dragging needs at least two ciphertexts under one keystream" << std::endl;
+        throw std::runtime_error("Invalid arguments");
+    }
+
+    // Every placement, in parallel over cribs
+    std::vector<CribPlacement> placements;
+    std::mutex placements_mutex;
+    std::atomic<uint64_t> evaluated(0);
+    parallel_for(cribs.size(), 1, [&](size_t, uint64_t c, uint64_t) {
+        std::vector<CribPlacement> found;
+        std::vector<unsigned char> plaintext;
+        uint64_t count = 0;
+        const std::string& crib = cribs[c];
+        for (size_t source = 0; source < texts.size(); source++) {
+            for (size_t offset = 0; offset + crib.size() <= texts[source].size(); offset++) {
+                float gain = 0.0f;
+                size_t bytes = 0;
+                bool plausible = true;
+                for (size_t other = 0; other < texts.size() && plausible; other++) {
+                    if (other == source || texts[other].size() <= offset) {
+                        continue;
+                    }
+                    size_t length = std::min(crib.size(), texts[other].size() - offset);
+                    plaintext.resize(length);
+                    for (size_t k = 0; k < length; k++) {
+                        plaintext[k] = texts[other][offset + k] ^ texts[source][offset + k] ^ (unsigned char)crib[k];
+                    }
+                    // One implausible decryption rules the placement out, however well the rest score
+                    float score = score_plaintext(model, plaintext.data(), length);
+                    plausible = score >= 0.0f;
+                    gain += score;
+                    bytes += length;
+                }
+                count++;
+                if (plausible && bytes > 0 && gain >= min_score * bytes) {
+                    found.push_back({ gain, (uint32_t)c, (uint32_t)source, (uint32_t)offset });
+                }
+            }
+        }
+        std::lock_guard<std::mutex> lock(placements_mutex);
+        placements.insert(placements.end(), found.begin(), found.end());
+        evaluated += count;
+    });
+    std::sort(placements.begin(), placements.end(), [](const CribPlacement& a, const CribPlacement& b) {
+        return a.gain > b.gain || (a.gain == b.gain && std::tie(a.crib, a.source, a.offset) < std::tie(b.crib, b.source, b.offset));
+    });
+
+    std::vector<unsigned char> keystream(longest, 0);
+    std::vector<bool> known(longest, false);
+    size_t accepted = 0;
+    for (const CribPlacement& placement : placements) {
+        const std::string& crib = cribs[placement.crib];
+        const std::vector<unsigned char>& source = texts[placement.source];
+        bool consistent = true, adds = false;
+        for (size_t k = 0; k < crib.size() && consistent; k++) {
+            unsigned char byte = source[placement.offset + k] ^ (unsigned char)crib[k];
+            consistent = !known[placement.offset + k] || keystream[placement.offset + k] == byte;
+            adds |= !known[placement.offset + k];
+        }
+        if (!consistent || !adds) {
+            continue;
+        }
+        for (size_t k = 0; k < crib.size(); k++) {
+            keystream[placement.offset + k] = source[placement.offset + k] ^ (unsigned char)crib[k];
+            known[placement.offset + k] = true;
+        }
+        if (++accepted > 10) {
+            continue;
+        }
+        std::cout << "  " << to_hex(&keystream[placement.offset], crib.size()) << " at " << placement.offset << ": \"" << crib << "\" in "
+            << paths[placement.source] << ", " << placement.gain << " bits" << std::endl;
+    }
+    if (accepted > 10) {
+        std::cout << "  ... and " << accepted - 10 << " more placements" << std::endl;
+    }
+    size_t from_cribs = std::count(known.begin(), known.end(), true);
+
+    // Extension: the column at position q is scored with the bigram to its known neighbour
+    auto column_gain = [&](size_t q, unsigned char byte, bool forward, size_t& covering) {
+        float gain = 0.0f;
+        covering = 0;
+        for (const std::vector<unsigned char>& text : texts) {
+            size_t neighbour = forward ? q - 1 : q + 1;
+            if (text.size() <= std::max(q, neighbour)) {
+                continue;
+            }
+            unsigned char pair[2] = { (unsigned char)(text[q - forward] ^ keystream[q - forward]), (unsigned char)(text[q + !forward] ^ keystream[q + !forward]) };
+            pair[forward ? 1 : 0] = text[q] ^ byte;
+            gain += score_plaintext(model, pair, 2) - model.unigram[pair[forward ? 0 : 1]];
+            covering++;
+        }
+        return gain;
+    };
+    size_t extended = 0;
+    for (bool changed = true; changed;) {
+        changed = false;
+        for (size_t q = 0; q < longest; q++) {
+            if (known[q]) {
+                continue;
+            }
+            for (bool forward : { true, false }) {
+                if ((forward && (q == 0 || !known[q - 1])) || (!forward && (q + 1 >= longest || !known[q + 1]))) {
+                    continue;
+                }
+                float best_gain = 0.0f;
+                int best_byte = -1;
+                size_t covering = 0;
+                for (int byte = 0; byte < 256; byte++) {
+                    float gain = column_gain(q, (unsigned char)byte, forward, covering);
+                    if (best_byte < 0 || gain > best_gain) {
+                        best_gain = gain;
+                        best_byte = byte;
+                    }
+                }
+                if (covering >= 2 && best_gain >= min_score * covering) {
+                    keystream[q] = (unsigned char)best_byte;
+                    known[q] = true;
+                    extended++;
+                    changed = true;
+                    break;
+                }
+            }
+        }
+    }
+
+    std::ofstream output(output_path, std::ios::binary);
+    if (!output) {
+        std::cerr << "Failed to open output file: " << output_path << std::endl;
+        throw std::runtime_error("File open error");
+    }
+    for (size_t t = 0; t < texts.size(); t++) {
+        std::string plaintext(texts[t].size(), '?');
+        for (size_t k = 0; k < texts[t].size(); k++) {
+            if (known[k]) {
+                plaintext[k] = (char)(texts[t][k] ^ keystream[k]);
+            }
+        }
+        output << "== " << paths[t] << "\n" << plaintext << "\n";
+        std::string shown = plaintext.substr(0, 120);
+        for (char& c : shown) {
+            if (!isprint((unsigned char)c)) {
+                c = '.';
+            }
+        }
+        std::cout << paths[t] << ": " << shown << std::endl;
+    }
+
+    std::chrono::duration<double> elapsed = std::chrono::high_resolution_clock::now() - start_time;
+    std::cout << "Crib dragging: " << evaluated.load() << " placements of " << cribs.size() << " cribs over " << texts.size() << " ciphertexts, "
+        << placements.size() << " scored at least " << min_score << " bits/byte, " << accepted << " accepted, " << elapsed.count() << " s" << std::endl;
+    std::cout << "Keystream: " << from_cribs << " bytes from cribs, " << extended << " extended, " << from_cribs + extended << " of " << longest
+        << " recovered; reconstructions written to " << output_path << std::endl;
+    return from_cribs > 0 ? 0 : 2;
+}
+
+// Fluhrer-McGrew digraphs: (Z_r, Z_r+1) pairs whose probability differs from 2^-16 by a factor
+// of 1 + 2^-8 (1 + 2^-9 for (0, 0) at i = 1, 1 - 2^-8 for the negative ones), i being the PRGA
+// counter when Z_r is produced. Returned as (first, second, log2 of the factor).
+struct Digraph {
+    unsigned char first;
+    unsigned char second;
+    float weight;
+};
+
+std::vector<Digraph> fluhrer_mcgrew_digraphs(int i) {
+    const float up = (float)std::log2(1.0 + 1.0 / 256), down = (float)std::log2(1.0 - 1.0 / 256);
+    std::vector<Digraph> digraphs;
+    auto add = [&](int first, int second, float weight) {
+        digraphs.push_back({ (unsigned char)first, (unsigned char)second, weight });
+    };
+    if (i == 1) {
+        add(0, 0, (float)std::log2(1.0 + 1.0 / 512));
+    }
+    else if (i != 255) {
+        add(0, 0, up);
+    }
+    if (i != 0 && i != 1) {
+        add(0, 1, up);
+    }
+    if (i != 0 && i != 255) {
+        add(0, i + 1, down);
+    }
+    if (i != 254) {
+        add(i + 1, 255, up);
+        add(255, 255, down);
+    }
+    if (i != 1 && i != 254) {
+        add(255, i + 1, up);
+    }
+    if (i != 0 && i < 253) {
+        add(255, i + 2, up);
+    }
+    if (i == 254) {
+        add(255, 0, up);
+    }
+    if (i == 255) {
+        add(255, 1, up);
+    }
+    if (i == 0 || i == 1) {
+        add(255, 2, up);
+    }
+    if (i == 2) {
+        add(129, 129, up);
+    }
+    return digraphs;
+}
+
+// --bias-analyze: histograms positions 1..positions of every ciphertext (the files of a
+// directory, or fixed-length records of one file) and decodes the most likely plaintext. Single
+// bytes are scored against the keystream distribution of a bias table, or one measured here over
+// samples random keys; the
+// first digraph_positions pairs also get Fluhrer-McGrew digraph terms, and a Viterbi pass over
+// them picks the best joint plaintext.
+int analyze_biases(const std::string& path, size_t record_length, size_t positions, size_t digraph_positions, uint64_t samples,
+    const std::string& bias_table_path, const std::string& output_path) {
+    auto start_time = std::chrono::high_resolution_clock::now();
+    std::vector<unsigned char> records;
+    struct stat info;
+    if (stat(path.c_str(), &info) == 0 && S_ISDIR(info.st_mode)) {
+        std::vector<std::string> paths;
+        DIR* dir = opendir(path.c_str());
+        while (dirent* entry = dir ? readdir(dir) : nullptr) {
+            std::string file = path + "/" + entry->d_name;
+            if (stat(file.c_str(), &info) == 0 && S_ISREG(info.st_mode)) {
+                paths.push_back(file);
+            }
+        }
+        if (dir) {
+            closedir(dir);
+        }
+        // Records are cut to the shortest ciphertext so every position has every sample
+        std::vector<std::vector<unsigned char>> files;
+        record_length = SIZE_MAX;
+        for (const std::string& file : paths) {
+            files.push_back(read_file(file));
+            record_length = std::min(record_length, files.back().size());
+        }
+        for (const std::vector<unsigned char>& file : files) {
+            records.insert(records.end(), file.begin(), file.begin() + record_length);
+        }
+    }
+    else {
+        records = read_file(path);
+        if (record_length == 0) {
+            std::cerr << "--record-length is needed to split " << path << " into ciphertexts" << std::endl;
+            throw std::runtime_error("Invalid arguments");
+        }
+    }
+    size_t count = record_length == SIZE_MAX || record_length == 0 ? 0 : records.size() / record_length;
+    positions = std::min(positions, count ? record_length : 0);
+    digraph_positions = std::min(digraph_positions, positions > 0 ? positions - 1 : 0);
+    if (count < 2 || positions == 0) {
+        std::cerr << "Bias analysis needs at least two non-empty ciphertexts" << std::endl;
+        throw std::runtime_error("Invalid arguments");
+    }
+
+    auto count_start = std::chrono::high_resolution_clock::now();
+    std::vector<uint64_t> ciphertext_counts = histogram_records(records.data(), record_length, count, positions);
+    std::chrono::duration<double> count_elapsed = std::chrono::high_resolution_clock::now() - count_start;
+
+    // Digraph counts, four positions per work item: 1 MiB of tables stays in cache while the
+    // records are read once per group instead of once per position
+    const size_t pair_group = 4;
+    std::vector<std::vector<uint32_t>> pair_counts(digraph_positions);
+    parallel_for(digraph_positions, pair_group, [&](size_t, uint64_t first, uint64_t last) {
+        std::vector<uint32_t> counts((last - first) * 65536, 0);
+        for (size_t k = 0; k < count; k++) {
+            const unsigned char* record = &records[k * record_length];
+            for (uint64_t r = first; r < last; r++) {
+                counts[(r - first) * 65536 + (record[r] << 8 | record[r + 1])]++;
+            }
+        }
+        for (uint64_t r = first; r < last; r++) {
+            pair_counts[r].assign(counts.begin() + (r - first) * 65536, counts.begin() + (r - first + 1) * 65536);
+        }
+    });
+    std::chrono::duration<double> pair_elapsed = std::chrono::high_resolution_clock::now() - count_start - count_elapsed;
+
+    auto model_start = std::chrono::high_resolution_clock::now();
+    std::vector<uint64_t> keystream_counts(positions * 256, 0);
+    if (!bias_table_path.empty()) {
+        BiasTable table = map_bias_table(bias_table_path);
+        if (table.header.positions < positions) {
+            release_bias_table(table);
+            std::cerr << "Bias table " << bias_table_path << " covers positions 1-" << table.header.positions << " only" << std::endl;
+            throw std::runtime_error("Invalid arguments");
+        }
+        std::copy(table.counts, table.counts + positions * 256, keystream_counts.begin());
+        samples = table.header.samples;
+        release_bias_table(table);
+    }
+    else {
+        sample_keystream_histogram(positions, 0x5243344249415331ULL, 0, samples, keystream_counts);
+    }
+    std::chrono::duration<double> model_elapsed = std::chrono::high_resolution_clock::now() - model_start;
+
+    // likelihood[r * 256 + p] = sum over ciphertext bytes c of N_r(c) log2 P_r(c ^ p)
+    std::vector<double> likelihood(positions * 256, 0.0);
+    for (size_t r = 0; r < positions; r++) {
+        double log_probability[256];
+        for (int z = 0; z < 256; z++) {
+            log_probability[z] = std::log2((keystream_counts[r * 256 + z] + 1.0) / (samples + 256.0));
+        }
+        for (int p = 0; p < 256; p++) {
+            double sum = 0.0;
+            for (int c = 0; c < 256; c++) {
+                sum += ciphertext_counts[r * 256 + c] * log_probability[c ^ p];
+            }
+            likelihood[r * 256 + p] = sum;
+        }
+    }
+
+    std::vector<unsigned char> plaintext(positions);
+    std::vector<double> margin(positions);
+    for (size_t r = 0; r < positions; r++) {
+        const double* row = &likelihood[r * 256];
+        int best = (int)(std::max_element(row, row + 256) - row);
+        double second = -std::numeric_limits<double>::infinity();
+        for (int p = 0; p < 256; p++) {
+            if (p != best) {
+                second = std::max(second, row[p]);
+            }
+        }
+        plaintext[r] = (unsigned char)best;
+        margin[r] = row[best] - second;
+    }
+
+    // Viterbi over positions 0..digraph_positions: state is the plaintext byte at r
+    size_t viterbi_changed = 0;
+    if (digraph_positions > 0) {
+        std::vector<double> score(likelihood.begin(), likelihood.begin() + 256), next_score(256);
+        std::vector<unsigned char> back(digraph_positions * 256);
+        std::vector<float> transition(65536);
+        for (size_t r = 0; r < digraph_positions; r++) {
+            std::fill(transition.begin(), transition.end(), 0.0f);
+            for (const Digraph& digraph : fluhrer_mcgrew_digraphs((int)((r + 1) & 255))) {
+                for (int p = 0; p < 256; p++) {
+                    for (int q = 0; q < 256; q++) {
+                        transition[p << 8 | q] += digraph.weight * pair_counts[r][(p ^ digraph.first) << 8 | (q ^ digraph.second)];
+                    }
+                }
+            }
+            for (int q = 0; q < 256; q++) {
+                double best = -std::numeric_limits<double>::infinity();
+                for (int p = 0; p < 256; p++) {
+                    double candidate = score[p] + transition[p << 8 | q];
+                    if (candidate > best) {
+                        best = candidate;
+                        back[r * 256 + q] = (unsigned char)p;
+                    }
+                }
+                next_score[q] = best + likelihood[(r + 1) * 256 + q];
+            }
+            score.swap(next_score);
+        }
+        unsigned char state = (unsigned char)(std::max_element(score.begin(), score.end()) - score.begin());
+        for (size_t r = digraph_positions + 1; r-- > 0;) {
+            viterbi_changed += plaintext[r] != state;
+            plaintext[r] = state;
+            if (r > 0) {
+                state = back[(r - 1) * 256 + state];
+            }
+        }
+    }
+
+    std::chrono::duration<double> elapsed = std::chrono::high_resolution_clock::now() - start_time;
+    std::cout << "Bias analysis: " << count << " ciphertexts, positions 1-" << positions << ", counted in " << count_elapsed.count() << " s ("
+        << (count_elapsed.count() > 0 ? count * positions / count_elapsed.count() / 1e9 : 0.0) << " GB/s), digraphs of positions 1-" << digraph_positions + (digraph_positions > 0)
+        << " in " << pair_elapsed.count() << " s" << std::endl;
+    std::cout << "Bias analysis: keystream model from " << samples << " random keys" << (bias_table_path.empty() ? "" : " in " + bias_table_path)
+        << " in " << model_elapsed.count() << " s, "
+        << viterbi_changed << " bytes changed by the digraph pass, " << elapsed.count() << " s total" << std::endl;
+    std::string shown(plaintext.begin(), plaintext.end());
+    for (char& c : shown) {
+        if (!isprint((unsigned char)c)) {
+            c = '.';
+        }
+    }
+    std::cout << "Plaintext: " << shown << std::endl;
+    std::cout << "Margins (bits):";
+    for (size_t r = 0; r < std::min<size_t>(positions, 32); r++) {
+        std::cout << " " << (int)margin[r];
+    }
+    std::cout << (positions > 32 ? " ..." : "") << std::endl;
+    write_file(output_path, plaintext);
+    std::cout << "Plaintext written to " << output_path << std::endl;
+    return 0;
+}
+
+// One packet of an IV-prepended key scheme: the per-packet key is iv || secret, and the first
+// keystream bytes are known (from a fixed header, for instance)
+struct IvSample {
+    std::vector<unsigned char> iv;
+    std::vector<unsigned char> keystream;
+};
+
+// "IVHEX KEYSTREAMHEX" lines, '#' starting a comment
+std::vector<IvSample> parse_iv_samples(const std::string& text, size_t iv_length) {
+    std::vector<IvSample> samples;
+    std::stringstream lines(text);
+    std::string line;
+    for (int line_number = 1; std::getline(lines, line); line_number++) {
+        line = line.substr(0, line.find('#'));
+        std::stringstream fields(line);
+        std::string iv, keystream;
+        if (!(fields >> iv)) {
+            continue;
+        }
+        IvSample sample{ parse_hex(iv), fields >> keystream ? parse_hex(keystream) : std::vector<unsigned char>() };
+        if (sample.iv.size() != iv_length || sample.keystream.empty()) {
+            std::cerr << "Line " << line_number << ": expected a " << iv_length << "-byte IV and keystream bytes" << std::endl;
+            throw std::runtime_error("Invalid arguments");
+        }
+        samples.push_back(sample);
+    }
+    return samples;
+}
+
+// Candidate key in the best-first enumeration: ranks[b] picks the ranks[b]-th most voted sum for
+// secret byte b; children only raise ranks at or after `last`, so each combination comes up once
+struct IvCandidate {
+    uint64_t deficit;
+    std::vector<uint16_t> ranks;
+    size_t last;
+
+    bool operator>(const IvCandidate& other) const {
+        return deficit > other.deficit;
+    }
+};
+
+// --iv-attack: PTW-style statistical recovery of the secret part of iv || secret keys. Every
+// sample runs the KSA over its IV only and votes, after Klein, for each running key sum
+// sigma_i = K[l] + ... + K[i] (l the IV length) as S^-1[i - Z_i] - (j + S[l] + ... + S[i]), with S
+// and j the state after the IV and Z_i keystream byte i (1-based). Votes are counted in
+// per-worker tables and merged; candidate keys are then enumerated from the best-voted sums
+// outwards and verified against the keystreams of two samples, at most max_candidates of them.
+int recover_iv_key(const std::string& samples_path, size_t iv_length, size_t secret_length, uint64_t max_candidates) {
+    auto start_time = std::chrono::high_resolution_clock::now();
+    std::vector<unsigned char> text = read_file(samples_path);
+    std::vector<IvSample> samples = parse_iv_samples(std::string(text.begin(), text.end()), iv_length);
+    const size_t key_length = iv_length + secret_length;
+    if (samples.size() < 2 || secret_length == 0 || key_length > 256) {
+        std::cerr << "The IV attack needs at least two samples and a 1-" << 256 - iv_length << " byte secret" << std::endl;
+        throw std::runtime_error("Invalid arguments");
+    }
+
+    std::vector<uint64_t> votes(secret_length * 256, 0);
+    std::vector<std::vector<uint32_t>> counts(cpu_worker_pool().threads.size());
+    parallel_for(samples.size(), 1024, [&](size_t worker, uint64_t begin, uint64_t end) {
+        std::vector<uint32_t>& local = counts[worker];
+        local.resize(secret_length * 256, 0);
+        for (uint64_t k = begin; k < end; k++) {
+            const IvSample& sample = samples[k];
+            unsigned char S[256], inverse[256];
+            for (int n = 0; n < 256; n++) {
+                S[n] = (unsigned char)n;
+            }
+            unsigned char j = 0;
+            for (size_t n = 0; n < iv_length; n++) {
+                j = (unsigned char)(j + S[n] + sample.iv[n]);
+                std::swap(S[n], S[j]);
+            }
+            for (int n = 0; n < 256; n++) {
+                inverse[S[n]] = (unsigned char)n;
+            }
+            unsigned char state_sum = j;
+            for (size_t i = iv_length; i < key_length && i <= sample.keystream.size(); i++) {
+                state_sum = (unsigned char)(state_sum + S[i]);
+                unsigned char sigma = (unsigned char)(inverse[(unsigned char)(i - sample.keystream[i - 1])] - state_sum);
+                local[(i - iv_length) * 256 + sigma]++;
+            }
+        }
+    });
+    merge_worker_counts(counts, votes);
+
+    // Sums of every byte ranked by votes
+    std::vector<std::vector<unsigned char>> ranked(secret_length);
+    std::cout << "IV attack: " << samples.size() << " samples, " << iv_length << "-byte IVs, " << secret_length << "-byte secret" << std::endl;
+    for (size_t b = 0; b < secret_length; b++) {
+        const uint64_t* row = &votes[b * 256];
+        for (int v = 0; v < 256; v++) {
+            ranked[b].push_back((unsigned char)v);
+        }
+        std::stable_sort(ranked[b].begin(), ranked[b].end(), [&](unsigned char a, unsigned char c) { return row[a] > row[c]; });
+        std::cout << "  sigma " << b << ": " << to_hex(&ranked[b][0], 1) << " (" << row[ranked[b][0]] << " votes, next " << row[ranked[b][1]] << ")" << std::endl;
+    }
+
+    // The sample with the longest keystream and one more verify every candidate
+    std::vector<size_t> checks(samples.size());
+    for (size_t k = 0; k < samples.size(); k++) {
+        checks[k] = k;
+    }
+    std::partial_sort(checks.begin(), checks.begin() + 2, checks.end(), [&](size_t a, size_t c) { return samples[a].keystream.size() > samples[c].keystream.size(); });
+    checks.resize(2);
+    std::vector<std::vector<uint64_t>> check_words;
+    for (size_t k : checks) {
+        check_words.push_back(pack_keystream_words(samples[k].keystream.data(), samples[k].keystream.size()));
+    }
+
+    std::priority_queue<IvCandidate, std::vector<IvCandidate>, std::greater<IvCandidate>> queue;
+    queue.push({ 0, std::vector<uint16_t>(secret_length, 0), 0 });
+    uint64_t tested = 0;
+    std::vector<unsigned char> found;
+    std::vector<std::vector<unsigned char>> batch;
+    auto secret_of = [&](const IvCandidate& candidate) {
+        std::vector<unsigned char> secret(secret_length);
+        unsigned char previous = 0;
+        for (size_t b = 0; b < secret_length; b++) {
+            unsigned char sigma = ranked[b][candidate.ranks[b]];
+            secret[b] = (unsigned char)(sigma - previous);
+            previous = sigma;
+        }
+        return secret;
+    };
+    while (found.empty() && tested < max_candidates && !queue.empty()) {
+        // Candidates come off the queue best first and are verified a batch at a time on the
+        // worker pool, with the keystream oracle's check against both samples
+        batch.clear();
+        while (!queue.empty() && batch.size() < 4096 && tested + batch.size() < max_candidates) {
+            IvCandidate candidate = queue.top();
+            queue.pop();
+            batch.push_back(secret_of(candidate));
+            for (size_t b = candidate.last; b < secret_length; b++) {
+                if (candidate.ranks[b] + 1 < 256) {
+                    IvCandidate child = candidate;
+                    child.ranks[b]++;
+                    child.deficit += votes[b * 256 + ranked[b][candidate.ranks[b]]] - votes[b * 256 + ranked[b][child.ranks[b]]];
+                    child.last = b;
+                    queue.push(child);
+                }
+            }
+        }
+        std::mutex found_mutex;
+        parallel_for(batch.size(), 64, [&](size_t, uint64_t begin, uint64_t end) {
+            std::vector<unsigned char> key(key_length);
+            for (uint64_t k = begin; k < end; k++) {
+                bool matches = true;
+                for (size_t c = 0; c < checks.size() && matches; c++) {
+                    const IvSample& sample = samples[checks[c]];
+                    std::copy(sample.iv.begin(), sample.iv.end(), key.begin());
+                    std::copy(batch[k].begin(), batch[k].end(), key.begin() + iv_length);
+                    matches = keystream_matches(key.data(), (int)key_length, check_words[c].data(), sample.keystream.size());
+                }
+                if (matches) {
+                    std::lock_guard<std::mutex> lock(found_mutex);
+                    found = batch[k];
+                }
+            }
+        });
+        tested += batch.size();
+    }
+
+    std::chrono::duration<double> elapsed = std::chrono::high_resolution_clock::now() - start_time;
+    std::cout << "IV attack: " << tested << " candidate keys verified in " << elapsed.count() << " s" << std::endl;
+    if (found.empty()) {
+        std::cout << "No key among the " << tested << " best-voted candidates; more samples or --iv-candidates may help" << std::endl;
+        return 2;
+    }
+    std::cout << "Secret found: " << to_hex(found.data(), found.size()) << " (\"" << std::string(found.begin(), found.end()) << "\")" << std::endl;
+    return 0;
+}
+
+int main(int argc, char** argv) {
+    try {
+        std::string backend = "gpu";
+        std::string device_type;
+        std::string input_path = "encrypted_file.bin";
+        std::string output_path = "decrypted_file.bin";
+        std::string charset = default_charset;
+        int max_key_length = 5;
+        std::string daemon_socket, submit_socket;
+        double priority = 1.0;
+        KeyspaceShard shard;
+        bool sharded = false;
+        std::string progress_path;
+        bool merge = false;
+        std::vector<std::string> merge_inputs;
+        int coordinator_port = 0;
+        std::string worker_endpoint;
+        char host_name[256] = "worker";
+        gethostname(host_name, sizeof(host_name) - 1);
+        std::string worker_name = std::string(host_name) + "-" + std::to_string(getpid());
+        std::string journal_path = "coordinator.journal";
+        double lease_seconds = 60.0;
+        double unit_seconds = 30.0;
+        bool self_test = false;
+        int self_test_keys = 1000;
+        unsigned int self_test_seed = std::random_device{}();
+        Oracle oracle;
+        std::string score_corpus_path;
+        std::string signature_table_path;
+        std::string crc_spec;
+        std::string cascade_spec = "printable:1,score:2.0,verify";
+        double false_hit_target = 1.0;
+        std::string validate_path;
+        std::string reuse_directory;
+        double reuse_threshold = 6.0;
+        bool reuse_all_pairs = false;
+        std::string clusters_path;
+        std::string crib_drag_clusters;
+        int crib_cluster = 0;
+        std::string cribs_path;
+        double crib_min_score = 2.0;
+        std::string bias_path;
+        size_t record_length = 0;
+        size_t bias_positions = 256;
+        size_t digraph_positions = 64;
+        uint64_t bias_samples = 1 << 22;
+        std::string bias_table_path, bias_build_path;
+        uint64_t bias_seed = 0x5243344249415331ULL;
+        std::string iv_samples_path;
+        size_t iv_length = 3, secret_length = 13;
+        uint64_t iv_candidates = 1 << 20;
+        std::string key_constraints;
+        KdfSpec kdf;
+        std::string pdf_path;
+        bool pdf_key_search = false;
+        bool validate_utf8 = false;
+        std::string scripts_spec = "any";
+        std::string keystream_hex, keystream_path, known_plaintext_path, targets_path;
+        double benchmark_seconds = 0.0;
+        TmtoParams tmto;
+        std::string tmto_build_path;
+        std::vector<std::string> tmto_lookup_paths;
+        std::string prefix_build_path, prefix_query_path;
+        size_t table_memory_mb = 1024;
+        for (int i = 1; i < argc; ++i) {
+            std::string arg = argv[i];
+            if (arg == "--backend" && i + 1 < argc) {
+                backend = argv[++i];
+            }
+            else if (arg == "--device-type" && i + 1 < argc) {
+                device_type = argv[++i];
+            }
+            else if (arg == "--input" && i + 1 < argc) {
+                input_path = argv[++i];
+            }
+            else if (arg == "--output" && i + 1 < argc) {
+                output_path = argv[++i];
+            }
+            else if (arg == "--key-constraints" && i + 1 < argc) {
+                key_constraints = argv[++i];
+            }
+            else if (arg == "--pdf" && i + 1 < argc) {
+                pdf_path = argv[++i];
+            }
+            else if (arg == "--pdf-key-search") {
+                pdf_key_search = true;
+            }
+            else if (arg == "--kdf" && i + 1 < argc) {
+                kdf.algorithm = argv[++i];
+            }
+            else if (arg == "--kdf-salt" && i + 1 < argc) {
+                kdf.salt = parse_hex(argv[++i]);
+            }
+            else if (arg == "--kdf-key-length" && i + 1 < argc) {
+                kdf.key_length = std::stoi(argv[++i]);
+            }
+            else if (arg == "--charset" && i + 1 < argc) {
+                charset = argv[++i];
+            }
+            else if (arg == "--max-key-length" && i + 1 < argc) {
+                max_key_length = std::stoi(argv[++i]);
+            }
+            else if (arg == "--oracle" && i + 1 < argc) {
+                oracle.kind = parse_oracle_kind(argv[++i]);
+            }
+            else if (arg == "--top-k" && i + 1 < argc) {
+                oracle.top_k = std::stoul(argv[++i]);
+            }
+            else if (arg == "--score-corpus" && i + 1 < argc) {
+                score_corpus_path = argv[++i];
+            }
+            else if (arg == "--signatures" && i + 1 < argc) {
+                signature_table_path = argv[++i];
+            }
+            else if (arg == "--byte-class" && i + 1 < argc) {
+                oracle.accept = parse_byte_class(argv[++i]);
+            }
+            else if (arg == "--keystream" && i + 1 < argc) {
+                keystream_hex = argv[++i];
+                oracle.kind = OracleKind::keystream;
+            }
+            else if (arg == "--keystream-file" && i + 1 < argc) {
+                keystream_path = argv[++i];
+                oracle.kind = OracleKind::keystream;
+            }
+            else if (arg == "--known-plaintext" && i + 1 < argc) {
+                known_plaintext_path = argv[++i];
+                oracle.kind = OracleKind::keystream;
+            }
+            else if (arg == "--targets" && i + 1 < argc) {
+                targets_path = argv[++i];
+                oracle.kind = OracleKind::multi;
+            }
+            else if (arg == "--tmto-build" && i + 1 < argc) {
+                tmto_build_path = argv[++i];
+            }
+            else if (arg == "--tmto-lookup" && i + 1 < argc) {
+                std::stringstream paths(argv[++i]);
+                std::string path;
+                while (std::getline(paths, path, ',')) {
+                    tmto_lookup_paths.push_back(path);
+                }
+            }
+            else if (arg == "--prefix-table-build" && i + 1 < argc) {
+                prefix_build_path = argv[++i];
+            }
+            else if (arg == "--prefix-table-query" && i + 1 < argc) {
+                prefix_query_path = argv[++i];
+            }
+            else if (arg == "--table-memory" && i + 1 < argc) {
+                table_memory_mb = std::stoul(argv[++i]);
+            }
+            else if (arg == "--tmto-bits" && i + 1 < argc) {
+                tmto.key_bits = std::stoi(argv[++i]);
+            }
+            else if (arg == "--tmto-chains" && i + 1 < argc) {
+                tmto.chains = std::stoull(argv[++i]);
+            }
+            else if (arg == "--tmto-length" && i + 1 < argc) {
+                tmto.chain_length = std::stoi(argv[++i]);
+            }
+            else if (arg == "--tmto-table" && i + 1 < argc) {
+                tmto.table = std::stoi(argv[++i]);
+            }
+            else if (arg == "--benchmark") {
+                benchmark_seconds = i + 1 < argc && argv[i + 1][0] != '-' ? std::stod(argv[++i]) : 5.0;
+            }
+            else if (arg == "--scripts" && i + 1 < argc) {
+                scripts_spec = argv[++i];
+            }
+            else if (arg == "--reuse-scan" && i + 1 < argc) {
+                reuse_directory = argv[++i];
+            }
+            else if (arg == "--reuse-threshold" && i + 1 < argc) {
+                reuse_threshold = std::stod(argv[++i]);
+            }
+            else if (arg == "--reuse-all-pairs") {
+                reuse_all_pairs = true;
+            }
+            else if (arg == "--clusters" && i + 1 < argc) {
+                clusters_path = argv[++i];
+            }
+            else if (arg == "--crib-drag" && i + 1 < argc) {
+                crib_drag_clusters = argv[++i];
+            }
+            else if (arg == "--cluster" && i + 1 < argc) {
+                crib_cluster = std::stoi(argv[++i]);
+            }
+            else if (arg == "--cribs" && i + 1 < argc) {
+                cribs_path = argv[++i];
+            }
+            else if (arg == "--crib-min-score" && i + 1 < argc) {
+                crib_min_score = std::stod(argv[++i]);
+            }
+            else if (arg == "--bias-analyze" && i + 1 < argc) {
+                bias_path = argv[++i];
+            }
+            else if (arg == "--record-length" && i + 1 < argc) {
+                record_length = std::stoul(argv[++i]);
+            }
+            else if (arg == "--bias-positions" && i + 1 < argc) {
+                bias_positions = std::stoul(argv[++i]);
+            }
+            else if (arg == "--digraph-positions" && i + 1 < argc) {
+                digraph_positions = std::stoul(argv[++i]);
+            }
+            else if (arg == "--bias-samples" && i + 1 < argc) {
+                bias_samples = std::stoull(argv[++i]);
+            }
+            else if (arg == "--bias-table" && i + 1 < argc) {
+                bias_table_path = argv[++i];
+            }
+            else if (arg == "--bias-table-build" && i + 1 < argc) {
+                bias_build_path = argv[++i];
+            }
+            else if (arg == "--bias-seed" && i + 1 < argc) {
+                bias_seed = std::stoull(argv[++i], nullptr, 0);
+            }
+            else if (arg == "--iv-attack" && i + 1 < argc) {
+                iv_samples_path = argv[++i];
+            }
+            else if (arg == "--iv-length" && i + 1 < argc) {
+                iv_length = std::stoul(argv[++i]);
+            }
+            else if (arg == "--secret-length" && i + 1 < argc) {
+                secret_length = std::stoul(argv[++i]);
+            }
+            else if (arg == "--iv-candidates" && i + 1 < argc) {
+                iv_candidates = std::stoull(argv[++i]);
+            }
+            else if (arg == "--validate" && i + 1 < argc) {
+                validate_path = argv[++i];
+            }
+            else if (arg == "--utf8") {
+                validate_utf8 = true;
+            }
+            else if (arg == "--false-hits" && i + 1 < argc) {
+                false_hit_target = std::stod(argv[++i]);
+            }
+            else if (arg == "--check-length" && i + 1 < argc) {
+                oracle.check_length = std::stoul(argv[++i]);
+            }
+            else if (arg == "--cascade" && i + 1 < argc) {
+                cascade_spec = argv[++i];
+            }
+            else if (arg == "--crc" && i + 1 < argc) {
+                crc_spec = argv[++i];
+            }
+            else if (arg == "--daemon" && i + 1 < argc) {
+                daemon_socket = argv[++i];
+            }
+            else if (arg == "--submit" && i + 1 < argc) {
+                submit_socket = argv[++i];
+            }
+            else if (arg == "--priority" && i + 1 < argc) {
+                priority = std::stod(argv[++i]);
+            }
+            else if (arg == "--shard" && i + 1 < argc) {
+                shard = parse_shard(argv[++i]);
+                sharded = true;
+            }
+            else if (arg == "--shard-range" && i + 1 < argc) {
+                shard = parse_shard_range(argv[++i]);
+                sharded = true;
+            }
+            else if (arg == "--progress-file" && i + 1 < argc) {
+                progress_path = argv[++i];
+            }
+            else if (arg == "--coordinator" && i + 1 < argc) {
+                coordinator_port = std::stoi(argv[++i]);
+            }
+            else if (arg == "--worker" && i + 1 < argc) {
+                worker_endpoint = argv[++i];
+            }
+            else if (arg == "--worker-name" && i + 1 < argc) {
+                worker_name = argv[++i];
+            }
+            else if (arg == "--journal" && i + 1 < argc) {
+                journal_path = argv[++i];
+            }
+            else if (arg == "--lease-seconds" && i + 1 < argc) {
+                lease_seconds = std::stod(argv[++i]);
+            }
+            else if (arg == "--unit-seconds" && i + 1 < argc) {
+                unit_seconds = std::stod(argv[++i]);
+            }
+            else if (arg == "--merge") {
+                merge = true;
+            }
+            else if (merge && arg[0] != '-') {
+                merge_inputs.push_back(arg);
+            }
+            else if (arg == "--self-test") {
+                self_test = true;
+            }
+            else if (arg == "--self-test-keys" && i + 1 < argc) {
+                self_test_keys = std::stoi(argv[++i]);
+            }
+            else if (arg == "--seed" && i + 1 < argc) {
+                self_test_seed = (unsigned int)std::stoul(argv[++i]);
+            }
+            else {
+                std::cerr << "Unknown argument: " << arg << std::endl;
+                throw std::runtime_error("Invalid arguments");
+            }
+        }
+        if (backend != "gpu" && backend != "cpu") {
+            std::cerr << "Unknown backend: " << backend << " (expected gpu or cpu)" << std::endl;
+            throw std::runtime_error("Invalid arguments");
+        }
+        if (oracle.top_k < 1 || oracle.top_k > max_top_k) {
+            std::cerr << "--top-k must be between 1 and " << max_top_k << std::endl;
+            throw std::runtime_error("Invalid arguments");
+        }
+        if (oracle.kind == OracleKind::cascade) {
+            oracle.cascade = parse_cascade(cascade_spec);
+        }
+        if (oracle.kind == OracleKind::score || oracle.kind == OracleKind::cascade) {
+            oracle.model = build_score_model(score_corpus_path.empty()
+                ? std::vector<unsigned char>(default_score_corpus, default_score_corpus + strlen(default_score_corpus))
+                : read_file(score_corpus_path));
+        }
+        if (oracle.kind == OracleKind::signature) {
+            std::vector<unsigned char> table = signature_table_path.empty() ? std::vector<unsigned char>() : read_file(signature_table_path);
+            oracle.signatures = parse_signature_table(signature_table_path.empty() ? std::string(default_signature_table) : std::string(table.begin(), table.end()));
+            oracle.signature_program = compile_signatures(oracle.signatures);
+            std::cout << "Signature oracle: " << oracle.signatures.size() << " signatures, " << oracle.signature_program.ops.size()
+                << " device comparisons over the first " << oracle.signature_program.check_length << " bytes" << std::endl;
+        }
+        if (oracle.kind == OracleKind::utf8) {
+            oracle.scripts = parse_text_scripts(scripts_spec);
+            std::cout << "UTF-8 oracle: scripts " << scripts_spec << ", " << oracle.scripts.ranges.size() / 2 << " code point ranges above U+007F" << std::endl;
+        }
+        check_charset(charset);
+        PdfSecurity pdf;
+        if (!pdf_path.empty()) {
+            pdf = read_pdf_security(pdf_path);
+            print_pdf_security(pdf);
+            if (pdf_key_search && pdf.key_length != 5) {
+                std::cerr << "--pdf-key-search needs a 40-bit document, this one has " << pdf.key_length * 8 << "-bit keys" << std::endl;
+                throw std::runtime_error("Invalid arguments");
+            }
+            // The direct key search enumerates raw file keys: "*" in --key-constraints is any
+            // byte, and without constraints all 2^40 keys are searched
+            if (pdf_key_search) {
+                charset.resize(256);
+                for (int c = 0; c < 256; c++) {
+                    charset[c] = (char)c;
+                }
+                if (key_constraints.empty()) {
+                    key_constraints = "*{5}";
+                }
+            }
+        }
+        Keyspace keyspace{ charset, "" };
+        if (!key_constraints.empty()) {
+            // From here on the keyspace is the compiled layout and the key length is fixed
+            keyspace.layout = compile_key_constraints(key_constraints, charset);
+            max_key_length = keyspace.key_length();
+            int free_positions = 0;
+            for (int k = 0; k < max_key_length; k++) {
+                free_positions += constrained_radix((const unsigned char*)keyspace.layout.data(), max_key_length, k) > 1;
+            }
+            std::cout << "Key constraints: " << max_key_length << " positions, " << free_positions << " free, "
+                << keyspace_size(keyspace, max_key_length) << " keys" << std::endl;
+        }
+
+        if (self_test) {
+            // Runs on CPU-only OpenCL runtimes such as PoCL with --device-type cpu or all
+            return run_self_test(parse_device_type(device_type.empty() ? "all" : device_type), self_test_keys, self_test_seed) ? 0 : 1;
+        }
+        if (!reuse_directory.empty()) {
+            return scan_keystream_reuse(reuse_directory, reuse_threshold, reuse_all_pairs, clusters_path);
+        }
+        if (!iv_samples_path.empty()) {
+            return recover_iv_key(iv_samples_path, iv_length, secret_length, iv_candidates);
+        }
+        if (!bias_build_path.empty()) {
+            return build_bias_table(bias_build_path, bias_positions, bias_samples, bias_seed, backend, parse_device_type(device_type.empty() ? "gpu" : device_type));
+        }
+        if (!bias_path.empty()) {
+            return analyze_biases(bias_path, record_length, bias_positions, digraph_positions, bias_samples, bias_table_path, output_path);
+        }
+        if (!crib_drag_clusters.empty()) {
+            // "cluster<TAB>path" lines as --reuse-scan writes them; the largest cluster by default
+            std::map<int, std::vector<std::string>> clusters;
+            std::ifstream clusters_file(crib_drag_clusters);
+            std::string line;
+            while (std::getline(clusters_file, line)) {
+                size_t tab = line.find('\t');
+                if (tab != std::string::npos) {
+                    clusters[std::stoi(line.substr(0, tab))].push_back(line.substr(tab + 1));
+                }
+            }
+            if (crib_cluster == 0) {
+                for (const auto& cluster : clusters) {
+                    if (crib_cluster == 0 || cluster.second.size() > clusters[crib_cluster].size()) {
+                        crib_cluster = cluster.first;
+                    }
+                }
+            }
+            if (clusters.count(crib_cluster) == 0) {
+                std::cerr << "No cluster " << crib_cluster << " in " << crib_drag_clusters << std::endl;
+                throw std::runtime_error("Invalid arguments");
+            }
+            std::vector<std::string> cribs(std::begin(default_cribs), std::end(default_cribs));
+            if (!cribs_path.empty()) {
+                cribs.clear();
+                std::ifstream cribs_file(cribs_path);
+                while (std::getline(cribs_file, line)) {
+                    if (!line.empty()) {
+                        cribs.push_back(line);
+                    }
+                }
+            }
+            ScoreModel model = build_score_model(score_corpus_path.empty()
+                ? std::vector<unsigned char>(default_score_corpus, default_score_corpus + strlen(default_score_corpus))
+                : read_file(score_corpus_path));
+            std::cout << "Crib dragging cluster " << crib_cluster << " of " << crib_drag_clusters << " with " << cribs.size() << " cribs" << std::endl;
+            return drag_cribs(clusters[crib_cluster], cribs, model, crib_min_score, output_path);
+        }
+        if (!validate_path.empty()) {
+            return validate_file(validate_path, oracle.accept, validate_utf8);
+        }
+        if (!prefix_build_path.empty()) {
+            return build_prefix_table(prefix_build_path, keyspace, max_key_length, table_memory_mb << 20, backend, parse_device_type(device_type.empty() ? "gpu" : device_type));
+        }
+        if (!prefix_query_path.empty()) {
+            // Many targets from --targets, or a single one from the keystream options
+            std::vector<KeystreamTarget> targets;
+            if (!targets_path.empty()) {
+                std::vector<unsigned char> table = read_file(targets_path);
+                targets = parse_keystream_targets(std::string(table.begin(), table.end()), prefix_table_bytes);
+            }
+            else {
+                targets.push_back({ "target", load_keystream_target(keystream_hex, keystream_path, input_path, known_plaintext_path) });
+                if (targets[0].keystream.size() < (size_t)prefix_table_bytes) {
+                    std::cerr << "The target needs at least " << prefix_table_bytes << " keystream bytes" << std::endl;
+                    throw std::runtime_error("Invalid arguments");
+                }
+            }
+            return query_prefix_table(prefix_query_path, targets);
+        }
+        if (!tmto_build_path.empty()) {
+            return build_tmto_table(tmto_build_path, tmto, backend, parse_device_type(device_type.empty() ? "gpu" : device_type));
+        }
+        if (!tmto_lookup_paths.empty()) {
+            // The target is the crib's keystream: --keystream, --keystream-file, or --known-plaintext with --input
+            return lookup_tmto_tables(tmto_lookup_paths, load_keystream_target(keystream_hex, keystream_path, input_path, known_plaintext_path));
+        }
+        if (benchmark_seconds > 0) {
+            return run_benchmark(backend, parse_device_type(device_type.empty() ? "gpu" : device_type), keyspace, max_key_length, benchmark_seconds);
+        }
+        if (merge) {
+            return merge_shard_logs(merge_inputs, progress_path);
+        }
+        if (!worker_endpoint.empty()) {
+            return run_worker(worker_endpoint, backend, parse_device_type(device_type.empty() ? "gpu" : device_type), worker_name);
+        }
+        if (coordinator_port > 0) {
+            SearchJob job;
+            job.encrypted_data = read_file(input_path);
+            job.keyspace = keyspace;
+            job.max_key_length = max_key_length;
+            job.output = output_path;
+            return run_coordinator(coordinator_port, job, journal_path, lease_seconds, unit_seconds);
+        }
+        if (!daemon_socket.empty()) {
+            return run_daemon(daemon_socket, parse_device_type(device_type.empty() ? "gpu" : device_type));
+        }
+        if (!submit_socket.empty()) {
+            // The daemon resolves paths itself, so hand it absolute ones
+            char resolved[PATH_MAX];
+            if (!realpath(input_path.c_str(), resolved)) {
+                std::cerr << "Failed to open input file: " << input_path << std::endl;
+                throw std::runtime_error("File open error");
+            }
+            std::string fields = std::string("input=") + resolved
+                + " " + keyspace_field(keyspace)
+                + " max-key-length=" + std::to_string(max_key_length) + " backend=" + backend
+                + " priority=" + std::to_string(priority);
+            if (!output_path.empty()) {
+                std::string output = output_path[0] == '/' ? output_path : std::string(getcwd(resolved, sizeof(resolved))) + "/" + output_path;
+                fields += " output=" + output;
+            }
+            return submit_job(submit_socket, fields);
+        }
+
+        // The keystream oracle searches the known keystream in place of the ciphertext; a PDF
+        // search has no ciphertext, and its progress files are keyed on /U
+        std::vector<unsigned char> encrypted_data = !pdf_path.empty() ? pdf.user : oracle.kind == OracleKind::keystream
+            ? load_keystream_target(keystream_hex, keystream_path, input_path, known_plaintext_path)
+            : oracle.kind == OracleKind::multi ? std::vector<unsigned char>() : read_file(input_path);
+        // The multi-target oracle's "ciphertext" is every target's keystream back to back, which
+        // is also what progress files are keyed on
+        if (oracle.kind == OracleKind::multi) {
+            std::vector<unsigned char> table = read_file(targets_path);
+            oracle.targets = parse_keystream_targets(std::string(table.begin(), table.end()));
+            oracle.target_set = build_target_set(oracle.targets);
+            for (const KeystreamTarget& target : oracle.targets) {
+                encrypted_data.insert(encrypted_data.end(), target.keystream.begin(), target.keystream.end());
+            }
+            std::cout << "Multi-target: " << oracle.targets.size() << " keystreams, looked up by their first 8 bytes" << std::endl;
+        }
+        if (oracle.kind == OracleKind::keystream) {
+            std::cout << "Keystream target: " << encrypted_data.size() << " bytes, first " << to_hex(encrypted_data.data(), std::min<size_t>(encrypted_data.size(), 8)) << std::endl;
+        }
+
+        // --oracle crc searches on the CRC alone (crc32 unless --crc says otherwise); --crc next
+        // to the printable or signature oracle becomes the final host-side check of their survivors
+        if (oracle.kind == OracleKind::crc || !crc_spec.empty()) {
+            if (oracle.kind == OracleKind::score) {
+                std::cerr << "--crc cannot follow the score oracle, which has no accept step" << std::endl;
+                throw std::runtime_error("Invalid arguments");
+            }
+            oracle.crc = parse_crc_spec(crc_spec.empty() ? "crc32" : crc_spec);
+            resolve_crc_frame(oracle.crc, encrypted_data.size());
+            oracle.crc_final = oracle.kind != OracleKind::crc;
+        }
+        if (oracle.kind == OracleKind::cascade) {
+            resolve_cascade(oracle.cascade, encrypted_data.size());
+        }
+        if ((oracle.kind == OracleKind::printable || oracle.kind == OracleKind::utf8 || oracle.kind == OracleKind::keystream) && oracle.check_length == 0 && pdf_path.empty()) {
+            long double keys = 0;
+            for (int key_length = 1; key_length <= max_key_length; key_length++) {
+                unsigned long long total = keyspace_size(keyspace, key_length);
+                keys += shard_boundary(total, shard.end) - shard_boundary(total, shard.begin);
+            }
+            CheckPlan plan = plan_check_length(oracle, keys, encrypted_data.size(), false_hit_target);
+            print_check_plan(plan, false_hit_target);
+            oracle.check_length = plan.length;
+        }
+
+        // Sharded runs always leave a progress file behind for --merge
+        if (sharded && progress_path.empty()) {
+            progress_path = shard.begin.den == shard.end.den && shard.end.num == shard.begin.num + 1
+                ? "shard-" + std::to_string(shard.begin.num) + "-of-" + std::to_string(shard.begin.den) + ".progress"
+                : "shard-" + std::to_string(shard.begin.num) + "_" + std::to_string(shard.begin.den) + "-"
+                    + std::to_string(shard.end.num) + "_" + std::to_string(shard.end.den) + ".progress";
+        }
+        ShardLog shard_log;
+        ProgressCallback progress = nullptr;
+        if (!progress_path.empty()) {
+            open_shard_log(shard_log, progress_path, keyspace_signature(encrypted_data, keyspace, max_key_length), shard);
+            progress = [&](const SearchProgress& p) {
+                if (p.completed_end > p.completed_begin) {
+                    shard_log.file << "done " << p.key_length << " " << p.completed_begin << " " << p.completed_end << std::endl;
+                }
+                return true;
+            };
+        }
+
+        // With --kdf the keyspace enumerates passphrases; the default key is the whole digest
+        if (!kdf.algorithm.empty() && kdf.key_length == 0) {
+            kdf.key_length = kdf_digest_length(kdf.algorithm);
+        }
+        SearchResult result = !pdf_path.empty()
+            ? brute_force_pdf(pdf, keyspace, max_key_length, pdf_key_search, backend, parse_device_type(device_type.empty() ? "gpu" : device_type), progress, shard)
+            : !kdf.algorithm.empty()
+            ? brute_force_kdf(encrypted_data, keyspace, max_key_length, kdf, backend, parse_device_type(device_type.empty() ? "gpu" : device_type), progress, shard, oracle)
+            : backend == "cpu"
+            ? brute_force_rc4_cpu(encrypted_data, keyspace, max_key_length, progress, shard, oracle)
+            : brute_force_rc4_gpu(encrypted_data, keyspace, max_key_length, parse_device_type(device_type.empty() ? "gpu" : device_type), progress, shard, oracle);
+
+        if (shard_log.file.is_open()) {
+            unsigned long long index = 0;
+            if (result.found && !result.key.empty() && key_index(result.key.data(), (int)result.key.size(), keyspace, index)) {
+                shard_log.file << "found " << result.key.size() << " " << index << " " << to_hex(result.key.data(), result.key.size()) << std::endl;
+            }
+            std::cout << "Progress written to " << progress_path << std::endl;
+        }
+        std::vector<unsigned char>& decrypted_data = result.plaintext;
+        if (result.found && oracle.kind == OracleKind::signature) {
+            std::cout << "Plaintext matches signature: " << oracle.signatures[match_signature(oracle.signatures, decrypted_data)].name << std::endl;
+        }
 
-            output_file.write(reinterpret_cast<char*>(decrypted_data.data()), decrypted_data.size());
-            output_file.close();
-            std::cout << "Decryption successful, output written to decrypted_file.bin" << std::endl;
+        // Under the keystream oracle the "plaintext" is all zeros; the key is the result
+        if (!decrypted_data.empty() && oracle.kind != OracleKind::keystream) {
+            write_file(output_path, decrypted_data);
+            std::cout << "Decryption successful, output written to " << output_path << std::endl;
         }
     }
     catch (const std::exception& e) {